@@ -15,6 +15,28 @@ DEFINES += JSONCOMMANDSERVER_LIBRARY
 
 SOURCES += jsoncommandserver.cpp \
     server/base_server.cpp \
+    server/acceptor.cpp \
+    server/atom_table.cpp \
+    server/datagram_channel.cpp \
+    server/envelope.cpp \
+    server/frame_codec.cpp \
+    server/gather_reducer.cpp \
+    server/listen_socket.cpp \
+    server/local_listener.cpp \
+    server/loop_watchdog.cpp \
+    server/message_history.cpp \
+    server/node_directory.cpp \
+    server/node_link.cpp \
+    server/offline_store.cpp \
+    server/peer_directory.cpp \
+    server/peer_index.cpp \
+    server/rate_limiter.cpp \
+    server/response_cache.cpp \
+    server/send_queue.cpp \
+    server/state_journal.cpp \
+    server/trace_recorder.cpp \
+    server/traffic_capture.cpp \
+    server/server_metrics.cpp \
     commands_controller.cpp \
     client/base_client.cpp
 
@@ -22,13 +44,50 @@ HEADERS += jsoncommandserver.h\
         jsoncommandserver_global.h \
     commands_controller.h \
     server/base_server.h \
+    server/acceptor.h \
+    server/atom_table.h \
+    server/binary_format.h \
+    server/command_task.h \
+    server/datagram_channel.h \
+    server/envelope.h \
+    server/frame_codec.h \
+    server/gather_reducer.h \
+    server/listen_socket.h \
+    server/local_listener.h \
+    server/loop_watchdog.h \
+    server/message_history.h \
+    server/node_directory.h \
+    server/node_link.h \
+    server/offline_store.h \
+    server/peer_directory.h \
+    server/peer_index.h \
+    server/rate_limiter.h \
+    server/response_cache.h \
+    server/send_queue.h \
+    server/state_journal.h \
+    server/trace_recorder.h \
+    server/traffic_capture.h \
+    server/server_metrics.h \
     client/base_client.h
 
+# raw fd transport, see EpollServer; shared memory connections, see ShmSocket
+linux {
+    SOURCES += server/epoll_server.cpp \
+        server/shm_socket.cpp \
+        server/uring_engine.cpp
+    HEADERS += server/epoll_server.h \
+        server/shm_socket.h \
+        server/uring_engine.h
+}
+
 INCLUDEPATH += server \
     client \
     . \
     ..
 
+# the library builds as C++11. server/command_task.h (coroutine handlers) is
+# header only and compiles to nothing unless the application that includes it
+# builds as C++20: CONFIG += c++2a
 CONFIG   += c++11
 unix {
     target.path = /usr/lib
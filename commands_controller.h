@@ -130,6 +130,20 @@ void send_cmd_to(BaseController*, const QJsonObject&);
 
 typedef void (*ProcessCmd)(BaseController*, const QJsonObject&);
 
+/* Commands with a streamed body (see frame_codec.h) reach their handler once
+ * per event: STREAM_BEGIN with an empty chunk, STREAM_DATA per piece of the
+ * body, then STREAM_END or STREAM_ABORT. cmd is the same in every call and
+ * carries "stream", which with "ip" and "port" tells concurrent streams apart. */
+enum StreamEvent {
+    STREAM_BEGIN = 0,
+    STREAM_DATA = 1,
+    STREAM_END = 2,
+    STREAM_ABORT = 3
+};
+
+typedef void (*ProcessStream)(BaseController*, const QJsonObject& cmd, int event,
+                              const QByteArray& chunk);
+
 void JSONCOMMANDSERVERSHARED_EXPORT execute_command(int cmd_type,
         BaseController* w,
         const QJsonObject& commad);
@@ -145,7 +159,26 @@ enum ServerCommands {
     CMD_TO = 6, // SEND MESSAGE FROM CLIENT A TO CLIENT B, VIA SERVER
     N_CMDS,
     CLOSE = -1, // CLOSE CONNECTION
-    NONE = -2
+    NONE = -2,
+    NODE_LINK = -3, // HANDSHAKE BETWEEN FEDERATED SERVERS
+    NODE_DIRECTORY = -4, // PEERS OWNED BY A FEDERATED SERVER
+    NODE_FORWARD = -5, // MESSAGE_TO/CMD_TO RELAYED BETWEEN FEDERATED SERVERS
+    COMMAND_REPLY = -6, // ANSWER TO A COMMAND CARRYING "request_id", SENT BACK WITH THE SAME ID
+    GATHER = -7, // FAN "cmd" OUT TO THE PEERS IN "to" AND ANSWER WITH ONE AGGREGATED COMMAND_REPLY
+    HISTORY = -8 // PAGE OF THE SERVER'S MESSAGE HISTORY, ANSWERED WITH A COMMAND_REPLY
+};
+
+enum MessagePriority {
+    PRIORITY_CONTROL = 0, // CLOSE, ERROR, STATUS, IDENTIFY AND PEER LIST
+    PRIORITY_HIGH = 1,
+    PRIORITY_NORMAL = 2,
+    PRIORITY_BULK = 3,
+    N_PRIORITIES
+};
+
+enum SendScheduling {
+    STRICT_PRIORITY = 0, // ALWAYS DRAIN THE HIGHEST PRIORITY LANE FIRST
+    WEIGHTED_PRIORITY = 1 // WEIGHTED ROUND ROBIN BETWEEN LANES
 };
 
 enum EquipamentTypes {
@@ -31,7 +31,37 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "jsoncommandserver.h"
 
-std::map<int, JsonCommandServer::ProcessCmd> JsonCommandServer::JsonCommandServer::user_process_;
+JsonCommandServer::CommandTable JsonCommandServer::JsonCommandServer::table_;
+
+static const int __g_default_priorities__[] = {
+    JsonCommandServer::PRIORITY_NORMAL, // MESSAGE_NORMAL
+    JsonCommandServer::PRIORITY_CONTROL, // MESSAGE_STATUS
+    JsonCommandServer::PRIORITY_CONTROL, // MESSAGE_ERROR
+    JsonCommandServer::PRIORITY_CONTROL, // MESSAGE_IDENTIFY
+    JsonCommandServer::PRIORITY_CONTROL, // MESSAGE_PEER_LIST
+    JsonCommandServer::PRIORITY_NORMAL, // MESSAGE_TO
+    JsonCommandServer::PRIORITY_NORMAL // CMD_TO
+};
+
+/* A cache_ttl_ms > 0 declares the command idempotent: its reply depends only on
+ * the command body, so the server may answer repeats from its response cache. */
+void JsonCommandServer::CommandTable::add(ProcessCmd cmd, int ID, int priority, int cache_ttl_ms) {
+    handlers[ID] = cmd;
+    setPriority(ID, priority);
+    if (cache_ttl_ms > 0) {
+        cache_ttls[ID] = cache_ttl_ms;
+    } else {
+        cache_ttls.erase(ID);
+    }
+}
+
+void JsonCommandServer::CommandTable::addStream(ProcessStream cmd, int ID) {
+    streams[ID] = cmd;
+}
+
+void JsonCommandServer::CommandTable::setPriority(int ID, int priority) {
+    priorities[ID] = qBound<int>(PRIORITY_CONTROL, priority, PRIORITY_BULK);
+}
 
 JsonCommandServer::JsonCommandServer::JsonCommandServer() {
 }
@@ -42,15 +72,91 @@ JsonCommandServer::JsonCommandServer::~JsonCommandServer() {
 void JsonCommandServer::JsonCommandServer::executeCommand(int type, BaseController *w, const QJsonObject &cmd) {
     if (type < N_CMDS) {
         execute_command(type, w, cmd);
-    } else if (user_process_.find(type) != user_process_.end()) {
-        ProcessCmd f = user_process_[type];
+    } else if (table_.handlers.find(type) != table_.handlers.end()) {
+        ProcessCmd f = table_.handlers[type];
         f(w, cmd);
     }
 }
 
-int JsonCommandServer::JsonCommandServer::addCommand(ProcessCmd cmd, int ID) {
-    int type = ID;
-    user_process_[type] = cmd;
-    return type;
+/* See CommandTable::add(). */
+int JsonCommandServer::JsonCommandServer::addCommand(ProcessCmd cmd, int ID, int priority,
+        int cache_ttl_ms) {
+    table_.add(cmd, ID, priority, cache_ttl_ms);
+    return ID;
+}
+
+/* False when no stream handler is registered for type. */
+bool JsonCommandServer::JsonCommandServer::executeStream(int type, BaseController *w,
+        const QJsonObject &cmd, int event, const QByteArray &chunk) {
+    std::map<int, ProcessStream>::const_iterator it = table_.streams.find(type);
+    if (it == table_.streams.end()) {
+        return false;
+    }
+    it->second(w, cmd, event, chunk);
+    return true;
+}
+
+int JsonCommandServer::JsonCommandServer::addStreamCommand(ProcessStream cmd, int ID) {
+    table_.addStream(cmd, ID);
+    return ID;
+}
+
+bool JsonCommandServer::JsonCommandServer::isStreamCommand(int type) {
+    return table_.streams.find(type) != table_.streams.end();
+}
+
+void JsonCommandServer::JsonCommandServer::setCommandPriority(int type, int priority) {
+    table_.setPriority(type, priority);
+}
+
+int JsonCommandServer::JsonCommandServer::commandPriority(int type) {
+    std::map<int, int>::const_iterator it = table_.priorities.find(type);
+    if (it != table_.priorities.end()) {
+        return it->second;
+    }
+    if (type == CLOSE || type == NODE_LINK || type == NODE_DIRECTORY) {
+        return PRIORITY_CONTROL;
+    }
+    if (type >= 0 && type < N_CMDS) {
+        return __g_default_priorities__[type];
+    }
+    return PRIORITY_NORMAL;
+}
+
+int JsonCommandServer::JsonCommandServer::commandCacheTtl(int type) {
+    std::map<int, int>::const_iterator it = table_.cache_ttls.find(type);
+    return it != table_.cache_ttls.end() ? it->second : 0;
 }
 
+/* Priority of a frame: the least urgent of the commands it carries, so that
+ * one urgent command cannot take the others ahead of their lane. */
+int JsonCommandServer::JsonCommandServer::messagePriority(const QJsonArray& cmds) {
+    int priority = -1;
+    for (int i = 0; i < cmds.size(); ++i) {
+        QJsonObject cmd = cmds[i].toObject();
+        if (cmd.contains("type")) {
+            priority = qMax(priority, commandPriority(cmd["type"].toInt()));
+        }
+    }
+    return priority < 0 ? PRIORITY_NORMAL : priority;
+}
+
+/* Priority of the commands a client hands to CMD_TO, NODE_FORWARD or GATHER:
+ * never more urgent than the carrying command, whatever types they claim. */
+int JsonCommandServer::JsonCommandServer::relayPriority(int type, const QJsonArray& cmds) {
+    return qMax(commandPriority(type), messagePriority(cmds));
+}
+
+JsonCommandServer::CommandTable JsonCommandServer::JsonCommandServer::commands() {
+    return table_;
+}
+
+/* Installs `table` and hands the previous one back. Commands are dispatched from
+ * the event loop, so every frame sees either the old or the new table, never a
+ * mix of both. */
+void JsonCommandServer::JsonCommandServer::swapCommands(CommandTable& table) {
+    table_.handlers.swap(table.handlers);
+    table_.priorities.swap(table.priorities);
+    table_.streams.swap(table.streams);
+    table_.cache_ttls.swap(table.cache_ttls);
+}
@@ -39,6 +39,19 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 namespace JsonCommandServer {
 
+/* A complete set of user commands, built aside and installed in one step with
+ * JsonCommandServer::swapCommands(). */
+struct JSONCOMMANDSERVERSHARED_EXPORT CommandTable {
+    std::map<int, ProcessCmd> handlers;
+    std::map<int, int> priorities;
+    std::map<int, ProcessStream> streams;
+    std::map<int, int> cache_ttls;
+
+    void add(ProcessCmd cmd, int ID, int priority = PRIORITY_NORMAL, int cache_ttl_ms = 0);
+    void addStream(ProcessStream cmd, int ID);
+    void setPriority(int ID, int priority);
+};
+
 class JSONCOMMANDSERVERSHARED_EXPORT JsonCommandServer {
 
   public:
@@ -46,10 +59,28 @@ class JSONCOMMANDSERVERSHARED_EXPORT JsonCommandServer {
     virtual ~JsonCommandServer();
 
     static void executeCommand(int type, BaseController* w, const QJsonObject& cmd);
-    static int addCommand(ProcessCmd cmd, int ID = 0);
+    static int addCommand(ProcessCmd cmd, int ID = 0, int priority = PRIORITY_NORMAL,
+                          int cache_ttl_ms = 0);
+
+    static bool executeStream(int type, BaseController* w, const QJsonObject& cmd, int event,
+                              const QByteArray& chunk);
+    static int addStreamCommand(ProcessStream cmd, int ID);
+    static bool isStreamCommand(int type);
+
+    static void setCommandPriority(int type, int priority);
+    static int commandPriority(int type);
+    static int messagePriority(const QJsonArray& cmds);
+    static int relayPriority(int type, const QJsonArray& cmds);
+
+    /* How long replies of an idempotent command may be served from the cache;
+     * 0 when the command is not cacheable. */
+    static int commandCacheTtl(int type);
+
+    static CommandTable commands();
+    static void swapCommands(CommandTable& table);
 
   private:
-    static std::map<int, ProcessCmd> user_process_;
+    static CommandTable table_;
 };
 
 } // namespace JsonCommandServer
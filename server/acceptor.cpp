@@ -0,0 +1,72 @@
+/*
+Json Command Server
+
+ACCEPTOR
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "acceptor.h"
+#include "listen_socket.h"
+
+#include <QMetaType>
+
+static const int N_MAX_ACCEPT_BATCH = 256;
+
+JsonCommandServer::Acceptor::Acceptor(QObject *_parent)
+    : QTcpServer(_parent) {
+    qRegisterMetaType<qintptr>("qintptr");
+    qRegisterMetaType<QVector<qintptr> >("QVector<qintptr>");
+}
+
+JsonCommandServer::Acceptor::~Acceptor() {
+    for (int i = 0; i < accepted_.size(); ++i) {
+        closeDescriptor(accepted_[i]);
+    }
+}
+
+bool JsonCommandServer::Acceptor::adopt(qintptr fd) {
+    return setSocketDescriptor(fd);
+}
+
+void JsonCommandServer::Acceptor::incomingConnection(qintptr descriptor) {
+    accepted_.append(descriptor);
+    if (accepted_.size() == 1) {
+        // QTcpServer accepts until the backlog is empty, then the batch goes out
+        QMetaObject::invokeMethod(this, "flushAccepted", Qt::QueuedConnection);
+    } else if (accepted_.size() >= N_MAX_ACCEPT_BATCH) {
+        flushAccepted();
+    }
+}
+
+void JsonCommandServer::Acceptor::flushAccepted() {
+    if (accepted_.isEmpty()) return;
+    QVector<qintptr> batch;
+    batch.swap(accepted_);
+    emit connectionsAccepted(batch);
+}
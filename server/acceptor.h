@@ -0,0 +1,72 @@
+/*
+Json Command Server
+
+ACCEPTOR
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_ACCEPTOR_H
+#define JSONCOMMANDSERVER_ACCEPTOR_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QTcpServer>
+#include <QVector>
+
+namespace JsonCommandServer {
+
+/* Listener of a SO_REUSEPORT group. It only accepts: descriptors are handed
+ * on in batches through connectionsAccepted(), so an Acceptor can run on its
+ * own thread and keep its backlog drained while the server thread does the
+ * handshakes. */
+class JSONCOMMANDSERVERSHARED_EXPORT Acceptor : public QTcpServer {
+    Q_OBJECT
+
+  public:
+    Acceptor(QObject* parent = 0);
+    virtual ~Acceptor();
+
+    Q_INVOKABLE bool adopt(qintptr fd);
+
+  signals:
+    void connectionsAccepted(const QVector<qintptr>& descriptors);
+
+  protected:
+    virtual void incomingConnection(qintptr descriptor);
+
+  private slots:
+    void flushAccepted();
+
+  private:
+    QVector<qintptr> accepted_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_ACCEPTOR_H
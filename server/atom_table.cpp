@@ -0,0 +1,81 @@
+/*
+Json Command Server
+
+ATOM TABLE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "atom_table.h"
+
+JsonCommandServer::AtomTable::AtomTable()
+    : slots_(1) {
+}
+
+JsonCommandServer::Atom JsonCommandServer::AtomTable::intern(const QString &text) {
+    QHash<QString, Atom>::const_iterator it = ids_.constFind(text);
+    if (it != ids_.constEnd()) {
+        ++slots_[it.value()].refs;
+        return it.value();
+    }
+    Atom atom;
+    if (!free_.empty()) {
+        atom = free_.back();
+        free_.pop_back();
+    } else {
+        atom = Atom(slots_.size());
+        slots_.push_back(Slot());
+    }
+    slots_[atom].text = text;
+    slots_[atom].refs = 1;
+    ids_.insert(text, atom);
+    return atom;
+}
+
+void JsonCommandServer::AtomTable::retain(Atom atom) {
+    if (atom != NO_ATOM) ++slots_[atom].refs;
+}
+
+void JsonCommandServer::AtomTable::release(Atom atom) {
+    if (atom == NO_ATOM || atom >= slots_.size() || slots_[atom].refs <= 0) return;
+    Slot& slot = slots_[atom];
+    if (--slot.refs > 0) return;
+    ids_.remove(slot.text);
+    slot.text = QString();
+    free_.push_back(atom);
+}
+
+void JsonCommandServer::AtomTable::clear() {
+    slots_.assign(1, Slot());
+    free_.clear();
+    ids_.clear();
+}
+
+JsonCommandServer::Atom JsonCommandServer::AtomTable::find(const QString &text) const {
+    return ids_.value(text, NO_ATOM);
+}
@@ -0,0 +1,83 @@
+/*
+Json Command Server
+
+ATOM TABLE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_ATOM_TABLE_H
+#define JSONCOMMANDSERVER_ATOM_TABLE_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QHash>
+#include <QString>
+
+#include <vector>
+
+namespace JsonCommandServer {
+
+typedef quint32 Atom;
+
+const Atom NO_ATOM = 0;
+
+/* Interned strings: each distinct string gets a small integer id, so peer
+ * names and addresses are built once and then compared, hashed and indexed as
+ * integers. Atoms are reference counted: peer names change with every
+ * connection, and a released atom's id is reused. Not thread safe, a table
+ * belongs to its server's event loop. */
+class JSONCOMMANDSERVERSHARED_EXPORT AtomTable {
+  public:
+    AtomTable();
+
+    Atom intern(const QString& text);  // takes a reference
+    void retain(Atom atom);
+    void release(Atom atom);
+    void clear();
+
+    Atom find(const QString& text) const;  // NO_ATOM when not interned
+    const QString& string(Atom atom) const { return slots_[atom].text; }
+    int size() const { return ids_.size(); }
+
+  private:
+    struct Slot {
+        Slot() : refs(0) {}
+
+        QString text;
+        int refs;
+    };
+
+    std::vector<Slot> slots_;  // slot 0 is NO_ATOM, the empty string
+    std::vector<Atom> free_;
+    QHash<QString, Atom> ids_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_ATOM_TABLE_H
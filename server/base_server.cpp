@@ -34,20 +34,108 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "base_server.h"
 
+#include "acceptor.h"
+#include "jsoncommandserver.h"
+#include "listen_socket.h"
+#ifdef Q_OS_LINUX
+#include "shm_socket.h"
+#endif
+
 #include <QTime>
 #include <QtNetwork>
+
+#include <algorithm>
+#include <functional>
 //#include <QMessageBox>
 
 static const int N_MAX_SERVER_MESSAGES = 50;
+static const qint32 DEFAULT_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+static const int DEFAULT_MAX_FRAMES_PER_READ = 32;
+static const qint64 SOCKET_READ_BUFFER_SIZE = 256 * 1024;
+static const qint64 SOCKET_WRITE_HIGH_WATER_MARK = 64 * 1024;
+static const qint64 STREAM_RELAY_HIGH_WATER_MARK = 256 * 1024;
+static const qint64 STREAM_RELAY_LOW_WATER_MARK = 64 * 1024;
+static const int GOSSIP_INTERVAL = 5000;
+static const int DIRECTORY_ANNOUNCE_DELAY = 50;
+static const int FORWARD_TTL = 8;
+static const int DEFAULT_GATHER_TIMEOUT = 5000;
+static const int MAX_GATHER_TIMEOUT = 60000;
+static const size_t N_MAX_SEEN_FORWARDS = 4096;
+static const int REPLAY_INTERVAL = 50;
+static const int OFFLINE_SYNC_INTERVAL = 1000;
+static const int DEFAULT_REPLAY_RATE = 200;
+static const int STATE_SYNC_INTERVAL = 1000;
+static const int LISTEN_BACKLOG = 1024;
+static const int N_MAX_HANDSHAKES_PER_TURN = 128;
+static const int N_MAX_DATAGRAM_BATCHES = 8;
+// how far a datagram may skip ahead, and how many out of that window in a row
+// mean the peer restarted its sequence
+static const quint32 DATAGRAM_WINDOW = 1024;
+static const int N_MAX_OUT_OF_WINDOW = 16;
+// per-connection entries that older versions journaled
+static const char NODE_STATE_PREFIX[] = "node/";
 
 JsonCommandServer::BaseServer::BaseServer(QObject *_parent)
     : QObject(_parent),
       BaseController(),
       tcp_server_(0),
       network_session_(0),
+      server_mode_(false),
+      startup_ns_(-1),
+      hot_reload_(false),
+      reuse_port_(false),
+      listener_fd_(-1),
+      n_acceptors_(1),
+      local_listener_(0),
+      shm_listener_(0),
+      n_local_connections_(0),
+      handshake_scheduled_(false),
+      peer_list_dirty_(false),
+      peer_list_stale_(true),
+      peers_version_(1),
+      peer_list_frame_version_(0),
+      publish_scheduled_(false),
       next_key_(0),
       n_messages_(0),
-      n_max_clients_(100) {
+      n_max_clients_(100),
+      max_frame_size_(DEFAULT_MAX_FRAME_SIZE),
+      max_frames_per_read_(DEFAULT_MAX_FRAMES_PER_READ),
+      batching_(false),
+      send_scheduling_(WEIGHTED_PRIORITY),
+      datagram_port_(0),
+      datagram_channel_(0),
+      token_random_(std::random_device()()),
+      max_frame_version_(FRAME_V2),
+      stream_chunk_size_(DEFAULT_STREAM_CHUNK_SIZE),
+      compress_min_size_(0),
+      watchdog_(new LoopWatchdog(this)),
+      shed_priority_(PRIORITY_BULK),
+      recording_reply_(false),
+      gossip_timer_(new QTimer(this)),
+      directory_dirty_(false),
+      directory_version_(0),
+      forward_seq_(0),
+      replay_timer_(new QTimer(this)),
+      offline_sync_timer_(new QTimer(this)),
+      replay_rate_(DEFAULT_REPLAY_RATE),
+      history_(atoms_),
+      verbose_(true),
+      frame_ready_ns_(0),
+      current_trace_(0),
+      state_sync_timer_(new QTimer(this)),
+      current_connection_(0),
+      waiters_(0),
+      waiter_timer_(new QTimer(this)),
+      request_seq_(0),
+      posted_(0) {
+    clock_.start();
+    connect(gossip_timer_, SIGNAL(timeout()), this, SLOT(gossipDirectory()));
+    connect(replay_timer_, SIGNAL(timeout()), this, SLOT(replayOffline()));
+    connect(offline_sync_timer_, SIGNAL(timeout()), this, SLOT(syncOffline()));
+    connect(state_sync_timer_, SIGNAL(timeout()), this, SLOT(syncState()));
+    waiter_timer_->setSingleShot(true);
+    connect(waiter_timer_, SIGNAL(timeout()), this, SLOT(expireWaiters()));
+    connect(watchdog_, SIGNAL(levelChanged(int,int,qint64)), this, SLOT(shedLoad(int,int,qint64)));
     connect(this, SIGNAL(dataReceived(QTcpSocket*,QString)), SLOT(processMessage(QTcpSocket*,QString)));
 }
 
@@ -55,6 +143,12 @@ JsonCommandServer::BaseServer::~BaseServer() {
 }
 
 void JsonCommandServer::BaseServer::initServer() {
+    startup_clock_.start();
+    startup_ns_ = -1;
+    if (server_mode_) {
+        sessionOpened();
+        return;
+    }
     QNetworkConfigurationManager manager;
     if (manager.capabilities() & QNetworkConfigurationManager::NetworkSessionRequired) {
         // Get saved network configuration
@@ -70,12 +164,11 @@ void JsonCommandServer::BaseServer::initServer() {
         }
         network_session_ = new QNetworkSession(config, this);
         connect(network_session_, SIGNAL(opened()), this, SLOT(sessionOpened()));
-        this->addStatusMessage(tr("Opening network session."));
+        logStatus(tr("Opening network session."));
         network_session_->open();
     } else {
         sessionOpened();
     }
-    connect(tcp_server_, SIGNAL(newConnection()), this, SLOT(sendInitialMessage()));
 }
 
 QString JsonCommandServer::BaseServer::myIP() {
@@ -102,45 +195,345 @@ void JsonCommandServer::BaseServer::sessionOpened() {
         settings.setValue(QLatin1String("DefaultNetworkConfiguration"), id);
         settings.endGroup();
     }
-    tcp_server_ = new QTcpServer(this);
-    if (!tcp_server_->listen(QHostAddress::Any, this->port_server_)) {
-        this->addErrorMessage(tr("Não foi possível iniciar o servidor: %1.")
-                              .arg(tcp_server_->errorString()));
+    tcp_server_ = createListener();
+    QString error;
+    if (!listenServer(tcp_server_, error) || !listenExtraAddresses(error) ||
+            !startAcceptorThreads(error)) {
+        logError(tr("Não foi possível iniciar o servidor: %1.").arg(error));
         return;
     }
-    ip_address_ = QString();
-    QList<QHostAddress> ipAddressesList = QNetworkInterface::allAddresses();
-    // use the first non-localhost IPv4 address
-    for (int i = 0; i < ipAddressesList.size(); ++i) {
-        if (ipAddressesList.at(i) != QHostAddress::LocalHost &&
-                ipAddressesList.at(i).toIPv4Address()) {
-            ip_address_ = ipAddressesList.at(i).toString();
-            break;
+    startup_ns_ = startup_clock_.nsecsElapsed();
+    if (server_mode_) {
+        // what was configured, never a guess from the interfaces
+        for (int i = 0; i < listen_addresses_.size() && ip_address_.isEmpty(); ++i) {
+            const QHostAddress& address = listen_addresses_[i];
+            if (address != QHostAddress::Any && address != QHostAddress::AnyIPv6 &&
+                    address != QHostAddress::AnyIPv4) {
+                ip_address_ = address.toString();
+            }
+        }
+    } else {
+        ip_address_ = QString();
+        QList<QHostAddress> ipAddressesList = QNetworkInterface::allAddresses();
+        // use the first non-localhost IPv4 address
+        for (int i = 0; i < ipAddressesList.size(); ++i) {
+            if (ipAddressesList.at(i) != QHostAddress::LocalHost &&
+                    ipAddressesList.at(i).toIPv4Address()) {
+                ip_address_ = ipAddressesList.at(i).toString();
+                break;
+            }
         }
     }
     // if we did not find one, use IPv4 localhost
     if (ip_address_.isEmpty())
         ip_address_ = QHostAddress(QHostAddress::LocalHost).toString();
-    this->addStatusMessage(tr("O servidor está rodando!\n\nIP: %1\nPorta: %2\n\n"
-                              "O sistema já está apto para receber dados dos clientes.")
-                           .arg(ip_address_)
-                           .arg(QString::number(tcp_server_->serverPort())));
+    if (!node_addresses_.empty()) {
+        gossipDirectory();
+        gossip_timer_->start(GOSSIP_INTERVAL);
+    }
+    openLocalListeners();
+    openDatagramChannel();
+    if (server_mode_) {
+        QStringList addresses;
+        addresses.append(primaryAddress().toString());
+        for (int i = 1; i < listen_addresses_.size(); ++i) {
+            addresses.append(listen_addresses_[i].toString());
+        }
+        logStatus(tr("Servidor pronto em %1 ms: %2, porta %3.")
+                  .arg(startup_ns_ / 1e6, 0, 'f', 2)
+                  .arg(addresses.join(", "))
+                  .arg(QString::number(tcp_server_->serverPort())));
+        return;
+    }
+    logStatus(tr("O servidor está rodando!\n\nIP: %1\nPorta: %2\n\n"
+                 "O sistema já está apto para receber dados dos clientes.")
+              .arg(ip_address_)
+              .arg(QString::number(tcp_server_->serverPort())));
+}
+
+bool JsonCommandServer::BaseServer::listenServer(QTcpServer *server, QString &error) {
+    qintptr fd = listener_fd_;
+    listener_fd_ = -1;
+    if (fd < 0 && (reuse_port_ || n_acceptors_ > 1)) {
+        fd = openListenSocket(primaryAddress(), port_server_, true, LISTEN_BACKLOG, &error);
+        if (fd < 0) return false;
+    }
+    if (fd >= 0) {
+        if (!server->setSocketDescriptor(fd)) {
+            error = server->errorString();
+            return false;
+        }
+        return true;
+    }
+    if (!server->listen(primaryAddress(), port_server_)) {
+        error = server->errorString();
+        return false;
+    }
+    return true;
+}
+
+QHostAddress JsonCommandServer::BaseServer::primaryAddress() const {
+    return listen_addresses_.isEmpty() ? QHostAddress(QHostAddress::Any)
+                                       : listen_addresses_.first();
+}
+
+/* The listen addresses after the first, on the port the first one got. They
+ * are plain listeners served by this thread. */
+bool JsonCommandServer::BaseServer::listenExtraAddresses(QString &error) {
+    closeExtraListeners();
+    for (int i = 1; i < listen_addresses_.size(); ++i) {
+        QTcpServer* server = new QTcpServer(this);
+        connect(server, SIGNAL(newConnection()), this, SLOT(sendInitialMessage()));
+        extra_listeners_.append(server);
+        if (!server->listen(listen_addresses_[i], tcp_server_->serverPort())) {
+            error = listen_addresses_[i].toString() + ": " + server->errorString();
+            return false;
+        }
+    }
+    return true;
+}
+
+void JsonCommandServer::BaseServer::closeExtraListeners() {
+    for (int i = 0; i < extra_listeners_.size(); ++i) {
+        QTcpServer* server = extra_listeners_[i];
+        // take what it already accepted before closing it
+        while (server->hasPendingConnections()) {
+            acceptConnection(server->nextPendingConnection());
+        }
+        server->close();
+        server->deleteLater();
+    }
+    extra_listeners_.clear();
+}
+
+void JsonCommandServer::BaseServer::setServerMode(bool _server_mode) {
+    this->server_mode_ = _server_mode;
+}
+
+void JsonCommandServer::BaseServer::setListenAddresses(const QList<QHostAddress> &addresses) {
+    this->listen_addresses_ = addresses;
+}
+
+/* Replaces the listener with one bound to the current port. The connections
+ * accepted so far belong to the server object, not to the listener, so they
+ * survive the old listener being deleted. */
+bool JsonCommandServer::BaseServer::rebindListener() {
+    stopAcceptorThreads();
+    QTcpServer* server = createListener();
+    QString error;
+    if (!listenServer(server, error)) {
+        delete server;
+        logError(tr("Não foi possível trocar a porta do servidor: %1.").arg(error));
+        return false;
+    }
+    QTcpServer* old_server = tcp_server_;
+    tcp_server_ = server;
+    if (old_server) {
+        // take what the old listener already accepted before closing it
+        while (old_server->hasPendingConnections()) {
+            acceptConnection(old_server->nextPendingConnection());
+        }
+        old_server->close();
+        old_server->deleteLater();
+    }
+    if (!listenExtraAddresses(error)) {
+        logError(tr("Não foi possível escutar em todos os endereços: %1.").arg(error));
+    }
+    if (!startAcceptorThreads(error)) {
+        logError(tr("Não foi possível iniciar os aceitadores: %1.").arg(error));
+    }
+    return true;
+}
+
+QTcpServer* JsonCommandServer::BaseServer::createListener() {
+    if (n_acceptors_ <= 1) {
+        QTcpServer* server = new QTcpServer(this);
+        connect(server, SIGNAL(newConnection()), this, SLOT(sendInitialMessage()));
+        return server;
+    }
+    Acceptor* acceptor = new Acceptor(this);
+    connect(acceptor, SIGNAL(connectionsAccepted(QVector<qintptr>)),
+            this, SLOT(acceptDescriptors(QVector<qintptr>)));
+    return acceptor;
+}
+
+/* The other members of tcp_server_'s SO_REUSEPORT group, one per thread. The
+ * kernel spreads new connections over all of them, so each backlog only sees
+ * its share of a storm. */
+bool JsonCommandServer::BaseServer::startAcceptorThreads(QString &error) {
+    for (int i = 1; i < n_acceptors_; ++i) {
+        qintptr fd = openListenSocket(primaryAddress(), tcp_server_->serverPort(),
+                                      true, LISTEN_BACKLOG, &error);
+        if (fd < 0) return false;
+        QThread* thread = new QThread(this);
+        Acceptor* acceptor = new Acceptor;
+        acceptor->moveToThread(thread);
+        connect(thread, SIGNAL(finished()), acceptor, SLOT(deleteLater()));
+        connect(acceptor, SIGNAL(connectionsAccepted(QVector<qintptr>)),
+                this, SLOT(acceptDescriptors(QVector<qintptr>)));
+        thread->start();
+        acceptor_threads_.append(thread);
+        bool ok = false;
+        QMetaObject::invokeMethod(acceptor, "adopt", Qt::BlockingQueuedConnection,
+                                  Q_RETURN_ARG(bool, ok), Q_ARG(qintptr, fd));
+        if (!ok) {
+            closeDescriptor(fd);
+            error = acceptor->errorString();
+            return false;
+        }
+    }
+    return true;
+}
+
+void JsonCommandServer::BaseServer::stopAcceptorThreads() {
+    for (int i = 0; i < acceptor_threads_.size(); ++i) {
+        acceptor_threads_[i]->quit();
+        acceptor_threads_[i]->wait();
+        delete acceptor_threads_[i];
+    }
+    acceptor_threads_.clear();
+}
+
+void JsonCommandServer::BaseServer::setAcceptors(int n_acceptors) {
+    this->n_acceptors_ = qMax(1, n_acceptors);
+}
+
+void JsonCommandServer::BaseServer::setLocalPath(const QString &local_path) {
+    this->local_path_ = local_path;
+}
+
+void JsonCommandServer::BaseServer::setSharedMemoryPath(const QString &shm_path) {
+    this->shm_path_ = shm_path;
+}
+
+/* Opens, moves or closes the local listeners to match the configured paths.
+ * They do not depend on the TCP port, so a reload leaves them alone otherwise. */
+void JsonCommandServer::BaseServer::openLocalListeners() {
+    LocalListener** listeners[2] = {&local_listener_, &shm_listener_};
+    const QString* paths[2] = {&local_path_, &shm_path_};
+    for (int i = 0; i < 2; ++i) {
+        LocalListener*& listener = *listeners[i];
+        const QString& path = *paths[i];
+        if (listener && listener->path() == path) continue;
+        delete listener;
+        listener = 0;
+        if (path.isEmpty()) continue;
+#ifndef Q_OS_LINUX
+        if (i == 1) {
+            logError(tr("Memória compartilhada só é suportada no Linux."));
+            continue;
+        }
+#endif
+        listener = new LocalListener(this);
+        QString error;
+        if (!listener->listen(path, &error)) {
+            logError(tr("Não foi possível escutar em %1: %2.").arg(path).arg(error));
+            delete listener;
+            listener = 0;
+            continue;
+        }
+        connect(listener, SIGNAL(connectionsAccepted(QVector<qintptr>)), this,
+                i == 0 ? SLOT(acceptDescriptors(QVector<qintptr>))
+                       : SLOT(acceptSharedMemory(QVector<qintptr>)));
+        logStatus(tr("Escutando clientes locais em %1.").arg(path));
+    }
+}
+
+void JsonCommandServer::BaseServer::acceptDescriptors(const QVector<qintptr> &descriptors) {
+    for (int i = 0; i < descriptors.size(); ++i) {
+        QTcpSocket* socket = new QTcpSocket(this);
+        if (!socket->setSocketDescriptor(descriptors[i])) {
+            closeDescriptor(descriptors[i]);
+            delete socket;
+            continue;
+        }
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        handshakes_.append(socket);
+    }
+    scheduleHandshakes();
+}
+
+/* Control connections of the shared memory listener: each one brings the
+ * region its client created, and becomes a ShmSocket. */
+void JsonCommandServer::BaseServer::acceptSharedMemory(const QVector<qintptr> &descriptors) {
+    for (int i = 0; i < descriptors.size(); ++i) {
+#ifdef Q_OS_LINUX
+        QString error;
+        QTcpSocket* socket = ShmSocket::accept(descriptors[i], &error, this);
+        if (!socket) {
+            logError(tr("Conexão por memória compartilhada recusada: %1").arg(error));
+            continue;
+        }
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+        handshakes_.append(socket);
+#else
+        closeDescriptor(descriptors[i]);
+#endif
+    }
+    scheduleHandshakes();
+}
+
+void JsonCommandServer::BaseServer::scheduleHandshakes() {
+    if (!handshakes_.isEmpty() && !handshake_scheduled_) {
+        handshake_scheduled_ = true;
+        QTimer::singleShot(0, this, SLOT(processHandshakes()));
+    }
+}
+
+/* Handshakes of batched connections, a bounded number per event loop turn so
+ * the clients already connected keep being served during a storm. */
+void JsonCommandServer::BaseServer::processHandshakes() {
+    handshake_scheduled_ = false;
+    int n = 0;
+    while (!handshakes_.isEmpty() && n < N_MAX_HANDSHAKES_PER_TURN) {
+        QPointer<QTcpSocket> socket = handshakes_.takeFirst();
+        if (!socket) continue;
+        acceptConnection(socket);
+        ++n;
+    }
+    if (n > 0) {
+        logStatus(tr("%1 clientes conectados.").arg(n));
+    }
+    scheduleHandshakes();
 }
 
 void JsonCommandServer::BaseServer::sendInitialMessage() {
-    QTcpSocket *client_connection = tcp_server_->nextPendingConnection();
-    this->addStatusMessage("Cliente conectado: " +
-                           client_connection->peerName() + "@" +
-                           client_connection->peerAddress().toString() +
-                           ": " +
-                           QString::number(client_connection->peerPort()) +
-                           "\n");
+    QTcpServer* server = qobject_cast<QTcpServer*>(sender());
+    if (!server) server = tcp_server_;
+    QTcpSocket *client_connection = server->nextPendingConnection();
+    if (client_connection) {
+        acceptConnection(client_connection);
+    }
+}
+
+void JsonCommandServer::BaseServer::acceptConnection(QTcpSocket *client_connection) {
+    // owned by the server, not by the listener, so a rebind keeps it alive
+    client_connection->setParent(this);
+    if (n_acceptors_ <= 1 && !client_connection->peerAddress().isNull()) {
+        // batched and local accepts are reported per batch in processHandshakes()
+        logStatus("Cliente conectado: " +
+                  client_connection->peerName() + "@" +
+                  client_connection->peerAddress().toString() +
+                  ": " +
+                  QString::number(client_connection->peerPort()) +
+                  "\n");
+    }
     connect(client_connection, SIGNAL(disconnected()),
-            client_connection, SLOT(deleteLater()));
+            client_connection, SLOT(deleteLater()), Qt::UniqueConnection);
+    QString error_message;
     if (numSockets() >= this->n_max_clients_) {
-        QString error_message = "Atingindo numero máximo de clientes suportados!";
+        error_message = "Atingindo numero máximo de clientes suportados!";
+    } else if (!admission_.consume(clock_.elapsed())) {
+        error_message = "Taxa máxima de novas conexões excedida!";
+    } else if (watchdog_->level() >= SHED_ACCEPT) {
+        // listeners are paused; this one came through an acceptor thread or a local listener
+        ++metrics_.connections_shed;
+        error_message = tr("Servidor sobrecarregado, tente novamente mais tarde.");
+    }
+    if (!error_message.isEmpty()) {
+        ++metrics_.connections_rejected;
         bool ok = false;
-        this->addErrorMessage(error_message);
+        logError(error_message);
         QJsonArray cmd = createError(error_message, ok);
         if (ok) {
             writeMessage(client_connection, cmd);
@@ -148,10 +541,15 @@ void JsonCommandServer::BaseServer::sendInitialMessage() {
         client_connection->disconnectFromHost();
         return;
     }
+    ++metrics_.connections_accepted;
+    // Bound Qt's own buffer so a flooding client is pushed back by TCP flow control
+    client_connection->setReadBufferSize(SOCKET_READ_BUFFER_SIZE);
     connect(client_connection, SIGNAL(readyRead()),
             this, SLOT(receiveMessage()));
     connect(client_connection, SIGNAL(error(QAbstractSocket::SocketError)),
             this, SLOT(displayError(QAbstractSocket::SocketError)));
+    connect(client_connection, SIGNAL(bytesWritten(qint64)),
+            this, SLOT(socketBytesWritten(qint64)));
     QString message = "conectado";
     bool ok = false;
     QJsonArray cmd = createStatus(message, ok);
@@ -159,64 +557,343 @@ void JsonCommandServer::BaseServer::sendInitialMessage() {
         writeMessage(client_connection, cmd);
     }
     addSocket(client_connection);
+    if (client_connection->bytesAvailable() > 0) {
+        // data that came in while the handshake was deferred
+        schedulePendingFrames(client_connection, 0);
+    }
 }
 
 void JsonCommandServer::BaseServer::writeMessage(QTcpSocket *_socket, const QString & _message) {
-    if (_socket->state() == QAbstractSocket::ConnectedState) {
-        QByteArray data = _message.toLocal8Bit();
+    writeMessage(_socket, _message, PRIORITY_NORMAL);
+}
+
+void JsonCommandServer::BaseServer::writeMessage(QTcpSocket *_socket, const QString & _message,
+        int priority) {
+    writeFrame(_socket, _message.toLocal8Bit(), priority);
+}
+
+void JsonCommandServer::BaseServer::writeFrame(QTcpSocket *_socket, const QByteArray& data,
+        int priority, const QString& conflation_key, bool unreliable) {
+    if (_socket->state() != QAbstractSocket::ConnectedState) return;
+    if (recording_reply_ && _socket == current_connection_) {
+        CachedFrame frame = { data, priority };
+        recorded_frames_.append(frame);
+    }
+    if (unreliable && sendDatagram(_socket, data)) return;
+    SendQueue* queue = send_queues_.value(_socket);
+    if (!queue) {
+        // not registered yet (handshake or rejection): write straight through
         _socket->write(IntToArray(data.size()));
         _socket->write(data);
-        //_socket->waitForBytesWritten();
+        return;
+    }
+    if (compress_min_size_ > 0 && data.size() >= compress_min_size_ &&
+            queue->framing() >= FRAME_V2) {
+        QByteArray compressed = encodePayload(ENCODING_DEFLATE_JSON, data);
+        if (compressed.size() < data.size()) {
+            if (!queue->push(priority, compressed, current_trace_, ENCODING_DEFLATE_JSON,
+                             conflation_key)) {
+                ++metrics_.frames_conflated;
+            }
+            flushSendQueue(_socket);
+            return;
+        }
+    }
+    if (!queue->push(priority, data, current_trace_, ENCODING_JSON, conflation_key)) {
+        ++metrics_.frames_conflated;
+    }
+    flushSendQueue(_socket);
+}
+
+void JsonCommandServer::BaseServer::flushSendQueue(QTcpSocket *_socket) {
+    SendQueue* queue = send_queues_.value(_socket);
+    if (!queue) return;
+    while (!queue->isEmpty() && _socket->bytesToWrite() < SOCKET_WRITE_HIGH_WATER_MARK) {
+        int priority = PRIORITY_NORMAL;
+        quint64 trace = 0;
+        qint64 queued_ns = 0;
+        bool complete = false;
+        _socket->write(queue->pop(&priority, &trace, &queued_ns, &complete));
+        if (!complete) continue;
+        ++metrics_.frames_sent[priority];
+        if (trace) {
+            qint64 now = TraceRecorder::now();
+            TraceRecorder::record(trace, "send_queue", queued_ns, now);
+            TracedWrite write = { trace, _socket->bytesToWrite(), now };
+            traced_writes_[_socket].push_back(write);
+        }
+    }
+    if (!stalled_reads_.isEmpty() && queue->pendingBytes() <= STREAM_RELAY_LOW_WATER_MARK) {
+        resumeStalledReads(_socket);
     }
 }
 
+void JsonCommandServer::BaseServer::socketBytesWritten(qint64 bytes) {
+    QTcpSocket* socket = static_cast<QTcpSocket*>(sender());
+    if (!traced_writes_.isEmpty()) traceWritten(socket, bytes);
+    flushSendQueue(socket);
+}
+
 void JsonCommandServer::BaseServer::receiveMessage() {
     QTcpSocket* socket = static_cast<QTcpSocket*>(sender());
-    QByteArray* buffer = buffers_.value(socket);
-    qint32* s = sizes_.value(socket);
-    qint32 size = *s;
-    while (socket->bytesAvailable() > 0) {
-        buffer->append(socket->readAll());
-        bool cond1 = (size == 0 && buffer->size() >= 4);
-        bool cond2 = (size > 0 && buffer->size() >= size);
-        while (cond1 || cond2) {
-            if (cond1) {
-                size = ArrayToInt(buffer->mid(0, 4));
-                *s = size;
-                buffer->remove(0, 4);
-                //QMessageBox::warning(0, "PACOTE RECEBIDO SERVIDOR -- ", "SIZE = " + QString::number(size));
-            } else {
-                QByteArray data = buffer->mid(0, size);
-                buffer->remove(0, size);
-                size = 0;
-                *s = size;
-                QString message(data);
-                //QMessageBox::warning(0, "PACOTE RECEBIDO SERVIDOR", "SIZE = " + QString::number(size) +
-                //                   "Messagem recebida: {" + message + "}");
-                this->addStatusMessage("Messagem recebida: {" + message + "}");
-                emit dataReceived(socket,message);
+    if (!buffers_.contains(socket)) return;
+    batching_ = true;
+    qint64 delay = readFrames(socket, max_frames_per_read_);
+    batching_ = false;
+    if (delay >= 0) {
+        schedulePendingFrames(socket, delay);
+    }
+    dispatchCommands();
+}
+
+void JsonCommandServer::BaseServer::processPendingFrames() {
+    QList<QTcpSocket*> pending;
+    pending.swap(pending_frames_);
+    batching_ = true;
+    for (int i = 0; i < pending.size(); ++i) {
+        QTcpSocket* socket = pending[i];
+        if (!buffers_.contains(socket)) continue;
+        qint64 delay = readFrames(socket, max_frames_per_read_);
+        if (delay >= 0) {
+            schedulePendingFrames(socket, delay);
+        }
+    }
+    batching_ = false;
+    dispatchCommands();
+}
+
+/* Pulls at most `budget` frames of _socket, reading from the socket only what the
+ * current frame still needs. Returns -1 when the socket is drained, otherwise the
+ * delay (ms) after which the remaining frames must be processed. */
+qint64 JsonCommandServer::BaseServer::readFrames(QTcpSocket* _socket, int budget) {
+    QByteArray* buffer = buffers_.value(_socket);
+    qint32* s = sizes_.value(_socket);
+    ClientRateLimiter* limiter = limiters_.value(_socket);
+    // only connections that negotiated v2 have one
+    StreamAssembler* streams = assemblers_.value(_socket);
+    while (true) {
+        if (!stalled_reads_.isEmpty() && stalled_reads_.contains(_socket)) {
+            // a stream it relays waits for its receiver, see resumeStalledReads()
+            return -1;
+        }
+        if (!shed_reads_.isEmpty() && shed_reads_.contains(_socket)) {
+            return -1;
+        }
+        qint32 size = *s;
+        bool in_chunk = streams && streams->inChunk();
+        int header_size = streams ? frameHeaderSize(*buffer) : FRAME_V1_HEADER_SIZE;
+        qint32 needed = (size == 0 && !in_chunk ? header_size : size) - buffer->size();
+        if (needed > 0) {
+            qint64 available = _socket->bytesAvailable();
+            if (available <= 0) return -1;
+            buffer->append(_socket->read(qMin<qint64>(needed, available)));
+            continue;
+        }
+        if (size == 0 && !in_chunk) {
+            if (header_size == FRAME_V2_HEADER_SIZE) {
+                FrameHeader header = decodeFrameHeader(*buffer);
+                buffer->clear();
+                QString error;
+                if (!streams->begin(header, &error)) {
+                    ++metrics_.frames_oversized;
+                    rejectFrame(_socket, error);
+                    return -1;
+                }
+                *s = header.size;
+                continue;
+            }
+            size = ArrayToInt(buffer->mid(0, 4));
+            buffer->clear();
+            if (size < 0 || size > max_frame_size_) {
+                rejectFrame(_socket, size);
+                return -1;
+            }
+            *s = size;
+            continue;
+        }
+        // every chunk counts, dispatched or not
+        if (budget <= 0) return 0;
+        qint64 now = clock_.elapsed();
+        if (!limiter->acceptFrame(now)) {
+            ++metrics_.frames_throttled;
+            return limiter->frameWaitTime(now);
+        }
+        --budget;
+        ++metrics_.frames_received;
+        if (in_chunk && streams->buffersChunk()) {
+            // more to come on this stream: nothing to dispatch yet
+            QString error;
+            if (streams->addChunk(*buffer, 0, &error) == StreamAssembler::CHUNK_ERROR) {
+                rejectFrame(_socket, error);
+                return -1;
+            }
+            buffer->clear();
+            *s = 0;
+            continue;
+        }
+        if (in_chunk) {
+            QByteArray payload;
+            QString error;
+            quint32 stream = streams->stream();
+            bool last = streams->lastChunk();
+            int kind = streams->addChunk(*buffer, &payload, &error);
+            if (kind == StreamAssembler::CHUNK_ERROR) {
+                rejectFrame(_socket, error);
+                return -1;
+            }
+            if (kind != StreamAssembler::CHUNK_MESSAGE) {
+                if (kind == StreamAssembler::CHUNK_STREAM_BEGIN && capture_.isOpen()) {
+                    captureStream(_socket);
+                }
+                buffer->clear();
+                *s = 0;
+                processStreamChunk(_socket, kind, stream, last, payload);
+                if (!buffers_.contains(_socket)) return -1;
+                continue;
             }
-            cond1 = (size == 0 && buffer->size() >= 4);
-            cond2 = (size > 0 && buffer->size() >= size);
+            buffer->swap(payload);
         }
+        if (capture_.isOpen()) captureFrame(_socket, *buffer);
+        frame_ready_ns_ = TraceRecorder::enabled() ? TraceRecorder::now() : 0;
+        QString message(*buffer);
+        buffer->clear();
+        *s = 0;
+        if (verbose_) logStatus("Messagem recebida: {" + message + "}", _socket);
+        emit dataReceived(_socket, message);
+        // the handler may have closed the connection
+        if (!buffers_.contains(_socket)) return -1;
+    }
+}
+
+void JsonCommandServer::BaseServer::schedulePendingFrames(QTcpSocket* _socket, qint64 delay) {
+    if (!pending_frames_.contains(_socket)) {
+        pending_frames_.append(_socket);
+    }
+    QTimer::singleShot(static_cast<int>(delay), this, SLOT(processPendingFrames()));
+}
+
+void JsonCommandServer::BaseServer::rejectFrame(QTcpSocket* _socket, qint32 size) {
+    ++metrics_.frames_oversized;
+    rejectFrame(_socket, tr("Tamanho de pacote inválido: %1 bytes (máximo %2).")
+                         .arg(size).arg(max_frame_size_));
+}
+
+void JsonCommandServer::BaseServer::rejectFrame(QTcpSocket* _socket, const QString &error_message) {
+    logError(error_message, _socket);
+    bool ok = false;
+    QJsonArray cmd = createError(error_message, ok);
+    if (ok) {
+        writeMessage(_socket, cmd);
     }
+    eraseSocket(_socket);
+    _socket->disconnectFromHost();
 }
 
 void JsonCommandServer::BaseServer::updateServer() {
+    if (hot_reload_) {
+        reloadServer();
+        return;
+    }
     save();
     closeServer();
     initServer();
 }
 
+void JsonCommandServer::BaseServer::reloadServer() {
+    save();
+    if (!tcp_server_) {
+        initServer();
+        return;
+    }
+    if (port_server_ != 0 && tcp_server_->serverPort() != port_server_) {
+        if (!rebindListener()) return;
+    }
+    openLocalListeners();
+    openDatagramChannel();
+    this->updateInfos();
+    logStatus(tr("Servidor recarregado na porta %1 (%2 clientes mantidos).")
+              .arg(QString::number(tcp_server_->serverPort()))
+              .arg(numSockets()));
+}
+
+void JsonCommandServer::BaseServer::setHotReload(bool _hot_reload) {
+    this->hot_reload_ = _hot_reload;
+}
+
+void JsonCommandServer::BaseServer::setReusePort(bool _reuse_port) {
+    this->reuse_port_ = _reuse_port;
+}
+
+void JsonCommandServer::BaseServer::setListenerDescriptor(qintptr fd) {
+    this->listener_fd_ = fd;
+}
+
+/* Stops accepting and returns the listening descriptor, made inheritable so a
+ * server exec()'d from here can adopt it; -1 when there is no listener. */
+qintptr JsonCommandServer::BaseServer::handOverListener() {
+    if (!tcp_server_ || !tcp_server_->isListening()) return -1;
+    qintptr fd = tcp_server_->socketDescriptor();
+    if (!setInheritable(fd, true)) return -1;
+    tcp_server_->pauseAccepting();
+    return fd;
+}
+
 
 void JsonCommandServer::BaseServer::closeServer() {
     this->clearMessages();
     clients_test_messages_.clear();
+    pending_frames_.clear();
     ips_info_.clear();
     ips_socket_.clear();
+    peer_index_.clear();
     socket_ips_.clear();
     peers_.clear();
+    identities_.clear();
+    history_.clear();
+    atoms_.clear();
+    peersChanged();
+    gossip_timer_->stop();
+    for (std::map<QString, NodeAddress>::iterator it = node_addresses_.begin();
+            it != node_addresses_.end(); ++it) {
+        if (it->second.socket) {
+            removeLink(it->second.socket);
+            it->second.socket->abort();
+            it->second.socket->deleteLater();
+        }
+    }
+    links_.clear();
+    link_handshakes_.clear();
+    directory_.clear();
+    replaying_.clear();
+    replay_timer_->stop();
+    stopAcceptorThreads();
+    delete local_listener_;
+    delete shm_listener_;
+    local_listener_ = shm_listener_ = 0;
+    delete datagram_channel_;
+    datagram_channel_ = 0;
+    datagram_peers_.clear();
+    datagram_tokens_.clear();
+    cancelWaiters();
+    for (int i = 0; i < handshakes_.size(); ++i) {
+        if (handshakes_[i]) handshakes_[i]->deleteLater();
+    }
+    handshakes_.clear();
+    peer_list_dirty_ = false;
+    // connections are owned by this object, not by tcp_server_
+    QList<QTcpSocket*> connections = buffers_.keys();
+    for (int i = 0; i < connections.size(); ++i) {
+        QTcpSocket* socket = connections[i];
+        disconnect(socket, 0, this, 0);
+        removeConnection(socket);
+        socket->abort();
+        socket->deleteLater();
+    }
     this->updateInfos();
+    for (int i = 0; i < extra_listeners_.size(); ++i) {
+        delete extra_listeners_[i];
+    }
+    extra_listeners_.clear();
     if (tcp_server_) delete tcp_server_;
     if (network_session_) delete network_session_;
     tcp_server_ = 0;
@@ -226,26 +903,20 @@ void JsonCommandServer::BaseServer::closeServer() {
 
 void JsonCommandServer::BaseServer::sendMessageTo(const QString& from, const QString &to, const QString &message) {
     bool ok;
-    if (to == "Todos") {
-        broadcastMessage(createMessage(from, message, ok));
-    } else {
-        QTcpSocket* socket = getPeer(to);
-        if (socket) {
-            writeMessage(socket, createMessage(from, message, ok));
-        }
+    routeCommand(to, traced(createMessage(from, message, ok)));
+    if (history_.capacity() > 0) {
+        QJsonObject payload;
+        payload.insert("from", from);
+        payload.insert("to", to);
+        payload.insert("message", message);
+        history_.append(QDateTime::currentMSecsSinceEpoch(), HISTORY_CLIENT, NO_ATOM, MESSAGE_TO,
+                        payload);
     }
     addClientMessage(from + " --> " + to + "> " + message);
 }
 
 void JsonCommandServer::BaseServer::sendCommandTo(const QString &from, const QString &to, const QJsonArray &cmd) {
-    if (to == "Todos") {
-        broadcastMessage(cmd);
-    } else {
-        QTcpSocket* socket = getPeer(to);
-        if (socket) {
-            writeMessage(socket, cmd);
-        }
-    }
+    routeCommand(to, traced(cmd));
     //addStatusMessage("cmd "+ from + " --> " + to + " >> " + QJsonDocument(cmd).toJson());
 }
 
@@ -254,32 +925,32 @@ void JsonCommandServer::BaseServer::displayError(QAbstractSocket::SocketError so
     eraseSocket(socket);
     switch (socketError) {
     case QAbstractSocket::RemoteHostClosedError:
-        this->addErrorMessage(tr("%1 fechou a conexão.")
-                              .arg(socket->peerAddress().toString() + ":" +
-                                   QString::number(socket->peerPort()) + "@" +
-                                   socket->peerName()));
+        logError(tr("%1 fechou a conexão.")
+                 .arg(socket->peerAddress().toString() + ":" +
+                      QString::number(socket->peerPort()) + "@" +
+                      socket->peerName()));
         break;
     case QAbstractSocket::HostNotFoundError:
-        this->addErrorMessage(tr("%1 não encontrado. Por favor, verifique as configurações "
-                                 "de host e porta.")
-                              .arg(socket->peerAddress().toString() + ":" +
-                                   QString::number(socket->peerPort()) + "@" +
-                                   socket->peerName()));
+        logError(tr("%1 não encontrado. Por favor, verifique as configurações "
+                    "de host e porta.")
+                 .arg(socket->peerAddress().toString() + ":" +
+                      QString::number(socket->peerPort()) + "@" +
+                      socket->peerName()));
         break;
     case QAbstractSocket::ConnectionRefusedError:
-        this->addErrorMessage(tr("A conexão foi recusado pelo servidor (%1). "
-                                 "Verifique se o servidor está rodando, "
-                                 "e confirme as configurações de host e porta. ")
-                              .arg(socket->peerAddress().toString() + ":" +
-                                   QString::number(socket->peerPort()) + "@" +
-                                   socket->peerName()));
+        logError(tr("A conexão foi recusado pelo servidor (%1). "
+                    "Verifique se o servidor está rodando, "
+                    "e confirme as configurações de host e porta. ")
+                 .arg(socket->peerAddress().toString() + ":" +
+                      QString::number(socket->peerPort()) + "@" +
+                      socket->peerName()));
         break;
     default:
-        this->addErrorMessage(tr("Um erro ocorreu de comunicação com %2: %1.")
-                              .arg(socket->errorString())
-                              .arg(socket->peerAddress().toString() + ":" +
-                                   QString::number(socket->peerPort()) + "@" +
-                                   socket->peerName()));
+        logError(tr("Um erro ocorreu de comunicação com %2: %1.")
+                 .arg(socket->errorString())
+                 .arg(socket->peerAddress().toString() + ":" +
+                      QString::number(socket->peerPort()) + "@" +
+                      socket->peerName()));
     }
 }
 
@@ -288,233 +959,846 @@ void JsonCommandServer::BaseServer::processMessage(QTcpSocket* _socket, const QS
     bool ok;
     QJsonArray cmds = convertMessage(message, ok);
     if (ok) {
-        for (int i  = 0; i < cmds.size(); ++i) {
-            QJsonObject cmd = cmds[i].toObject();
-            int type = -1;
-            if (cmd.contains("type")) {
-                type = cmd["type"].toInt();
-            } else {
-                continue;
-            }
-            cmd.insert("ip", _socket->peerAddress().toString());
-            cmd.insert("port", _socket->peerPort());
-            if (type == -1) continue;
-            if (type == CLOSE) {
-                eraseSocket(_socket);
-                _socket->disconnectFromHost();
-            } else {
-                execute_command(type, this, cmd);
-            }
-        }
+        processCommands(_socket, cmds, false);
     } else {
         if (message.size() > 0) {
-            addErrorMessage("Falha na execução do comando: <" + message + ">");
+            logError("Falha na execução do comando: <" + message + ">", _socket);
         }
     }
 }
 
-QJsonArray JsonCommandServer::BaseServer::convertMessage(const QString &message, bool &ok) {
-    ok = false;
-    QJsonArray out;
-    std::string str = message.toStdString();
-    QByteArray json_str(str.c_str(), str.size());
-    QJsonDocument doc = QJsonDocument::fromJson(json_str);
-    if (!doc.isNull()) {
-        ok = true;
-        return doc.array();
+/* Queues the commands of one frame, or of one datagram of the connection. */
+void JsonCommandServer::BaseServer::processCommands(QTcpSocket *_socket, const QJsonArray &cmds,
+        bool datagram) {
+    QHash<QTcpSocket*, ConnectionIdentity>::const_iterator identity =
+        identities_.constFind(_socket);
+    QString ip;
+    int port;
+    if (identity != identities_.constEnd()) {
+        ip = identity.value().ip;
+        port = identity.value().port;
+    } else {
+        ip = _socket->peerAddress().toString();
+        port = _socket->peerPort();
+    }
+    for (int i  = 0; i < cmds.size(); ++i) {
+        QJsonObject cmd = cmds[i].toObject();
+        int type = -1;
+        if (cmd.contains("type")) {
+            type = cmd["type"].toInt();
+        } else {
+            continue;
+        }
+        if (datagram && !isUnreliable(cmd)) {
+            // a datagram may be lost or late: only commands that can afford it
+            ++metrics_.datagrams_rejected;
+            continue;
+        }
+        ClientRateLimiter* limiter = limiters_.value(_socket);
+        if (limiter && !limiter->acceptCommand(type, clock_.elapsed())) {
+            ++metrics_.commands_throttled;
+            bool error_ok = false;
+            QJsonArray error = createError(tr("Limite de taxa excedido para o comando %1.")
+                                           .arg(type), error_ok);
+            if (error_ok) {
+                writeMessage(_socket, error);
+            }
+            continue;
+        }
+        cmd.insert("ip", ip);
+        cmd.insert("port", port);
+        if (type == MESSAGE_IDENTIFY) {
+            negotiateFraming(_socket, cmd);
+            negotiateDatagrams(_socket, cmd);
+        }
+        quint64 trace = frame_ready_ns_ ? traceCommand(type, cmd) : 0;
+        qint64 queued_ns = 0;
+        if (trace) {
+            queued_ns = TraceRecorder::now();
+            TraceRecorder::record(trace, "parse", frame_ready_ns_, queued_ns);
+        }
+        int priority;
+        if (type == CLOSE) {
+            // let the client's earlier commands run before its connection goes away
+            priority = PRIORITY_BULK;
+        } else if ((type == CMD_TO || type == NODE_FORWARD) && cmd["cmd"].isArray()) {
+            priority = JsonCommandServer::relayPriority(type, cmd["cmd"].toArray());
+        } else {
+            priority = JsonCommandServer::commandPriority(type);
+        }
+        if (type >= 0 && priority >= shed_priority_ &&
+                watchdog_->level() >= SHED_LOW_PRIORITY) {
+            ++metrics_.commands_shed;
+            bool error_ok = false;
+            QJsonArray error = createError(tr("Servidor sobrecarregado: comando %1 recusado.")
+                                           .arg(type), error_ok);
+            if (error_ok) {
+                writeMessage(_socket, error);
+            }
+            continue;
+        }
+        inbound_[priority].push_back(InboundCommand(_socket, cmd, type, trace, queued_ns));
+    }
+    if (!batching_) {
+        dispatchCommands();
     }
-    return out;
 }
 
-void JsonCommandServer::BaseServer::writeMessage(QTcpSocket *_socket, const QJsonArray &cmd) {
-    writeMessage(_socket, QJsonDocument(cmd).toJson());
+/* Runs the queued inbound commands, most urgent lane first. */
+void JsonCommandServer::BaseServer::dispatchCommands() {
+    int priority = 0;
+    while (priority < N_PRIORITIES) {
+        if (inbound_[priority].empty()) {
+            ++priority;
+            continue;
+        }
+        InboundCommand in = inbound_[priority].front();
+        inbound_[priority].pop_front();
+        if ((in.type >= 0 || in.type == CLOSE) && holds_.contains(in.socket)) {
+            // an earlier command of this connection is still running
+            parked_[in.socket].push_back(in);
+        } else {
+            runCommand(in);
+        }
+        // a handler may have queued more urgent work
+        priority = 0;
+    }
 }
 
-QJsonArray JsonCommandServer::BaseServer::createMessage(const QString &from, const QString &message, bool &ok, int type_message) {
-    ok = true;
-    QJsonArray out;
-    QJsonObject cmd;
-    if (message == "close") {
-        cmd.insert("type", CLOSE);
-    } else {
-        cmd.insert("id", newKey());
-        cmd.insert("ip", this->myIP());
-        cmd.insert("port", this->myPort());
-        cmd.insert("type", type_message);
-        cmd.insert("time", QTime::currentTime().toString());
-        cmd.insert("date", QDate::currentDate().toString());
-        cmd.insert("id_client", this->id());
-        cmd.insert("group_client", this->group());
-        cmd.insert("name_client", from);
-        cmd.insert("type_client", this->type());
-        cmd.insert("message", message);
+void JsonCommandServer::BaseServer::runCommand(const InboundCommand &in) {
+    qint64 begin_ns = 0;
+    if (in.trace) {
+        begin_ns = TraceRecorder::now();
+        TraceRecorder::record(in.trace, "inbound", in.queued_ns, begin_ns);
+        current_trace_ = in.trace;
+    }
+    if (in.type == CLOSE) {
+        if (buffers_.contains(in.socket)) {
+            eraseSocket(in.socket);
+            in.socket->disconnectFromHost();
+        }
+    } else if (in.type < 0) {
+        processServerCommand(in.socket, in.type, in.cmd);
+    } else if (!links_.contains(in.socket)) {
+        // client commands only; a linked server's own status/peer list is ignored
+        if (history_.capacity() > 0) recordHistory(in);
+        current_connection_ = in.socket;
+        executeClientCommand(in);
+        current_connection_ = 0;
+    }
+    if (in.trace) {
+        TraceRecorder::record(in.trace, "dispatch", begin_ns, TraceRecorder::now());
+        current_trace_ = 0;
     }
-    out.append(cmd);
-    return out;
 }
 
-/* Commands */
-QJsonArray JsonCommandServer::BaseServer::createMessage(const QString &message, bool &ok, int type_message) {
-    ok = true;
-    QJsonArray out;
-    QJsonObject cmd;
-    if (message == "close") {
-        cmd.insert("type", CLOSE);
-    } else {
-        cmd.insert("id", newKey());
-        cmd.insert("ip", this->myIP());
-        cmd.insert("port", this->myPort());
-        cmd.insert("type", type_message);
-        cmd.insert("time", QTime::currentTime().toString());
-        cmd.insert("date", QDate::currentDate().toString());
-        cmd.insert("id_client", this->id());
-        cmd.insert("group_client", this->group());
-        cmd.insert("name_client", this->name());
-        cmd.insert("type_client", this->type());
-        cmd.insert("message", message);
+/* A cached reply answers an earlier request_id; the caller waits for its own. */
+static QByteArray replyWithRequestId(const QByteArray& frame, const QJsonValue& request_id) {
+    QJsonDocument doc = QJsonDocument::fromJson(frame);
+    if (!doc.isArray()) return frame;
+    QJsonArray cmds = doc.array();
+    for (int i = 0; i < cmds.size(); ++i) {
+        QJsonObject cmd = cmds[i].toObject();
+        if (!cmd.contains("request_id")) continue;
+        cmd.insert("request_id", request_id);
+        cmds[i] = cmd;
     }
-    out.append(cmd);
-    return out;
+    return QJsonDocument(cmds).toJson();
 }
 
-QJsonArray JsonCommandServer::BaseServer::createStatus(const QString &message, bool &ok) {
-    return createMessage(message, ok, MESSAGE_STATUS);
+/* Cacheable commands are answered from the response cache when a reply to the
+ * same body is fresh; otherwise the handler runs and the frames it writes back
+ * to the caller are kept for the next repeat. A command delivered again with
+ * the same "idempotency_key" gets the reply of its first delivery. */
+void JsonCommandServer::BaseServer::executeClientCommand(const InboundCommand &in) {
+    int ttl_ms = JsonCommandServer::commandCacheTtl(in.type);
+    if (ttl_ms <= 0) {
+        QString key = in.cmd["idempotency_key"].toString();
+        if (key.isEmpty()) {
+            execute_command(in.type, this, in.cmd);
+            return;
+        }
+        key = idempotencyScope(in.socket) + "/" + key;
+        QList<CachedFrame> reply;
+        if (duplicate_filter_.isDuplicate(key, clock_.elapsed(), &reply)) {
+            answerDuplicate(in, reply);
+            return;
+        }
+        qint64 cost_ns;
+        reply = runRecorded(in, &cost_ns);
+        if (holds_.contains(in.socket) || !buffers_.contains(in.socket)) return;
+        duplicate_filter_.setReply(key, reply);
+        return;
+    }
+    QByteArray body = ResponseCache::canonicalBody(in.cmd);
+    quint64 key = ResponseCache::hash(body);
+    QList<CachedFrame> frames;
+    if (response_cache_.find(key, body, clock_.elapsed(), &frames)) {
+        writeRecordedReply(in, frames);
+        return;
+    }
+    qint64 cost_ns;
+    frames = runRecorded(in, &cost_ns);
+    // a handler that holds the connection answers later, outside of the recording
+    if (holds_.contains(in.socket) || !buffers_.contains(in.socket)) return;
+    response_cache_.insert(key, body, frames, ttl_ms, cost_ns, clock_.elapsed());
 }
 
-QJsonArray JsonCommandServer::BaseServer::createError(const QString &message, bool &ok) {
-    return createMessage(message, ok, MESSAGE_ERROR);
+/* Runs the handler and returns the frames it wrote back to the caller. */
+QList<JsonCommandServer::CachedFrame> JsonCommandServer::BaseServer::runRecorded(
+        const InboundCommand &in, qint64 *cost_ns) {
+    recorded_frames_.clear();
+    recording_reply_ = true;
+    qint64 begin_ns = TraceRecorder::now();
+    execute_command(in.type, this, in.cmd);
+    *cost_ns = TraceRecorder::now() - begin_ns;
+    recording_reply_ = false;
+    QList<CachedFrame> frames;
+    frames.swap(recorded_frames_);
+    return frames;
 }
 
-QJsonArray JsonCommandServer::BaseServer::createPeerList() {
-    QJsonArray out;
-    QJsonObject cmd;
-    QList<QString> peers = getPeers();
-    cmd.insert("id", newKey());
-    cmd.insert("ip", this->myIP());
-    cmd.insert("port", this->myPort());
-    cmd.insert("type", MESSAGE_PEER_LIST);
-    cmd.insert("time", QTime::currentTime().toString());
-    cmd.insert("date", QDate::currentDate().toString());
-    QJsonArray peers_array;
-    for (int i  = 0; i < peers.size(); ++i) {
-        peers_array.append(peers[i]);
+void JsonCommandServer::BaseServer::writeRecordedReply(const InboundCommand &in,
+        const QList<CachedFrame> &frames) {
+    for (int i = 0; i < frames.size(); ++i) {
+        writeFrame(in.socket, in.cmd.contains("request_id") ?
+                   replyWithRequestId(frames[i].data, in.cmd["request_id"]) : frames[i].data,
+                   frames[i].priority);
     }
-    cmd.insert("peers", peers_array);
-    out.append(cmd);
-    return out;
 }
 
-QJsonArray JsonCommandServer::BaseServer::createIdentify() {
-    QJsonArray out;
+/* The first delivery's reply again; when none was kept (the handler wrote
+ * nothing, answered later or the reply was too big) a COMMAND_REPLY says the
+ * command was already run. */
+void JsonCommandServer::BaseServer::answerDuplicate(const InboundCommand &in,
+        const QList<CachedFrame> &reply) {
+    if (!reply.isEmpty()) {
+        writeRecordedReply(in, reply);
+        return;
+    }
     QJsonObject cmd;
-    cmd.insert("id", newKey());
-    cmd.insert("ip", this->myIP());
-    cmd.insert("port", this->myPort());
-    cmd.insert("type", MESSAGE_IDENTIFY);
-    cmd.insert("time", QTime::currentTime().toString());
-    cmd.insert("date", QDate::currentDate().toString());
-    cmd.insert("id_client", this->id());
-    cmd.insert("group_client", this->group());
-    cmd.insert("name_client", this->name());
-    cmd.insert("type_client", this->type());
-    cmd.insert("description_client", this->description());
+    cmd.insert("type", COMMAND_REPLY);
+    if (in.cmd.contains("request_id")) cmd.insert("request_id", in.cmd["request_id"]);
+    cmd.insert("idempotency_key", in.cmd["idempotency_key"]);
+    cmd.insert("duplicate", true);
+    QJsonArray out;
     out.append(cmd);
-    return out;
+    writeMessage(in.socket, out);
 }
 
-QJsonArray JsonCommandServer::BaseServer::createMessageTo(const QString &from, const QString &to, const QString &message) {
-    QJsonArray out;
-    QJsonObject cmd;
-    cmd.insert("id", newKey());
-    cmd.insert("ip", this->myIP());
-    cmd.insert("port", this->myPort());
-    cmd.insert("type", MESSAGE_TO);
-    cmd.insert("time", QTime::currentTime().toString());
-    cmd.insert("date", QDate::currentDate().toString());
-    cmd.insert("id_client", this->id());
-    cmd.insert("group_client", this->group());
-    cmd.insert("name_client", this->name());
-    cmd.insert("type_client", this->type());
-    cmd.insert("description_client", this->description());
-    cmd.insert("from", from);
-    cmd.insert("to", to);
-    cmd.insert("message", message);
-    out.append(cmd);
-    return out;
+/* Who an idempotency key belongs to, as the server sees it: the name the
+ * connection identified with and the address it comes from, so a client that
+ * reconnects still matches its keys and no other host can reuse them. Until
+ * it identifies a connection only matches itself. */
+QString JsonCommandServer::BaseServer::idempotencyScope(QTcpSocket *_socket) {
+    QHash<QTcpSocket*, ConnectionIdentity>::const_iterator it = identities_.constFind(_socket);
+    if (it == identities_.constEnd()) return QString();
+    const ConnectionIdentity& identity = it.value();
+    std::map<QString, std::map<int, RemoteNodeInfo> >::const_iterator ip =
+        ips_info_.find(identity.ip);
+    if (ip != ips_info_.end()) {
+        std::map<int, RemoteNodeInfo>::const_iterator info = ip->second.find(identity.port);
+        if (info != ip->second.end() && !info->second.name.isEmpty()) {
+            return info->second.name + "@" + identity.ip;
+        }
+    }
+    return "@" + identity.endpoint;
 }
 
-QJsonArray JsonCommandServer::BaseServer::createCommandTo(const QString &from, const QString &to, const QJsonArray & _cmd) {
-    QJsonArray out;
-    QJsonObject cmd;
-    cmd.insert("id", newKey());
-    cmd.insert("ip", this->myIP());
-    cmd.insert("port", this->myPort());
-    cmd.insert("type", CMD_TO);
-    cmd.insert("time", QTime::currentTime().toString());
-    cmd.insert("date", QDate::currentDate().toString());
-    cmd.insert("id_client", this->id());
-    cmd.insert("group_client", this->group());
-    cmd.insert("name_client", this->name());
-    cmd.insert("type_client", this->type());
-    cmd.insert("description_client", this->description());
-    cmd.insert("from", from);
-    cmd.insert("to", to);
-    cmd.insert("cmd", _cmd);
-    out.append(cmd);
-    return out;
+JsonCommandServer::LoopWaiter::LoopWaiter()
+    : prev(0), next(0), deadline(-1), request_id(0), socket(0) {
 }
 
-void JsonCommandServer::BaseServer::executeCommand(const QJsonArray &cmd) {
+JsonCommandServer::LoopWaiter::~LoopWaiter() {
 }
 
-void JsonCommandServer::BaseServer::setPortServer(int _port_server) {
-    this->port_server_ = _port_server;
+/* The connection whose command is being executed, 0 outside of a handler. */
+QTcpSocket* JsonCommandServer::BaseServer::currentConnection() {
+    return current_connection_;
 }
 
-void JsonCommandServer::BaseServer::setIPServer(const QString &_IP) {
-    this->ip_address_= _IP;
+void JsonCommandServer::BaseServer::holdConnection(QTcpSocket *_socket) {
+    ++holds_[_socket];
 }
 
-void JsonCommandServer::BaseServer::addSocketMessage(QTcpSocket *_socket, const QString &_message) {
+void JsonCommandServer::BaseServer::releaseConnection(QTcpSocket *_socket) {
+    QHash<QTcpSocket*, int>::iterator it = holds_.find(_socket);
+    if (it == holds_.end()) return;
+    if (--it.value() > 0) return;
+    holds_.erase(it);
+    if (parked_.contains(_socket)) {
+        if (released_.isEmpty()) {
+            QTimer::singleShot(0, this, SLOT(resumeParked()));
+        }
+        released_.append(_socket);
+    }
+}
+
+/* Runs the commands parked behind a finished handler, in arrival order, until
+ * the connection is held again. */
+void JsonCommandServer::BaseServer::resumeParked() {
+    QList<QTcpSocket*> released;
+    released.swap(released_);
+    for (int i = 0; i < released.size(); ++i) {
+        QTcpSocket* socket = released[i];
+        while (!holds_.contains(socket) && parked_.contains(socket)) {
+            std::deque<InboundCommand>& parked = parked_[socket];
+            if (parked.empty()) {
+                parked_.remove(socket);
+                break;
+            }
+            InboundCommand in = parked.front();
+            parked.pop_front();
+            runCommand(in);
+        }
+    }
+    dispatchCommands();
+}
+
+void JsonCommandServer::BaseServer::addWaiter(LoopWaiter *waiter, int timeout_ms) {
+    waiter->prev = 0;
+    waiter->next = waiters_;
+    if (waiters_) waiters_->prev = waiter;
+    waiters_ = waiter;
+    waiter->deadline = timeout_ms >= 0 ? clock_.elapsed() + timeout_ms : -1;
+    if (waiter->deadline >= 0) {
+        qint64 remaining = waiter_timer_->isActive() ? waiter_timer_->remainingTime() : -1;
+        if (remaining < 0 || timeout_ms < remaining) {
+            waiter_timer_->start(timeout_ms);
+        }
+    }
+}
+
+void JsonCommandServer::BaseServer::removeWaiter(LoopWaiter *waiter) {
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else if (waiters_ == waiter) {
+        waiters_ = waiter->next;
+    }
+    if (waiter->next) waiter->next->prev = waiter->prev;
+    waiter->prev = waiter->next = 0;
+}
+
+void JsonCommandServer::BaseServer::expireWaiters() {
+    qint64 now = clock_.elapsed();
+    qint64 next_deadline = -1;
+    LoopWaiter* waiter = waiters_;
+    while (waiter) {
+        LoopWaiter* next = waiter->next;
+        if (waiter->deadline >= 0 && waiter->deadline <= now) {
+            removeWaiter(waiter);
+            waiter->wake(false, QJsonObject());
+            // the woken handler may have added or removed waiters
+            waiter = waiters_;
+            continue;
+        }
+        if (waiter->deadline >= 0 && (next_deadline < 0 || waiter->deadline < next_deadline)) {
+            next_deadline = waiter->deadline;
+        }
+        waiter = next;
+    }
+    if (next_deadline >= 0) {
+        waiter_timer_->start(static_cast<int>(qMax<qint64>(0, next_deadline - clock_.elapsed())));
+    }
+}
+
+/* Sends cmd to a peer with a fresh "request_id" on each command; the waiter is
+ * woken by the COMMAND_REPLY carrying that id from that peer, or on timeout. */
+bool JsonCommandServer::BaseServer::sendRequest(LoopWaiter *waiter, const QString &to,
+        const QJsonArray &cmd, int timeout_ms) {
+    QTcpSocket* socket = getPeer(to);
+    if (!socket) return false;
+    waiter->socket = socket;
+    waiter->request_id = ++request_seq_;
+    QJsonArray request;
+    for (int i = 0; i < cmd.size(); ++i) {
+        QJsonObject c = cmd[i].toObject();
+        c.insert("request_id", waiter->request_id);
+        request.append(c);
+    }
+    routeCommand(to, request);
+    addWaiter(waiter, timeout_ms);
+    return true;
+}
+
+void JsonCommandServer::BaseServer::processCommandReply(QTcpSocket *_socket,
+        const QJsonObject &cmd) {
+    qint64 request_id = static_cast<qint64>(cmd["request_id"].toDouble());
+    if (request_id <= 0) return;
+    PendingGather* gather = gathers_.value(request_id);
+    if (gather) {
+        // only the first answer of each asked peer counts
+        if (!gather->outstanding.remove(_socket)) return;
+        QString from = atoms_.string(identities_.value(_socket).peer);
+        if (gather->reducer.add(from, cmd) || gather->outstanding.isEmpty()) {
+            finishGather(gather, false);
+        }
+        return;
+    }
+    for (LoopWaiter* waiter = waiters_; waiter; waiter = waiter->next) {
+        if (waiter->request_id == request_id && waiter->socket == _socket) {
+            removeWaiter(waiter);
+            waiter->wake(true, cmd);
+            return;
+        }
+    }
+}
+
+/* The requests sent on a closing connection will not be answered. */
+void JsonCommandServer::BaseServer::failWaiters(QTcpSocket *_socket) {
+    LoopWaiter* waiter = waiters_;
+    while (waiter) {
+        if (waiter->socket == _socket) {
+            removeWaiter(waiter);
+            waiter->socket = 0;
+            waiter->wake(false, QJsonObject());
+            // the woken handler may have added or removed waiters
+            waiter = waiters_;
+            continue;
+        }
+        waiter = waiter->next;
+    }
+}
+
+/* Thread safe: wakes the waiter on the event loop, e.g. after pool work. */
+void JsonCommandServer::BaseServer::postWaiter(LoopWaiter *waiter) {
+    QMutexLocker lock(&posted_mutex_);
+    waiter->next = posted_;
+    posted_ = waiter;
+    if (!waiter->next) {
+        QMetaObject::invokeMethod(this, "wakePosted", Qt::QueuedConnection);
+    }
+}
+
+void JsonCommandServer::BaseServer::wakePosted() {
+    LoopWaiter* posted;
+    {
+        QMutexLocker lock(&posted_mutex_);
+        posted = posted_;
+        posted_ = 0;
+    }
+    // restore posting order
+    LoopWaiter* ordered = 0;
+    while (posted) {
+        LoopWaiter* next = posted->next;
+        posted->next = ordered;
+        ordered = posted;
+        posted = next;
+    }
+    while (ordered) {
+        LoopWaiter* next = ordered->next;
+        ordered->next = 0;
+        ordered->wake(true, QJsonObject());
+        ordered = next;
+    }
+}
+
+void JsonCommandServer::PendingGather::wake(bool ok, const QJsonObject &) {
+    server->finishGather(this, !ok);
+}
+
+/* GATHER: {"to": peer, selector or "Todos", "cmd": [...], "aggregate": collect,
+ * count, min, max, sum or first, "field", "k", "timeout" (ms), "request_id"}.
+ * cmd is encoded once and sent to every matching local peer with a request_id
+ * of the server's; each COMMAND_REPLY is folded into the result as it comes.
+ * The caller gets one COMMAND_REPLY with its own request_id when every peer
+ * answered, the result is settled or the timeout passed, whichever is first. */
+void JsonCommandServer::BaseServer::processGather(QTcpSocket *_socket, const QJsonObject &cmd) {
+    if (links_.contains(_socket)) return;
+    QString error;
+    GatherReducer reducer;
+    QJsonArray request = cmd["cmd"].toArray();
+    QString to = cmd["to"].toString();
+    std::set<Atom> peers;
+    if (request.isEmpty()) {
+        error = tr("'cmd' vazio");
+    } else if (reducer.setup(cmd, error)) {
+        if (to == "Todos") {
+            for (QHash<Atom, QTcpSocket*>::const_iterator it = peers_.constBegin();
+                    it != peers_.constEnd(); ++it) {
+                peers.insert(it.key());
+            }
+        } else if (PeerIndex::isSelector(to)) {
+            peer_index_.select(to, peers, &error);
+        } else {
+            Atom peer = atoms_.find(to);
+            if (peer == NO_ATOM || !peers_.contains(peer)) {
+                error = tr("'%1' não está conectado a este servidor").arg(to);
+            } else {
+                peers.insert(peer);
+            }
+        }
+    }
+    if (!error.isEmpty()) {
+        bool error_ok = false;
+        QJsonArray out = createError(tr("Gather inválido: %1.").arg(error), error_ok);
+        if (error_ok) {
+            writeMessage(_socket, out);
+        }
+        return;
+    }
+    PendingGather* gather = new PendingGather;
+    gather->server = this;
+    gather->origin = _socket;
+    gather->origin_request_id = cmd["request_id"];
+    gather->reducer = reducer;
+    gather->request_id = ++request_seq_;
+    ++metrics_.gathers_started;
+    QJsonArray out;
+    for (int i = 0; i < request.size(); ++i) {
+        QJsonObject c = request[i].toObject();
+        c.insert("request_id", gather->request_id);
+        out.append(c);
+    }
+    QByteArray data = QJsonDocument(out).toJson();
+    int priority = JsonCommandServer::relayPriority(GATHER, out);
+    for (std::set<Atom>::const_iterator it = peers.begin(); it != peers.end(); ++it) {
+        QTcpSocket* socket = peers_.value(*it);
+        if (!socket || socket == _socket) continue;
+        gather->outstanding.insert(socket);
+        writeFrame(socket, data, priority);
+    }
+    gather->expected = gather->outstanding.size();
+    if (gather->outstanding.isEmpty()) {
+        finishGather(gather, false);
+        return;
+    }
+    gathers_.insert(gather->request_id, gather);
+    int timeout_ms = cmd.contains("timeout") ? cmd["timeout"].toInt() : DEFAULT_GATHER_TIMEOUT;
+    addWaiter(gather, qBound(1, timeout_ms, MAX_GATHER_TIMEOUT));
+}
+
+void JsonCommandServer::BaseServer::finishGather(PendingGather *gather, bool timed_out) {
+    removeWaiter(gather);
+    gathers_.remove(gather->request_id);
+    if (timed_out) ++metrics_.gathers_timed_out;
+    QTcpSocket* origin = gather->origin.data();
+    if (origin && buffers_.contains(origin)) {
+        QJsonObject reply = gather->reducer.result();
+        reply.insert("type", COMMAND_REPLY);
+        if (!gather->origin_request_id.isUndefined()) {
+            reply.insert("request_id", gather->origin_request_id);
+        }
+        reply.insert("replies", gather->reducer.replies());
+        reply.insert("expected", gather->expected);
+        reply.insert("timed_out", timed_out);
+        QJsonArray out;
+        out.append(reply);
+        writeMessage(origin, out);
+    }
+    delete gather;
+}
+
+/* A peer that leaves no longer counts as outstanding; a caller that leaves
+ * ends its gathers. */
+void JsonCommandServer::BaseServer::dropFromGathers(QTcpSocket *_socket) {
+    if (gathers_.isEmpty()) return;
+    QList<PendingGather*> finished;
+    for (QHash<qint64, PendingGather*>::iterator it = gathers_.begin(); it != gathers_.end(); ++it) {
+        PendingGather* gather = it.value();
+        gather->outstanding.remove(_socket);
+        if (gather->outstanding.isEmpty() || gather->origin.data() == _socket) {
+            finished.append(gather);
+        }
+    }
+    for (int i = 0; i < finished.size(); ++i) {
+        finishGather(finished[i], false);
+    }
+}
+
+void JsonCommandServer::BaseServer::setHistoryCapacity(int capacity) {
+    history_.setCapacity(capacity);
+}
+
+/* Only what is at hand is kept; the text is made when a page is read. */
+void JsonCommandServer::BaseServer::recordHistory(const InboundCommand &in) {
+    int level = in.type == MESSAGE_STATUS ? HISTORY_STATUS :
+                in.type == MESSAGE_ERROR ? HISTORY_ERROR : HISTORY_CLIENT;
+    history_.append(QDateTime::currentMSecsSinceEpoch(), level, historyPeer(in.socket), in.type,
+                    in.cmd);
+}
+
+JsonCommandServer::Atom JsonCommandServer::BaseServer::historyPeer(QTcpSocket *_socket) {
+    if (!_socket) return NO_ATOM;
+    QHash<QTcpSocket*, ConnectionIdentity>::const_iterator identity =
+        identities_.constFind(_socket);
+    return identity != identities_.constEnd() ? identity.value().peer : NO_ATOM;
+}
+
+/* The server's own events reach addStatusMessage()/addErrorMessage() as before
+ * and are also kept in the history, as {"message": text} records of the
+ * connection they concern. */
+void JsonCommandServer::BaseServer::logStatus(const QString &message, QTcpSocket *_socket) {
+    if (history_.capacity() > 0) {
+        QJsonObject payload;
+        payload.insert("message", message);
+        history_.append(QDateTime::currentMSecsSinceEpoch(), HISTORY_STATUS, historyPeer(_socket),
+                        MESSAGE_STATUS, payload);
+    }
+    addStatusMessage(message);
+}
+
+void JsonCommandServer::BaseServer::logError(const QString &message, QTcpSocket *_socket) {
+    if (history_.capacity() > 0) {
+        QJsonObject payload;
+        payload.insert("message", message);
+        history_.append(QDateTime::currentMSecsSinceEpoch(), HISTORY_ERROR, historyPeer(_socket),
+                        MESSAGE_ERROR, payload);
+    }
+    addErrorMessage(message);
+}
+
+void JsonCommandServer::BaseServer::setVerbose(bool verbose) {
+    verbose_ = verbose;
+}
+
+void JsonCommandServer::BaseServer::processHistoryQuery(QTcpSocket *_socket,
+        const QJsonObject &cmd) {
+    if (links_.contains(_socket)) return;
+    HistoryFilter filter;
+    if (cmd.contains("level")) {
+        QJsonArray levels = cmd["level"].isArray() ? cmd["level"].toArray()
+                                                   : QJsonArray() << cmd["level"];
+        filter.levels = 0;
+        for (int i = 0; i < levels.size(); ++i) {
+            int level = levels[i].toInt(-1);
+            if (level >= 0 && level < N_HISTORY_LEVELS) filter.levels |= 1u << level;
+        }
+    }
+    if (cmd.contains("peer")) {
+        filter.any_peer = false;
+        filter.peer = atoms_.find(cmd["peer"].toString());
+        // a name never seen matches nothing
+        if (filter.peer == NO_ATOM) filter.match_nothing = true;
+    }
+    if (cmd.contains("cmd_type")) {
+        filter.any_type = false;
+        filter.type = cmd["cmd_type"].toInt();
+    }
+    if (cmd.contains("since")) filter.since_ms = static_cast<qint64>(cmd["since"].toDouble());
+    if (cmd.contains("until")) filter.until_ms = static_cast<qint64>(cmd["until"].toDouble());
+    bool forward = cmd.contains("after");
+    quint64 cursor = static_cast<quint64>(cmd[forward ? "after" : "before"].toDouble());
+    int limit = qBound(1, cmd["limit"].toInt(MessageHistory::DEFAULT_PAGE_SIZE),
+                       MessageHistory::MAX_PAGE_SIZE);
+    bool with_payload = cmd["payload"].toBool(true);
+    std::vector<const HistoryRecord*> page;
+    quint64 next = history_.query(filter, cursor, forward, limit, page);
+    QJsonArray records;
+    for (size_t i = 0; i < page.size(); ++i) {
+        const HistoryRecord& record = *page[i];
+        QJsonObject out;
+        out.insert("seq", double(record.seq));
+        out.insert("time", double(record.time_ms));
+        out.insert("level", record.level);
+        out.insert("peer", atoms_.string(record.peer));
+        out.insert("cmd_type", record.type);
+        if (with_payload) out.insert("payload", record.payload);
+        records.append(out);
+    }
+    QJsonObject reply;
+    reply.insert("type", COMMAND_REPLY);
+    if (cmd.contains("request_id")) reply.insert("request_id", cmd["request_id"]);
+    reply.insert("records", records);
+    reply.insert("next", double(next));
+    reply.insert("oldest", double(history_.oldest()));
+    reply.insert("newest", double(history_.newest()));
+    QJsonArray answer;
+    answer.append(reply);
+    writeMessage(_socket, answer);
+}
+
+void JsonCommandServer::BaseServer::cancelWaiters() {
+    waiter_timer_->stop();
+    while (waiters_) {
+        LoopWaiter* waiter = waiters_;
+        removeWaiter(waiter);
+        waiter->wake(false, QJsonObject());
+    }
+}
+
+QJsonArray JsonCommandServer::BaseServer::convertMessage(const QString &message, bool &ok) {
+    ok = false;
+    QJsonArray out;
+    std::string str = message.toStdString();
+    QByteArray json_str(str.c_str(), str.size());
+    QJsonDocument doc = QJsonDocument::fromJson(json_str);
+    if (!doc.isNull()) {
+        ok = true;
+        return doc.array();
+    }
+    return out;
+}
+
+void JsonCommandServer::BaseServer::writeMessage(QTcpSocket *_socket, const QJsonArray &cmd) {
+    writeFrame(_socket, QJsonDocument(cmd).toJson(), JsonCommandServer::messagePriority(cmd),
+               conflationKey(cmd), isUnreliable(cmd));
+}
+
+QJsonArray JsonCommandServer::BaseServer::createMessage(const QString &from, const QString &message, bool &ok, int type_message) {
+    ok = true;
+    return Envelope::message(envelopeSender(), newKey(), from, message, type_message);
+}
+
+/* Commands */
+QJsonArray JsonCommandServer::BaseServer::createMessage(const QString &message, bool &ok, int type_message) {
+    return createMessage(this->name(), message, ok, type_message);
+}
+
+QJsonArray JsonCommandServer::BaseServer::createStatus(const QString &message, bool &ok) {
+    return createMessage(message, ok, MESSAGE_STATUS);
+}
+
+QJsonArray JsonCommandServer::BaseServer::createError(const QString &message, bool &ok) {
+    return createMessage(message, ok, MESSAGE_ERROR);
+}
+
+QJsonArray JsonCommandServer::BaseServer::createPeerList() {
+    return Envelope::peerList(envelopeSender(), newKey(), peerListArray());
+}
+
+QJsonArray JsonCommandServer::BaseServer::createIdentify() {
+    return Envelope::identify(envelopeSender(), newKey());
+}
+
+QJsonArray JsonCommandServer::BaseServer::createMessageTo(const QString &from, const QString &to, const QString &message) {
+    return Envelope::messageTo(envelopeSender(), newKey(), from, to, message);
+}
+
+QJsonArray JsonCommandServer::BaseServer::createCommandTo(const QString &from, const QString &to, const QJsonArray & _cmd) {
+    return Envelope::commandTo(envelopeSender(), newKey(), from, to, _cmd);
+}
+
+JsonCommandServer::EnvelopeSender JsonCommandServer::BaseServer::envelopeSender() {
+    EnvelopeSender sender;
+    sender.ip = this->myIP();
+    sender.port = this->myPort();
+    sender.id = this->id();
+    sender.group = this->group();
+    sender.name = this->name();
+    sender.type = this->type();
+    sender.description = this->description();
+    return sender;
+}
+
+void JsonCommandServer::BaseServer::executeCommand(const QJsonArray &cmd) {
+}
+
+void JsonCommandServer::BaseServer::setPortServer(int _port_server) {
+    this->port_server_ = _port_server;
+}
+
+void JsonCommandServer::BaseServer::setIPServer(const QString &_IP) {
+    this->ip_address_= _IP;
+}
+
+void JsonCommandServer::BaseServer::addSocketMessage(QTcpSocket *_socket, const QString &_message) {
     this->clients_test_messages_[_socket] = _message;
 }
 
 void JsonCommandServer::BaseServer::addSocket(QTcpSocket *_socket) {
-    QString IP = _socket->peerAddress().toString();
-    int port = _socket->peerPort();
-    this->ips_socket_[IP][port] = _socket;
-    this->socket_ips_[_socket] = IP;
-    this->peers_['@' + IP + ":" + QString::number(port)] = _socket;
+    ConnectionIdentity& identity = identities_[_socket];
+    if (_socket->peerAddress().isNull()) {
+        // Unix domain and shared memory connections have no address: number them
+        identity.ip = _socket->inherits("JsonCommandServer::ShmSocket") ? "shm" : "unix";
+        identity.port = ++n_local_connections_;
+    } else {
+        identity.ip = _socket->peerAddress().toString();
+        identity.port = _socket->peerPort();
+    }
+    identity.endpoint = identity.ip + ":" + QString::number(identity.port);
+    identity.peer = atoms_.intern('@' + identity.endpoint);
+    this->ips_socket_[identity.ip][identity.port] = _socket;
+    this->socket_ips_[_socket] = identity.ip;
+    peers_.insert(identity.peer, _socket);
+    peersChanged();
+    addConnection(_socket);
+    schedulePeerList();
+    scheduleDirectoryAnnounce();
+}
+
+/* One peer list for a burst of new connections instead of one per connection. */
+void JsonCommandServer::BaseServer::schedulePeerList() {
+    if (peer_list_dirty_) return;
+    peer_list_dirty_ = true;
+    QTimer::singleShot(0, this, SLOT(broadcastPeerList()));
+}
+
+void JsonCommandServer::BaseServer::broadcastPeerList() {
+    if (!peer_list_dirty_) return;
+    peer_list_dirty_ = false;
+    this->updateInfos();
+    broadcastFrame(peerListFrame(), PRIORITY_CONTROL);
+}
+
+/* Per-connection framing, rate limiting and send queue state. */
+void JsonCommandServer::BaseServer::addConnection(QTcpSocket *_socket) {
     QByteArray* buffer = new QByteArray;
     qint32* s = new qint32(0);
     buffers_.insert(_socket, buffer);
     sizes_.insert(_socket, s);
-    updateInfos();
-    broadcastMessage(createPeerList());
+    limiters_.insert(_socket, new ClientRateLimiter(client_limit_, command_limits_));
+    SendQueue* queue = new SendQueue;
+    queue->setScheduling(send_scheduling_);
+    for (std::map<int, int>::iterator it = lane_weights_.begin(); it != lane_weights_.end(); ++it) {
+        queue->setWeight(it->first, it->second);
+    }
+    send_queues_.insert(_socket, queue);
+    if (capture_.isOpen() && !links_.contains(_socket)) {
+        capture_ids_.insert(_socket, capture_.connectionOpened());
+    }
 }
 
 QTcpSocket* JsonCommandServer::BaseServer::getPeer(const QString &_peer) {
-    if (this->peers_.find(_peer) != this->peers_.end()) {
-        return this->peers_[_peer];
-    }
-    return 0;
+    Atom peer = atoms_.find(_peer);
+    return peer == NO_ATOM ? 0 : peers_.value(peer);
 }
 
 QList<QString> JsonCommandServer::BaseServer::getPeers() {
-    QList<QString> list;
-    for (std::map<QString, QTcpSocket*>::iterator it = peers_.begin(); it != peers_.end(); ++it) {
-        list.push_back(it->first);
+    peerListArray();
+    return peer_names_;
+}
+
+/* The peer names, sorted, as peer lists carry them. Rebuilt only after a peer
+ * came, left or identified, not for every peer list. */
+const QJsonArray& JsonCommandServer::BaseServer::peerListArray() {
+    if (peer_list_stale_) {
+        peer_names_.clear();
+        for (QHash<Atom, QTcpSocket*>::const_iterator it = peers_.constBegin();
+                it != peers_.constEnd(); ++it) {
+            peer_names_.append(atoms_.string(it.key()));
+        }
+        std::sort(peer_names_.begin(), peer_names_.end());
+        peer_list_ = QJsonArray();
+        for (int i = 0; i < peer_names_.size(); ++i) {
+            peer_list_.append(peer_names_[i]);
+        }
+        peer_list_stale_ = false;
     }
-    return list;
+    return peer_list_;
 }
 
-void JsonCommandServer::BaseServer::broadcastMessage(const QJsonArray &cmd) {
+/* The encoded peer list, made again only when the peers changed. */
+const QByteArray& JsonCommandServer::BaseServer::peerListFrame() {
+    if (peer_list_frame_version_ != peers_version_) {
+        peer_list_frame_ = QJsonDocument(createPeerList()).toJson();
+        peer_list_frame_version_ = peers_version_;
+    }
+    return peer_list_frame_;
+}
+
+void JsonCommandServer::BaseServer::broadcastFrame(const QByteArray &data, int priority,
+        const QString &conflation_key, bool unreliable) {
     for (std::map<QTcpSocket*, QString>::iterator it = socket_ips_.begin(); it != socket_ips_.end(); ++it) {
-        QTcpSocket* socket = it->first;
-        writeMessage(socket, cmd);
+        writeFrame(it->first, data, priority, conflation_key, unreliable);
     }
 }
 
+void JsonCommandServer::BaseServer::broadcastMessage(const QJsonArray &cmd) {
+    broadcastFrame(QJsonDocument(cmd).toJson(), JsonCommandServer::messagePriority(cmd),
+                   conflationKey(cmd), isUnreliable(cmd));
+}
+
 void JsonCommandServer::BaseServer::broadcastMessage(const QString &message) {
     for (std::map<QTcpSocket*, QString>::iterator it = socket_ips_.begin(); it != socket_ips_.end(); ++it) {
         QTcpSocket* socket = it->first;
@@ -523,30 +1807,78 @@ void JsonCommandServer::BaseServer::broadcastMessage(const QString &message) {
 }
 
 void JsonCommandServer::BaseServer::eraseSocket(QTcpSocket *_socket) {
-    QString IP = _socket->peerAddress().toString();
+    if (links_.contains(_socket)) {
+        removeLink(_socket);
+        return;
+    }
+    unregisterPeer(_socket);
+    removeConnection(_socket);
+    this->updateInfos();
+    broadcastFrame(peerListFrame(), PRIORITY_CONTROL);
+    scheduleDirectoryAnnounce();
+}
+
+void JsonCommandServer::BaseServer::unregisterPeer(QTcpSocket *_socket) {
+    ConnectionIdentity identity = identities_.take(_socket);
+    if (identity.peer == NO_ATOM) {
+        identity.ip = _socket->peerAddress().toString();
+        identity.port = _socket->peerPort();
+        identity.endpoint = identity.ip + ":" + QString::number(identity.port);
+    }
+    QString IP = identity.ip;
     QString name = "";
-    int port = _socket->peerPort();
+    int port = identity.port;
     this->clients_test_messages_.erase(_socket);
     this->socket_ips_.erase(_socket);
     this->ips_socket_[IP].erase(port);
     if (this->ips_socket_[IP].size() == 0) {
         this->ips_socket_.erase(IP);
     }
-    name = ips_info_[IP][port].name;
-    this->ips_info_[IP].erase(port);
-    if (this->ips_info_[IP].size() == 0) {
-        this->ips_info_.erase(IP);
+    name = removeNodeInfo(IP, port);
+    if (identity.peer != NO_ATOM) {
+        peer_index_.remove(identity.peer);
+        peers_.remove(identity.peer);
+        atoms_.release(identity.peer);
+        peersChanged();
     }
-    this->peers_.erase("@" + IP + ":" + QString::number(port));
-    this->peers_.erase(name + "@" + IP + ":" + QString::number(port));
+    std::map<QString, QTcpSocket*>::iterator it = replaying_.find(name);
+    if (it != replaying_.end() && it->second == _socket) {
+        replaying_.erase(it);
+    }
+}
+
+void JsonCommandServer::BaseServer::removeConnection(QTcpSocket *_socket) {
     qint32* s = sizes_.value(_socket);
     QByteArray* buffer = buffers_.value(_socket);
     delete s;
     delete buffer;
     buffers_.remove(_socket);
     sizes_.remove(_socket);
-    this->updateInfos();
-    broadcastMessage(createPeerList());
+    delete limiters_.take(_socket);
+    delete assemblers_.take(_socket);
+    closeStreams(_socket);
+    shed_reads_.remove(_socket);
+    SendQueue* queue = send_queues_.take(_socket);
+    if (queue) {
+        // hand what is left to the socket so it is still delivered before closing
+        while (!queue->isEmpty() && _socket->state() == QAbstractSocket::ConnectedState) {
+            _socket->write(queue->pop());
+        }
+        delete queue;
+    }
+    pending_frames_.removeAll(_socket);
+    traced_writes_.remove(_socket);
+    if (capture_ids_.contains(_socket)) {
+        capture_.connectionClosed(capture_ids_.take(_socket));
+    }
+    parked_.remove(_socket);
+    holds_.remove(_socket);
+    released_.removeAll(_socket);
+    failWaiters(_socket);
+    dropFromGathers(_socket);
+    quint32 token = datagram_tokens_.take(_socket);
+    if (token) datagram_peers_.remove(token);
+    link_handshakes_.remove(_socket);
 }
 
 int JsonCommandServer::BaseServer::numSockets() {
@@ -557,35 +1889,1297 @@ void JsonCommandServer::BaseServer::setNMaxClients(int _n_max_clients) {
     this->n_max_clients_ = _n_max_clients;
 }
 
-void JsonCommandServer::BaseServer::addNewInfo(const RemoteNodeInfo &new_info) {
-    RemoteNodeInfo& info = ips_info_[new_info.IP][new_info.port];
-    info.date = new_info.date;
-    info.description = new_info.description;
-    info.group = new_info.group;
-    info.id = new_info.id;
-    info.IP = new_info.IP;
-    info.name = new_info.name;
-    info.port = new_info.port;
-    info.time = new_info.time;
-    info.type = new_info.type;
-    this->peers_.erase("@" + info.IP + ":" + QString::number(info.port));
-    this->peers_[info.name + "@" + info.IP + ":" + QString::number(info.port)] =
-        ips_socket_[info.IP][info.port];
-    this->updateInfos();
-    broadcastMessage(createPeerList());
+void JsonCommandServer::BaseServer::setMaxFrameSize(qint32 _max_frame_size) {
+    this->max_frame_size_ = _max_frame_size;
+    for (QHash<QTcpSocket*, StreamAssembler*>::iterator it = assemblers_.begin();
+            it != assemblers_.end(); ++it) {
+        it.value()->setMaxMessageSize(_max_frame_size);
+    }
 }
 
+void JsonCommandServer::BaseServer::setMaxFramesPerRead(int _max_frames_per_read) {
+    this->max_frames_per_read_ = qMax(1, _max_frames_per_read);
+}
 
-int JsonCommandServer::BaseServer::newKey() {
-    ++next_key_;
-    return next_key_;
+void JsonCommandServer::BaseServer::setConnectionRateLimit(double rate, double burst) {
+    admission_.setRate(rate, burst);
 }
 
-void JsonCommandServer::BaseServer::newMessage() {
-    ++n_messages_;
-    if (n_messages_ > N_MAX_SERVER_MESSAGES) {
-        n_messages_ = 0;
-        this->clearMessages();
+void JsonCommandServer::BaseServer::setClientRateLimit(double rate, double burst) {
+    client_limit_ = RateLimit(rate, burst);
+    for (QHash<QTcpSocket*, ClientRateLimiter*>::iterator it = limiters_.begin();
+            it != limiters_.end(); ++it) {
+        it.value()->setFrameLimit(client_limit_);
+    }
+}
+
+void JsonCommandServer::BaseServer::setCommandRateLimit(int type, double rate, double burst) {
+    if (rate <= 0) {
+        command_limits_.erase(type);
+    } else {
+        command_limits_[type] = RateLimit(rate, burst);
+    }
+    for (QHash<QTcpSocket*, ClientRateLimiter*>::iterator it = limiters_.begin();
+            it != limiters_.end(); ++it) {
+        it.value()->setCommandLimit(type, RateLimit(rate, burst));
+    }
+}
+
+void JsonCommandServer::BaseServer::setSendScheduling(int mode) {
+    send_scheduling_ = mode;
+    for (QHash<QTcpSocket*, SendQueue*>::iterator it = send_queues_.begin();
+            it != send_queues_.end(); ++it) {
+        it.value()->setScheduling(mode);
+    }
+}
+
+void JsonCommandServer::BaseServer::setLaneWeight(int priority, int weight) {
+    lane_weights_[priority] = weight;
+    for (QHash<QTcpSocket*, SendQueue*>::iterator it = send_queues_.begin();
+            it != send_queues_.end(); ++it) {
+        it.value()->setWeight(priority, weight);
+    }
+}
+
+void JsonCommandServer::BaseServer::setConflated(int type, bool conflated) {
+    if (conflated) {
+        conflated_types_.insert(type);
+    } else {
+        conflated_types_.erase(type);
+    }
+}
+
+/* Empty when cmd is not conflated. */
+QString JsonCommandServer::BaseServer::conflationKey(const QJsonArray &cmd) const {
+    if (conflated_types_.empty() || cmd.size() != 1) return QString();
+    QJsonObject object = cmd[0].toObject();
+    QString source = object.contains("from") ?
+                     object["from"].toString() :
+                     object["name_client"].toString() + "@" + object["ip"].toString() + ":" +
+                     QString::number(object["port"].toInt());
+    if (object["type"].toInt() == CMD_TO && object["cmd"].isArray()) {
+        QJsonArray inner = object["cmd"].toArray();
+        if (inner.size() != 1) return QString();
+        object = inner[0].toObject();
+    }
+    if (!object.contains("type")) return QString();
+    int type = object["type"].toInt();
+    if (!conflated_types_.count(type)) return QString();
+    return QString::number(type) + QChar(0) + source + QChar(0) + object["key"].toString();
+}
+
+void JsonCommandServer::BaseServer::setLagWatchdog(int interval_ms) {
+    if (interval_ms > 0) {
+        watchdog_->start(interval_ms);
+    } else {
+        watchdog_->stop();
+    }
+}
+
+void JsonCommandServer::BaseServer::setLoadShedding(qint64 accept_ms, qint64 low_priority_ms,
+        qint64 pause_reads_ms) {
+    watchdog_->setThreshold(SHED_ACCEPT, accept_ms);
+    watchdog_->setThreshold(SHED_LOW_PRIORITY, low_priority_ms);
+    watchdog_->setThreshold(SHED_READS, pause_reads_ms);
+}
+
+void JsonCommandServer::BaseServer::setShedPriority(int shed_priority) {
+    shed_priority_ = qBound<int>(PRIORITY_HIGH, shed_priority, PRIORITY_BULK);
+}
+
+void JsonCommandServer::BaseServer::setCommandCache(int max_entries, qint64 max_bytes) {
+    response_cache_.setCapacity(max_entries, max_bytes);
+}
+
+void JsonCommandServer::BaseServer::setDuplicateWindow(int window_ms, int max_keys) {
+    duplicate_filter_.setWindow(window_ms, max_keys);
+}
+
+void JsonCommandServer::BaseServer::shedLoad(int level, int previous, qint64 lag_us) {
+    QString message = tr("Atraso do laço de eventos em %1 ms: nível de descarte %2 -> %3.")
+                      .arg(double(lag_us) / 1000.0, 0, 'f', 1).arg(previous).arg(level);
+    if (level > previous) {
+        logError(message);
+    } else {
+        logStatus(message);
+    }
+    if ((level >= SHED_ACCEPT) != (previous >= SHED_ACCEPT)) {
+        pauseAccepting(level >= SHED_ACCEPT);
+    }
+    if (level >= SHED_READS && previous < SHED_READS) {
+        pauseNoisiestReads();
+    } else if (level < SHED_READS && previous >= SHED_READS) {
+        resumeShedReads();
+    }
+    // the next stage looks at the traffic since this one began
+    for (QHash<QTcpSocket*, ClientRateLimiter*>::iterator it = limiters_.begin();
+            it != limiters_.end(); ++it) {
+        it.value()->clearFrameCount();
     }
 }
 
+/* Pending connections wait in the kernel backlog meanwhile. */
+void JsonCommandServer::BaseServer::pauseAccepting(bool paused) {
+    QList<QTcpServer*> listeners = extra_listeners_;
+    if (tcp_server_) listeners.append(tcp_server_);
+    for (int i = 0; i < listeners.size(); ++i) {
+        if (paused) {
+            listeners[i]->pauseAccepting();
+        } else {
+            listeners[i]->resumeAccepting();
+        }
+    }
+}
+
+/* The tenth of the client connections that sent the most frames since the
+ * previous stage. Server links are never paused. */
+void JsonCommandServer::BaseServer::pauseNoisiestReads() {
+    std::vector<std::pair<quint64, QTcpSocket*> > counts;
+    for (QHash<QTcpSocket*, ClientRateLimiter*>::iterator it = limiters_.begin();
+            it != limiters_.end(); ++it) {
+        if (it.value()->frameCount() > 0 && !links_.contains(it.key())) {
+            counts.push_back(std::make_pair(it.value()->frameCount(), it.key()));
+        }
+    }
+    size_t n = qMin(counts.size(), qMax<size_t>(1, limiters_.size() / 10));
+    std::partial_sort(counts.begin(), counts.begin() + n, counts.end(),
+                      std::greater<std::pair<quint64, QTcpSocket*> >());
+    for (size_t i = 0; i < n; ++i) {
+        shed_reads_.insert(counts[i].second);
+    }
+}
+
+void JsonCommandServer::BaseServer::resumeShedReads() {
+    QList<QTcpSocket*> paused = shed_reads_.values();
+    shed_reads_.clear();
+    for (int i = 0; i < paused.size(); ++i) {
+        schedulePendingFrames(paused[i], 0);
+    }
+}
+
+void JsonCommandServer::BaseServer::setFrameVersion(int max_version) {
+    max_frame_version_ = qBound<int>(FRAME_V1, max_version, FRAME_V2);
+}
+
+/* Takes effect on connections negotiated from now on. */
+void JsonCommandServer::BaseServer::setStreamChunkSize(int chunk_size) {
+    stream_chunk_size_ = qMax(1, chunk_size);
+}
+
+void JsonCommandServer::BaseServer::setFrameCompression(qint32 min_size) {
+    compress_min_size_ = min_size;
+}
+
+/* Stream bodies go through as they arrive: nothing here holds more than the
+ * chunk at hand. */
+void JsonCommandServer::BaseServer::processStreamChunk(QTcpSocket *_socket, int kind,
+        quint32 stream, bool last, const QByteArray &data) {
+    if (kind == StreamAssembler::CHUNK_STREAM_BEGIN) {
+        ++metrics_.streams_opened;
+        InboundStream in = openStream(_socket, stream, last, data);
+        if (!last) {
+            inbound_streams_[_socket][stream] = in;
+        }
+        if (in.type != NONE) {
+            current_connection_ = _socket;
+            JsonCommandServer::executeStream(in.type, this, in.cmd, STREAM_BEGIN, QByteArray());
+            if (last) {
+                JsonCommandServer::executeStream(in.type, this, in.cmd, STREAM_END, QByteArray());
+            }
+            current_connection_ = 0;
+        }
+        return;
+    }
+    if (kind != StreamAssembler::CHUNK_STREAM_DATA && kind != StreamAssembler::CHUNK_STREAM_ABORT) {
+        return;
+    }
+    std::map<quint32, InboundStream>& open = inbound_streams_[_socket];
+    std::map<quint32, InboundStream>::iterator it = open.find(stream);
+    if (it == open.end()) return;
+    // the handler may touch the registry: work on a copy
+    InboundStream in = it->second;
+    bool aborted = kind == StreamAssembler::CHUNK_STREAM_ABORT;
+    if (aborted || last) {
+        open.erase(it);
+    }
+    if (aborted) ++metrics_.streams_aborted;
+    metrics_.stream_bytes += data.size();
+    if (in.target) {
+        relayPiece(_socket, in, aborted ? FRAME_ABORT : (last ? 0 : FRAME_MORE), data);
+    } else if (in.type != NONE) {
+        current_connection_ = _socket;
+        if (!data.isEmpty()) {
+            JsonCommandServer::executeStream(in.type, this, in.cmd, STREAM_DATA, data);
+        }
+        if (aborted || last) {
+            JsonCommandServer::executeStream(in.type, this, in.cmd,
+                                             aborted ? STREAM_ABORT : STREAM_END, QByteArray());
+        }
+        current_connection_ = 0;
+    }
+}
+
+/* Sets up a stream from its command: a CMD_TO to a local peer that takes
+ * streams is piped to it, other types need a stream handler. Anything else is
+ * answered with an error and its body dropped. */
+JsonCommandServer::InboundStream JsonCommandServer::BaseServer::openStream(QTcpSocket *_socket,
+        quint32 stream, bool last, const QByteArray &data) {
+    InboundStream in;
+    bool ok = false;
+    QJsonArray cmds = convertMessage(QString(data), ok);
+    QJsonObject cmd = ok && cmds.size() == 1 ? cmds[0].toObject() : QJsonObject();
+    if (!cmd.contains("type")) {
+        rejectStream(_socket, in, tr("Comando inválido no fluxo %1.").arg(stream));
+        return in;
+    }
+    int type = cmd["type"].toInt();
+    ClientRateLimiter* limiter = limiters_.value(_socket);
+    if (limiter && !limiter->acceptCommand(type, clock_.elapsed())) {
+        ++metrics_.commands_throttled;
+        rejectStream(_socket, in, tr("Limite de taxa excedido para o comando %1.").arg(type));
+        return in;
+    }
+    QHash<QTcpSocket*, ConnectionIdentity>::const_iterator identity =
+        identities_.constFind(_socket);
+    if (identity != identities_.constEnd()) {
+        cmd.insert("ip", identity.value().ip);
+        cmd.insert("port", identity.value().port);
+    }
+    cmd.insert("stream", double(stream));
+    if (type == CMD_TO) {
+        QString to = cmd["to"].toString();
+        QTcpSocket* target = getPeer(to);
+        SendQueue* queue = target ? send_queues_.value(target) : 0;
+        if (!queue || queue->framing() < FRAME_V2) {
+            rejectStream(_socket, in, tr("%1 não recebe fluxos.").arg(to));
+            return in;
+        }
+        in.target = target;
+        in.target_stream = queue->openStream();
+        if (cmd["cmd"].isArray()) {
+            in.priority = JsonCommandServer::relayPriority(CMD_TO, cmd["cmd"].toArray());
+        }
+        QJsonArray envelope = createCommandTo(cmd["from"].toString(), to, cmd["cmd"].toArray());
+        relayPiece(_socket, in, FRAME_STREAM | (last ? 0 : FRAME_MORE),
+                   QJsonDocument(envelope).toJson());
+        return in;
+    }
+    if (!JsonCommandServer::isStreamCommand(type)) {
+        rejectStream(_socket, in, tr("O comando %1 não aceita fluxos.").arg(type));
+        return in;
+    }
+    in.type = type;
+    in.cmd = cmd;
+    return in;
+}
+
+/* Pieces wait in the receiver's queue, in order; past the high water mark the
+ * sender is not read until they drain. */
+void JsonCommandServer::BaseServer::relayPiece(QTcpSocket *sender, const InboundStream &in,
+        int flags, const QByteArray &data) {
+    SendQueue* queue = send_queues_.value(in.target);
+    if (!queue) return;
+    queue->pushPiece(in.priority, in.target_stream, flags, data);
+    flushSendQueue(in.target);
+    if (sender && queue->pendingBytes() > STREAM_RELAY_HIGH_WATER_MARK) {
+        stalled_reads_.insert(sender, in.target);
+    }
+}
+
+void JsonCommandServer::BaseServer::rejectStream(QTcpSocket *_socket, InboundStream &in,
+        const QString &error_message) {
+    in.type = NONE;
+    in.target = 0;
+    logError(error_message, _socket);
+    bool ok = false;
+    QJsonArray cmd = createError(error_message, ok);
+    if (ok) {
+        writeMessage(_socket, cmd);
+    }
+}
+
+/* _socket is going away: the streams it was sending are aborted, the ones
+ * piped to it are dropped and their senders told so. */
+void JsonCommandServer::BaseServer::closeStreams(QTcpSocket *_socket) {
+    std::map<quint32, InboundStream> sending;
+    QHash<QTcpSocket*, std::map<quint32, InboundStream> >::iterator own =
+        inbound_streams_.find(_socket);
+    if (own != inbound_streams_.end()) {
+        sending.swap(own.value());
+        inbound_streams_.erase(own);
+    }
+    stalled_reads_.remove(_socket);
+    for (std::map<quint32, InboundStream>::iterator it = sending.begin(); it != sending.end(); ++it) {
+        ++metrics_.streams_aborted;
+        if (it->second.target) {
+            relayPiece(0, it->second, FRAME_ABORT, QByteArray());
+        } else if (it->second.type != NONE) {
+            JsonCommandServer::executeStream(it->second.type, this, it->second.cmd, STREAM_ABORT,
+                                             QByteArray());
+        }
+    }
+    for (QHash<QTcpSocket*, std::map<quint32, InboundStream> >::iterator sender =
+                inbound_streams_.begin(); sender != inbound_streams_.end(); ++sender) {
+        std::map<quint32, InboundStream>& open = sender.value();
+        for (std::map<quint32, InboundStream>::iterator it = open.begin(); it != open.end(); ++it) {
+            if (it->second.target == _socket) {
+                ++metrics_.streams_aborted;
+                rejectStream(sender.key(), it->second,
+                             tr("Fluxo %1 interrompido: o destino desconectou.").arg(it->first));
+            }
+        }
+    }
+    resumeStalledReads(_socket);
+}
+
+void JsonCommandServer::BaseServer::resumeStalledReads(QTcpSocket *target) {
+    QList<QTcpSocket*> senders = stalled_reads_.keys(target);
+    for (int i = 0; i < senders.size(); ++i) {
+        stalled_reads_.remove(senders[i]);
+        schedulePendingFrames(senders[i], 0);
+    }
+}
+
+/* The answer goes straight to the socket as the last v1 frame; whatever is
+ * still queued, or queued later, leaves as v2. */
+void JsonCommandServer::BaseServer::negotiateFraming(QTcpSocket *_socket, const QJsonObject &cmd) {
+    if (max_frame_version_ < FRAME_V2 || cmd["frame_version"].toInt() < FRAME_V2) return;
+    SendQueue* queue = send_queues_.value(_socket);
+    if (!queue || queue->framing() >= FRAME_V2) return;
+    QJsonArray answer = createIdentify();
+    QJsonObject identify = answer[0].toObject();
+    identify.insert("frame_version", FRAME_V2);
+    identify.insert("stream_chunk_size", stream_chunk_size_);
+    answer[0] = identify;
+    QByteArray data = QJsonDocument(answer).toJson();
+    _socket->write(IntToArray(data.size()) + data);
+    queue->setFraming(FRAME_V2, stream_chunk_size_);
+    assemblers_.insert(_socket, new StreamAssembler(max_frame_size_));
+}
+
+void JsonCommandServer::BaseServer::setDatagramPort(int port) {
+    this->datagram_port_ = qMax(0, port);
+}
+
+void JsonCommandServer::BaseServer::setUnreliable(int type, bool unreliable) {
+    if (unreliable) {
+        unreliable_types_.insert(type);
+    } else {
+        unreliable_types_.erase(type);
+    }
+}
+
+/* Opens, moves or closes the datagram channel to match the configured port. */
+void JsonCommandServer::BaseServer::openDatagramChannel() {
+    if (datagram_channel_ && datagram_channel_->localPort() == datagram_port_) return;
+    delete datagram_channel_;
+    datagram_channel_ = 0;
+    if (datagram_port_ == 0) return;
+    DatagramChannel* channel = new DatagramChannel(this);
+    QString error;
+    if (!channel->bind(primaryAddress(), quint16(datagram_port_), &error)) {
+        logError(tr("Não foi possível abrir a porta UDP %1: %2.")
+                 .arg(datagram_port_).arg(error));
+        delete channel;
+        return;
+    }
+    connect(channel, SIGNAL(readyRead()), this, SLOT(readDatagrams()));
+    datagram_channel_ = channel;
+    logStatus(tr("Recebendo datagramas na porta UDP %1.").arg(channel->localPort()));
+}
+
+/* The token binds the client's datagrams to this connection; it is kept if
+ * the client identifies again. */
+void JsonCommandServer::BaseServer::negotiateDatagrams(QTcpSocket *_socket,
+        const QJsonObject &cmd) {
+    if (!datagram_channel_ || !cmd["datagrams"].toBool() || links_.contains(_socket)) return;
+    quint32 token = datagram_tokens_.value(_socket);
+    if (!token) {
+        do {
+            token = quint32(token_random_());
+        } while (token == 0 || datagram_peers_.contains(token));
+        DatagramPeer& peer = datagram_peers_[token];
+        peer.socket = _socket;
+        peer.token = token;
+        peer.key = newDatagramKey();
+        datagram_tokens_.insert(_socket, token);
+    }
+    QJsonArray answer = createIdentify();
+    QJsonObject identify = answer[0].toObject();
+    identify.insert("datagram_port", datagram_channel_->localPort());
+    identify.insert("datagram_token", double(token));
+    identify.insert("datagram_key",
+                    QString::fromLatin1(datagram_peers_.value(token).key.toHex()));
+    answer[0] = identify;
+    writeMessage(_socket, answer);
+}
+
+/* A bounded number of batches per call: the channel signals again while
+ * datagrams are left, so TCP connections are not starved by a flood. */
+void JsonCommandServer::BaseServer::readDatagrams() {
+    if (!datagram_channel_) return;
+    QList<Datagram> batch;
+    batching_ = true;
+    for (int n = 0; n < N_MAX_DATAGRAM_BATCHES && datagram_channel_->receive(batch) > 0; ++n) {
+        for (int i = 0; i < batch.size(); ++i) {
+            processDatagram(batch[i]);
+        }
+        batch.clear();
+    }
+    batching_ = false;
+    dispatchCommands();
+}
+
+void JsonCommandServer::BaseServer::processDatagram(const Datagram &datagram) {
+    DatagramHeader header;
+    QHash<quint32, DatagramPeer>::iterator it = datagram_peers_.end();
+    if (decodeDatagramHeader(datagram.data, header)) {
+        it = datagram_peers_.find(header.token);
+    }
+    if (it == datagram_peers_.end()) {
+        ++metrics_.datagrams_rejected;
+        return;
+    }
+    DatagramPeer& peer = it.value();
+    // the token travels in clear, only the key proves the datagram is the peer's
+    if (!checkDatagramMac(datagram.data, peer.key)) {
+        ++metrics_.datagrams_rejected;
+        return;
+    }
+    quint32 ahead = header.sequence - peer.next_sequence;
+    if (ahead >= DATAGRAM_WINDOW && ++peer.out_of_window < N_MAX_OUT_OF_WINDOW) {
+        // older than one already dispatched (a stale reading), or a jump no
+        // loss explains: drop it
+        ++metrics_.datagrams_late;
+        return;
+    }
+    if (ahead < DATAGRAM_WINDOW) metrics_.datagrams_lost += ahead;
+    peer.out_of_window = 0;
+    peer.next_sequence = header.sequence + 1;
+    peer.address = datagram.address;
+    peer.port = datagram.port;
+    ++metrics_.datagrams_received;
+    QJsonDocument doc = QJsonDocument::fromJson(datagram.data.mid(DATAGRAM_HEADER_SIZE));
+    if (!doc.isArray()) {
+        ++metrics_.datagrams_rejected;
+        return;
+    }
+    processCommands(peer.socket, doc.array(), true);
+}
+
+bool JsonCommandServer::BaseServer::isUnreliable(const QJsonObject &cmd) const {
+    int type = cmd["type"].toInt();
+    if (type == CMD_TO && cmd["cmd"].isArray()) {
+        QJsonArray inner = cmd["cmd"].toArray();
+        return !inner.isEmpty() && isUnreliable(inner);
+    }
+    return unreliable_types_.count(type) > 0;
+}
+
+/* True when every command of the frame may be lost. */
+bool JsonCommandServer::BaseServer::isUnreliable(const QJsonArray &cmd) const {
+    if (unreliable_types_.empty() || cmd.isEmpty()) return false;
+    for (int i = 0; i < cmd.size(); ++i) {
+        if (!isUnreliable(cmd[i].toObject())) return false;
+    }
+    return true;
+}
+
+/* False when the frame has to go over TCP: no channel, no known endpoint for
+ * the peer, or too long for one datagram. */
+bool JsonCommandServer::BaseServer::sendDatagram(QTcpSocket *_socket, const QByteArray &data) {
+    if (!datagram_channel_ || data.size() > MAX_DATAGRAM_SIZE - DATAGRAM_HEADER_SIZE) return false;
+    QHash<QTcpSocket*, quint32>::const_iterator token = datagram_tokens_.constFind(_socket);
+    if (token == datagram_tokens_.constEnd()) return false;
+    DatagramPeer& peer = datagram_peers_[token.value()];
+    if (peer.port == 0) return false;
+    datagram_channel_->send(peer.address, peer.port,
+                            encodeDatagram(peer.token, ++peer.send_sequence, peer.key, data));
+    ++metrics_.datagrams_sent;
+    return true;
+}
+
+QJsonObject JsonCommandServer::BaseServer::metrics() {
+    QJsonObject out = metrics_.toJson();
+    QJsonObject limits;
+    limits.insert("max_frame_size", max_frame_size_);
+    limits.insert("max_frames_per_read", max_frames_per_read_);
+    limits.insert("client_rate", client_limit_.rate);
+    limits.insert("client_burst", client_limit_.burst);
+    QJsonObject commands;
+    for (std::map<int, RateLimit>::const_iterator it = command_limits_.begin();
+            it != command_limits_.end(); ++it) {
+        QJsonObject limit;
+        limit.insert("rate", it->second.rate);
+        limit.insert("burst", it->second.burst);
+        commands.insert(QString::number(it->first), limit);
+    }
+    limits.insert("commands", commands);
+    out.insert("limits", limits);
+    out.insert("clients", numSockets());
+    qint64 queued_bytes = 0;
+    for (QHash<QTcpSocket*, SendQueue*>::iterator it = send_queues_.begin();
+            it != send_queues_.end(); ++it) {
+        queued_bytes += it.value()->pendingBytes();
+    }
+    out.insert("send_queue_bytes", double(queued_bytes));
+    out.insert("send_scheduling", send_scheduling_);
+    out.insert("v2_connections", assemblers_.size());
+    out.insert("loop", watchdog_->toJson());
+    out.insert("gathers_pending", gathers_.size());
+    quint64 oldest_record = history_.oldest();
+    out.insert("history_records",
+               double(oldest_record ? history_.newest() - oldest_record + 1 : 0));
+    if (datagram_channel_) {
+        QJsonObject datagrams;
+        datagrams.insert("port", datagram_channel_->localPort());
+        datagrams.insert("peers", datagram_peers_.size());
+        datagrams.insert("syscalls", double(datagram_channel_->syscalls()));
+        datagrams.insert("dropped", double(datagram_channel_->dropped()));
+        out.insert("datagrams", datagrams);
+    }
+    QJsonObject command_cache = response_cache_.toJson();
+    command_cache.insert("duplicates", double(duplicate_filter_.duplicates()));
+    command_cache.insert("idempotency_keys", duplicate_filter_.size());
+    command_cache.insert("idempotency_bytes", double(duplicate_filter_.bytes()));
+    out.insert("command_cache", command_cache);
+    out.insert("links", links_.size());
+    if (startup_ns_ >= 0) out.insert("startup_us", double(startup_ns_ / 1000));
+    out.insert("nodes", directory_.nodes().size());
+    out.insert("remote_peers", directory_.numPeers());
+    out.insert("offline_destinations", offline_store_.numDestinations());
+    out.insert("offline_pending_bytes", double(offline_store_.pendingBytes()));
+    out.insert("offline_dropped", double(offline_store_.dropped()));
+    out.insert("state_entries", state_journal_.size());
+    out.insert("state_journal_bytes", double(state_journal_.journalBytes()));
+    return out;
+}
+
+void JsonCommandServer::BaseServer::addNewInfo(const RemoteNodeInfo &new_info) {
+    RemoteNodeInfo& info = ips_info_[new_info.IP][new_info.port];
+    info.date = new_info.date;
+    info.description = new_info.description;
+    info.group = new_info.group;
+    info.id = new_info.id;
+    info.IP = new_info.IP;
+    info.name = new_info.name;
+    info.port = new_info.port;
+    info.time = new_info.time;
+    info.type = new_info.type;
+    QTcpSocket* socket = ips_socket_[info.IP][info.port];
+    if (socket) {
+        // a peer identifying again may change its name, group or type
+        renamePeer(socket, info.name + "@" + info.IP + ":" + QString::number(info.port));
+        peer_index_.insert(identities_.value(socket).peer, info.group, info.type);
+    }
+    if (!info.name.isEmpty() && offline_store_.hasPending(info.name)) {
+        replaying_[info.name] = ips_socket_[info.IP][info.port];
+        if (!replay_timer_->isActive()) {
+            replay_timer_->start(REPLAY_INTERVAL);
+        }
+    }
+    this->updateInfos();
+    broadcastFrame(peerListFrame(), PRIORITY_CONTROL);
+    scheduleDirectoryAnnounce();
+}
+
+/* Returns the node's name. */
+QString JsonCommandServer::BaseServer::removeNodeInfo(const QString &IP, int port) {
+    std::map<QString, std::map<int, RemoteNodeInfo> >::iterator it = ips_info_.find(IP);
+    if (it == ips_info_.end()) return QString();
+    std::map<int, RemoteNodeInfo>::iterator info = it->second.find(port);
+    QString name;
+    if (info != it->second.end()) {
+        name = info->second.name;
+        it->second.erase(info);
+    }
+    if (it->second.empty()) {
+        ips_info_.erase(it);
+    }
+    return name;
+}
+
+/* Registers _socket under a new peer name, dropping the previous one. */
+void JsonCommandServer::BaseServer::renamePeer(QTcpSocket *_socket, const QString &peer) {
+    QHash<QTcpSocket*, ConnectionIdentity>::iterator identity = identities_.find(_socket);
+    if (identity == identities_.end()) return;
+    Atom atom = atoms_.intern(peer);
+    Atom& current = identity.value().peer;
+    if (current != NO_ATOM) {
+        peer_index_.remove(current);
+        peers_.remove(current);
+        atoms_.release(current);
+    }
+    current = atom;
+    peers_.insert(atom, _socket);
+    peersChanged();
+}
+
+/* The loop thread reads peers_ directly; other threads get one snapshot per
+ * event loop turn, however many peers changed in it. */
+void JsonCommandServer::BaseServer::peersChanged() {
+    peer_list_stale_ = true;
+    ++peers_version_;
+    if (publish_scheduled_) return;
+    publish_scheduled_ = true;
+    QTimer::singleShot(0, this, SLOT(publishPeers()));
+}
+
+void JsonCommandServer::BaseServer::publishPeers() {
+    publish_scheduled_ = false;
+    PeerSnapshot* snapshot = new PeerSnapshot;
+    snapshot->version = peers_version_;
+    for (QHash<Atom, QTcpSocket*>::const_iterator it = peers_.constBegin();
+            it != peers_.constEnd(); ++it) {
+        snapshot->peers.insert(atoms_.string(it.key()), it.value());
+    }
+    snapshot->names = getPeers();
+    snapshot->peer_list = peerListFrame();
+    peer_directory_.publish(snapshot);
+}
+
+quint64 JsonCommandServer::BaseServer::peersVersion() const {
+    PeerDirectory::ReadGuard snapshot(peer_directory_);
+    return snapshot->version;
+}
+
+bool JsonCommandServer::BaseServer::hasPeer(const QString &peer) const {
+    PeerDirectory::ReadGuard snapshot(peer_directory_);
+    return snapshot->peers.contains(peer);
+}
+
+QList<QString> JsonCommandServer::BaseServer::peersSnapshot() const {
+    PeerDirectory::ReadGuard snapshot(peer_directory_);
+    return snapshot->names;
+}
+
+QByteArray JsonCommandServer::BaseServer::peerListSnapshot() const {
+    PeerDirectory::ReadGuard snapshot(peer_directory_);
+    return snapshot->peer_list;
+}
+
+/* A peer known to the snapshot gets the frame encoded here; anything else
+ * (Todos, selectors, remote or offline peers) is routed by the event loop. */
+void JsonCommandServer::BaseServer::postCommandTo(const QString &to, const QJsonArray &cmd) {
+    if (hasPeer(to)) {
+        QByteArray data = QJsonDocument(cmd).toJson();
+        int priority = JsonCommandServer::messagePriority(cmd);
+        QMetaObject::invokeMethod(this, "writeToPeer", Qt::QueuedConnection,
+                                  Q_ARG(QString, to), Q_ARG(QByteArray, data),
+                                  Q_ARG(int, priority));
+        return;
+    }
+    QMetaObject::invokeMethod(this, "routeQueued", Qt::QueuedConnection,
+                              Q_ARG(QString, to), Q_ARG(QJsonArray, cmd));
+}
+
+void JsonCommandServer::BaseServer::writeToPeer(const QString &to, const QByteArray &data,
+        int priority) {
+    QTcpSocket* socket = getPeer(to);
+    if (socket) {
+        writeFrame(socket, data, priority);
+    } else {
+        // gone since the snapshot: offline store or another node
+        routeCommand(to, QJsonDocument::fromJson(data).array());
+    }
+}
+
+void JsonCommandServer::BaseServer::routeQueued(const QString &to, const QJsonArray &cmd) {
+    routeCommand(to, cmd);
+}
+
+void JsonCommandServer::BaseServer::setNodeName(const QString &_node_name) {
+    this->node_name_ = _node_name;
+}
+
+void JsonCommandServer::BaseServer::setNodeSecret(const QByteArray &secret) {
+    this->node_secret_ = secret;
+}
+
+QString JsonCommandServer::BaseServer::nodeName() {
+    if (node_name_.isEmpty()) {
+        return myIP() + ":" + QString::number(myPort());
+    }
+    return node_name_;
+}
+
+void JsonCommandServer::BaseServer::connectToNode(const QString &host, int port) {
+    if (node_secret_.isEmpty()) {
+        logError(tr("Ligação com %1:%2 recusada: nenhum segredo de federação definido.")
+                 .arg(host).arg(port));
+        return;
+    }
+    NodeAddress& address = node_addresses_[host + ":" + QString::number(port)];
+    address.host = host;
+    address.port = port;
+    if (!address.socket.isNull() && address.socket->state() != QAbstractSocket::UnconnectedState) {
+        return;
+    }
+    QTcpSocket* socket = new QTcpSocket(this);
+    address.socket = socket;
+    links_.insert(socket, QString());
+    connect(socket, SIGNAL(connected()), this, SLOT(nodeConnected()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+            this, SLOT(displayError(QAbstractSocket::SocketError)));
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    socket->connectToHost(host, port);
+    if (tcp_server_ && !gossip_timer_->isActive()) {
+        gossip_timer_->start(GOSSIP_INTERVAL);
+    }
+}
+
+QList<QString> JsonCommandServer::BaseServer::getNodes() {
+    return directory_.nodes();
+}
+
+void JsonCommandServer::BaseServer::nodeConnected() {
+    QTcpSocket* socket = static_cast<QTcpSocket*>(sender());
+    addConnection(socket);
+    connect(socket, SIGNAL(readyRead()), this, SLOT(receiveMessage()));
+    connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(socketBytesWritten(qint64)));
+    NodeLinkHandshake handshake(LINK_INITIATOR, node_secret_, nodeName());
+    writeMessage(socket, createNodeLink(handshake.start()));
+    link_handshakes_.insert(socket, handshake);
+}
+
+/* Delivers cmd to a local peer, or relays it to the node that owns `to`.
+ * "Todos" reaches every local client and crosses each link once, and so does
+ * a selector such as "group:2 & type:sensor", each node delivering to its own
+ * matching clients. */
+void JsonCommandServer::BaseServer::routeCommand(const QString &to, const QJsonArray &cmd) {
+    if (to == "Todos") {
+        broadcastMessage(cmd);
+        if (!links_.isEmpty()) {
+            forwardCommand(to, cmd, 0);
+        }
+        return;
+    }
+    QTcpSocket* socket = getPeer(to);
+    if (socket) {
+        // keep the order while an offline backlog is still being replayed
+        if (!offline_store_.hasPending(peerIdentity(to)) || !storeOffline(to, cmd)) {
+            writeMessage(socket, cmd);
+        }
+        return;
+    }
+    if (PeerIndex::isSelector(to)) {
+        if (deliverSelected(to, cmd) && !links_.isEmpty()) {
+            forwardCommand(to, cmd, 0);
+        }
+        return;
+    }
+    QTcpSocket* via = directory_.route(to);
+    if (via) {
+        forwardCommand(to, cmd, via);
+    } else {
+        storeOffline(to, cmd);
+    }
+}
+
+/* Encodes cmd once for all the local peers the selector matches. False when
+ * the selector does not parse or is past the PeerIndex limits; the client
+ * whose command sent it gets a MESSAGE_ERROR. */
+bool JsonCommandServer::BaseServer::deliverSelected(const QString &selector,
+        const QJsonArray &cmd) {
+    std::set<Atom> peers;
+    QString error;
+    if (!peer_index_.select(selector, peers, &error)) {
+        QString error_message = tr("Endereço inválido '%1': %2.")
+                                .arg(selector.left(64)).arg(error);
+        logError(error_message);
+        if (current_connection_ && !links_.contains(current_connection_)) {
+            bool ok = false;
+            writeMessage(current_connection_, createError(error_message, ok));
+        }
+        return false;
+    }
+    if (peers.empty()) return true;
+    QByteArray data = QJsonDocument(cmd).toJson();
+    int priority = JsonCommandServer::messagePriority(cmd);
+    QString conflation_key = conflationKey(cmd);
+    bool unreliable = isUnreliable(cmd);
+    for (std::set<Atom>::const_iterator it = peers.begin(); it != peers.end(); ++it) {
+        QTcpSocket* socket = peers_.value(*it);
+        if (socket) writeFrame(socket, data, priority, conflation_key, unreliable);
+    }
+    return true;
+}
+
+void JsonCommandServer::BaseServer::forwardCommand(const QString &to, const QJsonArray &cmd,
+        QTcpSocket* via) {
+    QString origin = nodeName();
+    quint64 seq = ++forward_seq_;
+    markForwardSeen(origin + "#" + QString::number(seq));
+    QJsonArray out;
+    QJsonObject forward;
+    forward.insert("type", NODE_FORWARD);
+    forward.insert("origin", origin);
+    forward.insert("seq", double(seq));
+    forward.insert("ttl", FORWARD_TTL);
+    forward.insert("to", to);
+    forward.insert("cmd", cmd);
+    out.append(forward);
+    int priority = JsonCommandServer::messagePriority(cmd);
+    if (via) {
+        writeFrame(via, QJsonDocument(out).toJson(), priority);
+    } else {
+        writeToLinks(out, 0, priority);
+    }
+}
+
+void JsonCommandServer::BaseServer::processServerCommand(QTcpSocket *_socket, int type,
+        const QJsonObject &cmd) {
+    switch (type) {
+    case NODE_LINK:
+        processNodeLink(_socket, cmd);
+        break;
+    case NODE_DIRECTORY:
+        processNodeDirectory(_socket, cmd);
+        break;
+    case NODE_FORWARD:
+        processNodeForward(_socket, cmd);
+        break;
+    case COMMAND_REPLY:
+        processCommandReply(_socket, cmd);
+        break;
+    case GATHER:
+        processGather(_socket, cmd);
+        break;
+    case HISTORY:
+        processHistoryQuery(_socket, cmd);
+        break;
+    default:
+        break;
+    }
+}
+
+/* See NodeLinkHandshake. A connection accepted as a client stays one until
+ * its proof checks out. */
+void JsonCommandServer::BaseServer::processNodeLink(QTcpSocket *_socket, const QJsonObject &cmd) {
+    QHash<QTcpSocket*, NodeLinkHandshake>::iterator it = link_handshakes_.find(_socket);
+    if (it == link_handshakes_.end()) {
+        // a link already up, or an outbound one that has not connected yet
+        if (links_.contains(_socket)) return;
+        it = link_handshakes_.insert(_socket,
+                                     NodeLinkHandshake(LINK_RESPONDER, node_secret_, nodeName()));
+    }
+    QJsonObject reply;
+    int state = it.value().receive(cmd, &reply);
+    if (!reply.isEmpty()) writeMessage(_socket, createNodeLink(reply));
+    if (state == LINK_PENDING) return;
+    QString node = it.value().peer();
+    link_handshakes_.erase(it);
+    if (state == LINK_REJECTED) {
+        rejectLink(_socket, cmd["node"].toString());
+        return;
+    }
+    if (!links_.contains(_socket)) {
+        unregisterPeer(_socket);
+        this->updateInfos();
+        broadcastFrame(peerListFrame(), PRIORITY_CONTROL);
+    }
+    acceptLink(_socket, node);
+}
+
+void JsonCommandServer::BaseServer::acceptLink(QTcpSocket *_socket, const QString &node) {
+    links_[_socket] = node;
+    logStatus(tr("Servidor %1 conectado.").arg(node), _socket);
+    writeMessage(_socket, createDirectory(nodeName(), directory_version_, 0, getPeers()));
+    QList<QString> nodes = directory_.nodes();
+    for (int i = 0; i < nodes.size(); ++i) {
+        NodeDirectory::NodeInfo info = directory_.nodeInfo(nodes[i]);
+        writeMessage(_socket, createDirectory(nodes[i], info.version, info.hops, info.peers));
+    }
+}
+
+void JsonCommandServer::BaseServer::rejectLink(QTcpSocket *_socket, const QString &node) {
+    logError(tr("Ligação inválida com o servidor %1.").arg(node), _socket);
+    eraseSocket(_socket);
+    _socket->disconnectFromHost();
+}
+
+void JsonCommandServer::BaseServer::processNodeDirectory(QTcpSocket *_socket,
+        const QJsonObject &cmd) {
+    if (links_.value(_socket).isEmpty()) return;
+    QString node = cmd["node"].toString();
+    if (node.isEmpty() || node == nodeName()) return;
+    qint64 version = static_cast<qint64>(cmd["version"].toDouble());
+    int hops = cmd["hops"].toInt() + 1;
+    QList<QString> peers;
+    QJsonArray array = cmd["peers"].toArray();
+    for (int i = 0; i < array.size(); ++i) {
+        peers.append(array[i].toString());
+    }
+    if (directory_.update(node, version, hops, _socket, peers)) {
+        writeToLinks(createDirectory(node, version, hops, peers), _socket, PRIORITY_CONTROL);
+    }
+}
+
+void JsonCommandServer::BaseServer::processNodeForward(QTcpSocket *_socket,
+        const QJsonObject &cmd) {
+    if (links_.value(_socket).isEmpty()) return;
+    QString key = cmd["origin"].toString() + "#" +
+                  QString::number(static_cast<quint64>(cmd["seq"].toDouble()));
+    if (!markForwardSeen(key)) return;
+    QString to = cmd["to"].toString();
+    QJsonArray payload = cmd["cmd"].toArray();
+    int ttl = cmd["ttl"].toInt() - 1;
+    int priority = JsonCommandServer::relayPriority(NODE_FORWARD, payload);
+    QJsonObject relay = cmd;
+    relay.insert("ttl", ttl);
+    QJsonArray out;
+    out.append(relay);
+    if (to == "Todos") {
+        broadcastMessage(payload);
+        if (ttl > 0) {
+            writeToLinks(out, _socket, priority);
+        }
+        return;
+    }
+    QTcpSocket* socket = getPeer(to);
+    if (socket) {
+        writeMessage(socket, payload);
+        return;
+    }
+    if (PeerIndex::isSelector(to)) {
+        if (deliverSelected(to, payload) && ttl > 0) {
+            writeToLinks(out, _socket, priority);
+        }
+        return;
+    }
+    QTcpSocket* via = directory_.route(to);
+    if (via && via != _socket && ttl > 0) {
+        writeFrame(via, QJsonDocument(out).toJson(), priority);
+    }
+}
+
+void JsonCommandServer::BaseServer::removeLink(QTcpSocket *_socket) {
+    QString node = links_.take(_socket);
+    QList<QString> lost = directory_.removeLink(_socket);
+    removeConnection(_socket);
+    // also frees outbound links that never connected, so gossip can retry them
+    _socket->deleteLater();
+    if (!node.isEmpty()) {
+        logError(tr("Servidor %1 desconectado (%2 nós inacessíveis).")
+                 .arg(node).arg(lost.size()));
+    }
+}
+
+void JsonCommandServer::BaseServer::scheduleDirectoryAnnounce() {
+    if (links_.isEmpty() || directory_dirty_) return;
+    directory_dirty_ = true;
+    // coalesce the announces of a connection burst
+    QTimer::singleShot(DIRECTORY_ANNOUNCE_DELAY, this, SLOT(announceDirectory()));
+}
+
+void JsonCommandServer::BaseServer::announceDirectory() {
+    directory_dirty_ = false;
+    // versions survive restarts: a restarted node must not look older than before
+    directory_version_ = qMax(directory_version_ + 1, QDateTime::currentMSecsSinceEpoch());
+    writeToLinks(createDirectory(nodeName(), directory_version_, 0, getPeers()), 0,
+                 PRIORITY_CONTROL);
+}
+
+void JsonCommandServer::BaseServer::gossipDirectory() {
+    for (std::map<QString, NodeAddress>::iterator it = node_addresses_.begin();
+            it != node_addresses_.end(); ++it) {
+        if (it->second.socket.isNull()) {
+            connectToNode(it->second.host, it->second.port);
+        }
+    }
+    announceDirectory();
+}
+
+bool JsonCommandServer::BaseServer::markForwardSeen(const QString &key) {
+    if (!seen_forwards_.insert(key).second) return false;
+    seen_order_.push_back(key);
+    if (seen_order_.size() > N_MAX_SEEN_FORWARDS) {
+        seen_forwards_.erase(seen_order_.front());
+        seen_order_.pop_front();
+    }
+    return true;
+}
+
+void JsonCommandServer::BaseServer::writeToLinks(const QJsonArray &cmd, QTcpSocket *except,
+        int priority) {
+    QByteArray data = QJsonDocument(cmd).toJson();
+    for (QHash<QTcpSocket*, QString>::iterator it = links_.begin(); it != links_.end(); ++it) {
+        if (it.key() != except && !it.value().isEmpty()) {
+            writeFrame(it.key(), data, priority);
+        }
+    }
+}
+
+bool JsonCommandServer::BaseServer::enableOfflineStore(const QString &path) {
+    if (!offline_store_.open(path)) {
+        logError(tr("Não foi possível abrir a fila de mensagens offline em %1.").arg(path));
+        return false;
+    }
+    offline_sync_timer_->start(OFFLINE_SYNC_INTERVAL);
+    return true;
+}
+
+void JsonCommandServer::BaseServer::setOfflineSyncPolicy(int type, int policy) {
+    offline_sync_[type] = policy;
+}
+
+void JsonCommandServer::BaseServer::setOfflineReplayRate(int messages_per_second) {
+    replay_rate_ = qMax(1, messages_per_second);
+}
+
+void JsonCommandServer::BaseServer::setOfflineRetention(qint64 max_bytes, qint64 max_age_ms) {
+    offline_store_.setMaxBytes(max_bytes);
+    offline_store_.setMaxAge(max_age_ms);
+}
+
+void JsonCommandServer::BaseServer::setOfflineLimits(int max_destinations, qint64 max_total_bytes,
+        int max_open_queues) {
+    offline_store_.setMaxDestinations(max_destinations);
+    offline_store_.setMaxTotalBytes(max_total_bytes);
+    offline_store_.setMaxOpenQueues(max_open_queues);
+}
+
+bool JsonCommandServer::BaseServer::storeOffline(const QString &to, const QJsonArray &cmd) {
+    QString identity = peerIdentity(to);
+    if (!offline_store_.isOpen() || identity.isEmpty()) return false;
+    int type = cmd.size() > 0 ? cmd[0].toObject()["type"].toInt() : MESSAGE_NORMAL;
+    std::map<int, int>::iterator it = offline_sync_.find(type);
+    int policy = it != offline_sync_.end() ? it->second : static_cast<int>(SYNC_PERIODIC);
+    if (!offline_store_.append(identity, QJsonDocument(cmd).toJson(), policy)) return false;
+    ++metrics_.offline_stored;
+    return true;
+}
+
+/* Stable part of a peer name: "name@ip:port" -> "name". Anonymous peers have none. */
+QString JsonCommandServer::BaseServer::peerIdentity(const QString &peer) {
+    int at = peer.indexOf('@');
+    return at < 0 ? peer : peer.left(at);
+}
+
+void JsonCommandServer::BaseServer::replayOffline() {
+    int budget = qMax(1, replay_rate_ * REPLAY_INTERVAL / 1000);
+    std::map<QString, QTcpSocket*>::iterator it = replaying_.begin();
+    while (it != replaying_.end()) {
+        QTcpSocket* socket = it->second;
+        if (socket_ips_.find(socket) == socket_ips_.end()) {
+            replaying_.erase(it++);
+            continue;
+        }
+        SendQueue* queue = send_queues_.value(socket);
+        if (queue && queue->pendingBytes() > SOCKET_WRITE_HIGH_WATER_MARK) {
+            // the peer is not keeping up; do not pile the backlog into memory
+            ++it;
+            continue;
+        }
+        QList<QByteArray> frames = offline_store_.take(it->first, budget);
+        for (int i = 0; i < frames.size(); ++i) {
+            writeFrame(socket, frames[i], PRIORITY_BULK);
+            ++metrics_.offline_replayed;
+        }
+        if (offline_store_.hasPending(it->first)) {
+            ++it;
+        } else {
+            replaying_.erase(it++);
+        }
+    }
+    if (replaying_.empty()) {
+        replay_timer_->stop();
+    }
+}
+
+void JsonCommandServer::BaseServer::syncOffline() {
+    offline_store_.sync();
+    offline_store_.expire();
+}
+
+bool JsonCommandServer::BaseServer::enableStatePersistence(const QString &path) {
+    if (!state_journal_.open(path)) {
+        logError(tr("Não foi possível abrir o diário de estado em %1.").arg(path));
+        return false;
+    }
+    state_sync_timer_->start(STATE_SYNC_INTERVAL);
+    restoreAllState();
+    return true;
+}
+
+void JsonCommandServer::BaseServer::persistState(const QString &key, const QByteArray &value) {
+    state_journal_.put(key.toUtf8(), value);
+}
+
+QByteArray JsonCommandServer::BaseServer::stateValue(const QString &key) {
+    return state_journal_.value(key.toUtf8());
+}
+
+void JsonCommandServer::BaseServer::removeState(const QString &key) {
+    state_journal_.remove(key.toUtf8());
+}
+
+void JsonCommandServer::BaseServer::compactState() {
+    state_journal_.compact();
+}
+
+void JsonCommandServer::BaseServer::restoreState(const QString &key, const QByteArray &value) {
+    Q_UNUSED(key);
+    Q_UNUSED(value);
+}
+
+/* Entries of connections, which do not outlive the process, are dropped
+ * instead of restored as nodes that are not there. */
+void JsonCommandServer::BaseServer::restoreAllState() {
+    if (!state_journal_.isOpen()) return;
+    QList<QByteArray> stale;
+    state_journal_.forEach([this, &stale](const QByteArray& key, const QByteArray& value) {
+        QString name = QString::fromUtf8(key);
+        if (name.startsWith(NODE_STATE_PREFIX)) {
+            stale.append(QByteArray(key.constData(), key.size()));
+        } else {
+            restoreState(name, value);
+        }
+    });
+    for (int i = 0; i < stale.size(); ++i) {
+        state_journal_.remove(stale[i]);
+    }
+}
+
+void JsonCommandServer::BaseServer::syncState() {
+    state_journal_.sync();
+}
+
+bool JsonCommandServer::BaseServer::startCapture(const QString &path) {
+    capture_ids_.clear();
+    if (!capture_.open(path)) {
+        logError(tr("Não foi possível criar o arquivo de captura %1.").arg(path));
+        return false;
+    }
+    logStatus(tr("Capturando o tráfego em %1.").arg(path));
+    return true;
+}
+
+void JsonCommandServer::BaseServer::stopCapture() {
+    if (!capture_.isOpen()) return;
+    capture_.close();
+    capture_ids_.clear();
+    logStatus(tr("Captura encerrada: %1 mensagens.").arg(capture_.frames()));
+}
+
+/* Connections already open when the capture started get their id with their
+ * first frame. 0 for federation links, which are not recorded. */
+quint32 JsonCommandServer::BaseServer::captureId(QTcpSocket *_socket) {
+    if (links_.contains(_socket)) return 0;
+    QHash<QTcpSocket*, quint32>::iterator it = capture_ids_.find(_socket);
+    if (it == capture_ids_.end()) {
+        it = capture_ids_.insert(_socket, capture_.connectionOpened());
+    }
+    return it.value();
+}
+
+void JsonCommandServer::BaseServer::captureFrame(QTcpSocket *_socket, const QByteArray &frame) {
+    quint32 id = captureId(_socket);
+    if (id) capture_.frame(id, frame);
+}
+
+void JsonCommandServer::BaseServer::captureStream(QTcpSocket *_socket) {
+    quint32 id = captureId(_socket);
+    if (id) capture_.stream(id);
+}
+
+void JsonCommandServer::BaseServer::setTraceSampling(int one_in_n) {
+    TraceRecorder::setSampling(one_in_n);
+    if (one_in_n <= 0) traced_writes_.clear();
+}
+
+bool JsonCommandServer::BaseServer::writeTrace(const QString &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+            file.write(TraceRecorder::toChromeTrace(nodeName())) < 0) {
+        logError(tr("Não foi possível gravar o rastreamento em %1.").arg(path));
+        return false;
+    }
+    logStatus(tr("Rastreamento gravado em %1.").arg(path));
+    return true;
+}
+
+/* The trace id of a command: the one it carries (a NODE_FORWARD carries it in
+ * the relayed command), otherwise a sampled one for MESSAGE_TO and CMD_TO,
+ * written into cmd. */
+quint64 JsonCommandServer::BaseServer::traceCommand(int type, QJsonObject &cmd) {
+    quint64 trace = TraceRecorder::idFromJson(cmd["trace"]);
+    if (trace) return trace;
+    if (type == NODE_FORWARD) {
+        QJsonArray payload = cmd["cmd"].toArray();
+        return payload.isEmpty() ? 0 : TraceRecorder::idFromJson(payload[0].toObject()["trace"]);
+    }
+    if (type != MESSAGE_TO && type != CMD_TO) return 0;
+    trace = TraceRecorder::sample();
+    if (trace) cmd.insert("trace", TraceRecorder::idToString(trace));
+    return trace;
+}
+
+/* cmd with the trace of the running command, for what it sends on. */
+QJsonArray JsonCommandServer::BaseServer::traced(const QJsonArray &cmd) {
+    if (!current_trace_ || cmd.isEmpty()) return cmd;
+    QJsonArray out = cmd;
+    QJsonObject first = out[0].toObject();
+    first.insert("trace", TraceRecorder::idToString(current_trace_));
+    out[0] = first;
+    return out;
+}
+
+void JsonCommandServer::BaseServer::traceWritten(QTcpSocket *_socket, qint64 bytes) {
+    QHash<QTcpSocket*, std::vector<TracedWrite> >::iterator it = traced_writes_.find(_socket);
+    if (it == traced_writes_.end()) return;
+    std::vector<TracedWrite>& writes = it.value();
+    qint64 now = TraceRecorder::now();
+    size_t done = 0;
+    for (size_t i = 0; i < writes.size(); ++i) {
+        writes[i].remaining -= bytes;
+        if (writes[i].remaining <= 0) {
+            TraceRecorder::record(writes[i].trace, "socket_write", writes[i].begin_ns, now);
+            ++done;
+        }
+    }
+    // frames leave the buffer in order
+    writes.erase(writes.begin(), writes.begin() + done);
+    if (writes.empty()) traced_writes_.erase(it);
+}
+
+QJsonArray JsonCommandServer::BaseServer::createNodeLink(const QJsonObject &link) {
+    QJsonArray out;
+    QJsonObject cmd = link;
+    cmd.insert("type", NODE_LINK);
+    out.append(cmd);
+    return out;
+}
+
+QJsonArray JsonCommandServer::BaseServer::createDirectory(const QString &node, qint64 version,
+        int hops, const QList<QString> &peers) {
+    QJsonArray out;
+    QJsonObject cmd;
+    cmd.insert("type", NODE_DIRECTORY);
+    cmd.insert("node", node);
+    cmd.insert("version", double(version));
+    cmd.insert("hops", hops);
+    QJsonArray peers_array;
+    for (int i = 0; i < peers.size(); ++i) {
+        peers_array.append(peers[i]);
+    }
+    cmd.insert("peers", peers_array);
+    out.append(cmd);
+    return out;
+}
+
+
+int JsonCommandServer::BaseServer::newKey() {
+    ++next_key_;
+    return next_key_;
+}
+
+void JsonCommandServer::BaseServer::newMessage() {
+    ++n_messages_;
+    if (n_messages_ > N_MAX_SERVER_MESSAGES) {
+        n_messages_ = 0;
+        this->clearMessages();
+    }
+}
+
+
@@ -42,14 +42,137 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <set>
 #include <map>
+#include <deque>
 #include <queue>
+#include <random>
 #include <vector>
 #include <QString>
 
 #include "commands_controller.h"
+#include "atom_table.h"
+#include "datagram_channel.h"
+#include "envelope.h"
+#include "frame_codec.h"
+#include "gather_reducer.h"
+#include "local_listener.h"
+#include "loop_watchdog.h"
+#include "message_history.h"
+#include "node_directory.h"
+#include "node_link.h"
+#include "offline_store.h"
+#include "peer_directory.h"
+#include "peer_index.h"
+#include "rate_limiter.h"
+#include "response_cache.h"
+#include "send_queue.h"
+#include "state_journal.h"
+#include "trace_recorder.h"
+#include "traffic_capture.h"
+#include "server_metrics.h"
 
 namespace JsonCommandServer {
 
+class BaseServer;
+
+struct JSONCOMMANDSERVERSHARED_EXPORT InboundCommand {
+    InboundCommand(QTcpSocket* _socket, const QJsonObject& _cmd, int _type,
+                   quint64 _trace = 0, qint64 _queued_ns = 0)
+        : socket(_socket), cmd(_cmd), type(_type), trace(_trace), queued_ns(_queued_ns) {}
+
+    QTcpSocket* socket;
+    QJsonObject cmd;
+    int type;
+    quint64 trace;
+    qint64 queued_ns;
+};
+
+/* A stream being received (see frame_codec.h): handed to the stream handler
+ * of its command type, piped to another connection, or, after an error,
+ * dropped as it comes. */
+struct JSONCOMMANDSERVERSHARED_EXPORT InboundStream {
+    InboundStream() : type(NONE), target(0), target_stream(0), priority(PRIORITY_BULK) {}
+
+    int type;  // NONE when the body is dropped
+    QJsonObject cmd;
+    QTcpSocket* target;  // CMD_TO relays
+    quint32 target_stream;
+    int priority;
+};
+
+/* What a connection is known by, built once when it is registered instead of
+ * on every command. */
+struct JSONCOMMANDSERVERSHARED_EXPORT ConnectionIdentity {
+    ConnectionIdentity() : port(0), peer(NO_ATOM) {}
+
+    QString ip;
+    int port;
+    QString endpoint;  // ip:port
+    Atom peer;  // "name@ip:port", or "@ip:port" until the peer identifies
+};
+
+/* The datagram side of a TCP connection, keyed by the token handed to the peer
+ * in its identify reply along with the key of its datagrams' MAC. The peer's
+ * UDP endpoint is learned from its last authentic datagram; until the first
+ * one everything goes over TCP. */
+struct JSONCOMMANDSERVERSHARED_EXPORT DatagramPeer {
+    DatagramPeer()
+        : socket(0), port(0), token(0), send_sequence(0), next_sequence(1), out_of_window(0) {}
+
+    QTcpSocket* socket;
+    QHostAddress address;
+    quint16 port;  // 0 until the first datagram
+    quint32 token;
+    QByteArray key;
+    quint32 send_sequence;
+    quint32 next_sequence;  // expected from the peer
+    int out_of_window;  // consecutive datagrams dropped as late or too far ahead
+};
+
+/* A traced frame handed to its socket. Its span ends when the socket has
+ * passed `remaining` more bytes to the OS. */
+struct JSONCOMMANDSERVERSHARED_EXPORT TracedWrite {
+    quint64 trace;
+    qint64 remaining;
+    qint64 begin_ns;
+};
+
+/* Something a suspended handler waits for on the event loop: a deadline, a
+ * COMMAND_REPLY or work done on the thread pool. Waiters are linked into the
+ * server intrusively, so waiting allocates nothing. */
+struct JSONCOMMANDSERVERSHARED_EXPORT LoopWaiter {
+    LoopWaiter();
+    virtual ~LoopWaiter();
+
+    // ok is false on timeout or when the server closes
+    virtual void wake(bool ok, const QJsonObject& result) = 0;
+
+    LoopWaiter* prev;
+    LoopWaiter* next;
+    qint64 deadline;
+    qint64 request_id;
+    QTcpSocket* socket;  // the only connection whose COMMAND_REPLY counts
+};
+
+/* A GATHER in flight: the peers still to answer, the running result and, as a
+ * waiter, its deadline. */
+struct JSONCOMMANDSERVERSHARED_EXPORT PendingGather : public LoopWaiter {
+    PendingGather() : server(0), expected(0) {}
+
+    virtual void wake(bool ok, const QJsonObject& result);
+
+    BaseServer* server;
+    QPointer<QTcpSocket> origin;
+    QJsonValue origin_request_id;
+    QSet<QTcpSocket*> outstanding;
+    int expected;
+    GatherReducer reducer;
+};
+
+struct JSONCOMMANDSERVERSHARED_EXPORT NodeAddress {
+    QString host;
+    int port;
+    QPointer<QTcpSocket> socket;
+};
 
 class JSONCOMMANDSERVERSHARED_EXPORT BaseServer : public QObject, public BaseController {
     Q_OBJECT
@@ -78,9 +201,30 @@ class JSONCOMMANDSERVERSHARED_EXPORT BaseServer : public QObject, public BaseCon
   public slots:
     virtual void sessionOpened();
     void sendInitialMessage();
+    void acceptDescriptors(const QVector<qintptr>& descriptors);
+    void acceptSharedMemory(const QVector<qintptr>& descriptors);
+    void processHandshakes();
+    void broadcastPeerList();
     void receiveMessage();
+    void processPendingFrames();
+    void socketBytesWritten(qint64 bytes);
+    void nodeConnected();
+    void announceDirectory();
+    void gossipDirectory();
+    void replayOffline();
+    void syncOffline();
+    void syncState();
+    void expireWaiters();
+    void wakePosted();
+    void resumeParked();
+    void publishPeers();
+    void writeToPeer(const QString& to, const QByteArray& data, int priority);
+    void routeQueued(const QString& to, const QJsonArray& cmd);
+    void shedLoad(int level, int previous, qint64 lag_us);
+    void readDatagrams();
 
     virtual void updateServer();
+    void reloadServer();
     void closeServer();
 
     virtual void addClientMessage(const QString& message) {}
@@ -101,6 +245,8 @@ class JSONCOMMANDSERVERSHARED_EXPORT BaseServer : public QObject, public BaseCon
 
     void writeMessage(QTcpSocket* _socket, const QJsonArray& cmd);
     void writeMessage(QTcpSocket* _socket, const QString& message);
+    void writeMessage(QTcpSocket* _socket, const QString& message, int priority);
+    void dispatchCommands();
 
     /*Commands*/
     QJsonArray createMessage(const QString& from, const QString &message, bool &ok,
@@ -128,8 +274,201 @@ class JSONCOMMANDSERVERSHARED_EXPORT BaseServer : public QObject, public BaseCon
     void eraseSocket(QTcpSocket* _socket);
     int numSockets();
 
+    /* Safe from any thread (see peer_directory.h). Other threads see the peers
+     * as the event loop last published them, once per turn in which they
+     * changed, always as one consistent set. postCommandTo() encodes in the
+     * calling thread and leaves only the write to the event loop. */
+    quint64 peersVersion() const;
+    bool hasPeer(const QString& peer) const;
+    QList<QString> peersSnapshot() const;
+    QByteArray peerListSnapshot() const;
+    void postCommandTo(const QString& to, const QJsonArray& cmd);
+
     void setNMaxClients(int _n_max_clients);
 
+    /* Admission control and rate limiting. A rate <= 0 disables the limit. */
+    void setMaxFrameSize(qint32 _max_frame_size);
+    void setMaxFramesPerRead(int _max_frames_per_read);
+    void setConnectionRateLimit(double rate, double burst);
+    void setClientRateLimit(double rate, double burst);
+    void setCommandRateLimit(int type, double rate, double burst);
+
+    /* Outbound lanes, see SendQueue */
+    void setSendScheduling(int mode);
+    void setLaneWeight(int priority, int weight);
+
+    /* Latest-value conflation: a pending frame of a conflated type is replaced
+     * by a newer one from the same source ("from", or the sender's
+     * name@ip:port) with the same "key" field, so a slow reader only gets the
+     * newest value of each. Applies to frames holding one command of the type,
+     * or a CMD_TO carrying one. */
+    void setConflated(int type, bool conflated);
+
+    /* Datagram transport for lossy, high-rate commands (telemetry). With a
+     * datagram port (0, the default, turns it off) a client whose identify
+     * carries "datagrams": true gets "datagram_port", "datagram_token" and
+     * "datagram_key" (hex) in an identify reply, and may send frames of
+     * unreliable types as UDP datagrams authenticated with the key, see
+     * datagram_channel.h. They are dispatched like TCP frames; lost and late
+     * ones are counted, late ones dropped, as are ones over 1024
+     * ahead of the expected sequence, until 16 such in a row make the server
+     * follow the peer's sequence again (the peer restarted it). Frames to such a
+     * client made only of unreliable commands (or a CMD_TO carrying them) go
+     * as datagrams once its UDP endpoint is known, TCP otherwise. */
+    void setDatagramPort(int port);
+    void setUnreliable(int type, bool unreliable);
+
+    /* Keeps the last `capacity` client commands and server events as
+     * structured records (time, level, peer, type and the command, or
+     * {"message"} for status and error events) in a ring, 0 (the default)
+     * keeps none. Clients page through it with HISTORY: {"before" or "after":
+     * cursor, "limit", and optional "level", "peer", "cmd_type", "since",
+     * "until" (ms since epoch) and "payload": false}; the COMMAND_REPLY has
+     * "records" and "next", the cursor of the following page (0: no more). */
+    void setHistoryCapacity(int capacity);
+
+    /* Echoes every received frame to addStatusMessage(), on by default. */
+    void setVerbose(bool verbose);
+
+    /* Load shedding, see LoopWatchdog. setLagWatchdog() samples the event loop
+     * lag every interval_ms, 0 stops it. As the average lag passes each
+     * threshold (ms, <= 0 leaves the stage out) the listeners stop accepting,
+     * then commands of shed_priority and below are answered with MESSAGE_ERROR,
+     * then the noisiest tenth of the connections is no longer read. Lag
+     * histogram, shed level and its transitions are in metrics()["loop"]. */
+    void setLagWatchdog(int interval_ms);
+    void setLoadShedding(qint64 accept_ms, qint64 low_priority_ms, qint64 pause_reads_ms);
+    void setShedPriority(int shed_priority);
+
+    /* Replies of commands registered with a cache TTL are kept in a response
+     * cache bounded by max_entries and max_bytes (0 entries turns it off), and
+     * a repeat of the same body within the TTL is answered from it without
+     * running the handler. Other commands carrying an "idempotency_key" are
+     * run once per sender and key within window_ms. A later delivery gets the
+     * reply of the first one again, or a COMMAND_REPLY with "duplicate": true
+     * when there was none to keep. The sender is the name its connection
+     * identified with and the address it comes from, so a client still matches
+     * its keys after reconnecting. Hits, misses and duplicates are in
+     * metrics()["command_cache"]. */
+    void setCommandCache(int max_entries, qint64 max_bytes);
+    void setDuplicateWindow(int window_ms, int max_keys);
+
+    /* Framing offered to clients that ask for it in their identify, see
+     * frame_codec.h. FRAME_V1 turns v2 off. On v2 connections a command can
+     * come as a stream: its body reaches the handler registered with
+     * JsonCommandServer::addStreamCommand() piece by piece, and a CMD_TO to a
+     * local v2 peer is piped to it, pausing the sender's reads while more than
+     * a few chunks wait for the receiver. On v2 connections messages longer
+     * than chunk_size bytes are sent in interleaved chunks, and, when min_size
+     * > 0, messages of at least min_size bytes are sent compressed. */
+    void setFrameVersion(int max_version);
+    void setStreamChunkSize(int chunk_size);
+    void setFrameCompression(qint32 min_size);
+
+    QJsonObject metrics();
+
+    /* Server mode, for daemons and containers: initServer() binds right away,
+     * without the network session, the saved configuration in QSettings or the
+     * interface enumeration desktop builds go through. myIP() is then what
+     * setIPServer() set, or else the first listen address that is not a
+     * wildcard, or else localhost. The time from initServer() to listening is
+     * reported in a status message and as startup_us in metrics().
+     *
+     * Listen addresses, IPv6 included, all share the port of the first one;
+     * by default there is one, QHostAddress::Any (dual stack). Only the first
+     * takes part in SO_REUSEPORT groups, acceptor threads and handovers. */
+    void setServerMode(bool _server_mode);
+    void setListenAddresses(const QList<QHostAddress>& addresses);
+
+    /* Hot reload: with it enabled updateServer() keeps the connections, their
+     * buffers, queues and identities, and only rebinds the listener when the
+     * port changed. Handlers are replaced with JsonCommandServer::swapCommands().
+     * A listener opened with SO_REUSEPORT can be bound by a new process while
+     * this one still serves; handOverListener() instead passes the listening
+     * descriptor on to a process started by exec(), which adopts it with
+     * setListenerDescriptor() before initServer(). */
+    void setHotReload(bool _hot_reload);
+    void setReusePort(bool _reuse_port);
+    void setListenerDescriptor(qintptr fd);
+    qintptr handOverListener();
+
+    /* Connection storms: n_acceptors > 1 opens that many SO_REUSEPORT listeners
+     * on the same port, all but one on their own thread (one per core is a good
+     * start). Accepted connections reach this thread in batches and their
+     * handshakes are spread over the following event loop iterations. */
+    void setAcceptors(int n_acceptors);
+
+    /* Clients on this host can skip TCP: a Unix domain socket listener at
+     * local_path and, on Linux, a shared memory one (see shm_socket.h) whose
+     * control socket is at shm_path. Empty paths, the default, open neither.
+     * Their connections are peers like the TCP ones, named name@unix:<n> and
+     * name@shm:<n>, so routing works across transports. */
+    void setLocalPath(const QString& local_path);
+    void setSharedMemoryPath(const QString& shm_path);
+
+    /* Federation: servers linked over the same framed protocol share a
+     * peer -> node directory and relay MESSAGE_TO/CMD_TO to the owning node.
+     * Both ends of a link must share the secret given to setNodeSecret(), and
+     * prove it with the handshake in node_link.h; NODE_LINK from a connection
+     * that cannot is refused. Without a secret no link is made. */
+    void setNodeName(const QString& _node_name);
+    void setNodeSecret(const QByteArray& secret);
+    QString nodeName();
+    void connectToNode(const QString& host, int port);
+    QList<QString> getNodes();
+
+    /* Store-and-forward for offline peers: frames to an unknown peer are kept
+     * under its name (the part before '@') and replayed when it identifies.
+     * Any client can name a destination, so setOfflineLimits bounds the store
+     * as a whole, see OfflineStore. */
+    bool enableOfflineStore(const QString& path);
+    void setOfflineSyncPolicy(int type, int policy);
+    void setOfflineReplayRate(int messages_per_second);
+    void setOfflineRetention(qint64 max_bytes, qint64 max_age_ms);
+    void setOfflineLimits(int max_destinations, qint64 max_total_bytes, int max_open_queues);
+
+    /* Incremental persistence. Subclasses persist their own entries with
+     * persistState() instead of dumping serialize() on every change, and get
+     * them back in restoreState() once, when enableStatePersistence() opens
+     * the journal, or look them up with stateValue() when needed. The nodes
+     * in ips_info_ are connections and are not persisted. The snapshot is
+     * read from its mapping: the value given to restoreState() must be
+     * copied to be kept. */
+    bool enableStatePersistence(const QString& path);
+    void persistState(const QString& key, const QByteArray& value);
+    QByteArray stateValue(const QString& key);
+    void removeState(const QString& key);
+    void compactState();
+    virtual void restoreState(const QString& key, const QByteArray& value);
+
+    /* Traffic capture: every message clients send is recorded, as read, into
+     * a trace that tools/traffic_replay plays back against another server.
+     * Federation links are not recorded, nor are stream bodies: a stream only
+     * marks its connection, which the replay then leaves out. */
+    bool startCapture(const QString& path);
+    void stopCapture();
+
+    /* Sampled tracing (see trace_recorder.h). One MESSAGE_TO/CMD_TO in
+     * one_in_n gets a trace id, unless its sender already set one, and the
+     * spans of its hop through this server are recorded: parse, inbound
+     * (waiting for dispatch), dispatch, send_queue and socket_write (Qt's write
+     * buffer). The id goes on with the delivered command, so the next node or
+     * the receiving client can add its own spans. 0 turns sampling off. */
+    void setTraceSampling(int one_in_n);
+    bool writeTrace(const QString& path);
+
+    /* Asynchronous handlers (see command_task.h). While a connection is held its
+     * next commands are parked, so they still run in order after the handler. */
+    QTcpSocket* currentConnection();
+    void holdConnection(QTcpSocket* _socket);
+    void releaseConnection(QTcpSocket* _socket);
+    void addWaiter(LoopWaiter* waiter, int timeout_ms);
+    void removeWaiter(LoopWaiter* waiter);
+    /* Only peers connected to this server can be asked: false, and nothing is
+     * sent, for anything else. */
+    bool sendRequest(LoopWaiter* waiter, const QString& to, const QJsonArray& cmd, int timeout_ms);
+    void postWaiter(LoopWaiter* waiter);
+
     virtual void addNewInfo(const RemoteNodeInfo& new_info);
     virtual void updateInfos() {}
 
@@ -139,26 +478,233 @@ class JSONCOMMANDSERVERSHARED_EXPORT BaseServer : public QObject, public BaseCon
     void dataReceived(QTcpSocket*, const QString&);
 
   protected:
+    friend struct PendingGather;
+
     int newKey();
     void newMessage();
+    void logStatus(const QString& message, QTcpSocket* _socket = 0);
+    void logError(const QString& message, QTcpSocket* _socket = 0);
+    Atom historyPeer(QTcpSocket* _socket);
+    EnvelopeSender envelopeSender();
+
+    bool listenServer(QTcpServer* server, QString& error);
+    bool listenExtraAddresses(QString& error);
+    void closeExtraListeners();
+    QHostAddress primaryAddress() const;
+    bool rebindListener();
+    QTcpServer* createListener();
+    bool startAcceptorThreads(QString& error);
+    void stopAcceptorThreads();
+    void openLocalListeners();
+    void scheduleHandshakes();
+    void schedulePeerList();
+    void acceptConnection(QTcpSocket* client_connection);
+
+    qint64 readFrames(QTcpSocket* _socket, int budget);
+    void schedulePendingFrames(QTcpSocket* _socket, qint64 delay);
+    void rejectFrame(QTcpSocket* _socket, qint32 size);
+    void rejectFrame(QTcpSocket* _socket, const QString& error_message);
+    void negotiateFraming(QTcpSocket* _socket, const QJsonObject& cmd);
+    void processCommands(QTcpSocket* _socket, const QJsonArray& cmds, bool datagram);
+    void openDatagramChannel();
+    void negotiateDatagrams(QTcpSocket* _socket, const QJsonObject& cmd);
+    void processDatagram(const Datagram& datagram);
+    bool isUnreliable(const QJsonObject& cmd) const;
+    bool isUnreliable(const QJsonArray& cmd) const;
+    bool sendDatagram(QTcpSocket* _socket, const QByteArray& data);
+    void processStreamChunk(QTcpSocket* _socket, int kind, quint32 stream, bool last,
+                            const QByteArray& data);
+    InboundStream openStream(QTcpSocket* _socket, quint32 stream, bool last,
+                             const QByteArray& data);
+    void relayPiece(QTcpSocket* sender, const InboundStream& in, int flags,
+                    const QByteArray& data);
+    void rejectStream(QTcpSocket* _socket, InboundStream& in, const QString& error_message);
+    void closeStreams(QTcpSocket* _socket);
+    void resumeStalledReads(QTcpSocket* target);
+    void pauseAccepting(bool paused);
+    void pauseNoisiestReads();
+    void resumeShedReads();
+    void writeFrame(QTcpSocket* _socket, const QByteArray& data, int priority,
+                    const QString& conflation_key = QString(), bool unreliable = false);
+    QString conflationKey(const QJsonArray& cmd) const;
+    void flushSendQueue(QTcpSocket* _socket);
+
+    void addConnection(QTcpSocket* _socket);
+    void removeConnection(QTcpSocket* _socket);
+    void unregisterPeer(QTcpSocket* _socket);
+    void renamePeer(QTcpSocket* _socket, const QString& peer);
+    void peersChanged();
+    const QJsonArray& peerListArray();
+    const QByteArray& peerListFrame();
+    void broadcastFrame(const QByteArray& data, int priority,
+                        const QString& conflation_key = QString(), bool unreliable = false);
+    quint32 captureId(QTcpSocket* _socket);
+    void captureFrame(QTcpSocket* _socket, const QByteArray& frame);
+    void captureStream(QTcpSocket* _socket);
+    quint64 traceCommand(int type, QJsonObject& cmd);
+    QJsonArray traced(const QJsonArray& cmd);
+    void traceWritten(QTcpSocket* _socket, qint64 bytes);
+
+    void runCommand(const InboundCommand& in);
+    void executeClientCommand(const InboundCommand& in);
+    QList<CachedFrame> runRecorded(const InboundCommand& in, qint64* cost_ns);
+    void writeRecordedReply(const InboundCommand& in, const QList<CachedFrame>& frames);
+    void answerDuplicate(const InboundCommand& in, const QList<CachedFrame>& reply);
+    QString idempotencyScope(QTcpSocket* _socket);
+    void processCommandReply(QTcpSocket* _socket, const QJsonObject& cmd);
+    void cancelWaiters();
+    void failWaiters(QTcpSocket* _socket);
+    void processGather(QTcpSocket* _socket, const QJsonObject& cmd);
+    void recordHistory(const InboundCommand& in);
+    void processHistoryQuery(QTcpSocket* _socket, const QJsonObject& cmd);
+    void finishGather(PendingGather* gather, bool timed_out);
+    void dropFromGathers(QTcpSocket* _socket);
+
+    void routeCommand(const QString& to, const QJsonArray& cmd);
+    bool deliverSelected(const QString& selector, const QJsonArray& cmd);
+    void forwardCommand(const QString& to, const QJsonArray& cmd, QTcpSocket* via);
+    void processServerCommand(QTcpSocket* _socket, int type, const QJsonObject& cmd);
+    void processNodeLink(QTcpSocket* _socket, const QJsonObject& cmd);
+    void acceptLink(QTcpSocket* _socket, const QString& node);
+    void rejectLink(QTcpSocket* _socket, const QString& node);
+    void processNodeDirectory(QTcpSocket* _socket, const QJsonObject& cmd);
+    void processNodeForward(QTcpSocket* _socket, const QJsonObject& cmd);
+    void removeLink(QTcpSocket* _socket);
+    void scheduleDirectoryAnnounce();
+    bool markForwardSeen(const QString& key);
+    void writeToLinks(const QJsonArray& cmd, QTcpSocket* except, int priority);
+
+    bool storeOffline(const QString& to, const QJsonArray& cmd);
+    QString peerIdentity(const QString& peer);
+    void restoreAllState();
+    QString removeNodeInfo(const QString& IP, int port);
+
+    QJsonArray createNodeLink(const QJsonObject& link);
+    QJsonArray createDirectory(const QString& node, qint64 version, int hops,
+                               const QList<QString>& peers);
 
     QString ip_address_;
     int port_server_;
     QTcpServer* tcp_server_;
     QNetworkSession* network_session_;
+    bool server_mode_;
+    QList<QHostAddress> listen_addresses_;
+    QList<QTcpServer*> extra_listeners_;
+    QElapsedTimer startup_clock_;
+    qint64 startup_ns_;
+    bool hot_reload_;
+    bool reuse_port_;
+    qintptr listener_fd_;
+    int n_acceptors_;
+    QList<QThread*> acceptor_threads_;
+    QString local_path_;
+    QString shm_path_;
+    LocalListener* local_listener_;
+    LocalListener* shm_listener_;
+    int n_local_connections_;
+    QList<QPointer<QTcpSocket> > handshakes_;
+    bool handshake_scheduled_;
+    bool peer_list_dirty_;
 
     QHash<QTcpSocket*,QByteArray*> buffers_;
     QHash<QTcpSocket*, qint32*> sizes_;
+    QHash<QTcpSocket*, ClientRateLimiter*> limiters_;
+    QList<QTcpSocket*> pending_frames_;
+    QHash<QTcpSocket*, SendQueue*> send_queues_;
+    QHash<QTcpSocket*, StreamAssembler*> assemblers_;
+    QHash<QTcpSocket*, std::map<quint32, InboundStream> > inbound_streams_;
+    QHash<QTcpSocket*, QTcpSocket*> stalled_reads_;  // sender -> relay target
+    std::deque<InboundCommand> inbound_[N_PRIORITIES];
 
     std::map<QTcpSocket*, QString> clients_test_messages_;
     std::map<QTcpSocket*, QString> socket_ips_;
     std::map<QString, std::map<int, QTcpSocket*> > ips_socket_;
     std::map<QString, std::map<int, RemoteNodeInfo> > ips_info_;
-    std::map<QString, QTcpSocket*> peers_;
+    AtomTable atoms_;
+    QHash<QTcpSocket*, ConnectionIdentity> identities_;
+    QHash<Atom, QTcpSocket*> peers_;
+    QList<QString> peer_names_;  // sorted, rebuilt when peers_ changes
+    QJsonArray peer_list_;
+    bool peer_list_stale_;
+    quint64 peers_version_;
+    QByteArray peer_list_frame_;
+    quint64 peer_list_frame_version_;
+    PeerDirectory peer_directory_;
+    bool publish_scheduled_;
+    PeerIndex peer_index_;
 
     int next_key_;
     int n_messages_;
     int n_max_clients_;
+
+    qint32 max_frame_size_;
+    int max_frames_per_read_;
+    bool batching_;
+    TokenBucket admission_;
+    RateLimit client_limit_;
+    std::map<int, RateLimit> command_limits_;
+    int send_scheduling_;
+    std::map<int, int> lane_weights_;
+    std::set<int> conflated_types_;
+    std::set<int> unreliable_types_;
+    int datagram_port_;
+    DatagramChannel* datagram_channel_;
+    QHash<quint32, DatagramPeer> datagram_peers_;
+    QHash<QTcpSocket*, quint32> datagram_tokens_;
+    std::mt19937 token_random_;
+    int max_frame_version_;
+    int stream_chunk_size_;
+    qint32 compress_min_size_;
+    LoopWatchdog* watchdog_;
+    int shed_priority_;
+    QSet<QTcpSocket*> shed_reads_;
+    ResponseCache response_cache_;
+    DuplicateFilter duplicate_filter_;
+    bool recording_reply_;
+    QList<CachedFrame> recorded_frames_;  // what the running handler wrote back
+    QElapsedTimer clock_;
+    ServerMetrics metrics_;
+
+    QString node_name_;
+    NodeDirectory directory_;
+    QHash<QTcpSocket*, QString> links_;
+    QByteArray node_secret_;
+    QHash<QTcpSocket*, NodeLinkHandshake> link_handshakes_;  // until the link is up
+    std::map<QString, NodeAddress> node_addresses_;
+    QTimer* gossip_timer_;
+    bool directory_dirty_;
+    qint64 directory_version_;
+    quint64 forward_seq_;
+    std::set<QString> seen_forwards_;
+    std::deque<QString> seen_order_;
+
+    OfflineStore offline_store_;
+    std::map<int, int> offline_sync_;
+    std::map<QString, QTcpSocket*> replaying_;
+    QTimer* replay_timer_;
+    QTimer* offline_sync_timer_;
+    int replay_rate_;
+
+    StateJournal state_journal_;
+    TrafficCapture capture_;
+    QHash<QTcpSocket*, quint32> capture_ids_;
+    MessageHistory history_;
+    bool verbose_;
+    qint64 frame_ready_ns_;
+    quint64 current_trace_;
+    QHash<QTcpSocket*, std::vector<TracedWrite> > traced_writes_;
+    QTimer* state_sync_timer_;
+
+    QTcpSocket* current_connection_;
+    QHash<QTcpSocket*, int> holds_;
+    QHash<QTcpSocket*, std::deque<InboundCommand> > parked_;
+    QList<QTcpSocket*> released_;
+    LoopWaiter* waiters_;
+    QTimer* waiter_timer_;
+    qint64 request_seq_;
+    QHash<qint64, PendingGather*> gathers_;
+    QMutex posted_mutex_;
+    LoopWaiter* posted_;
 };
 
 }  // namespace JsonCommandServer
@@ -0,0 +1,78 @@
+/*
+Json Command Server
+
+BINARY FORMAT
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_BINARY_FORMAT_H
+#define JSONCOMMANDSERVER_BINARY_FORMAT_H
+
+#include <QByteArray>
+
+#include <cstring>
+
+namespace JsonCommandServer {
+
+/* Helpers for the on-disk logs. Fields are stored in host byte order: the
+ * files are local to the machine that wrote them. */
+
+template<typename T>
+inline T readField(const uchar* p) {
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template<typename T>
+inline void writeField(uchar* p, T value) {
+    std::memcpy(p, &value, sizeof(T));
+}
+
+template<typename T>
+inline void appendField(QByteArray& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+inline qint64 align8(qint64 n) {
+    return (n + 7) & ~qint64(7);
+}
+
+/* FNV-1a, used to detect torn or corrupted records and to hash snapshot keys. */
+inline quint32 checksum(const char* data, int size, quint32 hash = 2166136261u) {
+    for (int i = 0; i < size; ++i) {
+        hash ^= static_cast<uchar>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_BINARY_FORMAT_H
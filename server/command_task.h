@@ -0,0 +1,294 @@
+/*
+Json Command Server
+
+COMMAND TASK
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_COMMAND_TASK_H
+#define JSONCOMMANDSERVER_COMMAND_TASK_H
+
+/* Coroutine command handlers. The library itself builds as C++11; this header
+ * is for applications built as C++20 (CONFIG += c++2a) and is empty otherwise.
+ *
+ *     CommandTask lookup(BaseServer* server, QJsonObject cmd) {
+ *         ReplyResult r = co_await request(server, cmd["peer"].toString(), query, 2000);
+ *         co_await runInPool(server, [&] { save(r.reply); });
+ *         co_await sleepFor(server, 100);
+ *         ...
+ *     }
+ *     addCoroutineCommand(lookup, LOOKUP);
+ *
+ * Handlers run on the event loop and come back to it after every co_await.
+ * While one is suspended, the later commands of the same connection wait for
+ * it. The awaitables live in the coroutine frame and frames are recycled, so
+ * a suspension allocates nothing. Take arguments by value: the caller's
+ * references are gone after the first suspension. */
+
+#include "base_server.h"
+#include "jsoncommandserver.h"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#define JSONCOMMANDSERVER_HAS_COROUTINES 1
+
+#include <QRunnable>
+#include <QThreadPool>
+
+#include <coroutine>
+#include <cstddef>
+#include <map>
+#include <new>
+
+namespace JsonCommandServer {
+
+/* Free lists of coroutine frames by size class. Handlers start and finish on
+ * the event loop thread, so the lists are per thread. */
+class FramePool {
+  public:
+    static void* allocate(std::size_t size) {
+        std::size_t c = sizeClass(size);
+        if (c >= N_CLASSES) return ::operator new(size);
+        Block*& head = freeList(c);
+        if (head) {
+            Block* block = head;
+            head = block->next;
+            return block;
+        }
+        return ::operator new((c + 1) * GRANULE);
+    }
+
+    static void release(void* p, std::size_t size) noexcept {
+        std::size_t c = sizeClass(size);
+        if (c >= N_CLASSES) {
+            ::operator delete(p);
+            return;
+        }
+        Block* block = static_cast<Block*>(p);
+        block->next = freeList(c);
+        freeList(c) = block;
+    }
+
+  private:
+    struct Block { Block* next; };
+
+    static const std::size_t GRANULE = 64;
+    static const std::size_t N_CLASSES = 16;
+
+    static std::size_t sizeClass(std::size_t size) { return (size + GRANULE - 1) / GRANULE - 1; }
+
+    static Block*& freeList(std::size_t c) {
+        thread_local Block* lists[N_CLASSES] = {};
+        return lists[c];
+    }
+};
+
+class CommandTask {
+  public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(Handle h) noexcept {
+            promise_type& p = h.promise();
+            if (!p.detached) return;  // still owned by a CommandTask
+            BaseServer* server = p.server;
+            QPointer<QTcpSocket> socket = p.socket;
+            h.destroy();
+            if (server && socket) server->releaseConnection(socket);
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        BaseServer* server = nullptr;
+        QPointer<QTcpSocket> socket;
+        bool detached = false;
+
+        CommandTask get_return_object() noexcept { return CommandTask(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            if (server) server->addErrorMessage(QLatin1String("Falha na execução do comando assíncrono."));
+        }
+
+        static void* operator new(std::size_t size) { return FramePool::allocate(size); }
+        static void operator delete(void* p, std::size_t size) noexcept { FramePool::release(p, size); }
+    };
+
+    CommandTask(CommandTask&& other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    CommandTask(const CommandTask&) = delete;
+    CommandTask& operator=(const CommandTask&) = delete;
+    ~CommandTask() { if (handle_) handle_.destroy(); }
+
+    /* Runs the handler up to its first suspension. From there on the frame owns
+     * itself and holds the connection until it finishes. */
+    void start(BaseServer* server, QTcpSocket* socket) {
+        Handle h = handle_;
+        h.promise().server = server;
+        h.promise().socket = socket;
+        h.resume();
+        if (h.done()) return;
+        handle_ = nullptr;
+        h.promise().detached = true;
+        if (socket) server->holdConnection(socket);
+    }
+
+  private:
+    explicit CommandTask(Handle h) : handle_(h) {}
+
+    Handle handle_;
+};
+
+typedef CommandTask (*CoroutineCmd)(BaseServer*, QJsonObject);
+
+namespace detail {
+
+inline std::map<int, CoroutineCmd>& coroutineCommands() {
+    static std::map<int, CoroutineCmd> commands;
+    return commands;
+}
+
+inline void runCoroutineCommand(BaseController* w, const QJsonObject& cmd) {
+    BaseServer* server = dynamic_cast<BaseServer*>(w);
+    std::map<int, CoroutineCmd>::iterator it = coroutineCommands().find(cmd["type"].toInt());
+    if (!server || it == coroutineCommands().end()) return;
+    it->second(server, cmd).start(server, server->currentConnection());
+}
+
+}  // namespace detail
+
+inline int addCoroutineCommand(CoroutineCmd cmd, int ID, int priority = PRIORITY_NORMAL) {
+    detail::coroutineCommands()[ID] = cmd;
+    return JsonCommandServer::addCommand(detail::runCoroutineCommand, ID, priority);
+}
+
+/* co_await sleepFor(server, ms) */
+class SleepAwaiter : public LoopWaiter {
+  public:
+    SleepAwaiter(BaseServer* server, int ms) : server_(server), ms_(ms) {}
+
+    bool await_ready() const noexcept { return ms_ <= 0; }
+    void await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        server_->addWaiter(this, ms_);
+    }
+    void await_resume() noexcept {}
+
+    virtual void wake(bool, const QJsonObject&) { handle_.resume(); }
+
+  private:
+    BaseServer* server_;
+    int ms_;
+    std::coroutine_handle<> handle_;
+};
+
+inline SleepAwaiter sleepFor(BaseServer* server, int ms) {
+    return SleepAwaiter(server, ms);
+}
+
+struct ReplyResult {
+    bool ok;  // false on timeout
+    QJsonObject reply;
+};
+
+/* co_await request(server, peer, cmd, timeout_ms): sends cmd to the peer and
+ * resumes with the COMMAND_REPLY it sends back. */
+class ReplyAwaiter : public LoopWaiter {
+  public:
+    ReplyAwaiter(BaseServer* server, const QString& to, const QJsonArray& cmd, int timeout_ms)
+        : server_(server), to_(to), cmd_(cmd), timeout_ms_(timeout_ms) {}
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        result_.ok = false;
+        return server_->sendRequest(this, to_, cmd_, timeout_ms_);
+    }
+    ReplyResult await_resume() { return result_; }
+
+    virtual void wake(bool ok, const QJsonObject& result) {
+        result_.ok = ok;
+        result_.reply = result;
+        handle_.resume();
+    }
+
+  private:
+    BaseServer* server_;
+    QString to_;
+    QJsonArray cmd_;
+    int timeout_ms_;
+    ReplyResult result_;
+    std::coroutine_handle<> handle_;
+};
+
+inline ReplyAwaiter request(BaseServer* server, const QString& to, const QJsonArray& cmd,
+                            int timeout_ms) {
+    return ReplyAwaiter(server, to, cmd, timeout_ms);
+}
+
+/* co_await runInPool(server, fn): runs fn on QThreadPool::globalInstance() and
+ * resumes the handler on the event loop once it returns. fn must not touch
+ * the server. */
+template <typename Fn>
+class PoolAwaiter : public LoopWaiter, public QRunnable {
+  public:
+    PoolAwaiter(BaseServer* server, Fn fn) : server_(server), fn_(fn) { setAutoDelete(false); }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        QThreadPool::globalInstance()->start(this);
+    }
+    void await_resume() noexcept {}
+
+    virtual void run() {
+        fn_();
+        server_->postWaiter(this);
+    }
+    virtual void wake(bool, const QJsonObject&) { handle_.resume(); }
+
+  private:
+    BaseServer* server_;
+    Fn fn_;
+    std::coroutine_handle<> handle_;
+};
+
+template <typename Fn>
+PoolAwaiter<Fn> runInPool(BaseServer* server, Fn fn) {
+    return PoolAwaiter<Fn>(server, fn);
+}
+
+}  // namespace JsonCommandServer
+
+#endif // __cpp_impl_coroutine
+
+#endif // JSONCOMMANDSERVER_COMMAND_TASK_H
@@ -0,0 +1,364 @@
+/*
+Json Command Server
+
+DATAGRAM CHANNEL
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "datagram_channel.h"
+
+#include <QCryptographicHash>
+#include <QMessageAuthenticationCode>
+#include <QTimer>
+#include <QtEndian>
+
+#include <random>
+#include <string.h>
+
+#ifdef Q_OS_LINUX
+#include <QSocketNotifier>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#else
+#include <QUdpSocket>
+#endif
+
+// receive slots are larger than MAX_DATAGRAM_SIZE so an oversized one shows up as such
+static const int RECEIVE_SLOT_SIZE = 2048;
+
+static QByteArray datagramMac(const QByteArray& datagram, const QByteArray& key) {
+    using JsonCommandServer::DATAGRAM_HEADER_SIZE;
+    using JsonCommandServer::DATAGRAM_MAC_SIZE;
+    QByteArray data = datagram.left(DATAGRAM_HEADER_SIZE - DATAGRAM_MAC_SIZE);
+    data.append(datagram.mid(DATAGRAM_HEADER_SIZE));
+    return QMessageAuthenticationCode::hash(data, key, QCryptographicHash::Sha256)
+            .left(DATAGRAM_MAC_SIZE);
+}
+
+QByteArray JsonCommandServer::encodeDatagram(quint32 token, quint32 sequence,
+        const QByteArray &key, const QByteArray &payload) {
+    QByteArray out(DATAGRAM_HEADER_SIZE, '\0');
+    uchar* p = reinterpret_cast<uchar*>(out.data());
+    p[0] = DATAGRAM_MAGIC;
+    p[1] = DATAGRAM_VERSION;
+    qToBigEndian<quint32>(token, p + 4);
+    qToBigEndian<quint32>(sequence, p + 8);
+    out.append(payload);
+    QByteArray mac = datagramMac(out, key);
+    memcpy(out.data() + DATAGRAM_HEADER_SIZE - DATAGRAM_MAC_SIZE, mac.constData(),
+           DATAGRAM_MAC_SIZE);
+    return out;
+}
+
+bool JsonCommandServer::decodeDatagramHeader(const QByteArray &datagram, DatagramHeader &header) {
+    if (datagram.size() < DATAGRAM_HEADER_SIZE) return false;
+    const uchar* p = reinterpret_cast<const uchar*>(datagram.constData());
+    if (p[0] != DATAGRAM_MAGIC || p[1] != DATAGRAM_VERSION) return false;
+    header.token = qFromBigEndian<quint32>(p + 4);
+    header.sequence = qFromBigEndian<quint32>(p + 8);
+    return true;
+}
+
+bool JsonCommandServer::checkDatagramMac(const QByteArray &datagram, const QByteArray &key) {
+    if (datagram.size() < DATAGRAM_HEADER_SIZE || key.isEmpty()) return false;
+    QByteArray expected = datagramMac(datagram, key);
+    const char* given = datagram.constData() + DATAGRAM_HEADER_SIZE - DATAGRAM_MAC_SIZE;
+    char diff = 0;
+    for (int i = 0; i < DATAGRAM_MAC_SIZE; ++i) {
+        diff |= given[i] ^ expected[i];
+    }
+    return diff == 0;
+}
+
+QByteArray JsonCommandServer::newDatagramKey() {
+    std::random_device random;
+    QByteArray key;
+    for (int i = 0; i < DATAGRAM_KEY_SIZE; i += 4) {
+        quint32 word = random();
+        key.append(reinterpret_cast<const char*>(&word), 4);
+    }
+    return key;
+}
+
+#ifdef Q_OS_LINUX
+/* A v4 destination on a dual-stack socket goes as a v4-mapped v6 address. */
+static bool fillAddress(const QHostAddress& address, quint16 port, bool ipv6,
+                        sockaddr_storage& storage, socklen_t& size) {
+    memset(&storage, 0, sizeof(storage));
+    bool is_v4 = false;
+    quint32 v4 = address.toIPv4Address(&is_v4);
+    if (!ipv6) {
+        if (!is_v4) return false;
+        sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&storage);
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        addr->sin_addr.s_addr = htonl(v4);
+        size = sizeof(sockaddr_in);
+        return true;
+    }
+    sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(&storage);
+    addr->sin6_family = AF_INET6;
+    addr->sin6_port = htons(port);
+    if (is_v4) {
+        addr->sin6_addr.s6_addr[10] = 0xff;
+        addr->sin6_addr.s6_addr[11] = 0xff;
+        qToBigEndian<quint32>(v4, addr->sin6_addr.s6_addr + 12);
+    } else {
+        Q_IPV6ADDR ip6 = address.toIPv6Address();
+        memcpy(&addr->sin6_addr, &ip6, sizeof(addr->sin6_addr));
+    }
+    size = sizeof(sockaddr_in6);
+    return true;
+}
+
+static quint16 addressPort(const sockaddr_storage& storage) {
+    if (storage.ss_family == AF_INET) {
+        return ntohs(reinterpret_cast<const sockaddr_in*>(&storage)->sin_port);
+    }
+    return ntohs(reinterpret_cast<const sockaddr_in6*>(&storage)->sin6_port);
+}
+#endif
+
+JsonCommandServer::DatagramChannel::DatagramChannel(QObject *_parent)
+    : QObject(_parent),
+#ifdef Q_OS_LINUX
+      fd_(-1),
+      ipv6_(false),
+      notifier_(0),
+#else
+      socket_(0),
+#endif
+      port_(0),
+      flush_scheduled_(false),
+      syscalls_(0),
+      dropped_(0) {
+}
+
+JsonCommandServer::DatagramChannel::~DatagramChannel() {
+    close();
+}
+
+bool JsonCommandServer::DatagramChannel::bind(const QHostAddress &address, quint16 port,
+        QString *error) {
+    close();
+#ifdef Q_OS_LINUX
+    ipv6_ = address.protocol() != QAbstractSocket::IPv4Protocol;
+    fd_ = ::socket(ipv6_ ? AF_INET6 : AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    sockaddr_storage storage;
+    socklen_t size = 0;
+    if (ipv6_) {
+        // QHostAddress::Any: one dual-stack socket, as for the TCP listener
+        int v6only = address == QHostAddress(QHostAddress::Any) ? 0 : 1;
+        ::setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+    bool any = address == QHostAddress(QHostAddress::Any) ||
+               address == QHostAddress(QHostAddress::AnyIPv6);
+    fillAddress(any ? QHostAddress(QHostAddress::AnyIPv6) : address, port, ipv6_, storage, size);
+    if (::bind(fd_, reinterpret_cast<sockaddr*>(&storage), size) < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        close();
+        return false;
+    }
+    size = sizeof(storage);
+    ::getsockname(fd_, reinterpret_cast<sockaddr*>(&storage), &size);
+    port_ = addressPort(storage);
+    buffer_.resize(N_MAX_BATCH * RECEIVE_SLOT_SIZE);
+    notifier_ = new QSocketNotifier(fd_, QSocketNotifier::Read, this);
+    connect(notifier_, SIGNAL(activated(int)), this, SIGNAL(readyRead()));
+#else
+    socket_ = new QUdpSocket(this);
+    if (!socket_->bind(address, port)) {
+        if (error) *error = socket_->errorString();
+        close();
+        return false;
+    }
+    port_ = socket_->localPort();
+    connect(socket_, SIGNAL(readyRead()), this, SIGNAL(readyRead()));
+#endif
+    return true;
+}
+
+void JsonCommandServer::DatagramChannel::close() {
+    pending_.clear();
+#ifdef Q_OS_LINUX
+    delete notifier_;
+    notifier_ = 0;
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+#else
+    delete socket_;
+    socket_ = 0;
+#endif
+    port_ = 0;
+}
+
+bool JsonCommandServer::DatagramChannel::isOpen() const {
+#ifdef Q_OS_LINUX
+    return fd_ >= 0;
+#else
+    return socket_ != 0;
+#endif
+}
+
+int JsonCommandServer::DatagramChannel::receive(QList<Datagram> &out) {
+    if (!isOpen()) return 0;
+    int n = 0;
+#ifdef Q_OS_LINUX
+    mmsghdr msgs[N_MAX_BATCH];
+    iovec iovs[N_MAX_BATCH];
+    sockaddr_storage addresses[N_MAX_BATCH];
+    // a batch of only oversized datagrams is not the end of the queue
+    while (n == 0) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < N_MAX_BATCH; ++i) {
+            iovs[i].iov_base = &buffer_[i * RECEIVE_SLOT_SIZE];
+            iovs[i].iov_len = RECEIVE_SLOT_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addresses[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        }
+        ++syscalls_;
+        int received = ::recvmmsg(fd_, msgs, N_MAX_BATCH, MSG_DONTWAIT, 0);
+        if (received <= 0) return 0;
+        for (int i = 0; i < received; ++i) {
+            unsigned len = msgs[i].msg_len;
+            if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || len > unsigned(MAX_DATAGRAM_SIZE)) {
+                ++dropped_;
+                continue;
+            }
+            Datagram datagram;
+            datagram.address = QHostAddress(reinterpret_cast<sockaddr*>(&addresses[i]));
+            datagram.port = addressPort(addresses[i]);
+            datagram.data = QByteArray(&buffer_[i * RECEIVE_SLOT_SIZE], int(len));
+            out.append(datagram);
+            ++n;
+        }
+    }
+#else
+    while (n < N_MAX_BATCH && socket_->hasPendingDatagrams()) {
+        qint64 size = socket_->pendingDatagramSize();
+        Datagram datagram;
+        datagram.data.resize(int(qMax<qint64>(size, 0)));
+        ++syscalls_;
+        qint64 read = socket_->readDatagram(datagram.data.data(), datagram.data.size(),
+                                            &datagram.address, &datagram.port);
+        if (read < 0 || read > MAX_DATAGRAM_SIZE) {
+            ++dropped_;
+            continue;
+        }
+        out.append(datagram);
+        ++n;
+    }
+#endif
+    return n;
+}
+
+/* Queued and sent at the end of the event loop turn with the others. */
+void JsonCommandServer::DatagramChannel::send(const QHostAddress &address, quint16 port,
+        const QByteArray &data) {
+    if (!isOpen()) return;
+    if (data.size() > MAX_DATAGRAM_SIZE) {
+        ++dropped_;
+        return;
+    }
+    Datagram datagram;
+    datagram.address = address;
+    datagram.port = port;
+    datagram.data = data;
+    pending_.append(datagram);
+    if (pending_.size() >= N_MAX_BATCH) {
+        flush();
+    } else if (!flush_scheduled_) {
+        flush_scheduled_ = true;
+        QTimer::singleShot(0, this, SLOT(flush()));
+    }
+}
+
+void JsonCommandServer::DatagramChannel::flush() {
+    flush_scheduled_ = false;
+    QList<Datagram> pending;
+    pending.swap(pending_);
+    if (!isOpen()) return;
+#ifdef Q_OS_LINUX
+    int first = 0;
+    while (first < pending.size()) {
+        mmsghdr msgs[N_MAX_BATCH];
+        iovec iovs[N_MAX_BATCH];
+        sockaddr_storage addresses[N_MAX_BATCH];
+        memset(msgs, 0, sizeof(msgs));
+        int n = 0;
+        for (; n < N_MAX_BATCH && first + n < pending.size(); ++n) {
+            Datagram& datagram = pending[first + n];
+            socklen_t size = 0;
+            if (!fillAddress(datagram.address, datagram.port, ipv6_, addresses[n], size)) break;
+            iovs[n].iov_base = datagram.data.data();
+            iovs[n].iov_len = datagram.data.size();
+            msgs[n].msg_hdr.msg_iov = &iovs[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            msgs[n].msg_hdr.msg_name = &addresses[n];
+            msgs[n].msg_hdr.msg_namelen = size;
+        }
+        if (n == 0) {
+            // no route from this socket's family
+            ++dropped_;
+            ++first;
+            continue;
+        }
+        ++syscalls_;
+        int sent = ::sendmmsg(fd_, msgs, n, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the socket buffer is full: the rest is lost, as any datagram may be
+                dropped_ += pending.size() - first;
+                return;
+            }
+            // the kernel refused the first one; a short batch reports it on the next call
+            ++dropped_;
+            ++first;
+            continue;
+        }
+        first += sent;
+    }
+#else
+    for (int i = 0; i < pending.size(); ++i) {
+        ++syscalls_;
+        if (socket_->writeDatagram(pending[i].data, pending[i].address, pending[i].port) < 0) {
+            ++dropped_;
+        }
+    }
+#endif
+}
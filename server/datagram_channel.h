@@ -0,0 +1,138 @@
+/*
+Json Command Server
+
+DATAGRAM CHANNEL
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_DATAGRAM_CHANNEL_H
+#define JSONCOMMANDSERVER_DATAGRAM_CHANNEL_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QHostAddress>
+#include <QList>
+#include <QObject>
+#include <QString>
+
+#include <vector>
+
+class QSocketNotifier;
+class QUdpSocket;
+
+namespace JsonCommandServer {
+
+/* Every datagram starts with a header, integers big endian:
+ *     magic | version | reserved (2) | token (4) | sequence (4) | mac (16)
+ * followed by a JSON array of commands, as in a TCP frame. The token and the
+ * key are the ones the server handed the peer in its identify reply over TCP;
+ * sequence counts the sender's datagrams to that receiver from 1, so the
+ * receiver can tell lost and late datagrams apart. mac is HMAC-SHA256 under
+ * the key of everything else in the datagram, truncated. */
+static const quint8 DATAGRAM_MAGIC = 0xD6;
+static const quint8 DATAGRAM_VERSION = 2;
+static const int DATAGRAM_MAC_SIZE = 16;
+static const int DATAGRAM_HEADER_SIZE = 12 + DATAGRAM_MAC_SIZE;
+static const int DATAGRAM_KEY_SIZE = 32;
+// an Ethernet MTU less the IP and UDP headers: nothing gets fragmented
+static const int MAX_DATAGRAM_SIZE = 1472;
+
+struct JSONCOMMANDSERVERSHARED_EXPORT DatagramHeader {
+    quint32 token;
+    quint32 sequence;
+};
+
+QByteArray JSONCOMMANDSERVERSHARED_EXPORT encodeDatagram(quint32 token, quint32 sequence,
+        const QByteArray& key, const QByteArray& payload);
+/* False when the datagram is too short or not ours. */
+bool JSONCOMMANDSERVERSHARED_EXPORT decodeDatagramHeader(const QByteArray& datagram,
+        DatagramHeader& header);
+/* Compares in constant time. */
+bool JSONCOMMANDSERVERSHARED_EXPORT checkDatagramMac(const QByteArray& datagram,
+        const QByteArray& key);
+QByteArray JSONCOMMANDSERVERSHARED_EXPORT newDatagramKey();
+
+struct JSONCOMMANDSERVERSHARED_EXPORT Datagram {
+    QHostAddress address;
+    quint16 port;
+    QByteArray data;
+};
+
+/* A bound UDP socket moving datagrams in batches: on Linux one recvmmsg()
+ * reads up to N_MAX_BATCH of them and the ones queued with send() during an
+ * event loop turn leave with one sendmmsg(); elsewhere QUdpSocket does the
+ * same one datagram at a time. Datagrams longer than MAX_DATAGRAM_SIZE and
+ * sends the kernel has no room for are dropped and counted, never retried. */
+class JSONCOMMANDSERVERSHARED_EXPORT DatagramChannel : public QObject {
+    Q_OBJECT
+
+  public:
+    static const int N_MAX_BATCH = 64;
+
+    DatagramChannel(QObject* parent = 0);
+    virtual ~DatagramChannel();
+
+    bool bind(const QHostAddress& address, quint16 port, QString* error);
+    void close();
+    bool isOpen() const;
+    quint16 localPort() const { return port_; }
+
+    /* Appends up to N_MAX_BATCH pending datagrams to out; 0 when none is left. */
+    int receive(QList<Datagram>& out);
+    void send(const QHostAddress& address, quint16 port, const QByteArray& data);
+
+    quint64 syscalls() const { return syscalls_; }
+    quint64 dropped() const { return dropped_; }
+
+  signals:
+    void readyRead();
+
+  public slots:
+    void flush();
+
+  private:
+#ifdef Q_OS_LINUX
+    int fd_;
+    bool ipv6_;
+    QSocketNotifier* notifier_;
+    std::vector<char> buffer_;
+#else
+    QUdpSocket* socket_;
+#endif
+    quint16 port_;
+    QList<Datagram> pending_;
+    bool flush_scheduled_;
+    quint64 syscalls_;
+    quint64 dropped_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_DATAGRAM_CHANNEL_H
@@ -0,0 +1,115 @@
+/*
+Json Command Server
+
+ENVELOPE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "envelope.h"
+
+#include "commands_controller.h"
+
+#include <QDate>
+#include <QTime>
+
+QJsonObject JsonCommandServer::Envelope::header(const EnvelopeSender& sender, int key,
+        int type_message) {
+    QJsonObject cmd;
+    cmd.insert("id", key);
+    cmd.insert("ip", sender.ip);
+    cmd.insert("port", sender.port);
+    cmd.insert("type", type_message);
+    cmd.insert("time", QTime::currentTime().toString());
+    cmd.insert("date", QDate::currentDate().toString());
+    return cmd;
+}
+
+/* "close" asks the other end to drop the connection. */
+QJsonArray JsonCommandServer::Envelope::message(const EnvelopeSender& sender, int key,
+        const QString& from, const QString& message, int type_message) {
+    QJsonArray out;
+    QJsonObject cmd;
+    if (message == "close") {
+        cmd.insert("type", CLOSE);
+    } else {
+        cmd = header(sender, key, type_message);
+        cmd.insert("id_client", sender.id);
+        cmd.insert("group_client", sender.group);
+        cmd.insert("name_client", from);
+        cmd.insert("type_client", sender.type);
+        cmd.insert("message", message);
+    }
+    out.append(cmd);
+    return out;
+}
+
+QJsonArray JsonCommandServer::Envelope::peerList(const EnvelopeSender& sender, int key,
+        const QJsonArray& peers) {
+    QJsonArray out;
+    QJsonObject cmd = header(sender, key, MESSAGE_PEER_LIST);
+    cmd.insert("peers", peers);
+    out.append(cmd);
+    return out;
+}
+
+QJsonArray JsonCommandServer::Envelope::identify(const EnvelopeSender& sender, int key) {
+    QJsonArray out;
+    QJsonObject cmd = header(sender, key, MESSAGE_IDENTIFY);
+    cmd.insert("id_client", sender.id);
+    cmd.insert("group_client", sender.group);
+    cmd.insert("name_client", sender.name);
+    cmd.insert("type_client", sender.type);
+    cmd.insert("description_client", sender.description);
+    out.append(cmd);
+    return out;
+}
+
+QJsonArray JsonCommandServer::Envelope::messageTo(const EnvelopeSender& sender, int key,
+        const QString& from, const QString& to, const QString& message) {
+    QJsonArray out = identify(sender, key);
+    QJsonObject cmd = out[0].toObject();
+    cmd.insert("type", MESSAGE_TO);
+    cmd.insert("from", from);
+    cmd.insert("to", to);
+    cmd.insert("message", message);
+    out[0] = cmd;
+    return out;
+}
+
+QJsonArray JsonCommandServer::Envelope::commandTo(const EnvelopeSender& sender, int key,
+        const QString& from, const QString& to, const QJsonArray& cmd) {
+    QJsonArray out = identify(sender, key);
+    QJsonObject command = out[0].toObject();
+    command.insert("type", CMD_TO);
+    command.insert("from", from);
+    command.insert("to", to);
+    command.insert("cmd", cmd);
+    out[0] = command;
+    return out;
+}
@@ -0,0 +1,74 @@
+/*
+Json Command Server
+
+ENVELOPE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_ENVELOPE_H
+#define JSONCOMMANDSERVER_ENVELOPE_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+
+namespace JsonCommandServer {
+
+/* What a server stamps on the messages it builds. */
+struct JSONCOMMANDSERVERSHARED_EXPORT EnvelopeSender {
+    QString ip;
+    int port;
+    int id;
+    int group;
+    QString name;
+    QString type;
+    QString description;
+};
+
+/* The envelopes both BaseServer and EpollServer send. key is the message id,
+ * from the server's newKey(). */
+namespace Envelope {
+JSONCOMMANDSERVERSHARED_EXPORT QJsonObject header(const EnvelopeSender& sender, int key,
+        int type_message);
+JSONCOMMANDSERVERSHARED_EXPORT QJsonArray message(const EnvelopeSender& sender, int key,
+        const QString& from, const QString& message, int type_message);
+JSONCOMMANDSERVERSHARED_EXPORT QJsonArray peerList(const EnvelopeSender& sender, int key,
+        const QJsonArray& peers);
+JSONCOMMANDSERVERSHARED_EXPORT QJsonArray identify(const EnvelopeSender& sender, int key);
+JSONCOMMANDSERVERSHARED_EXPORT QJsonArray messageTo(const EnvelopeSender& sender, int key,
+        const QString& from, const QString& to, const QString& message);
+JSONCOMMANDSERVERSHARED_EXPORT QJsonArray commandTo(const EnvelopeSender& sender, int key,
+        const QString& from, const QString& to, const QJsonArray& cmd);
+}
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_ENVELOPE_H
@@ -0,0 +1,1056 @@
+/*
+Json Command Server
+
+EPOLL SERVER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "epoll_server.h"
+#include "listen_socket.h"
+
+#include <QHostAddress>
+#include <QJsonDocument>
+#include <QNetworkInterface>
+#include <QtEndian>
+
+#include <algorithm>
+#include <deque>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const qint32 DEFAULT_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+static const qint64 DEFAULT_MAX_PENDING_OUTPUT = 64 * 1024 * 1024;
+static const int LISTEN_BACKLOG = 1024;
+static const int N_MAX_EVENTS = 256;
+static const int READ_CHUNK_SIZE = 64 * 1024;
+static const int N_MAX_READS_PER_EVENT = 16;
+
+static const unsigned RING_ENTRIES = 1024;
+static const unsigned N_RECV_BUFFERS = 512;
+static const unsigned RECV_BUFFER_SIZE = 16 * 1024;
+static const unsigned N_SEND_SLOTS = 64;
+static const unsigned SEND_SLOT_SIZE = 64 * 1024;
+static const int N_MAX_COMPLETIONS = 256;
+
+// ring user_data: Connection* | tag, plus slot + 1 in the top bits of sends
+static const quint64 TAG_RECV = 1;
+static const quint64 TAG_SEND = 2;
+static const quint64 TAG_ACCEPT = 3;
+static const quint64 TAG_MASK = 7;
+static const int SLOT_SHIFT = 48;
+
+static quint64 userData(const void* c, quint64 tag, int slot = -1) {
+    return quint64(reinterpret_cast<quintptr>(c)) | tag | (quint64(slot + 1) << SLOT_SHIFT);
+}
+
+/* Outbound bytes of a connection on the io_uring path: either its own frames
+ * or a registered slot shared with the other receivers of a broadcast. */
+struct JsonCommandServer::EpollServer::Segment {
+    Segment() : slot(-1), offset(0), size(0) {}
+
+    int slot;
+    QByteArray data;
+    int offset;
+    int size;
+};
+
+struct JsonCommandServer::EpollServer::Connection {
+    Connection(int _fd, const QString& _ip, int _port)
+        : fd(_fd), ip(_ip), port(_port), in_pos(0), out_pos(0), dirty(false), ready(false),
+          overflowed(false), pending_ops(0), sending(false), zero_copy(true), queued(0),
+          stalled(false), rearm(false), peer(NO_ATOM) {}
+
+    int fd;  // -1 once closed
+    QString ip;
+    int port;
+    QByteArray in;
+    int in_pos;
+    QByteArray out;
+    int out_pos;
+    bool dirty;
+    bool ready;
+    bool overflowed;  // in overflowed_, to be closed
+
+    int pending_ops;  // ring requests the kernel still owns, the struct outlives them
+    bool sending;
+    bool zero_copy;
+    qint64 queued;  // bytes in segments, not yet sent
+    bool stalled;  // in stalled_, holding a pending op
+    bool rearm;    // the receive is to be queued again
+    std::deque<Segment> segments;
+    Atom peer;  // "name@ip:port", or "@ip:port" until the peer identifies
+};
+
+JsonCommandServer::EpollServer::EpollServer(QObject *_parent)
+    : QObject(_parent),
+      BaseController(),
+      port_server_(0),
+      n_max_clients_(100),
+      max_frame_size_(DEFAULT_MAX_FRAME_SIZE),
+      max_pending_output_(DEFAULT_MAX_PENDING_OUTPUT),
+      next_key_(0),
+      epoll_fd_(-1),
+      listen_fd_(-1),
+      reserve_fd_(-1),
+      notifier_(0),
+      in_loop_(false),
+      peer_list_dirty_(false),
+      accept_stalled_(false),
+      current_(0),
+      io_engine_(IO_EPOLL),
+      ring_(0),
+      syscalls_(0),
+      frames_received_(0),
+      frames_sent_(0) {
+}
+
+JsonCommandServer::EpollServer::~EpollServer() {
+    closeServer();
+}
+
+void JsonCommandServer::EpollServer::initServer() {
+    syscalls_ = frames_received_ = frames_sent_ = 0;
+    QString error;
+    listen_fd_ = openListenSocket(QHostAddress(QHostAddress::Any), port_server_, false,
+                                  LISTEN_BACKLOG, &error);
+    if (listen_fd_ < 0) {
+        this->addErrorMessage(tr("Não foi possível iniciar o servidor: %1.").arg(error));
+        return;
+    }
+    reserve_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (io_engine_ == IO_URING && initRing()) {
+        accept_stalled_ = !ring_->acceptMultishot(listen_fd_, TAG_ACCEPT);
+        ring_->submit();
+        notifier_ = new QSocketNotifier(ring_->fd(), QSocketNotifier::Read, this);
+    } else {
+        epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = 0;  // the listener; connections carry their Connection*
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+        notifier_ = new QSocketNotifier(epoll_fd_, QSocketNotifier::Read, this);
+    }
+    connect(notifier_, SIGNAL(activated(int)), this, SLOT(processEvents()));
+
+    ip_address_ = QString();
+    QList<QHostAddress> ipAddressesList = QNetworkInterface::allAddresses();
+    // use the first non-localhost IPv4 address
+    for (int i = 0; i < ipAddressesList.size(); ++i) {
+        if (ipAddressesList.at(i) != QHostAddress::LocalHost &&
+                ipAddressesList.at(i).toIPv4Address()) {
+            ip_address_ = ipAddressesList.at(i).toString();
+            break;
+        }
+    }
+    if (ip_address_.isEmpty())
+        ip_address_ = QHostAddress(QHostAddress::LocalHost).toString();
+    this->addStatusMessage(tr("O servidor está rodando!\n\nIP: %1\nPorta: %2\n\n"
+                              "O sistema já está apto para receber dados dos clientes.")
+                           .arg(ip_address_)
+                           .arg(QString::number(port_server_)));
+}
+
+void JsonCommandServer::EpollServer::updateServer() {
+    closeServer();
+    initServer();
+}
+
+void JsonCommandServer::EpollServer::closeServer() {
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        if (connections_[i]) closeConnection(connections_[i]);
+    }
+    for (size_t i = 0; i < closed_.size(); ++i) {
+        delete closed_[i];
+    }
+    closed_.clear();
+    connections_.clear();
+    dirty_.clear();
+    stalled_.clear();
+    overflowed_.clear();
+    accept_stalled_ = false;
+    ready_.clear();
+    addresses_.clear();
+    peers_.clear();
+    peer_index_.clear();
+    atoms_.clear();
+    ips_info_.clear();
+    peer_list_dirty_ = false;
+    delete notifier_;
+    notifier_ = 0;
+    if (ring_) {
+        // closing the ring cancels what is still in flight
+        syscalls_ += ring_->syscalls();
+        delete ring_;
+        ring_ = 0;
+    }
+    for (size_t i = 0; i < lingering_.size(); ++i) {
+        delete lingering_[i];
+    }
+    lingering_.clear();
+    if (listen_fd_ >= 0) ::close(listen_fd_);
+    if (epoll_fd_ >= 0) ::close(epoll_fd_);
+    if (reserve_fd_ >= 0) ::close(reserve_fd_);
+    listen_fd_ = epoll_fd_ = reserve_fd_ = -1;
+    next_key_ = 0;
+    this->clearMessages();
+}
+
+QString JsonCommandServer::EpollServer::myIP() {
+    return ip_address_;
+}
+
+int JsonCommandServer::EpollServer::myPort() {
+    return port_server_;
+}
+
+void JsonCommandServer::EpollServer::setPortServer(int _port_server) {
+    this->port_server_ = _port_server;
+}
+
+void JsonCommandServer::EpollServer::setNMaxClients(int _n_max_clients) {
+    this->n_max_clients_ = _n_max_clients;
+}
+
+void JsonCommandServer::EpollServer::setMaxFrameSize(qint32 _max_frame_size) {
+    this->max_frame_size_ = _max_frame_size;
+}
+
+void JsonCommandServer::EpollServer::setMaxPendingOutput(qint64 _max_pending_output) {
+    this->max_pending_output_ = _max_pending_output;
+}
+
+/* Takes effect on the next initServer(). */
+void JsonCommandServer::EpollServer::setIoEngine(int _io_engine) {
+    this->io_engine_ = _io_engine;
+}
+
+/* The engine actually running, IO_EPOLL after a fallback. */
+int JsonCommandServer::EpollServer::ioEngine() const {
+    return ring_ ? IO_URING : IO_EPOLL;
+}
+
+/* Syscalls made by the transport itself; the event loop adds one poll per
+ * turn on either engine. */
+QJsonObject JsonCommandServer::EpollServer::ioStats() const {
+    quint64 syscalls = syscalls_ + (ring_ ? ring_->syscalls() : 0);
+    quint64 frames = frames_received_ + frames_sent_;
+    QJsonObject stats;
+    stats.insert("engine", QString(ring_ ? "io_uring" : "epoll"));
+    stats.insert("syscalls", double(syscalls));
+    stats.insert("frames_received", double(frames_received_));
+    stats.insert("frames_sent", double(frames_sent_));
+    stats.insert("syscalls_per_1k_frames", frames > 0 ? 1000.0 * syscalls / frames : 0.0);
+    return stats;
+}
+
+/* Drains the epoll set. Closed connections are only freed at the end of the
+ * batch, since later events of the same batch may still point at them. */
+void JsonCommandServer::EpollServer::processEvents() {
+    if (ring_) {
+        processCompletions();
+        return;
+    }
+    if (epoll_fd_ < 0) return;
+    in_loop_ = true;
+    std::vector<Connection*> ready;
+    ready.swap(ready_);
+    for (size_t i = 0; i < ready.size(); ++i) {
+        ready[i]->ready = false;
+        if (ready[i]->fd >= 0) readConnection(ready[i]);
+    }
+    epoll_event events[N_MAX_EVENTS];
+    int n;
+    do {
+        n = ::epoll_wait(epoll_fd_, events, N_MAX_EVENTS, 0);
+        ++syscalls_;
+        for (int i = 0; i < n; ++i) {
+            Connection* c = static_cast<Connection*>(events[i].data.ptr);
+            if (!c) {
+                acceptConnections();
+                continue;
+            }
+            if (c->fd < 0) continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(c);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && !readConnection(c)) continue;
+            if (events[i].events & EPOLLOUT) flushConnection(c);
+        }
+    } while (n == N_MAX_EVENTS);
+    // replies of the whole batch leave together
+    for (size_t i = 0; i < dirty_.size(); ++i) {
+        dirty_[i]->dirty = false;
+        if (dirty_[i]->fd >= 0) flushConnection(dirty_[i]);
+    }
+    dirty_.clear();
+    in_loop_ = false;
+    for (size_t i = 0; i < closed_.size(); ++i) {
+        delete closed_[i];
+    }
+    closed_.clear();
+    if (peer_list_dirty_) {
+        broadcastPeerList();
+    }
+    if (!ready_.empty()) {
+        // edge-triggered: nobody else will tell us these still have data
+        QMetaObject::invokeMethod(this, "processEvents", Qt::QueuedConnection);
+    }
+}
+
+void JsonCommandServer::EpollServer::acceptConnections() {
+    for (;;) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int fd = ::accept4(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        ++syscalls_;
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // edge-triggered: the backlog has to drain or no new edge comes
+            if ((errno == EMFILE || errno == ENFILE) && dropPendingConnection()) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                this->addErrorMessage(tr("Falha ao aceitar conexão: %1.")
+                                      .arg(QString::fromLocal8Bit(strerror(errno))));
+            }
+            return;
+        }
+        Connection* c = openConnection(fd, addr);
+        if (!c) continue;
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+        ++syscalls_;
+    }
+}
+
+/* Registers an accepted socket, or turns it away when the server is full. */
+JsonCommandServer::EpollServer::Connection* JsonCommandServer::EpollServer::openConnection(
+        int fd, const sockaddr_storage& addr) {
+    QHostAddress address(reinterpret_cast<const sockaddr*>(&addr));
+    bool v4 = false;
+    quint32 ip4 = address.toIPv4Address(&v4);
+    if (v4) address = QHostAddress(ip4);  // v4-mapped on the dual-stack listener
+    int port = addr.ss_family == AF_INET6
+               ? ntohs(reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_port)
+               : ntohs(reinterpret_cast<const sockaddr_in*>(&addr)->sin_port);
+    if (numSockets() >= n_max_clients_) {
+        QString error_message = "Atingindo numero máximo de clientes suportados!";
+        this->addErrorMessage(error_message);
+        bool ok = false;
+        QByteArray data = QJsonDocument(createError(error_message, ok)).toJson(QJsonDocument::Compact);
+        QByteArray frame(4, 0);
+        qToBigEndian<qint32>(data.size(), reinterpret_cast<uchar*>(frame.data()));
+        frame.append(data);
+        ::send(fd, frame.constData(), frame.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        ::close(fd);
+        syscalls_ += 2;
+        return 0;
+    }
+    Connection* c = new Connection(fd, address.toString(), port);
+    // writes are already coalesced per event batch
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ++syscalls_;
+    if (connections_.size() <= size_t(fd)) {
+        connections_.resize(fd + 1, 0);
+    }
+    connections_[fd] = c;
+    c->peer = atoms_.intern("@" + c->ip + ":" + QString::number(c->port));
+    addresses_[c->ip + ":" + QString::number(c->port)] = c;
+    peers_[c->peer] = c;
+    bool ok = false;
+    writeMessage(c, createStatus("conectado", ok));
+    peer_list_dirty_ = true;
+    return c;
+}
+
+/* Reads until the socket is drained, parsing as it goes. A connection still
+ * readable after its budget is revisited on the next turn. */
+bool JsonCommandServer::EpollServer::readConnection(Connection *c) {
+    for (int reads = 0; reads < N_MAX_READS_PER_EVENT; ++reads) {
+        int old_size = c->in.size();
+        c->in.resize(old_size + READ_CHUNK_SIZE);
+        ssize_t r = ::read(c->fd, c->in.data() + old_size, READ_CHUNK_SIZE);
+        ++syscalls_;
+        if (r < 0 && errno == EINTR) {
+            c->in.resize(old_size);
+            continue;
+        }
+        c->in.resize(old_size + qMax<ssize_t>(r, 0));
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            closeConnection(c);
+            return false;
+        }
+        if (r < 0) return true;
+        if (!processFrames(c)) return false;
+        if (r < READ_CHUNK_SIZE) return true;  // a later edge reports new data
+    }
+    if (!c->ready) {
+        c->ready = true;
+        ready_.push_back(c);
+    }
+    return true;
+}
+
+bool JsonCommandServer::EpollServer::processFrames(Connection *c) {
+    for (;;) {
+        int available = c->in.size() - c->in_pos;
+        if (available < 4) break;
+        qint32 size = qFromBigEndian<qint32>(
+                          reinterpret_cast<const uchar*>(c->in.constData() + c->in_pos));
+        if (size < 0 || size > max_frame_size_) {
+            QString error_message = tr("Tamanho de pacote inválido: %1 bytes (máximo %2).")
+                                    .arg(size).arg(max_frame_size_);
+            this->addErrorMessage(error_message);
+            bool ok = false;
+            writeMessage(c, createError(error_message, ok));
+            closeConnection(c);
+            return false;
+        }
+        if (available - 4 < size) break;
+        // parsed in place, the buffer is not touched until the frame is done
+        QByteArray frame = QByteArray::fromRawData(c->in.constData() + c->in_pos + 4, size);
+        c->in_pos += 4 + size;
+        ++frames_received_;
+        processFrame(c, frame);
+        if (c->fd < 0) return false;
+    }
+    if (c->in_pos == c->in.size()) {
+        c->in.resize(0);
+        c->in_pos = 0;
+    } else if (c->in_pos > 0) {
+        c->in.remove(0, c->in_pos);
+        c->in_pos = 0;
+    }
+    return true;
+}
+
+void JsonCommandServer::EpollServer::processFrame(Connection *c, const QByteArray &frame) {
+    QJsonDocument doc = QJsonDocument::fromJson(frame);
+    if (!doc.isArray()) {
+        if (frame.size() > 0) {
+            addErrorMessage("Falha na execução do comando: <" + QString::fromUtf8(frame) + ">");
+        }
+        return;
+    }
+    QJsonArray cmds = doc.array();
+    for (int i = 0; i < cmds.size(); ++i) {
+        QJsonObject cmd = cmds[i].toObject();
+        if (!cmd.contains("type")) continue;
+        int type = cmd["type"].toInt();
+        if (type == CLOSE) {
+            closeConnection(c);
+            return;
+        }
+        if (type < 0) continue;  // server to server commands are BaseServer's
+        cmd.insert("ip", c->ip);
+        cmd.insert("port", c->port);
+        current_ = c;
+        execute_command(type, this, cmd);
+        current_ = 0;
+        if (c->fd < 0) return;
+    }
+}
+
+void JsonCommandServer::EpollServer::writeMessage(Connection *c, const QJsonArray &cmd) {
+    writeFrame(c, QJsonDocument(cmd).toJson(QJsonDocument::Compact));
+}
+
+void JsonCommandServer::EpollServer::writeFrame(Connection *c, const QByteArray &data) {
+    if (c->fd < 0 || !reserveOutput(c, 4 + data.size())) return;
+    uchar header[4];
+    qToBigEndian<qint32>(data.size(), header);
+    ++frames_sent_;
+    if (ring_) {
+        // the segment being sent must stay untouched until its completion
+        if (c->segments.empty() || c->segments.back().slot >= 0 ||
+                (c->sending && c->segments.size() == 1)) {
+            c->segments.push_back(Segment());
+        }
+        Segment& segment = c->segments.back();
+        segment.data.append(reinterpret_cast<const char*>(header), 4);
+        segment.data.append(data);
+        segment.size = segment.data.size();
+        c->queued += 4 + data.size();
+    } else {
+        c->out.append(reinterpret_cast<const char*>(header), 4);
+        c->out.append(data);
+    }
+    if (!in_loop_) {
+        flushConnection(c);
+    } else if (!c->dirty) {
+        c->dirty = true;
+        dirty_.push_back(c);
+    }
+}
+
+/* Sends what the kernel takes; the rest waits for the next EPOLLOUT edge. On
+ * the ring the send is only queued, and goes out with the next submit. */
+bool JsonCommandServer::EpollServer::flushConnection(Connection *c) {
+    if (ring_) {
+        sendSegment(c);
+        if (!in_loop_) ring_->submit();
+        return true;
+    }
+    while (c->out_pos < c->out.size()) {
+        ssize_t w = ::send(c->fd, c->out.constData() + c->out_pos, c->out.size() - c->out_pos,
+                           MSG_NOSIGNAL);
+        ++syscalls_;
+        if (w > 0) {
+            c->out_pos += w;
+        } else if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            closeConnection(c);
+            return false;
+        }
+    }
+    c->out.resize(0);
+    c->out_pos = 0;
+    return true;
+}
+
+/* False, with the connection on its way out, when size more bytes would take
+ * its unsent output past max_pending_output_. It is closed from the event
+ * loop: the caller may be walking peers_. */
+bool JsonCommandServer::EpollServer::reserveOutput(Connection *c, qint64 size) {
+    qint64 pending = ring_ ? c->queued : c->out.size() - c->out_pos;
+    if (pending + size <= max_pending_output_) return true;
+    if (!c->overflowed) {
+        c->overflowed = true;
+        overflowed_.push_back(c);
+        if (overflowed_.size() == 1) {
+            QMetaObject::invokeMethod(this, "closeOverflowed", Qt::QueuedConnection);
+        }
+    }
+    return false;
+}
+
+void JsonCommandServer::EpollServer::closeOverflowed() {
+    std::vector<Connection*> overflowed;
+    overflowed.swap(overflowed_);
+    for (size_t i = 0; i < overflowed.size(); ++i) {
+        Connection* c = overflowed[i];
+        c->overflowed = false;
+        this->addErrorMessage(tr("%1:%2 não lê as respostas (mais de %3 bytes pendentes), "
+                                 "conexão fechada.")
+                              .arg(c->ip).arg(c->port).arg(max_pending_output_));
+        closeConnection(c);
+    }
+}
+
+/* Out of descriptors: the spare one makes room to accept the oldest pending
+ * connection and close it at once, so the backlog drains. */
+bool JsonCommandServer::EpollServer::dropPendingConnection() {
+    if (reserve_fd_ < 0) return false;
+    ::close(reserve_fd_);
+    int fd = ::accept4(listen_fd_, 0, 0, SOCK_CLOEXEC);
+    if (fd >= 0) ::close(fd);
+    reserve_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    syscalls_ += fd >= 0 ? 4 : 3;
+    if (fd >= 0) {
+        this->addErrorMessage(tr("Sem descritores livres, conexão recusada."));
+    }
+    return fd >= 0;
+}
+
+void JsonCommandServer::EpollServer::closeConnection(Connection *c) {
+    if (c->fd < 0) return;
+    int fd = c->fd;
+    if (c->overflowed) {
+        c->overflowed = false;
+        overflowed_.erase(std::remove(overflowed_.begin(), overflowed_.end(), c),
+                          overflowed_.end());
+    }
+    if (c->out_pos < c->out.size()) {
+        // last chance for the replies already queued, e.g. before a CLOSE
+        ::send(fd, c->out.constData() + c->out_pos, c->out.size() - c->out_pos,
+               MSG_NOSIGNAL | MSG_DONTWAIT);
+        ++syscalls_;
+    }
+    if (ring_) {
+        for (size_t i = 0; i < c->segments.size(); ++i) {
+            const Segment& segment = c->segments[i];
+            if (!c->sending) {
+                const char* data = segment.slot >= 0 ? ring_->slotData(segment.slot)
+                                                     : segment.data.constData();
+                ::send(fd, data + segment.offset, segment.size - segment.offset,
+                       MSG_NOSIGNAL | MSG_DONTWAIT);
+                ++syscalls_;
+            }
+            if (segment.slot >= 0) ring_->releaseSlot(segment.slot);
+        }
+        // a send in flight keeps its bytes, and its slot holds a reference of its own
+        c->segments.resize(c->sending ? 1 : 0);
+        if (c->sending) c->segments.front().slot = -1;
+        // ends the multishot receive and whatever send is in flight
+        ::shutdown(fd, SHUT_RDWR);
+        ++syscalls_;
+    }
+    ::close(fd);
+    ++syscalls_;
+    c->fd = -1;
+    if (size_t(fd) < connections_.size()) connections_[fd] = 0;
+    addresses_.erase(c->ip + ":" + QString::number(c->port));
+    peers_.erase(c->peer);
+    peer_index_.remove(c->peer);
+    atoms_.release(c->peer);
+    c->peer = NO_ATOM;
+    ips_info_[c->ip].erase(c->port);
+    if (ips_info_[c->ip].empty()) ips_info_.erase(c->ip);
+    if (c->ready) {
+        ready_.erase(std::remove(ready_.begin(), ready_.end(), c), ready_.end());
+    }
+    if (c->pending_ops > 0) {
+        lingering_.push_back(c);  // freed by finishOp()
+    } else if (in_loop_) {
+        closed_.push_back(c);
+    } else {
+        delete c;
+    }
+    peer_list_dirty_ = true;
+    this->updateInfos();
+    if (!in_loop_) {
+        broadcastPeerList();
+    }
+}
+
+void JsonCommandServer::EpollServer::broadcastPeerList() {
+    peer_list_dirty_ = false;
+    broadcastMessage(createPeerList());
+}
+
+void JsonCommandServer::EpollServer::sendMessageTo(const QString &from, const QString &to,
+        const QString &message) {
+    bool ok;
+    sendCommandTo(from, to, createMessage(from, message, ok));
+    addClientMessage(from + " --> " + to + "> " + message);
+}
+
+void JsonCommandServer::EpollServer::sendCommandTo(const QString &from, const QString &to,
+        const QJsonArray &cmd) {
+    if (to == "Todos") {
+        broadcastMessage(cmd);
+        return;
+    }
+    std::map<Atom, Connection*>::iterator it = peers_.find(atoms_.find(to));
+    if (it != peers_.end()) {
+        writeMessage(it->second, cmd);
+        return;
+    }
+    if (PeerIndex::isSelector(to)) {
+        std::set<Atom> selected;
+        QString error;
+        if (!peer_index_.select(to, selected, &error)) {
+            QString error_message = tr("Endereço inválido '%1': %2.").arg(to.left(64)).arg(error);
+            this->addErrorMessage(error_message);
+            if (current_) {
+                bool ok = false;
+                writeMessage(current_, createError(error_message, ok));
+            }
+            return;
+        }
+        QByteArray data = QJsonDocument(cmd).toJson(QJsonDocument::Compact);
+        for (std::set<Atom>::const_iterator peer = selected.begin(); peer != selected.end();
+                ++peer) {
+            it = peers_.find(*peer);
+            if (it != peers_.end()) writeFrame(it->second, data);
+        }
+    }
+}
+
+/* On the ring the frame is encoded once into a registered slot that every
+ * receiver sends from. */
+void JsonCommandServer::EpollServer::broadcastMessage(const QJsonArray &cmd) {
+    QByteArray data = QJsonDocument(cmd).toJson(QJsonDocument::Compact);
+    int slot = ring_ && !peers_.empty() ? ring_->acquireSlot(4 + data.size()) : -1;
+    if (slot >= 0) {
+        char* frame = ring_->slotData(slot);
+        qToBigEndian<qint32>(data.size(), reinterpret_cast<uchar*>(frame));
+        memcpy(frame + 4, data.constData(), data.size());
+        for (std::map<Atom, Connection*>::iterator it = peers_.begin(); it != peers_.end(); ++it) {
+            Connection* c = it->second;
+            Segment segment;
+            segment.slot = slot;
+            segment.size = 4 + data.size();
+            if (!reserveOutput(c, segment.size)) continue;
+            ring_->retainSlot(slot);
+            c->segments.push_back(segment);
+            c->queued += segment.size;
+            ++frames_sent_;
+            if (!c->dirty) {
+                c->dirty = true;
+                dirty_.push_back(c);
+            }
+        }
+        ring_->releaseSlot(slot);
+        if (!in_loop_) {
+            for (size_t i = 0; i < dirty_.size(); ++i) {
+                dirty_[i]->dirty = false;
+                sendSegment(dirty_[i]);
+            }
+            dirty_.clear();
+            ring_->submit();
+        }
+        return;
+    }
+    for (std::map<Atom, Connection*>::iterator it = peers_.begin(); it != peers_.end(); ++it) {
+        writeFrame(it->second, data);
+    }
+}
+
+QList<QString> JsonCommandServer::EpollServer::getPeers() {
+    QList<QString> list;
+    for (std::map<Atom, Connection*>::iterator it = peers_.begin(); it != peers_.end(); ++it) {
+        list.push_back(atoms_.string(it->first));
+    }
+    return list;
+}
+
+int JsonCommandServer::EpollServer::numSockets() {
+    return peers_.size();
+}
+
+void JsonCommandServer::EpollServer::addNewInfo(const RemoteNodeInfo &new_info) {
+    std::map<QString, Connection*>::iterator it =
+        addresses_.find(new_info.IP + ":" + QString::number(new_info.port));
+    if (it == addresses_.end()) return;
+    Connection* c = it->second;
+    ips_info_[new_info.IP][new_info.port] = new_info;
+    Atom peer = atoms_.intern(new_info.name + "@" + new_info.IP + ":" +
+                              QString::number(new_info.port));
+    peers_.erase(c->peer);
+    peer_index_.remove(c->peer);
+    atoms_.release(c->peer);
+    c->peer = peer;
+    peers_[c->peer] = c;
+    peer_index_.insert(c->peer, new_info.group, new_info.type);
+    this->updateInfos();
+    if (in_loop_) {
+        peer_list_dirty_ = true;
+    } else {
+        broadcastPeerList();
+    }
+}
+
+/* The kernel lacking anything UringEngine needs is not an error: the server
+ * runs on epoll instead. */
+bool JsonCommandServer::EpollServer::initRing() {
+    ring_ = new UringEngine();
+    if (ring_->init(RING_ENTRIES, N_RECV_BUFFERS, RECV_BUFFER_SIZE, N_SEND_SLOTS, SEND_SLOT_SIZE)) {
+        return true;
+    }
+    this->addStatusMessage(tr("io_uring indisponível (%1), usando epoll.")
+                           .arg(QString::fromLocal8Bit(strerror(ring_->error()))));
+    delete ring_;
+    ring_ = 0;
+    return false;
+}
+
+/* The io_uring counterpart of the epoll loop: handles every completion the
+ * kernel posted, then hands all requests queued meanwhile (receives to re-arm,
+ * replies, the coalesced peer list, buffers to recycle) over in one submit. */
+void JsonCommandServer::EpollServer::processCompletions() {
+    in_loop_ = true;
+    UringEngine::Completion done[N_MAX_COMPLETIONS];
+    int n;
+    do {
+        n = ring_->reap(done, N_MAX_COMPLETIONS);
+        for (int i = 0; i < n; ++i) {
+            quint64 tag = done[i].user_data & TAG_MASK;
+            int res = done[i].res;
+            if (tag == TAG_ACCEPT) {
+                if (!done[i].more() && !ring_->acceptMultishot(listen_fd_, TAG_ACCEPT)) {
+                    accept_stalled_ = true;
+                }
+                if (res == -EMFILE || res == -ENFILE) {
+                    dropPendingConnection();
+                    continue;
+                }
+                if (res < 0) {
+                    if (res != -ECONNABORTED && res != -EINTR) {
+                        this->addErrorMessage(tr("Falha ao aceitar conexão: %1.")
+                                              .arg(QString::fromLocal8Bit(strerror(-res))));
+                    }
+                    continue;
+                }
+                sockaddr_storage addr;
+                socklen_t len = sizeof(addr);
+                ++syscalls_;
+                if (::getpeername(res, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+                    ::close(res);
+                    ++syscalls_;
+                    continue;
+                }
+                Connection* c = openConnection(res, addr);
+                if (c) {
+                    ++c->pending_ops;
+                    if (!ring_->recvMultishot(c->fd, userData(c, TAG_RECV))) {
+                        c->rearm = true;
+                        stall(c);
+                    }
+                }
+                continue;
+            }
+            Connection* c = reinterpret_cast<Connection*>(quintptr(
+                                done[i].user_data & ((quint64(1) << SLOT_SHIFT) - 1) & ~TAG_MASK));
+            if (tag == TAG_SEND) {
+                sendCompleted(c, int(done[i].user_data >> SLOT_SHIFT) - 1, done[i]);
+                continue;
+            }
+            int id = done[i].bufferId();
+            if (id >= 0) {
+                if (c->fd >= 0 && res > 0) receiveData(c, ring_->buffer(id), res);
+                ring_->recycleBuffer(id);
+            }
+            if (done[i].more()) continue;
+            // the multishot receive ended: out of buffers, or the peer is gone
+            if (c->fd >= 0 && (res > 0 || res == -ENOBUFS)) {
+                if (!ring_->recvMultishot(c->fd, userData(c, TAG_RECV))) {
+                    c->rearm = true;
+                    stall(c);
+                }
+                continue;
+            }
+            closeConnection(c);
+            finishOp(c);
+        }
+    } while (n == N_MAX_COMPLETIONS);
+    if (peer_list_dirty_) {
+        broadcastPeerList();
+    }
+    for (size_t i = 0; i < dirty_.size(); ++i) {
+        dirty_[i]->dirty = false;
+        if (dirty_[i]->fd >= 0) sendSegment(dirty_[i]);
+    }
+    dirty_.clear();
+    in_loop_ = false;
+    ring_->submit();
+    if (accept_stalled_ || !stalled_.empty()) {
+        retryStalled();
+        ring_->submit();
+    }
+    for (size_t i = 0; i < closed_.size(); ++i) {
+        delete closed_[i];
+    }
+    closed_.clear();
+}
+
+/* Frames are handled straight from the provided buffer; only a frame split
+ * across receives is copied into the connection. */
+void JsonCommandServer::EpollServer::receiveData(Connection *c, const char *data, int size) {
+    int pos = 0;
+    if (c->in.isEmpty()) {
+        while (size - pos >= 4) {
+            qint32 frame_size = qFromBigEndian<qint32>(reinterpret_cast<const uchar*>(data + pos));
+            if (frame_size < 0 || frame_size > max_frame_size_ || size - pos - 4 < frame_size) {
+                break;
+            }
+            QByteArray frame = QByteArray::fromRawData(data + pos + 4, frame_size);
+            pos += 4 + frame_size;
+            ++frames_received_;
+            processFrame(c, frame);
+            if (c->fd < 0) return;
+        }
+    }
+    if (pos < size) {
+        c->in.append(data + pos, size - pos);
+        processFrames(c);
+    }
+}
+
+/* One send in flight per connection keeps its bytes in order. */
+void JsonCommandServer::EpollServer::sendSegment(Connection *c) {
+    if (c->sending || c->segments.empty() || c->fd < 0) return;
+    const Segment& segment = c->segments.front();
+    unsigned size = segment.size - segment.offset;
+    bool queued;
+    if (segment.slot >= 0) {
+        ring_->retainSlot(segment.slot);
+        quint64 user_data = userData(c, TAG_SEND, segment.slot);
+        if (c->zero_copy) {
+            queued = ring_->sendSlot(c->fd, segment.slot, segment.offset, size, user_data);
+        } else {
+            queued = ring_->send(c->fd, ring_->slotData(segment.slot) + segment.offset, size,
+                                 user_data);
+        }
+        if (!queued) ring_->releaseSlot(segment.slot);
+    } else {
+        queued = ring_->send(c->fd, segment.data.constData() + segment.offset, size,
+                             userData(c, TAG_SEND));
+    }
+    if (!queued) {
+        stall(c);
+        return;
+    }
+    c->sending = true;
+    ++c->pending_ops;
+}
+
+/* A zero-copy send completes twice, the slot is free for reuse only once the
+ * notification says the kernel is done reading it. */
+void JsonCommandServer::EpollServer::sendCompleted(Connection *c, int slot,
+        const UringEngine::Completion& done) {
+    if (done.notification()) {
+        ring_->releaseSlot(slot);
+        finishOp(c);
+        return;
+    }
+    bool notification = done.more();
+    int res = done.res;
+    if (slot >= 0 && !notification) ring_->releaseSlot(slot);
+    c->sending = false;
+    if (c->fd >= 0) {
+        if (res == -EOPNOTSUPP && slot >= 0 && c->zero_copy) {
+            c->zero_copy = false;  // e.g. not a TCP socket
+        } else if (res < 0) {
+            closeConnection(c);
+        } else {
+            Segment& segment = c->segments.front();
+            segment.offset += res;
+            c->queued -= res;
+            if (segment.offset == segment.size) {
+                if (segment.slot >= 0) ring_->releaseSlot(segment.slot);
+                c->segments.pop_front();
+            }
+        }
+        sendSegment(c);
+    } else {
+        c->segments.clear();
+    }
+    if (!notification) finishOp(c);
+}
+
+void JsonCommandServer::EpollServer::finishOp(Connection *c) {
+    if (--c->pending_ops > 0 || c->fd >= 0) return;
+    lingering_.erase(std::remove(lingering_.begin(), lingering_.end(), c), lingering_.end());
+    closed_.push_back(c);
+}
+
+/* The submission queue stayed full: the request is queued again after the
+ * next submit, the pending op keeps a closed connection alive until then. */
+void JsonCommandServer::EpollServer::stall(Connection *c) {
+    if (c->stalled) return;
+    c->stalled = true;
+    ++c->pending_ops;
+    stalled_.push_back(c);
+}
+
+void JsonCommandServer::EpollServer::retryStalled() {
+    if (accept_stalled_) {
+        accept_stalled_ = !ring_->acceptMultishot(listen_fd_, TAG_ACCEPT);
+    }
+    std::vector<Connection*> stalled;
+    stalled.swap(stalled_);
+    for (size_t i = 0; i < stalled.size(); ++i) {
+        Connection* c = stalled[i];
+        c->stalled = false;
+        if (c->rearm) {
+            if (c->fd < 0) {
+                c->rearm = false;
+                finishOp(c);  // the receive that was never queued
+            } else if (ring_->recvMultishot(c->fd, userData(c, TAG_RECV))) {
+                c->rearm = false;
+            } else {
+                stall(c);
+            }
+        }
+        if (c->fd >= 0) sendSegment(c);
+        finishOp(c);
+    }
+}
+
+int JsonCommandServer::EpollServer::newKey() {
+    ++next_key_;
+    return next_key_;
+}
+
+JsonCommandServer::EnvelopeSender JsonCommandServer::EpollServer::envelopeSender() {
+    EnvelopeSender sender;
+    sender.ip = this->myIP();
+    sender.port = this->myPort();
+    sender.id = this->id();
+    sender.group = this->group();
+    sender.name = this->name();
+    sender.type = this->type();
+    sender.description = this->description();
+    return sender;
+}
+
+QJsonArray JsonCommandServer::EpollServer::createMessage(const QString &from,
+        const QString &message, bool &ok, int type_message) {
+    ok = true;
+    return Envelope::message(envelopeSender(), newKey(), from, message, type_message);
+}
+
+QJsonArray JsonCommandServer::EpollServer::createMessage(const QString &message, bool &ok,
+        int type_message) {
+    return createMessage(this->name(), message, ok, type_message);
+}
+
+QJsonArray JsonCommandServer::EpollServer::createStatus(const QString &message, bool &ok) {
+    return createMessage(message, ok, MESSAGE_STATUS);
+}
+
+QJsonArray JsonCommandServer::EpollServer::createError(const QString &message, bool &ok) {
+    return createMessage(message, ok, MESSAGE_ERROR);
+}
+
+QJsonArray JsonCommandServer::EpollServer::createPeerList() {
+    QJsonArray peers_array;
+    for (std::map<Atom, Connection*>::iterator it = peers_.begin(); it != peers_.end(); ++it) {
+        peers_array.append(atoms_.string(it->first));
+    }
+    return Envelope::peerList(envelopeSender(), newKey(), peers_array);
+}
+
+QJsonArray JsonCommandServer::EpollServer::createIdentify() {
+    return Envelope::identify(envelopeSender(), newKey());
+}
+
+QJsonArray JsonCommandServer::EpollServer::createMessageTo(const QString &from,
+        const QString &to, const QString &message) {
+    return Envelope::messageTo(envelopeSender(), newKey(), from, to, message);
+}
+
+QJsonArray JsonCommandServer::EpollServer::createCommandTo(const QString &from,
+        const QString &to, const QJsonArray &_cmd) {
+    return Envelope::commandTo(envelopeSender(), newKey(), from, to, _cmd);
+}
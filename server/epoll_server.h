@@ -0,0 +1,209 @@
+/*
+Json Command Server
+
+EPOLL SERVER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_EPOLL_SERVER_H
+#define JSONCOMMANDSERVER_EPOLL_SERVER_H
+
+#include "atom_table.h"
+#include "commands_controller.h"
+#include "envelope.h"
+#include "peer_index.h"
+#include "uring_engine.h"
+
+#include <QObject>
+#include <QSocketNotifier>
+
+#include <map>
+#include <vector>
+
+struct sockaddr_storage;
+
+namespace JsonCommandServer {
+
+/* The BaseServer protocol on raw non-blocking fds and one edge-triggered epoll
+ * set (Linux only). A connection is a plain struct, not a QObject: there are no
+ * per-connection signals, the whole epoll set is one QSocketNotifier on the
+ * event loop, frames are parsed in place and the replies of an event batch
+ * leave with one send() per connection.
+ *
+ * It is constructed instead of a BaseServer and keeps the same BaseController
+ * hooks and peer addressed calls (sendMessageTo, sendCommandTo, broadcast,
+ * addNewInfo), so a frontend written against those, e.g. as a template over
+ * its base class, picks the transport at construction. Federation, offline
+ * store, persistence and priority lanes stay with BaseServer.
+ *
+ * With setIoEngine(IO_URING) the same connections run on an io_uring ring
+ * instead: connections are armed once with multishot receive, frames are
+ * parsed straight out of the kernel's provided buffers, a broadcast is encoded
+ * once into a registered buffer shared by every send, and each event loop turn
+ * ends with a single io_uring_enter. When the kernel can not do that
+ * initServer() falls back to epoll. ioStats() reports the syscalls made per
+ * thousand frames on either path. */
+class JSONCOMMANDSERVERSHARED_EXPORT EpollServer : public QObject, public BaseController {
+    Q_OBJECT
+
+  public:
+    enum IoEngine {
+        IO_EPOLL,
+        IO_URING
+    };
+
+    EpollServer(QObject* parent = 0);
+    virtual ~EpollServer();
+
+    virtual void initServer();
+
+    virtual QString name() { return ""; }
+    virtual QString type() { return ""; }
+    virtual int id() { return 0; }
+    virtual int group() { return 0; }
+    virtual QString description() { return ""; }
+
+    QString myIP();
+    int myPort();
+
+    void setPortServer(int _port_server);
+    void setNMaxClients(int _n_max_clients);
+    void setMaxFrameSize(qint32 _max_frame_size);
+    /* A connection whose unsent replies pass this many bytes (64 MiB by
+     * default) does not read them: it is disconnected, not buffered. */
+    void setMaxPendingOutput(qint64 _max_pending_output);
+    void setIoEngine(int _io_engine);
+    int ioEngine() const;
+    QJsonObject ioStats() const;
+
+  public slots:
+    virtual void updateServer();
+    void closeServer();
+
+    virtual void addClientMessage(const QString& message) {}
+    virtual void addStatusMessage(const QString& message) {}
+    virtual void addErrorMessage(const QString& message) {}
+    virtual void addIdentify(const QJsonObject& info) {}
+    virtual void addPeerList(const QList<QString>&) {}
+
+    virtual void sendMessageTo(const QString& from, const QString& to, const QString& message);
+    virtual void sendCommandTo(const QString& from, const QString& to, const QJsonArray& cmd);
+
+    virtual void clearMessages() {}
+
+  public:
+    QJsonArray createMessage(const QString& from, const QString &message, bool &ok,
+                             int type_message = MESSAGE_NORMAL);
+    QJsonArray createMessage(const QString &message, bool &ok, int type_message = MESSAGE_NORMAL);
+    QJsonArray createStatus(const QString &message, bool &ok);
+    QJsonArray createError(const QString &message, bool &ok);
+    QJsonArray createPeerList();
+    QJsonArray createIdentify();
+    QJsonArray createMessageTo(const QString& from, const QString& to, const QString &message);
+    QJsonArray createCommandTo(const QString& from, const QString& to, const QJsonArray &cmd);
+
+    QList<QString> getPeers();
+    void broadcastMessage(const QJsonArray& cmd);
+    int numSockets();
+
+    virtual void addNewInfo(const RemoteNodeInfo& new_info);
+    virtual void updateInfos() {}
+
+  private slots:
+    void processEvents();
+    void closeOverflowed();
+
+  protected:
+    struct Connection;
+    struct Segment;
+
+    int newKey();
+    EnvelopeSender envelopeSender();
+
+    void acceptConnections();
+    Connection* openConnection(int fd, const sockaddr_storage& addr);
+    bool readConnection(Connection* c);
+    bool processFrames(Connection* c);
+    void processFrame(Connection* c, const QByteArray& frame);
+    void writeFrame(Connection* c, const QByteArray& data);
+    void writeMessage(Connection* c, const QJsonArray& cmd);
+    bool flushConnection(Connection* c);
+    void closeConnection(Connection* c);
+    bool reserveOutput(Connection* c, qint64 size);
+    bool dropPendingConnection();
+    void broadcastPeerList();
+
+    bool initRing();
+    void processCompletions();
+    void receiveData(Connection* c, const char* data, int size);
+    void sendSegment(Connection* c);
+    void sendCompleted(Connection* c, int slot, const UringEngine::Completion& done);
+    void finishOp(Connection* c);
+    void stall(Connection* c);
+    void retryStalled();
+
+    QString ip_address_;
+    int port_server_;
+    int n_max_clients_;
+    qint32 max_frame_size_;
+    qint64 max_pending_output_;
+    int next_key_;
+
+    int epoll_fd_;
+    int listen_fd_;
+    int reserve_fd_;  // closed to accept and turn away a connection when out of fds
+    QSocketNotifier* notifier_;
+    bool in_loop_;
+    bool peer_list_dirty_;
+    bool accept_stalled_;  // the multishot accept waits for room in the ring
+    Connection* current_;  // the connection whose command is executing
+
+    int io_engine_;
+    UringEngine* ring_;
+    quint64 syscalls_;
+    quint64 frames_received_;
+    quint64 frames_sent_;
+
+    std::vector<Connection*> connections_;
+    std::vector<Connection*> dirty_;
+    std::vector<Connection*> ready_;
+    std::vector<Connection*> closed_;
+    std::vector<Connection*> lingering_;
+    std::vector<Connection*> stalled_;
+    std::vector<Connection*> overflowed_;
+    std::map<QString, Connection*> addresses_;
+    AtomTable atoms_;
+    std::map<Atom, Connection*> peers_;
+    PeerIndex peer_index_;
+    std::map<QString, std::map<int, RemoteNodeInfo> > ips_info_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_EPOLL_SERVER_H
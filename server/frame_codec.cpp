@@ -0,0 +1,197 @@
+/*
+Json Command Server
+
+FRAME CODEC
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "frame_codec.h"
+
+#include <QObject>
+#include <QtEndian>
+
+const int JsonCommandServer::StreamAssembler::MAX_PARTIAL_MESSAGES;
+const int JsonCommandServer::StreamAssembler::MAX_OPEN_STREAMS;
+
+QByteArray JsonCommandServer::encodeFrameHeader(const FrameHeader &header) {
+    QByteArray out(FRAME_V2_HEADER_SIZE, '\0');
+    uchar* p = reinterpret_cast<uchar*>(out.data());
+    p[0] = FRAME_V2_MAGIC;
+    p[1] = header.flags;
+    p[2] = header.encoding;
+    qToBigEndian<quint32>(header.stream, p + 4);
+    qToBigEndian<qint32>(header.size, p + 8);
+    return out;
+}
+
+JsonCommandServer::FrameHeader JsonCommandServer::decodeFrameHeader(const QByteArray &data) {
+    const uchar* p = reinterpret_cast<const uchar*>(data.constData());
+    FrameHeader header;
+    header.flags = p[1];
+    header.encoding = p[2];
+    header.stream = qFromBigEndian<quint32>(p + 4);
+    header.size = qFromBigEndian<qint32>(p + 8);
+    return header;
+}
+
+QByteArray JsonCommandServer::encodePayload(int encoding, const QByteArray &data) {
+    return encoding == ENCODING_DEFLATE_JSON ? qCompress(data) : data;
+}
+
+bool JsonCommandServer::decodePayload(int encoding, const QByteArray &data, qint32 max_size,
+        QByteArray *out) {
+    if (encoding == ENCODING_JSON) {
+        *out = data;
+        return true;
+    }
+    if (encoding != ENCODING_DEFLATE_JSON || data.size() < 4) return false;
+    // qCompress() leads with the inflated size: check it before inflating
+    quint32 size = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(data.constData()));
+    if (size > static_cast<quint32>(max_size)) return false;
+    *out = qUncompress(data);
+    return out->size() == static_cast<int>(size);
+}
+
+JsonCommandServer::StreamAssembler::StreamAssembler(qint32 max_message_size)
+    : in_chunk_(false),
+      max_message_size_(max_message_size),
+      buffered_(0) {
+}
+
+void JsonCommandServer::StreamAssembler::setMaxMessageSize(qint32 max_message_size) {
+    max_message_size_ = max_message_size;
+}
+
+bool JsonCommandServer::StreamAssembler::begin(const FrameHeader &header, QString *error) {
+    if (header.encoding >= N_ENCODINGS) {
+        *error = QObject::tr("Codificação de pacote desconhecida: %1.").arg(header.encoding);
+        return false;
+    }
+    if (header.stream == 0 && (header.flags & (FRAME_MORE | FRAME_STREAM))) {
+        *error = QObject::tr("O fluxo 0 só leva mensagens inteiras.");
+        return false;
+    }
+    bool open = open_.count(header.stream) > 0;
+    std::map<quint32, Partial>::const_iterator it = partial_.find(header.stream);
+    if ((header.flags & FRAME_STREAM) && (open || it != partial_.end())) {
+        *error = QObject::tr("O fluxo %1 já está em uso.").arg(header.stream);
+        return false;
+    }
+    qint64 size = header.size;
+    qint64 buffered = buffered_;
+    if (!open && !(header.flags & FRAME_STREAM)) {
+        // pieces of a message: bound what is kept until it is complete
+        if (it != partial_.end()) size += it->second.data.size();
+        buffered += header.size;
+    }
+    if (header.size < 0 || size > max_message_size_ ||
+            buffered > qint64(MAX_PARTIAL_MESSAGES) * max_message_size_) {
+        *error = QObject::tr("Tamanho de pacote inválido: %1 bytes no fluxo %2 (máximo %3).")
+                 .arg(size).arg(header.stream).arg(max_message_size_);
+        return false;
+    }
+    if (it != partial_.end() && it->second.encoding != header.encoding) {
+        *error = QObject::tr("Codificação trocada no meio do fluxo %1.").arg(header.stream);
+        return false;
+    }
+    // a new stream, or the first chunk of a message kept until it is complete
+    bool opens = (header.flags & FRAME_MORE) && !(header.flags & FRAME_ABORT) &&
+                 !open && it == partial_.end();
+    if (opens && open_.size() + partial_.size() >= size_t(MAX_OPEN_STREAMS)) {
+        *error = QObject::tr("Fluxos abertos demais: %1 (máximo %2).")
+                 .arg(int(open_.size() + partial_.size())).arg(MAX_OPEN_STREAMS);
+        return false;
+    }
+    header_ = header;
+    in_chunk_ = true;
+    return true;
+}
+
+bool JsonCommandServer::StreamAssembler::buffersChunk() const {
+    if (!in_chunk_ || (header_.flags & FRAME_STREAM) || open_.count(header_.stream)) {
+        return false;
+    }
+    return (header_.flags & (FRAME_MORE | FRAME_ABORT)) != 0;
+}
+
+int JsonCommandServer::StreamAssembler::addChunk(const QByteArray &chunk, QByteArray *out,
+        QString *error) {
+    in_chunk_ = false;
+    if (header_.flags & FRAME_STREAM) {
+        if (!decodePayload(header_.encoding, chunk, max_message_size_, out)) {
+            *error = QObject::tr("Falha ao decodificar o comando do fluxo %1.").arg(header_.stream);
+            return CHUNK_ERROR;
+        }
+        if (!lastChunk()) open_.insert(header_.stream);
+        return CHUNK_STREAM_BEGIN;
+    }
+    if (open_.count(header_.stream)) {
+        if (header_.flags & FRAME_ABORT) {
+            open_.erase(header_.stream);
+            return CHUNK_STREAM_ABORT;
+        }
+        if (!decodePayload(header_.encoding, chunk, max_message_size_, out)) {
+            *error = QObject::tr("Falha ao decodificar o fluxo %1.").arg(header_.stream);
+            return CHUNK_ERROR;
+        }
+        if (lastChunk()) open_.erase(header_.stream);
+        return CHUNK_STREAM_DATA;
+    }
+    std::map<quint32, Partial>::iterator it = partial_.find(header_.stream);
+    if (header_.flags & FRAME_ABORT) {
+        if (it != partial_.end()) {
+            buffered_ -= it->second.data.size();
+            partial_.erase(it);
+        }
+        return CHUNK_PARTIAL;
+    }
+    if (header_.flags & FRAME_MORE) {
+        if (it == partial_.end()) {
+            it = partial_.insert(std::make_pair(header_.stream, Partial())).first;
+            it->second.encoding = header_.encoding;
+        }
+        it->second.data.append(chunk);
+        buffered_ += chunk.size();
+        return CHUNK_PARTIAL;
+    }
+    QByteArray data;
+    if (it == partial_.end()) {
+        data = chunk;
+    } else {
+        buffered_ -= it->second.data.size();
+        data.swap(it->second.data);
+        data.append(chunk);
+        partial_.erase(it);
+    }
+    if (!decodePayload(header_.encoding, data, max_message_size_, out)) {
+        *error = QObject::tr("Falha ao decodificar a mensagem do fluxo %1.").arg(header_.stream);
+        return CHUNK_ERROR;
+    }
+    return CHUNK_MESSAGE;
+}
@@ -0,0 +1,171 @@
+/*
+Json Command Server
+
+FRAME CODEC
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_FRAME_CODEC_H
+#define JSONCOMMANDSERVER_FRAME_CODEC_H
+
+#include "commands_controller.h"
+
+#include <QByteArray>
+#include <QString>
+
+#include <map>
+#include <set>
+
+namespace JsonCommandServer {
+
+/* Wire framing. A v1 frame is a big-endian qint32 length and the JSON text.
+ * A v2 frame starts with FRAME_V2_MAGIC, whose high bit makes it a negative
+ * length to a v1 reader, so every frame says which version it is:
+ *
+ *     0      magic (0xF2)
+ *     1      flags (FRAME_MORE)
+ *     2      payload encoding
+ *     3      reserved, 0
+ *     4..7   stream id, big-endian
+ *     8..11  chunk length, big-endian
+ *
+ * A message that fits in one chunk goes whole on stream 0. A larger one is cut
+ * into chunks on a stream of its own, all but the last flagged FRAME_MORE, and
+ * chunks of different streams may interleave. Order is kept within a stream
+ * only: a whole message sent after a large one can arrive first.
+ *
+ * A stream is a command with a body of any size that is never held whole:
+ * its first chunk is flagged FRAME_STREAM and carries the command, as a JSON
+ * array of one object, and the body follows in chunks of raw bytes on the same
+ * stream, ending with the first one without FRAME_MORE. A chunk flagged
+ * FRAME_ABORT cancels the stream, or drops a message still missing chunks.
+ *
+ * Connections start with v1 and switch when the client's MESSAGE_IDENTIFY asks
+ * for "frame_version": 2; the server answers with its own MESSAGE_IDENTIFY
+ * carrying "frame_version": 2, the last v1 frame it sends. */
+enum FrameVersion {
+    FRAME_V1 = 1,
+    FRAME_V2 = 2
+};
+
+enum FrameFlag {
+    FRAME_MORE = 0x01,
+    FRAME_STREAM = 0x02,
+    FRAME_ABORT = 0x04
+};
+
+enum PayloadEncoding {
+    ENCODING_JSON = 0,  // as is: JSON text, or raw bytes in a stream body
+    ENCODING_DEFLATE_JSON = 1,  // qCompress()ed JSON
+    N_ENCODINGS
+};
+
+const int FRAME_V1_HEADER_SIZE = 4;
+const int FRAME_V2_HEADER_SIZE = 12;
+const uchar FRAME_V2_MAGIC = 0xF2;
+const int DEFAULT_STREAM_CHUNK_SIZE = 16 * 1024;
+
+struct FrameHeader {
+    FrameHeader() : flags(0), encoding(ENCODING_JSON), stream(0), size(0) {}
+
+    quint8 flags;
+    quint8 encoding;
+    quint32 stream;
+    qint32 size;
+};
+
+/* Size of the header that starts with `received`, as far as it was read. */
+inline int frameHeaderSize(const QByteArray& received) {
+    return !received.isEmpty() && uchar(received.at(0)) == FRAME_V2_MAGIC ?
+           FRAME_V2_HEADER_SIZE : FRAME_V1_HEADER_SIZE;
+}
+
+JSONCOMMANDSERVERSHARED_EXPORT QByteArray encodeFrameHeader(const FrameHeader& header);
+JSONCOMMANDSERVERSHARED_EXPORT FrameHeader decodeFrameHeader(const QByteArray& data);
+
+JSONCOMMANDSERVERSHARED_EXPORT QByteArray encodePayload(int encoding, const QByteArray& data);
+JSONCOMMANDSERVERSHARED_EXPORT bool decodePayload(int encoding, const QByteArray& data,
+        qint32 max_size, QByteArray* out);
+
+/* Inbound v2 state of one connection: the header of the chunk being read, the
+ * messages still missing chunks and the open streams. Each message, and each
+ * chunk of a stream body, is bounded by max_message_size; all the partial
+ * messages together by MAX_PARTIAL_MESSAGES times that. At most
+ * MAX_OPEN_STREAMS partial messages and open streams are kept at once. */
+class JSONCOMMANDSERVERSHARED_EXPORT StreamAssembler {
+  public:
+    static const int MAX_PARTIAL_MESSAGES = 4;
+    static const int MAX_OPEN_STREAMS = 64;
+
+    enum ChunkKind {
+        CHUNK_ERROR,
+        CHUNK_PARTIAL,  // kept until its message is complete
+        CHUNK_MESSAGE,
+        CHUNK_STREAM_BEGIN,  // the command of a new stream
+        CHUNK_STREAM_DATA,  // a piece of the body, the last one without FRAME_MORE
+        CHUNK_STREAM_ABORT
+    };
+
+    explicit StreamAssembler(qint32 max_message_size);
+
+    void setMaxMessageSize(qint32 max_message_size);
+
+    bool begin(const FrameHeader& header, QString* error);
+    bool inChunk() const { return in_chunk_; }
+    /* True when the chunk announced by begin() will not be dispatched. */
+    bool buffersChunk() const;
+    quint32 stream() const { return header_.stream; }
+    bool lastChunk() const { return !(header_.flags & FRAME_MORE); }
+
+    /* Takes the chunk announced by begin() and says what it was. Messages and
+     * stream commands come out whole, body pieces as they are, all decoded
+     * into *out. */
+    int addChunk(const QByteArray& chunk, QByteArray* out, QString* error);
+
+    int partialMessages() const { return static_cast<int>(partial_.size()); }
+    int openStreams() const { return static_cast<int>(open_.size()); }
+    qint64 bufferedBytes() const { return buffered_; }
+
+  private:
+    struct Partial {
+        QByteArray data;
+        quint8 encoding;
+    };
+
+    FrameHeader header_;
+    bool in_chunk_;
+    qint32 max_message_size_;
+    std::map<quint32, Partial> partial_;
+    std::set<quint32> open_;
+    qint64 buffered_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_FRAME_CODEC_H
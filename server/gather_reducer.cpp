@@ -0,0 +1,160 @@
+/*
+Json Command Server
+
+GATHER REDUCER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "gather_reducer.h"
+
+#include <QObject>
+
+static const char* const AGGREGATE_NAMES[] = {
+    "collect", "count", "min", "max", "sum", "first"
+};
+
+JsonCommandServer::GatherReducer::GatherReducer()
+    : aggregate_(GATHER_COLLECT),
+      k_(0),
+      replies_(0),
+      skipped_(0),
+      has_value_(false),
+      value_(0) {
+}
+
+bool JsonCommandServer::GatherReducer::setup(const QJsonObject &request, QString &error) {
+    QString name = request["aggregate"].toString();
+    aggregate_ = name.isEmpty() ? GATHER_COLLECT : aggregateByName(name);
+    if (aggregate_ < 0) {
+        error = QObject::tr("agregação desconhecida '%1'").arg(name);
+        return false;
+    }
+    QString field = request["field"].toString();
+    if (aggregate_ == GATHER_MIN || aggregate_ == GATHER_MAX || aggregate_ == GATHER_SUM) {
+        if (field.isEmpty()) {
+            error = QObject::tr("'%1' exige o campo 'field'").arg(name);
+            return false;
+        }
+        field_ = field.split('.');
+    }
+    if (aggregate_ == GATHER_FIRST_K) {
+        k_ = request["k"].toInt();
+        if (k_ <= 0) {
+            error = QObject::tr("'first' exige 'k' maior que zero");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonCommandServer::GatherReducer::add(const QString &from, const QJsonObject &reply) {
+    if (done()) return true;
+    ++replies_;
+    double value = 0;
+    switch (aggregate_) {
+    case GATHER_COLLECT:
+    case GATHER_FIRST_K: {
+        QJsonObject kept = reply;
+        kept.remove("type");
+        kept.remove("request_id");
+        kept.remove("ip");
+        kept.remove("port");
+        kept.insert("from", from);
+        kept_.append(kept);
+        break;
+    }
+    case GATHER_MIN:
+    case GATHER_MAX:
+    case GATHER_SUM:
+        if (!fieldValue(reply, value)) {
+            ++skipped_;
+        } else if (!has_value_) {
+            value_ = value;
+            has_value_ = true;
+        } else if (aggregate_ == GATHER_MIN) {
+            value_ = qMin(value_, value);
+        } else if (aggregate_ == GATHER_MAX) {
+            value_ = qMax(value_, value);
+        } else {
+            value_ += value;
+        }
+        break;
+    default:
+        break;
+    }
+    return done();
+}
+
+bool JsonCommandServer::GatherReducer::done() const {
+    return aggregate_ == GATHER_FIRST_K && replies_ >= k_;
+}
+
+QJsonObject JsonCommandServer::GatherReducer::result() const {
+    QJsonObject out;
+    out.insert("aggregate", aggregateName(aggregate_));
+    switch (aggregate_) {
+    case GATHER_COLLECT:
+    case GATHER_FIRST_K:
+        out.insert("result", kept_);
+        break;
+    case GATHER_COUNT:
+        out.insert("result", replies_);
+        break;
+    default:
+        // no reply had the field: null rather than a made up 0
+        out.insert("result", has_value_ ? QJsonValue(value_) : QJsonValue());
+        out.insert("field", field_.join('.'));
+        out.insert("skipped", skipped_);
+        break;
+    }
+    return out;
+}
+
+int JsonCommandServer::GatherReducer::aggregateByName(const QString &name) {
+    for (int i = 0; i < N_GATHER_AGGREGATES; ++i) {
+        if (name == AGGREGATE_NAMES[i]) return i;
+    }
+    return -1;
+}
+
+QString JsonCommandServer::GatherReducer::aggregateName(int aggregate) {
+    if (aggregate < 0 || aggregate >= N_GATHER_AGGREGATES) return QString();
+    return AGGREGATE_NAMES[aggregate];
+}
+
+bool JsonCommandServer::GatherReducer::fieldValue(const QJsonObject &reply, double &value) const {
+    QJsonValue v = reply;
+    for (int i = 0; i < field_.size(); ++i) {
+        if (!v.isObject()) return false;
+        v = v.toObject()[field_[i]];
+    }
+    if (!v.isDouble()) return false;
+    value = v.toDouble();
+    return true;
+}
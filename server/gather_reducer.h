@@ -0,0 +1,92 @@
+/*
+Json Command Server
+
+GATHER REDUCER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_GATHER_REDUCER_H
+#define JSONCOMMANDSERVER_GATHER_REDUCER_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+
+namespace JsonCommandServer {
+
+enum GatherAggregate {
+    GATHER_COLLECT = 0, // EVERY REPLY, WITH "from", IN ARRIVAL ORDER
+    GATHER_COUNT = 1, // NUMBER OF REPLIES
+    GATHER_MIN = 2, // SMALLEST NUMERIC "field" OF THE REPLIES
+    GATHER_MAX = 3, // LARGEST NUMERIC "field" OF THE REPLIES
+    GATHER_SUM = 4, // SUM OF THE NUMERIC "field" OF THE REPLIES
+    GATHER_FIRST_K = 5, // THE FIRST "k" REPLIES; THE GATHER ENDS WITH THE K-TH
+    N_GATHER_AGGREGATES
+};
+
+/* Folds the replies of a gather into one result as they arrive, so only the
+ * running value (or the kept replies, for collect and first-k) is held.
+ * "field" may name a nested value as "a.b.c"; replies where it is missing
+ * or not a number are counted as skipped. */
+class JSONCOMMANDSERVERSHARED_EXPORT GatherReducer {
+  public:
+    GatherReducer();
+
+    /* Reads "aggregate", "field" and "k" from the gather request. */
+    bool setup(const QJsonObject& request, QString& error);
+
+    /* True once more replies can no longer change the result. */
+    bool add(const QString& from, const QJsonObject& reply);
+    bool done() const;
+
+    int replies() const { return replies_; }
+    QJsonObject result() const;
+
+    static int aggregateByName(const QString& name);
+    static QString aggregateName(int aggregate);
+
+  private:
+    bool fieldValue(const QJsonObject& reply, double& value) const;
+
+    int aggregate_;
+    QStringList field_;
+    int k_;
+    int replies_;
+    int skipped_;
+    bool has_value_;
+    double value_;
+    QJsonArray kept_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_GATHER_REDUCER_H
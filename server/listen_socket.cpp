@@ -0,0 +1,165 @@
+/*
+Json Command Server
+
+LISTEN SOCKET
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "listen_socket.h"
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+qintptr JsonCommandServer::openListenSocket(const QHostAddress& address, quint16 port,
+        bool reuse_port, int backlog, QString* error) {
+#ifdef Q_OS_UNIX
+    bool ipv4 = address.protocol() == QAbstractSocket::IPv4Protocol;
+    int fd = openStreamSocket(ipv4 ? AF_INET : AF_INET6, true);
+    if (fd < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        return -1;
+    }
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    }
+    int result;
+    if (ipv4) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(address.toIPv4Address());
+        result = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    } else {
+        // QHostAddress::Any: one dual-stack socket, like QTcpServer does
+        bool any = address == QHostAddress(QHostAddress::Any) ||
+                   address == QHostAddress(QHostAddress::AnyIPv6);
+        int v6only = address == QHostAddress(QHostAddress::Any) ? 0 : 1;
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(port);
+        if (any) {
+            addr.sin6_addr = in6addr_any;
+        } else {
+            Q_IPV6ADDR ip6 = address.toIPv6Address();
+            memcpy(&addr.sin6_addr, &ip6, sizeof(addr.sin6_addr));
+        }
+        result = ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+    if (result < 0 || ::listen(fd, backlog) < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(address);
+    Q_UNUSED(port);
+    Q_UNUSED(reuse_port);
+    Q_UNUSED(backlog);
+    if (error) *error = QLatin1String("SO_REUSEPORT listeners are not supported on this platform");
+    return -1;
+#endif
+}
+
+bool JsonCommandServer::setInheritable(qintptr fd, bool inheritable) {
+#ifdef Q_OS_UNIX
+    int flags = ::fcntl(static_cast<int>(fd), F_GETFD);
+    if (flags < 0) return false;
+    flags = inheritable ? (flags & ~FD_CLOEXEC) : (flags | FD_CLOEXEC);
+    return ::fcntl(static_cast<int>(fd), F_SETFD, flags) == 0;
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(inheritable);
+    return false;
+#endif
+}
+
+void JsonCommandServer::closeDescriptor(qintptr fd) {
+#ifdef Q_OS_UNIX
+    ::close(static_cast<int>(fd));
+#else
+    Q_UNUSED(fd);
+#endif
+}
+
+#if defined(Q_OS_UNIX) && !defined(Q_OS_LINUX)
+static int setDescriptorFlags(int fd, bool non_blocking) {
+    if (fd < 0) return fd;
+    int flags = ::fcntl(fd, F_GETFD);
+    bool ok = flags >= 0 && ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == 0;
+    if (ok && non_blocking) {
+        flags = ::fcntl(fd, F_GETFL);
+        ok = flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+    if (!ok) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+int JsonCommandServer::openStreamSocket(int domain, bool non_blocking) {
+#if defined(Q_OS_LINUX)
+    return ::socket(domain, SOCK_STREAM | SOCK_CLOEXEC | (non_blocking ? SOCK_NONBLOCK : 0), 0);
+#elif defined(Q_OS_UNIX)
+    return setDescriptorFlags(::socket(domain, SOCK_STREAM, 0), non_blocking);
+#else
+    Q_UNUSED(domain);
+    Q_UNUSED(non_blocking);
+    return -1;
+#endif
+}
+
+int JsonCommandServer::acceptSocket(int listen_fd, bool non_blocking) {
+#if defined(Q_OS_LINUX)
+    return ::accept4(listen_fd, 0, 0, SOCK_CLOEXEC | (non_blocking ? SOCK_NONBLOCK : 0));
+#elif defined(Q_OS_UNIX)
+    return setDescriptorFlags(::accept(listen_fd, 0, 0), non_blocking);
+#else
+    Q_UNUSED(listen_fd);
+    Q_UNUSED(non_blocking);
+    return -1;
+#endif
+}
@@ -0,0 +1,65 @@
+/*
+Json Command Server
+
+LISTEN SOCKET
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_LISTEN_SOCKET_H
+#define JSONCOMMANDSERVER_LISTEN_SOCKET_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QHostAddress>
+#include <QString>
+
+namespace JsonCommandServer {
+
+/* Creates a non-blocking listening TCP socket, for listeners QTcpServer cannot
+ * configure itself (SO_REUSEPORT). The descriptor is meant to be adopted with
+ * QTcpServer::setSocketDescriptor(). Returns -1 and fills `error` on failure. */
+qintptr JSONCOMMANDSERVERSHARED_EXPORT openListenSocket(const QHostAddress& address, quint16 port,
+        bool reuse_port, int backlog, QString* error);
+
+/* Lets a listening descriptor survive exec(), to hand it over to a new server
+ * process. */
+bool JSONCOMMANDSERVERSHARED_EXPORT setInheritable(qintptr fd, bool inheritable);
+
+/* Closes an accepted descriptor that never got a socket object. */
+void JSONCOMMANDSERVERSHARED_EXPORT closeDescriptor(qintptr fd);
+
+/* socket() and accept() returning close-on-exec descriptors, non-blocking if
+ * asked: in the call itself on Linux, with fcntl() on other Unix systems.
+ * -1 with errno set on failure. */
+int JSONCOMMANDSERVERSHARED_EXPORT openStreamSocket(int domain, bool non_blocking);
+int JSONCOMMANDSERVERSHARED_EXPORT acceptSocket(int listen_fd, bool non_blocking);
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_LISTEN_SOCKET_H
@@ -0,0 +1,203 @@
+/*
+Json Command Server
+
+LOCAL LISTENER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "local_listener.h"
+#include "listen_socket.h"
+
+#include <QMetaType>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+static const int LOCAL_BACKLOG = 128;
+static const int N_MAX_ACCEPT_BATCH = 256;
+static const int ACCEPT_RETRY_MS = 100;
+
+#ifdef Q_OS_UNIX
+static bool fillAddress(const QString& path, sockaddr_un& addr, QString* error) {
+    QByteArray native = path.toLocal8Bit();
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (native.isEmpty() || native.size() >= static_cast<int>(sizeof(addr.sun_path))) {
+        if (error) *error = QObject::tr("caminho de socket local inválido: %1").arg(path);
+        return false;
+    }
+    memcpy(addr.sun_path, native.constData(), native.size());
+    return true;
+}
+#endif
+
+JsonCommandServer::LocalListener::LocalListener(QObject *_parent)
+    : QObject(_parent), fd_(-1), reserve_fd_(-1), notifier_(0) {
+    qRegisterMetaType<qintptr>("qintptr");
+    qRegisterMetaType<QVector<qintptr> >("QVector<qintptr>");
+}
+
+JsonCommandServer::LocalListener::~LocalListener() {
+    close();
+}
+
+bool JsonCommandServer::LocalListener::listen(const QString &path, QString *error) {
+    close();
+#ifdef Q_OS_UNIX
+    sockaddr_un addr;
+    if (!fillAddress(path, addr, error)) return false;
+    int fd = openStreamSocket(AF_UNIX, true);
+    if (fd < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    // only remove what is a socket: a typo must not delete a regular file
+    struct stat st;
+    if (::lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        ::unlink(addr.sun_path);
+    }
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            ::listen(fd, LOCAL_BACKLOG) < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    fd_ = fd;
+    path_ = path;
+    reserve_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    notifier_ = new QSocketNotifier(fd_, QSocketNotifier::Read, this);
+    connect(notifier_, SIGNAL(activated(int)), this, SLOT(acceptPending()));
+    return true;
+#else
+    Q_UNUSED(path);
+    if (error) *error = QLatin1String("Unix domain sockets are not supported on this platform");
+    return false;
+#endif
+}
+
+void JsonCommandServer::LocalListener::close() {
+    delete notifier_;
+    notifier_ = 0;
+#ifdef Q_OS_UNIX
+    if (fd_ >= 0) {
+        ::close(fd_);
+        ::unlink(path_.toLocal8Bit().constData());
+    }
+    if (reserve_fd_ >= 0) ::close(reserve_fd_);
+#endif
+    fd_ = -1;
+    reserve_fd_ = -1;
+    path_.clear();
+}
+
+bool JsonCommandServer::LocalListener::isListening() const {
+    return fd_ >= 0;
+}
+
+QString JsonCommandServer::LocalListener::path() const {
+    return path_;
+}
+
+/* Drains the backlog, handing it on in batches. The notifier is level
+ * triggered: out of descriptors, a connection left in the backlog would wake
+ * it again at once, so it is turned away or the notifier paused. */
+void JsonCommandServer::LocalListener::acceptPending() {
+#ifdef Q_OS_UNIX
+    QVector<qintptr> batch;
+    for (;;) {
+        int fd = acceptSocket(fd_, true);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                if (dropPending()) continue;
+                notifier_->setEnabled(false);
+                QTimer::singleShot(ACCEPT_RETRY_MS, this, SLOT(resumeAccepting()));
+            }
+            break;
+        }
+        batch.append(fd);
+        if (batch.size() >= N_MAX_ACCEPT_BATCH) {
+            emit connectionsAccepted(batch);
+            batch.clear();
+        }
+    }
+    if (!batch.isEmpty()) emit connectionsAccepted(batch);
+#endif
+}
+
+void JsonCommandServer::LocalListener::resumeAccepting() {
+    if (!notifier_) return;
+    notifier_->setEnabled(true);
+    acceptPending();
+}
+
+/* The spare descriptor makes room to accept the oldest pending connection
+ * and close it at once. */
+bool JsonCommandServer::LocalListener::dropPending() {
+#ifdef Q_OS_UNIX
+    if (reserve_fd_ < 0) {
+        reserve_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return false;
+    }
+    ::close(reserve_fd_);
+    int fd = acceptSocket(fd_, false);
+    if (fd >= 0) ::close(fd);
+    reserve_fd_ = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0;
+#else
+    return false;
+#endif
+}
+
+qintptr JsonCommandServer::connectLocalSocket(const QString &path, QString *error) {
+#ifdef Q_OS_UNIX
+    sockaddr_un addr;
+    if (!fillAddress(path, addr, error)) return -1;
+    int fd = openStreamSocket(AF_UNIX, false);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        if (fd >= 0) ::close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    Q_UNUSED(path);
+    if (error) *error = QLatin1String("Unix domain sockets are not supported on this platform");
+    return -1;
+#endif
+}
@@ -0,0 +1,87 @@
+/*
+Json Command Server
+
+LOCAL LISTENER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_LOCAL_LISTENER_H
+#define JSONCOMMANDSERVER_LOCAL_LISTENER_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+
+class QSocketNotifier;
+
+namespace JsonCommandServer {
+
+/* Listener on a Unix domain socket path, for clients on the same host. Like an
+ * Acceptor it only accepts: the descriptors go out in batches through
+ * connectionsAccepted(). QTcpSocket drives a connected AF_UNIX descriptor as
+ * any other stream socket, so those connections get the same framing, queues
+ * and routing as TCP ones. */
+class JSONCOMMANDSERVERSHARED_EXPORT LocalListener : public QObject {
+    Q_OBJECT
+
+  public:
+    LocalListener(QObject* parent = 0);
+    virtual ~LocalListener();
+
+    /* A stale socket file left at `path` by a previous run is replaced. */
+    bool listen(const QString& path, QString* error);
+    void close();
+    bool isListening() const;
+    QString path() const;
+
+  signals:
+    void connectionsAccepted(const QVector<qintptr>& descriptors);
+
+  private slots:
+    void acceptPending();
+    void resumeAccepting();
+
+  private:
+    bool dropPending();
+
+    int fd_;
+    int reserve_fd_;  // closed to accept and turn away a connection when out of fds
+    QString path_;
+    QSocketNotifier* notifier_;
+};
+
+/* Connects to a LocalListener. Returns a connected blocking descriptor, or -1
+ * and fills `error`. */
+qintptr JSONCOMMANDSERVERSHARED_EXPORT connectLocalSocket(const QString& path, QString* error);
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_LOCAL_LISTENER_H
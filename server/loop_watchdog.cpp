@@ -0,0 +1,201 @@
+/*
+Json Command Server
+
+LOOP WATCHDOG
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "loop_watchdog.h"
+
+#include <QDateTime>
+#include <QJsonArray>
+#include <QTimer>
+
+const int JsonCommandServer::LoopWatchdog::N_LAG_BUCKETS;
+const int JsonCommandServer::LoopWatchdog::N_MAX_TRANSITIONS;
+
+static const int DEFAULT_RECOVERY_MS = 2000;
+static const int AVERAGE_WEIGHT = 8;  // a new sample counts 1/8
+
+static int lagBucket(qint64 lag_us) {
+    int bucket = 0;
+    while (lag_us > 1 && bucket < JsonCommandServer::LoopWatchdog::N_LAG_BUCKETS - 1) {
+        lag_us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+JsonCommandServer::LoopWatchdog::LoopWatchdog(QObject *parent)
+    : QObject(parent),
+      timer_(new QTimer(this)),
+      interval_ms_(0),
+      last_ns_(0),
+      recovery_ns_(qint64(DEFAULT_RECOVERY_MS) * 1000000),
+      calm_since_ns_(-1),
+      level_(SHED_NONE),
+      average_us_(0),
+      max_us_(0),
+      samples_(0) {
+    for (int i = 0; i < N_SHED_LEVELS; ++i) {
+        thresholds_us_[i] = 0;
+    }
+    clearHistogram();
+    timer_->setTimerType(Qt::PreciseTimer);
+    connect(timer_, SIGNAL(timeout()), this, SLOT(tick()));
+    clock_.start();
+}
+
+JsonCommandServer::LoopWatchdog::~LoopWatchdog() {
+}
+
+void JsonCommandServer::LoopWatchdog::start(int interval_ms) {
+    interval_ms_ = qMax(1, interval_ms);
+    last_ns_ = clock_.nsecsElapsed();
+    timer_->start(interval_ms_);
+}
+
+/* Stopping also lifts any shedding. */
+void JsonCommandServer::LoopWatchdog::stop() {
+    timer_->stop();
+    average_us_ = 0;
+    calm_since_ns_ = -1;
+    if (level_ != SHED_NONE) changeLevel(SHED_NONE);
+}
+
+bool JsonCommandServer::LoopWatchdog::isActive() const {
+    return timer_->isActive();
+}
+
+void JsonCommandServer::LoopWatchdog::setThreshold(int level, qint64 lag_ms) {
+    if (level <= SHED_NONE || level >= N_SHED_LEVELS) return;
+    thresholds_us_[level] = lag_ms * 1000;
+}
+
+void JsonCommandServer::LoopWatchdog::setRecoveryTime(int recovery_ms) {
+    recovery_ns_ = qint64(qMax(0, recovery_ms)) * 1000000;
+}
+
+void JsonCommandServer::LoopWatchdog::clearHistogram() {
+    for (int i = 0; i < N_LAG_BUCKETS; ++i) {
+        histogram_[i] = 0;
+    }
+    samples_ = 0;
+    max_us_ = 0;
+}
+
+void JsonCommandServer::LoopWatchdog::tick() {
+    qint64 now = clock_.nsecsElapsed();
+    qint64 lag_us = qMax<qint64>(0, (now - last_ns_) / 1000 - qint64(interval_ms_) * 1000);
+    last_ns_ = now;
+    ++histogram_[lagBucket(lag_us)];
+    ++samples_;
+    max_us_ = qMax(max_us_, lag_us);
+    average_us_ += (lag_us - average_us_) / AVERAGE_WEIGHT;
+
+    int target = targetLevel();
+    if (target > level_) {
+        calm_since_ns_ = -1;
+        changeLevel(target);
+    } else if (level_ > SHED_NONE && target < level_ &&
+               (thresholds_us_[level_] <= 0 || average_us_ * 2 < thresholds_us_[level_])) {
+        if (calm_since_ns_ < 0) {
+            calm_since_ns_ = now;
+        } else if (now - calm_since_ns_ >= recovery_ns_) {
+            calm_since_ns_ = now;
+            int level = level_ - 1;
+            // skip the stages left out
+            while (level > SHED_NONE && thresholds_us_[level] <= 0) --level;
+            changeLevel(level);
+        }
+    } else {
+        calm_since_ns_ = -1;
+    }
+}
+
+int JsonCommandServer::LoopWatchdog::targetLevel() const {
+    for (int level = N_SHED_LEVELS - 1; level > SHED_NONE; --level) {
+        if (thresholds_us_[level] > 0 && average_us_ >= thresholds_us_[level]) return level;
+    }
+    return SHED_NONE;
+}
+
+void JsonCommandServer::LoopWatchdog::changeLevel(int level) {
+    int previous = level_;
+    level_ = level;
+    Transition transition = { QDateTime::currentMSecsSinceEpoch(), previous, level, average_us_ };
+    transitions_.push_back(transition);
+    if (transitions_.size() > size_t(N_MAX_TRANSITIONS)) transitions_.pop_front();
+    emit levelChanged(level, previous, average_us_);
+}
+
+/* Upper bound of the bucket holding the p-th percentile (0 < p <= 1), in us. */
+qint64 JsonCommandServer::LoopWatchdog::lagPercentile(double p) const {
+    if (samples_ == 0) return 0;
+    quint64 rank = quint64(p * samples_ + 0.5);
+    quint64 seen = 0;
+    for (int i = 0; i < N_LAG_BUCKETS; ++i) {
+        seen += histogram_[i];
+        if (seen >= rank && seen > 0) return qMin(max_us_, (qint64(1) << (i + 1)) - 1);
+    }
+    return max_us_;
+}
+
+QJsonObject JsonCommandServer::LoopWatchdog::toJson() const {
+    QJsonObject out;
+    out.insert("level", level_);
+    out.insert("interval_ms", interval_ms_);
+    out.insert("lag_us", double(average_us_));
+    out.insert("max_lag_us", double(max_us_));
+    out.insert("p50_lag_us", double(lagPercentile(0.5)));
+    out.insert("p99_lag_us", double(lagPercentile(0.99)));
+    out.insert("samples", double(samples_));
+    QJsonArray thresholds;
+    for (int i = SHED_NONE + 1; i < N_SHED_LEVELS; ++i) {
+        thresholds.append(double(thresholds_us_[i] / 1000));
+    }
+    out.insert("thresholds_ms", thresholds);
+    // bucket i counts lags below 2^(i+1) us
+    QJsonArray histogram;
+    for (int i = 0; i < N_LAG_BUCKETS; ++i) {
+        histogram.append(double(histogram_[i]));
+    }
+    out.insert("lag_histogram", histogram);
+    QJsonArray transitions;
+    for (size_t i = 0; i < transitions_.size(); ++i) {
+        QJsonObject transition;
+        transition.insert("time", double(transitions_[i].time_ms));
+        transition.insert("from", transitions_[i].from);
+        transition.insert("to", transitions_[i].to);
+        transition.insert("lag_us", double(transitions_[i].lag_us));
+        transitions.append(transition);
+    }
+    out.insert("transitions", transitions);
+    return out;
+}
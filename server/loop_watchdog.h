@@ -0,0 +1,122 @@
+/*
+Json Command Server
+
+LOOP WATCHDOG
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_LOOP_WATCHDOG_H
+#define JSONCOMMANDSERVER_LOOP_WATCHDOG_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QObject>
+
+#include <deque>
+
+class QTimer;
+
+namespace JsonCommandServer {
+
+enum ShedLevel {
+    SHED_NONE = 0,
+    SHED_ACCEPT = 1, // NO NEW CONNECTIONS
+    SHED_LOW_PRIORITY = 2, // AND LOW PRIORITY COMMANDS ARE REFUSED
+    SHED_READS = 3, // AND THE NOISIEST CONNECTIONS ARE NOT READ
+    N_SHED_LEVELS
+};
+
+/* Event loop lag: a precise timer stamps every time it fires, and the lag is
+ * how late that is against the previous stamp plus the interval. Samples go
+ * to a log2 histogram and to a moving average that drives the shed level.
+ *
+ * The level rises as soon as the average crosses a stage's threshold and
+ * falls one stage at a time, once the average has stayed under half the
+ * current stage's threshold for the recovery time. A threshold <= 0 leaves
+ * its stage out. */
+class JSONCOMMANDSERVERSHARED_EXPORT LoopWatchdog : public QObject {
+    Q_OBJECT
+
+  public:
+    static const int N_LAG_BUCKETS = 24;  // the last one counts lags of 8 s and up
+    static const int N_MAX_TRANSITIONS = 32;
+
+    LoopWatchdog(QObject* parent = 0);
+    virtual ~LoopWatchdog();
+
+    void start(int interval_ms);
+    void stop();
+    bool isActive() const;
+
+    void setThreshold(int level, qint64 lag_ms);
+    void setRecoveryTime(int recovery_ms);
+
+    int level() const { return level_; }
+    qint64 lag() const { return average_us_; }  // us
+    qint64 lagPercentile(double p) const;
+    QJsonObject toJson() const;
+    void clearHistogram();
+
+  signals:
+    void levelChanged(int level, int previous, qint64 lag_us);
+
+  private slots:
+    void tick();
+
+  private:
+    struct Transition {
+        qint64 time_ms;  // since the epoch
+        int from;
+        int to;
+        qint64 lag_us;
+    };
+
+    int targetLevel() const;
+    void changeLevel(int level);
+
+    QTimer* timer_;
+    QElapsedTimer clock_;
+    int interval_ms_;
+    qint64 last_ns_;
+    qint64 thresholds_us_[N_SHED_LEVELS];
+    qint64 recovery_ns_;
+    qint64 calm_since_ns_;
+    int level_;
+    qint64 average_us_;
+    qint64 max_us_;
+    quint64 samples_;
+    quint64 histogram_[N_LAG_BUCKETS];
+    std::deque<Transition> transitions_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_LOOP_WATCHDOG_H
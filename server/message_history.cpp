@@ -0,0 +1,126 @@
+/*
+Json Command Server
+
+MESSAGE HISTORY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "message_history.h"
+
+#include <limits>
+
+const int JsonCommandServer::MessageHistory::DEFAULT_PAGE_SIZE;
+const int JsonCommandServer::MessageHistory::MAX_PAGE_SIZE;
+
+JsonCommandServer::HistoryFilter::HistoryFilter()
+    : match_nothing(false),
+      levels((1u << N_HISTORY_LEVELS) - 1),
+      any_peer(true),
+      peer(NO_ATOM),
+      any_type(true),
+      type(0),
+      since_ms(0),
+      until_ms(std::numeric_limits<qint64>::max()) {
+}
+
+JsonCommandServer::MessageHistory::MessageHistory(AtomTable &atoms)
+    : atoms_(atoms), next_seq_(1) {
+}
+
+JsonCommandServer::MessageHistory::~MessageHistory() {
+}
+
+/* Drops what is kept: records are placed by their number modulo the capacity. */
+void JsonCommandServer::MessageHistory::setCapacity(int capacity) {
+    clear();
+    ring_.resize(qMax(0, capacity));
+}
+
+/* Call before the atom table is cleared, the records hold its atoms. */
+void JsonCommandServer::MessageHistory::clear() {
+    for (size_t i = 0; i < ring_.size(); ++i) {
+        if (ring_[i].seq && ring_[i].peer != NO_ATOM) atoms_.release(ring_[i].peer);
+        ring_[i] = HistoryRecord();
+    }
+    next_seq_ = 1;
+}
+
+void JsonCommandServer::MessageHistory::append(qint64 time_ms, int level, Atom peer, int type,
+        const QJsonObject &payload) {
+    if (ring_.empty()) return;
+    quint64 seq = next_seq_++;
+    HistoryRecord& record = slot(seq);
+    if (record.seq && record.peer != NO_ATOM) atoms_.release(record.peer);
+    if (peer != NO_ATOM) atoms_.retain(peer);
+    record.seq = seq;
+    record.time_ms = time_ms;
+    record.peer = peer;
+    record.type = type;
+    record.level = level;
+    record.payload = payload;
+}
+
+quint64 JsonCommandServer::MessageHistory::oldest() const {
+    if (next_seq_ == 1) return 0;
+    return next_seq_ > ring_.size() ? next_seq_ - ring_.size() : 1;
+}
+
+quint64 JsonCommandServer::MessageHistory::query(const HistoryFilter &filter, quint64 cursor,
+        bool forward, int limit, std::vector<const HistoryRecord*> &out) const {
+    out.clear();
+    quint64 first = oldest();
+    quint64 last = newest();
+    if (first == 0 || limit <= 0 || filter.match_nothing) return 0;
+    if (forward) {
+        quint64 seq = qMax(first, cursor + 1);
+        for (; seq <= last; ++seq) {
+            const HistoryRecord& record = slot(seq);
+            if (!matches(filter, record)) continue;
+            out.push_back(&record);
+            if (static_cast<int>(out.size()) == limit) return seq < last ? seq : 0;
+        }
+        return 0;
+    }
+    quint64 seq = cursor == 0 ? last : qMin(last, cursor - 1);
+    for (; seq >= first && seq > 0; --seq) {
+        const HistoryRecord& record = slot(seq);
+        if (!matches(filter, record)) continue;
+        out.push_back(&record);
+        if (static_cast<int>(out.size()) == limit) return seq > first ? seq : 0;
+    }
+    return 0;
+}
+
+bool JsonCommandServer::MessageHistory::matches(const HistoryFilter &filter,
+        const HistoryRecord &record) {
+    return (filter.levels & (1u << record.level)) &&
+           (filter.any_peer || record.peer == filter.peer) &&
+           (filter.any_type || record.type == filter.type) &&
+           record.time_ms >= filter.since_ms && record.time_ms <= filter.until_ms;
+}
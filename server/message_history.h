@@ -0,0 +1,120 @@
+/*
+Json Command Server
+
+MESSAGE HISTORY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_MESSAGE_HISTORY_H
+#define JSONCOMMANDSERVER_MESSAGE_HISTORY_H
+
+#include "jsoncommandserver_global.h"
+#include "atom_table.h"
+
+#include <QJsonObject>
+
+#include <vector>
+
+namespace JsonCommandServer {
+
+enum HistoryLevel {
+    HISTORY_CLIENT = 0, // MESSAGES AND COMMANDS FROM CLIENTS, MESSAGE_TO SENT BY THE SERVER
+    HISTORY_STATUS = 1, // MESSAGE_STATUS, SERVER STATUS EVENTS
+    HISTORY_ERROR = 2, // MESSAGE_ERROR, SERVER ERROR EVENTS
+    N_HISTORY_LEVELS
+};
+
+/* One dispatched command or server event. The payload shares the command's data, so keeping
+ * it costs a reference count, not a copy. */
+struct JSONCOMMANDSERVERSHARED_EXPORT HistoryRecord {
+    HistoryRecord() : seq(0), time_ms(0), peer(NO_ATOM), type(0), level(HISTORY_CLIENT) {}
+
+    quint64 seq;
+    qint64 time_ms;
+    Atom peer;
+    qint32 type;
+    qint32 level;
+    QJsonObject payload;
+};
+
+struct JSONCOMMANDSERVERSHARED_EXPORT HistoryFilter {
+    HistoryFilter();
+
+    bool match_nothing;  // e.g. a peer name that was never seen
+    quint32 levels;  // bit per HistoryLevel
+    bool any_peer;
+    Atom peer;
+    bool any_type;
+    int type;
+    qint64 since_ms;
+    qint64 until_ms;
+};
+
+/* The last `capacity` records in a ring. Records are numbered from 1 in
+ * arrival order, and the number is the cursor pages are read by, so a page
+ * stays where it was while new records come in. Appending is O(1); the peer
+ * atom is retained in the server's table while a record holds it, so the
+ * name outlives the connection. */
+class JSONCOMMANDSERVERSHARED_EXPORT MessageHistory {
+  public:
+    static const int DEFAULT_PAGE_SIZE = 100;
+    static const int MAX_PAGE_SIZE = 1000;
+
+    explicit MessageHistory(AtomTable& atoms);
+    ~MessageHistory();
+
+    void setCapacity(int capacity);
+    int capacity() const { return static_cast<int>(ring_.size()); }
+    void clear();
+
+    void append(qint64 time_ms, int level, Atom peer, int type, const QJsonObject& payload);
+
+    // seq of the oldest and newest records kept, 0 when empty
+    quint64 oldest() const;
+    quint64 newest() const { return next_seq_ - 1; }
+
+    /* Up to limit records matching filter: after cursor oldest first when
+     * forward, before it newest first otherwise (cursor 0: from the start).
+     * Returns the cursor of the next page, 0 when there is nothing past it. */
+    quint64 query(const HistoryFilter& filter, quint64 cursor, bool forward, int limit,
+                  std::vector<const HistoryRecord*>& out) const;
+
+  private:
+    HistoryRecord& slot(quint64 seq) { return ring_[(seq - 1) % ring_.size()]; }
+    const HistoryRecord& slot(quint64 seq) const { return ring_[(seq - 1) % ring_.size()]; }
+    static bool matches(const HistoryFilter& filter, const HistoryRecord& record);
+
+    AtomTable& atoms_;
+    std::vector<HistoryRecord> ring_;
+    quint64 next_seq_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_MESSAGE_HISTORY_H
@@ -0,0 +1,122 @@
+/*
+Json Command Server
+
+NODE DIRECTORY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "node_directory.h"
+
+JsonCommandServer::NodeDirectory::NodeDirectory() {
+}
+
+bool JsonCommandServer::NodeDirectory::update(const QString& node, qint64 version, int hops,
+        QTcpSocket* via, const QList<QString>& peers) {
+    std::map<QString, NodeInfo>::iterator it = nodes_.find(node);
+    if (it != nodes_.end()) {
+        NodeInfo& known = it->second;
+        if (version < known.version || (version == known.version && hops >= known.hops)) {
+            return false;
+        }
+        erasePeers(node, known);
+    }
+    NodeInfo& entry = nodes_[node];
+    entry.version = version;
+    entry.hops = hops;
+    entry.via = via;
+    entry.peers = peers;
+    for (int i = 0; i < peers.size(); ++i) {
+        peer_nodes_[peers[i]] = node;
+    }
+    return true;
+}
+
+/* Forgets every node reached through `via`; returns their names. */
+QList<QString> JsonCommandServer::NodeDirectory::removeLink(QTcpSocket* via) {
+    QList<QString> lost;
+    std::map<QString, NodeInfo>::iterator it = nodes_.begin();
+    while (it != nodes_.end()) {
+        if (it->second.via == via) {
+            lost.append(it->first);
+            erasePeers(it->first, it->second);
+            nodes_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    return lost;
+}
+
+void JsonCommandServer::NodeDirectory::clear() {
+    nodes_.clear();
+    peer_nodes_.clear();
+}
+
+QTcpSocket* JsonCommandServer::NodeDirectory::route(const QString& peer) const {
+    std::map<QString, QString>::const_iterator it = peer_nodes_.find(peer);
+    if (it == peer_nodes_.end()) return 0;
+    return routeToNode(it->second);
+}
+
+QTcpSocket* JsonCommandServer::NodeDirectory::routeToNode(const QString& node) const {
+    std::map<QString, NodeInfo>::const_iterator it = nodes_.find(node);
+    if (it == nodes_.end()) return 0;
+    return it->second.via;
+}
+
+QString JsonCommandServer::NodeDirectory::nodeOf(const QString& peer) const {
+    std::map<QString, QString>::const_iterator it = peer_nodes_.find(peer);
+    if (it == peer_nodes_.end()) return QString();
+    return it->second;
+}
+
+QList<QString> JsonCommandServer::NodeDirectory::nodes() const {
+    QList<QString> list;
+    for (std::map<QString, NodeInfo>::const_iterator it = nodes_.begin(); it != nodes_.end(); ++it) {
+        list.append(it->first);
+    }
+    return list;
+}
+
+JsonCommandServer::NodeDirectory::NodeInfo JsonCommandServer::NodeDirectory::nodeInfo(
+    const QString& node) const {
+    std::map<QString, NodeInfo>::const_iterator it = nodes_.find(node);
+    if (it == nodes_.end()) return NodeInfo();
+    return it->second;
+}
+
+void JsonCommandServer::NodeDirectory::erasePeers(const QString& node, const NodeInfo& entry) {
+    for (int i = 0; i < entry.peers.size(); ++i) {
+        std::map<QString, QString>::iterator it = peer_nodes_.find(entry.peers[i]);
+        // a peer may have moved to another node meanwhile
+        if (it != peer_nodes_.end() && it->second == node) {
+            peer_nodes_.erase(it);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/*
+Json Command Server
+
+NODE DIRECTORY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_NODE_DIRECTORY_H
+#define JSONCOMMANDSERVER_NODE_DIRECTORY_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QList>
+#include <QString>
+#include <QTcpSocket>
+
+#include <map>
+
+namespace JsonCommandServer {
+
+/* Which federated node owns each remote peer, and through which link it is
+ * reached. Every node is authoritative for its own peers: it announces them
+ * with an increasing version, and a newer version (or a shorter route for
+ * the same version) replaces what is known about that node. */
+class JSONCOMMANDSERVERSHARED_EXPORT NodeDirectory {
+  public:
+    struct NodeInfo {
+        NodeInfo() : version(0), hops(0), via(0) {}
+
+        qint64 version;
+        int hops;
+        QTcpSocket* via;
+        QList<QString> peers;
+    };
+
+    NodeDirectory();
+
+    bool update(const QString& node, qint64 version, int hops, QTcpSocket* via,
+                const QList<QString>& peers);
+    QList<QString> removeLink(QTcpSocket* via);
+    void clear();
+
+    QTcpSocket* route(const QString& peer) const;
+    QTcpSocket* routeToNode(const QString& node) const;
+    QString nodeOf(const QString& peer) const;
+    QList<QString> nodes() const;
+    NodeInfo nodeInfo(const QString& node) const;
+    int numPeers() const { return static_cast<int>(peer_nodes_.size()); }
+
+  private:
+    void erasePeers(const QString& node, const NodeInfo& entry);
+
+    std::map<QString, NodeInfo> nodes_;
+    std::map<QString, QString> peer_nodes_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_NODE_DIRECTORY_H
@@ -0,0 +1,180 @@
+/*
+Json Command Server
+
+NODE LINK
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "node_link.h"
+#include "commands_controller.h"
+
+#include <QCryptographicHash>
+#include <QMessageAuthenticationCode>
+
+#include <random>
+
+const int JsonCommandServer::NodeLinkHandshake::CHALLENGE_SIZE;
+
+JsonCommandServer::NodeLinkHandshake::NodeLinkHandshake()
+    : role_(LINK_RESPONDER),
+      step_(STEP_DONE),
+      state_(LINK_REJECTED) {
+}
+
+JsonCommandServer::NodeLinkHandshake::NodeLinkHandshake(int role, const QByteArray &secret,
+        const QString &node)
+    : role_(role),
+      step_(STEP_IDLE),
+      state_(secret.isEmpty() || node.isEmpty() ? LINK_REJECTED : LINK_PENDING),
+      secret_(secret),
+      node_(node) {
+}
+
+QJsonObject JsonCommandServer::NodeLinkHandshake::start() {
+    if (role_ != LINK_INITIATOR || step_ != STEP_IDLE || state_ != LINK_PENDING) {
+        return QJsonObject();
+    }
+    initiator_challenge_ = newChallenge();
+    step_ = STEP_HELLO_SENT;
+    QJsonObject out = message();
+    out.insert("challenge", QString::fromLatin1(initiator_challenge_.toHex()));
+    return out;
+}
+
+int JsonCommandServer::NodeLinkHandshake::receive(const QJsonObject &cmd, QJsonObject *reply) {
+    *reply = QJsonObject();
+    if (state_ != LINK_PENDING) return state_;
+    QString node = cmd["node"].toString();
+    if (node.isEmpty() || node == node_ || (!peer_.isEmpty() && node != peer_)) {
+        return reject();
+    }
+    QByteArray challenge = QByteArray::fromHex(cmd["challenge"].toString().toLatin1());
+    switch (step_) {
+    case STEP_IDLE:
+        // a responder's first message: the initiator's challenge, no proof
+        if (role_ != LINK_RESPONDER || cmd.contains("proof") ||
+                challenge.size() != CHALLENGE_SIZE) {
+            return reject();
+        }
+        peer_ = node;
+        initiator_challenge_ = challenge;
+        responder_challenge_ = newChallenge();
+        *reply = message();
+        reply->insert("ack", true);
+        reply->insert("challenge", QString::fromLatin1(responder_challenge_.toHex()));
+        step_ = STEP_CHALLENGED;
+        return state_;
+    case STEP_HELLO_SENT:
+        // the responder's challenge; a proof this early is refused
+        if (cmd.contains("proof") || challenge.size() != CHALLENGE_SIZE ||
+                challenge == initiator_challenge_) {
+            return reject();
+        }
+        peer_ = node;
+        responder_challenge_ = challenge;
+        *reply = message();
+        reply->insert("proof", QString::fromLatin1(proofOf(LINK_INITIATOR).toHex()));
+        step_ = STEP_PROOF_SENT;
+        return state_;
+    case STEP_CHALLENGED:
+        if (!checkProof(LINK_INITIATOR, cmd)) return reject();
+        *reply = message();
+        reply->insert("ack", true);
+        reply->insert("proof", QString::fromLatin1(proofOf(LINK_RESPONDER).toHex()));
+        step_ = STEP_DONE;
+        state_ = LINK_ACCEPTED;
+        return state_;
+    case STEP_PROOF_SENT:
+        if (!checkProof(LINK_RESPONDER, cmd)) return reject();
+        step_ = STEP_DONE;
+        state_ = LINK_ACCEPTED;
+        return state_;
+    default:
+        return reject();
+    }
+}
+
+int JsonCommandServer::NodeLinkHandshake::reject() {
+    step_ = STEP_DONE;
+    state_ = LINK_REJECTED;
+    return state_;
+}
+
+QByteArray JsonCommandServer::NodeLinkHandshake::newChallenge() {
+    std::random_device random;
+    QByteArray challenge;
+    for (int i = 0; i < CHALLENGE_SIZE; i += 4) {
+        quint32 word = random();
+        challenge.append(reinterpret_cast<const char*>(&word), 4);
+    }
+    return challenge;
+}
+
+/* Challenges have a fixed size and names are length prefixed, so no two
+ * handshakes hash the same bytes. */
+QByteArray JsonCommandServer::NodeLinkHandshake::proof(const QByteArray &secret, int role,
+        const QByteArray &initiator_challenge, const QByteArray &responder_challenge,
+        const QString &initiator, const QString &responder) {
+    QByteArray initiator_name = initiator.toUtf8();
+    QByteArray responder_name = responder.toUtf8();
+    QByteArray data(role == LINK_INITIATOR ? "initiator" : "responder");
+    data.append('\0');
+    data.append(initiator_challenge);
+    data.append(responder_challenge);
+    data.append(IntToArray(initiator_name.size()));
+    data.append(initiator_name);
+    data.append(IntToArray(responder_name.size()));
+    data.append(responder_name);
+    return QMessageAuthenticationCode::hash(data, secret, QCryptographicHash::Sha256);
+}
+
+QByteArray JsonCommandServer::NodeLinkHandshake::proofOf(int role) const {
+    bool initiator = role_ == LINK_INITIATOR;
+    return proof(secret_, role, initiator_challenge_, responder_challenge_,
+                 initiator ? node_ : peer_, initiator ? peer_ : node_);
+}
+
+/* Compares in constant time. */
+bool JsonCommandServer::NodeLinkHandshake::checkProof(int role, const QJsonObject &cmd) const {
+    if (cmd.contains("challenge")) return false;
+    QByteArray expected = proofOf(role);
+    QByteArray given = QByteArray::fromHex(cmd["proof"].toString().toLatin1());
+    if (given.size() != expected.size()) return false;
+    char diff = 0;
+    for (int i = 0; i < expected.size(); ++i) {
+        diff |= given[i] ^ expected[i];
+    }
+    return diff == 0;
+}
+
+QJsonObject JsonCommandServer::NodeLinkHandshake::message() const {
+    QJsonObject out;
+    out.insert("node", node_);
+    return out;
+}
@@ -0,0 +1,113 @@
+/*
+Json Command Server
+
+NODE LINK
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_NODE_LINK_H
+#define JSONCOMMANDSERVER_NODE_LINK_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QString>
+
+namespace JsonCommandServer {
+
+enum LinkRole {
+    LINK_INITIATOR = 0, // OPENED THE CONNECTION, SEE connectToNode()
+    LINK_RESPONDER = 1 // ACCEPTED IT
+};
+
+enum LinkState {
+    LINK_PENDING = 0,
+    LINK_ACCEPTED = 1,
+    LINK_REJECTED = 2
+};
+
+/* One side of the NODE_LINK handshake between two servers sharing a secret:
+ *   I -> R  {node: I, challenge: C1}
+ *   R -> I  {node: R, ack, challenge: C2}
+ *   I -> R  {node: I, proof: HMAC(secret, "initiator", C1, C2, I, R)}
+ *   R -> I  {node: R, ack, proof: HMAC(secret, "responder", C1, C2, I, R)}
+ * A responder proves nothing until the initiator has, and an initiator only
+ * answers on a connection it opened, so neither side can be made to sign a
+ * challenge for someone else. Both challenges, both names and the role are in
+ * every proof: a proof is good for one connection and one direction only. */
+class JSONCOMMANDSERVERSHARED_EXPORT NodeLinkHandshake {
+  public:
+    static const int CHALLENGE_SIZE = 16;
+
+    NodeLinkHandshake();
+    NodeLinkHandshake(int role, const QByteArray& secret, const QString& node);
+
+    /* The initiator's first message. */
+    QJsonObject start();
+    /* Takes the other side's NODE_LINK (without "type") and says where the
+     * handshake stands; *reply gets what to send back, empty for nothing. */
+    int receive(const QJsonObject& cmd, QJsonObject* reply);
+
+    int state() const { return state_; }
+    QString peer() const { return peer_; }
+
+    static QByteArray newChallenge();
+    static QByteArray proof(const QByteArray& secret, int role,
+                            const QByteArray& initiator_challenge,
+                            const QByteArray& responder_challenge,
+                            const QString& initiator, const QString& responder);
+
+  private:
+    enum Step {
+        STEP_IDLE,
+        STEP_HELLO_SENT,  // initiator, waiting for C2
+        STEP_CHALLENGED,  // responder, waiting for the initiator's proof
+        STEP_PROOF_SENT,  // initiator, waiting for the responder's proof
+        STEP_DONE
+    };
+
+    int reject();
+    QByteArray proofOf(int role) const;
+    bool checkProof(int role, const QJsonObject& cmd) const;
+    QJsonObject message() const;
+
+    int role_;
+    int step_;
+    int state_;
+    QByteArray secret_;
+    QString node_;
+    QString peer_;
+    QByteArray initiator_challenge_;
+    QByteArray responder_challenge_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_NODE_LINK_H
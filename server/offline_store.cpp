@@ -0,0 +1,530 @@
+/*
+Json Command Server
+
+OFFLINE STORE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "offline_store.h"
+
+#include "binary_format.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QStringList>
+
+#include <cstring>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+static const quint32 SEGMENT_MAGIC = 0x4a435351; // "JCSQ"
+static const quint32 INDEX_MAGIC = 0x4a435349; // "JCSI"
+static const quint32 STORE_VERSION = 1;
+static const qint64 SEGMENT_HEADER_SIZE = 32;
+static const qint64 RECORD_HEADER_SIZE = 16;
+static const qint64 INDEX_SIZE = 32;
+static const qint64 DEFAULT_SEGMENT_SIZE = 4 * 1024 * 1024;
+static const qint64 DEFAULT_MAX_BYTES = 64 * 1024 * 1024;
+static const qint64 DEFAULT_MAX_AGE = 24 * 3600 * 1000;
+static const int DEFAULT_MAX_DESTINATIONS = 1024;
+static const qint64 DEFAULT_MAX_TOTAL_BYTES = Q_INT64_C(1024) * 1024 * 1024;
+static const int DEFAULT_MAX_OPEN_QUEUES = 64;
+static const int MAX_QUEUE_NAME = 255; // NAME_MAX OF THE USUAL FILE SYSTEMS
+static const char HASHED_PREFIX[] = "sha256-";
+static const char NAME_FILE[] = "name";
+
+static QString segmentName(quint64 id) {
+    return QString("%1.seg").arg(id, 16, 16, QChar('0'));
+}
+
+/* Hex of the name, or its hash when the hex does not fit in a file name; the
+ * hashed form cannot clash with the other, 's' is not a hex digit. */
+static QString queueName(const QString& dest) {
+    QByteArray hex = dest.toUtf8().toHex();
+    if (hex.size() <= MAX_QUEUE_NAME) return QString::fromLatin1(hex);
+    return HASHED_PREFIX + QString::fromLatin1(
+               QCryptographicHash::hash(dest.toUtf8(), QCryptographicHash::Sha256).toHex());
+}
+
+static void syncMemory(uchar* data, qint64 size) {
+#ifdef Q_OS_UNIX
+    ::msync(data, static_cast<size_t>(size), MS_SYNC);
+#else
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+#endif
+}
+
+JsonCommandServer::OfflineStore::OfflineStore()
+    : segment_size_(DEFAULT_SEGMENT_SIZE),
+      max_bytes_(DEFAULT_MAX_BYTES),
+      max_age_ms_(DEFAULT_MAX_AGE),
+      max_destinations_(DEFAULT_MAX_DESTINATIONS),
+      max_total_bytes_(DEFAULT_MAX_TOTAL_BYTES),
+      max_open_queues_(DEFAULT_MAX_OPEN_QUEUES),
+      total_bytes_(0),
+      open_queues_(0),
+      clock_(0),
+      dropped_(0) {
+}
+
+JsonCommandServer::OfflineStore::~OfflineStore() {
+    close();
+}
+
+bool JsonCommandServer::OfflineStore::open(const QString& path) {
+    close();
+    QDir dir(path);
+    if (!dir.exists() && !dir.mkpath(".")) return false;
+    path_ = dir.absolutePath();
+    QStringList dests = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (int i = 0; i < dests.size(); ++i) {
+        QString dest;
+        if (dests[i].startsWith(HASHED_PREFIX)) {
+            QFile name(QDir(dir.filePath(dests[i])).filePath(NAME_FILE));
+            if (!name.open(QIODevice::ReadOnly)) continue;
+            dest = QString::fromUtf8(name.readAll());
+        } else {
+            dest = QString::fromUtf8(QByteArray::fromHex(dests[i].toLatin1()));
+        }
+        makeRoom();
+        Queue* q = new Queue;
+        if (openQueue(q, dir.filePath(dests[i]))) {
+            total_bytes_ += q->bytes;
+            queues_[dest] = q;
+        } else {
+            closeQueue(q);
+            delete q;
+        }
+    }
+    expire();
+    return true;
+}
+
+void JsonCommandServer::OfflineStore::close() {
+    for (std::map<QString, Queue*>::iterator it = queues_.begin(); it != queues_.end(); ++it) {
+        syncQueue(it->second);
+        closeQueue(it->second);
+        delete it->second;
+    }
+    queues_.clear();
+    total_bytes_ = 0;
+    path_ = QString();
+}
+
+void JsonCommandServer::OfflineStore::setSegmentSize(qint64 _segment_size) {
+    segment_size_ = qMax(_segment_size, SEGMENT_HEADER_SIZE + RECORD_HEADER_SIZE);
+}
+
+void JsonCommandServer::OfflineStore::setMaxBytes(qint64 _max_bytes) {
+    max_bytes_ = _max_bytes;
+}
+
+void JsonCommandServer::OfflineStore::setMaxAge(qint64 _max_age_ms) {
+    max_age_ms_ = _max_age_ms;
+}
+
+void JsonCommandServer::OfflineStore::setMaxDestinations(int _max_destinations) {
+    max_destinations_ = _max_destinations;
+}
+
+void JsonCommandServer::OfflineStore::setMaxTotalBytes(qint64 _max_total_bytes) {
+    max_total_bytes_ = _max_total_bytes;
+}
+
+void JsonCommandServer::OfflineStore::setMaxOpenQueues(int _max_open_queues) {
+    max_open_queues_ = _max_open_queues;
+    makeRoom();
+}
+
+bool JsonCommandServer::OfflineStore::append(const QString& dest, const QByteArray& frame,
+        int sync_policy) {
+    if (!isOpen()) return false;
+    qint64 need = RECORD_HEADER_SIZE + align8(frame.size());
+    if ((max_bytes_ > 0 && need > max_bytes_) ||
+            (max_total_bytes_ > 0 && total_bytes_ + need > max_total_bytes_)) {
+        ++dropped_;
+        return false;
+    }
+    Queue* q = queue(dest, true);
+    if (!q) {
+        ++dropped_;
+        return false;
+    }
+    // size limit: the oldest records make room for the newest
+    while (max_bytes_ > 0 && q->bytes + need > max_bytes_ && popRecord(q, 0, 0)) {
+        ++dropped_;
+    }
+    Segment* seg = q->segments.empty() ? 0 : &q->segments.back();
+    if (!seg || readField<qint64>(seg->data + 16) + need > seg->capacity) {
+        if (!addSegment(q, q->next_id, qMax(segment_size_, SEGMENT_HEADER_SIZE + need))) {
+            return false;
+        }
+        seg = &q->segments.back();
+    }
+    qint64 pos = readField<qint64>(seg->data + 16);
+    uchar* p = seg->data + pos;
+    writeField<quint32>(p, static_cast<quint32>(frame.size()));
+    writeField<quint32>(p + 4, checksum(frame.constData(), frame.size()));
+    writeField<qint64>(p + 8, QDateTime::currentMSecsSinceEpoch());
+    std::memcpy(p + RECORD_HEADER_SIZE, frame.constData(), frame.size());
+    // publish the record only once it is complete
+    writeField<qint64>(seg->data + 16, pos + need);
+    q->bytes += need;
+    total_bytes_ += need;
+    if (sync_policy == SYNC_ALWAYS) {
+        syncMemory(seg->data, seg->capacity);
+    } else if (sync_policy == SYNC_PERIODIC && !q->dirty) {
+        q->dirty = true;
+        q->dirty_from = seg->id;
+    }
+    return true;
+}
+
+QList<QByteArray> JsonCommandServer::OfflineStore::take(const QString& dest, int max_records) {
+    QList<QByteArray> out;
+    Queue* q = queue(dest, false);
+    if (!q) return out;
+    qint64 cutoff = max_age_ms_ > 0 ? QDateTime::currentMSecsSinceEpoch() - max_age_ms_ : 0;
+    QByteArray payload;
+    qint64 time_ms = 0;
+    while (out.size() < max_records && popRecord(q, &payload, &time_ms)) {
+        if (time_ms < cutoff || payload.isEmpty()) {
+            ++dropped_;
+            continue;
+        }
+        out.append(payload);
+    }
+    return out;
+}
+
+bool JsonCommandServer::OfflineStore::hasPending(const QString& dest) const {
+    std::map<QString, Queue*>::const_iterator it = queues_.find(dest);
+    return it != queues_.end() && it->second->bytes > 0;
+}
+
+void JsonCommandServer::OfflineStore::sync() {
+    for (std::map<QString, Queue*>::iterator it = queues_.begin(); it != queues_.end(); ++it) {
+        syncQueue(it->second);
+    }
+}
+
+/* Drops records older than the maximum age and forgets empty destinations.
+ * A closed queue is reopened only when its head, read as it was closed, is
+ * due. */
+void JsonCommandServer::OfflineStore::expire() {
+    qint64 cutoff = max_age_ms_ > 0 ? QDateTime::currentMSecsSinceEpoch() - max_age_ms_ : 0;
+    std::map<QString, Queue*>::iterator it = queues_.begin();
+    while (it != queues_.end()) {
+        Queue* q = it->second;
+        if (!q->index_file && ((q->bytes > 0 && q->head_time >= cutoff) || !reopenQueue(q))) {
+            ++it;
+            continue;
+        }
+        while (!q->segments.empty()) {
+            Segment& seg = q->segments.front();
+            qint64 offset = readField<qint64>(q->index + 16);
+            if (readField<quint64>(q->index + 8) != seg.id) offset = SEGMENT_HEADER_SIZE;
+            if (offset + RECORD_HEADER_SIZE > readField<qint64>(seg.data + 16)) {
+                removeFrontSegment(q);
+                continue;
+            }
+            if (readField<qint64>(seg.data + offset + 8) >= cutoff) break;
+            if (popRecord(q, 0, 0)) ++dropped_;
+        }
+        if (q->segments.empty()) {
+            QString path = q->path;
+            total_bytes_ -= q->bytes;
+            closeQueue(q);
+            delete q;
+            QDir(path).removeRecursively();
+            queues_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+qint64 JsonCommandServer::OfflineStore::pendingBytes() const {
+    qint64 bytes = 0;
+    for (std::map<QString, Queue*>::const_iterator it = queues_.begin(); it != queues_.end(); ++it) {
+        bytes += it->second->bytes;
+    }
+    return bytes;
+}
+
+JsonCommandServer::OfflineStore::Queue* JsonCommandServer::OfflineStore::queue(
+    const QString& dest, bool create) {
+    std::map<QString, Queue*>::iterator it = queues_.find(dest);
+    if (it != queues_.end()) {
+        Queue* q = it->second;
+        if (!q->index_file && !reopenQueue(q)) return 0;
+        q->last_used = ++clock_;
+        return q;
+    }
+    if (!create) return 0;
+    if (max_destinations_ > 0 && numDestinations() >= max_destinations_) return 0;
+    QDir dir(path_);
+    QString name = queueName(dest);
+    if (!dir.mkpath(name)) return 0;
+    if (name.startsWith(HASHED_PREFIX)) {
+        QFile file(QDir(dir.filePath(name)).filePath(NAME_FILE));
+        if (!file.open(QIODevice::WriteOnly) || file.write(dest.toUtf8()) < 0) return 0;
+    }
+    makeRoom();
+    Queue* q = new Queue;
+    if (!openQueue(q, dir.filePath(name))) {
+        closeQueue(q);
+        delete q;
+        return 0;
+    }
+    total_bytes_ += q->bytes;
+    queues_[dest] = q;
+    return q;
+}
+
+bool JsonCommandServer::OfflineStore::reopenQueue(Queue* q) {
+    makeRoom();
+    qint64 bytes = q->bytes;
+    if (!openQueue(q, q->path)) {
+        closeQueue(q);
+        q->bytes = bytes;
+        return false;
+    }
+    total_bytes_ += q->bytes - bytes;
+    return true;
+}
+
+/* Closes the least recently used queues until one more can be opened. */
+void JsonCommandServer::OfflineStore::makeRoom() {
+    while (max_open_queues_ > 0 && open_queues_ >= max_open_queues_) {
+        Queue* lru = 0;
+        for (std::map<QString, Queue*>::iterator it = queues_.begin(); it != queues_.end(); ++it) {
+            Queue* q = it->second;
+            if (q->index_file && (!lru || q->last_used < lru->last_used)) lru = q;
+        }
+        if (!lru) return;
+        syncQueue(lru);
+        lru->head_time = headTime(lru);
+        closeQueue(lru);
+    }
+}
+
+/* Timestamp of the oldest record still to replay. */
+qint64 JsonCommandServer::OfflineStore::headTime(const Queue* q) const {
+    for (size_t i = 0; i < q->segments.size(); ++i) {
+        const Segment& seg = q->segments[i];
+        qint64 offset = SEGMENT_HEADER_SIZE;
+        if (readField<quint64>(q->index + 8) == seg.id) {
+            offset = qMax(offset, readField<qint64>(q->index + 16));
+        }
+        if (offset + RECORD_HEADER_SIZE <= readField<qint64>(seg.data + 16)) {
+            return readField<qint64>(seg.data + offset + 8);
+        }
+    }
+    return std::numeric_limits<qint64>::max();
+}
+
+bool JsonCommandServer::OfflineStore::openQueue(Queue* q, const QString& path) {
+    q->path = path;
+    q->index = 0;
+    q->bytes = 0;
+    q->next_id = 1;
+    q->dirty_from = 0;
+    q->dirty = false;
+    q->last_used = ++clock_;
+    q->head_time = 0;
+    QDir dir(path);
+    q->index_file = new QFile(dir.filePath("index"));
+    ++open_queues_;
+    if (!q->index_file->open(QIODevice::ReadWrite)) return false;
+    bool fresh = q->index_file->size() < INDEX_SIZE;
+    if (fresh && !q->index_file->resize(INDEX_SIZE)) return false;
+    q->index = q->index_file->map(0, INDEX_SIZE);
+    if (!q->index) return false;
+    if (fresh || readField<quint32>(q->index) != INDEX_MAGIC) {
+        writeField<quint32>(q->index, INDEX_MAGIC);
+        writeField<quint32>(q->index + 4, STORE_VERSION);
+        writeField<quint64>(q->index + 8, 0);
+        writeField<qint64>(q->index + 16, SEGMENT_HEADER_SIZE);
+    }
+    quint64 head = readField<quint64>(q->index + 8);
+    QStringList names = dir.entryList(QStringList() << "*.seg", QDir::Files, QDir::Name);
+    for (int i = 0; i < names.size(); ++i) {
+        bool ok = false;
+        quint64 id = names[i].left(names[i].size() - 4).toULongLong(&ok, 16);
+        if (!ok) continue;
+        if (id < head || !mapSegment(q, id, false, 0)) {
+            // already replayed, or unreadable
+            QFile::remove(dir.filePath(names[i]));
+            continue;
+        }
+        Segment& seg = q->segments.back();
+        q->bytes += readField<qint64>(seg.data + 16) - SEGMENT_HEADER_SIZE;
+        q->next_id = id + 1;
+    }
+    if (!q->segments.empty() && q->segments.front().id == head) {
+        q->bytes -= qMax<qint64>(0, readField<qint64>(q->index + 16) - SEGMENT_HEADER_SIZE);
+    }
+    return true;
+}
+
+bool JsonCommandServer::OfflineStore::addSegment(Queue* q, quint64 id, qint64 capacity) {
+    if (!mapSegment(q, id, true, capacity)) return false;
+    q->next_id = id + 1;
+    if (q->segments.size() == 1) {
+        writeField<quint64>(q->index + 8, id);
+        writeField<qint64>(q->index + 16, SEGMENT_HEADER_SIZE);
+    }
+    return true;
+}
+
+bool JsonCommandServer::OfflineStore::mapSegment(Queue* q, quint64 id, bool create,
+        qint64 capacity) {
+    QFile* file = new QFile(QDir(q->path).filePath(segmentName(id)));
+    if (!file->open(QIODevice::ReadWrite)) {
+        delete file;
+        return false;
+    }
+    if (create) {
+        file->resize(capacity);
+    }
+    capacity = file->size();
+    uchar* data = capacity >= SEGMENT_HEADER_SIZE ? file->map(0, capacity) : 0;
+    if (!data) {
+        delete file;
+        return false;
+    }
+    if (create) {
+        writeField<quint32>(data, SEGMENT_MAGIC);
+        writeField<quint32>(data + 4, STORE_VERSION);
+        writeField<quint64>(data + 8, id);
+        writeField<qint64>(data + 16, SEGMENT_HEADER_SIZE);
+    } else {
+        qint64 used = readField<qint64>(data + 16);
+        if (readField<quint32>(data) != SEGMENT_MAGIC || used < SEGMENT_HEADER_SIZE ||
+                used > capacity) {
+            file->unmap(data);
+            delete file;
+            return false;
+        }
+    }
+    Segment seg;
+    seg.id = id;
+    seg.file = file;
+    seg.data = data;
+    seg.capacity = capacity;
+    q->segments.push_back(seg);
+    return true;
+}
+
+void JsonCommandServer::OfflineStore::removeFrontSegment(Queue* q) {
+    Segment seg = q->segments.front();
+    q->segments.pop_front();
+    seg.file->unmap(seg.data);
+    seg.file->close();
+    seg.file->remove();
+    delete seg.file;
+    if (!q->segments.empty()) {
+        writeField<quint64>(q->index + 8, q->segments.front().id);
+        writeField<qint64>(q->index + 16, SEGMENT_HEADER_SIZE);
+    }
+}
+
+bool JsonCommandServer::OfflineStore::popRecord(Queue* q, QByteArray* payload, qint64* time_ms) {
+    while (!q->segments.empty()) {
+        Segment& seg = q->segments.front();
+        qint64 offset = readField<qint64>(q->index + 16);
+        if (readField<quint64>(q->index + 8) != seg.id || offset < SEGMENT_HEADER_SIZE) {
+            offset = SEGMENT_HEADER_SIZE;
+        }
+        qint64 used = readField<qint64>(seg.data + 16);
+        if (offset + RECORD_HEADER_SIZE > used) {
+            // fully replayed; the last segment goes too, appends open a new one
+            removeFrontSegment(q);
+            continue;
+        }
+        const uchar* p = seg.data + offset;
+        quint32 length = readField<quint32>(p);
+        qint64 size = RECORD_HEADER_SIZE + align8(length);
+        if (offset + size > used) {
+            q->bytes -= used - offset;
+            total_bytes_ -= used - offset;
+            removeFrontSegment(q);
+            continue;
+        }
+        if (payload) {
+            const char* data = reinterpret_cast<const char*>(p + RECORD_HEADER_SIZE);
+            if (checksum(data, length) == readField<quint32>(p + 4)) {
+                *payload = QByteArray(data, length);
+            } else {
+                *payload = QByteArray();
+            }
+        }
+        if (time_ms) *time_ms = readField<qint64>(p + 8);
+        writeField<quint64>(q->index + 8, seg.id);
+        writeField<qint64>(q->index + 16, offset + size);
+        q->bytes -= size;
+        total_bytes_ -= size;
+        return true;
+    }
+    total_bytes_ -= q->bytes;
+    q->bytes = 0;
+    return false;
+}
+
+void JsonCommandServer::OfflineStore::syncQueue(Queue* q) {
+    if (!q->dirty) return;
+    for (size_t i = 0; i < q->segments.size(); ++i) {
+        if (q->segments[i].id >= q->dirty_from) {
+            syncMemory(q->segments[i].data, q->segments[i].capacity);
+        }
+    }
+    syncMemory(q->index, INDEX_SIZE);
+    q->dirty = false;
+}
+
+void JsonCommandServer::OfflineStore::closeQueue(Queue* q) {
+    for (size_t i = 0; i < q->segments.size(); ++i) {
+        q->segments[i].file->unmap(q->segments[i].data);
+        delete q->segments[i].file;
+    }
+    q->segments.clear();
+    if (q->index_file) {
+        if (q->index) q->index_file->unmap(q->index);
+        delete q->index_file;
+        --open_queues_;
+    }
+    q->index_file = 0;
+    q->index = 0;
+}
@@ -0,0 +1,148 @@
+/*
+Json Command Server
+
+OFFLINE STORE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_OFFLINE_STORE_H
+#define JSONCOMMANDSERVER_OFFLINE_STORE_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QString>
+
+#include <deque>
+#include <map>
+
+namespace JsonCommandServer {
+
+enum OfflineSyncPolicy {
+    SYNC_NEVER = 0, // LEAVE IT TO THE KERNEL
+    SYNC_PERIODIC = 1, // FLUSHED BY OfflineStore::sync()
+    SYNC_ALWAYS = 2 // FLUSHED BEFORE append() RETURNS
+};
+
+/* Store-and-forward log of frames for peers that are offline.
+ *
+ * Every destination owns a directory with memory-mapped segment files and a
+ * small mapped index holding the replay position, so reopening the store
+ * only reads segment headers. Segment layout:
+ *   header: magic, version, segment id, used bytes
+ *   record: payload length, checksum, timestamp (ms since epoch), payload
+ *           padded to 8 bytes
+ * A maximum size or age <= 0 disables that retention limit.
+ *
+ * Destinations come from clients, so the store as a whole is bounded too:
+ * a frame to a new destination past the maximum number of destinations, or
+ * past the total size, is dropped, and only the most recently used queues
+ * stay mapped; the others are closed and reopened on demand. A name whose
+ * hex encoding does not fit in a file name gets a directory named after its
+ * hash and keeps the full name in a file inside it. */
+class JSONCOMMANDSERVERSHARED_EXPORT OfflineStore {
+  public:
+    OfflineStore();
+    ~OfflineStore();
+
+    bool open(const QString& path);
+    void close();
+    bool isOpen() const { return !path_.isEmpty(); }
+
+    void setSegmentSize(qint64 _segment_size);
+    void setMaxBytes(qint64 _max_bytes);
+    void setMaxAge(qint64 _max_age_ms);
+    void setMaxDestinations(int _max_destinations);
+    void setMaxTotalBytes(qint64 _max_total_bytes);
+    void setMaxOpenQueues(int _max_open_queues);
+
+    bool append(const QString& dest, const QByteArray& frame, int sync_policy);
+    QList<QByteArray> take(const QString& dest, int max_records);
+    bool hasPending(const QString& dest) const;
+
+    void sync();
+    void expire();
+
+    qint64 pendingBytes() const;
+    int numDestinations() const { return static_cast<int>(queues_.size()); }
+    int numOpenQueues() const { return open_queues_; }
+    quint64 dropped() const { return dropped_; }
+
+  private:
+    struct Segment {
+        quint64 id;
+        QFile* file;
+        uchar* data;
+        qint64 capacity;
+    };
+
+    struct Queue {
+        QString path;
+        QFile* index_file;
+        uchar* index;
+        std::deque<Segment> segments;
+        qint64 bytes;
+        quint64 next_id;
+        quint64 dirty_from;
+        bool dirty;
+        quint64 last_used;
+        qint64 head_time;
+    };
+
+    Queue* queue(const QString& dest, bool create);
+    bool reopenQueue(Queue* q);
+    void makeRoom();
+    qint64 headTime(const Queue* q) const;
+    bool openQueue(Queue* q, const QString& path);
+    bool addSegment(Queue* q, quint64 id, qint64 capacity);
+    bool mapSegment(Queue* q, quint64 id, bool create, qint64 capacity);
+    void removeFrontSegment(Queue* q);
+    bool popRecord(Queue* q, QByteArray* payload, qint64* time_ms);
+    void syncQueue(Queue* q);
+    void closeQueue(Queue* q);
+
+    QString path_;
+    qint64 segment_size_;
+    qint64 max_bytes_;
+    qint64 max_age_ms_;
+    int max_destinations_;
+    qint64 max_total_bytes_;
+    int max_open_queues_;
+    qint64 total_bytes_;
+    int open_queues_;
+    quint64 clock_;
+    quint64 dropped_;
+    std::map<QString, Queue*> queues_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_OFFLINE_STORE_H
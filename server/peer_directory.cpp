@@ -0,0 +1,133 @@
+/*
+Json Command Server
+
+PEER DIRECTORY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "peer_directory.h"
+
+static const int N_READER_SLOTS = 128;
+
+namespace {
+
+/* Epochs are shared by every directory: a reader's slot says "I may hold any
+ * snapshot still current at this epoch". 0 marks an idle slot. */
+std::atomic<quint64> g_epoch(1);
+std::atomic<quint64> g_reader_epochs[N_READER_SLOTS];
+std::atomic<bool> g_reader_claimed[N_READER_SLOTS];
+// readers that found no free slot; nothing is reclaimed while there are any
+std::atomic<int> g_overflow_readers(0);
+
+struct ReaderSlot {
+    ReaderSlot() : slot(-1), depth(0) {
+        for (int i = 0; i < N_READER_SLOTS; ++i) {
+            bool expected = false;
+            if (!g_reader_claimed[i].load(std::memory_order_relaxed) &&
+                    g_reader_claimed[i].compare_exchange_strong(expected, true)) {
+                slot = i;
+                break;
+            }
+        }
+    }
+
+    ~ReaderSlot() {
+        if (slot >= 0) g_reader_claimed[slot].store(false);
+    }
+
+    int slot;
+    int depth;
+};
+
+ReaderSlot& readerSlot() {
+    thread_local ReaderSlot reader;
+    return reader;
+}
+
+}  // namespace
+
+JsonCommandServer::PeerDirectory::PeerDirectory()
+    : current_(new PeerSnapshot) {
+}
+
+/* No reader may be left when the directory goes. */
+JsonCommandServer::PeerDirectory::~PeerDirectory() {
+    delete current_.load();
+    for (size_t i = 0; i < retired_.size(); ++i) {
+        delete retired_[i].first;
+    }
+}
+
+JsonCommandServer::PeerDirectory::ReadGuard::ReadGuard(const PeerDirectory &directory) {
+    ReaderSlot& reader = readerSlot();
+    if (reader.depth++ == 0) {
+        if (reader.slot >= 0) {
+            g_reader_epochs[reader.slot].store(g_epoch.load());
+        } else {
+            ++g_overflow_readers;
+        }
+    }
+    snapshot_ = directory.current_.load();
+}
+
+JsonCommandServer::PeerDirectory::ReadGuard::~ReadGuard() {
+    ReaderSlot& reader = readerSlot();
+    if (--reader.depth == 0) {
+        if (reader.slot >= 0) {
+            g_reader_epochs[reader.slot].store(0, std::memory_order_release);
+        } else {
+            --g_overflow_readers;
+        }
+    }
+}
+
+void JsonCommandServer::PeerDirectory::publish(PeerSnapshot *snapshot) {
+    PeerSnapshot* old = current_.exchange(snapshot);
+    // readers that loaded `old` stored an epoch <= this one before loading it
+    retired_.push_back(std::make_pair(old, g_epoch.fetch_add(1)));
+    reclaim();
+}
+
+void JsonCommandServer::PeerDirectory::reclaim() {
+    if (retired_.empty() || g_overflow_readers.load() > 0) return;
+    quint64 oldest = g_epoch.load();
+    for (int i = 0; i < N_READER_SLOTS; ++i) {
+        quint64 epoch = g_reader_epochs[i].load();
+        if (epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+        if (retired_[i].second < oldest) {
+            delete retired_[i].first;
+        } else {
+            retired_[kept++] = retired_[i];
+        }
+    }
+    retired_.resize(kept);
+}
@@ -0,0 +1,110 @@
+/*
+Json Command Server
+
+PEER DIRECTORY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_PEER_DIRECTORY_H
+#define JSONCOMMANDSERVER_PEER_DIRECTORY_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+class QTcpSocket;
+
+namespace JsonCommandServer {
+
+/* The local peers at one version. Never changed once published. */
+struct JSONCOMMANDSERVERSHARED_EXPORT PeerSnapshot {
+    PeerSnapshot() : version(0) {}
+
+    quint64 version;
+    QHash<QString, QTcpSocket*> peers;
+    QList<QString> names;  // sorted
+    QByteArray peer_list;  // encoded MESSAGE_PEER_LIST, without its length prefix
+};
+
+/* Read-copy-update view of the local peers for other threads. The owning
+ * thread publishes a new snapshot, and readers in any thread pin the current
+ * one with a ReadGuard:
+ *
+ *     PeerDirectory::ReadGuard peers(directory);
+ *     if (peers->peers.contains(name)) ...
+ *
+ * Reading is wait-free: a guard stores the global epoch in its thread's slot,
+ * loads the snapshot pointer and clears the slot when it goes away. A
+ * replaced snapshot is freed once no slot holds an epoch from before its
+ * replacement, checked whenever the writer publishes. Guards may nest. Sockets
+ * in a snapshot are only names for the owner's connections, never used from
+ * another thread. */
+class JSONCOMMANDSERVERSHARED_EXPORT PeerDirectory {
+  public:
+    PeerDirectory();
+    ~PeerDirectory();
+
+    class JSONCOMMANDSERVERSHARED_EXPORT ReadGuard {
+      public:
+        explicit ReadGuard(const PeerDirectory& directory);
+        ~ReadGuard();
+
+        const PeerSnapshot* operator->() const { return snapshot_; }
+        const PeerSnapshot& operator*() const { return *snapshot_; }
+
+      private:
+        ReadGuard(const ReadGuard&);
+        ReadGuard& operator=(const ReadGuard&);
+
+        const PeerSnapshot* snapshot_;
+    };
+
+    // owning thread only; takes the snapshot
+    void publish(PeerSnapshot* snapshot);
+    void reclaim();
+    int retired() const { return int(retired_.size()); }
+
+  private:
+    PeerDirectory(const PeerDirectory&);
+    PeerDirectory& operator=(const PeerDirectory&);
+
+    std::atomic<PeerSnapshot*> current_;
+    std::vector<std::pair<PeerSnapshot*, quint64> > retired_;  // with the epoch it was replaced in
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_PEER_DIRECTORY_H
@@ -0,0 +1,233 @@
+/*
+Json Command Server
+
+PEER INDEX
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "peer_index.h"
+
+#include <QObject>
+
+static const char GROUP_PREFIX[] = "group:";
+static const char TYPE_PREFIX[] = "type:";
+static const int GROUP_PREFIX_SIZE = sizeof(GROUP_PREFIX) - 1;
+static const int TYPE_PREFIX_SIZE = sizeof(TYPE_PREFIX) - 1;
+
+const int JsonCommandServer::PeerIndex::MAX_SELECTOR_SIZE;
+const int JsonCommandServer::PeerIndex::MAX_SELECTOR_DEPTH;
+
+/* Recursive descent over the selector, evaluating as it goes:
+ *     expr   := term ('|' term)*
+ *     term   := factor ('&' factor)*
+ *     factor := '!' factor | '(' expr ')' | group:<n> | type:<name>
+ * Each factor counts as one nesting level, so the recursion is bounded by
+ * MAX_SELECTOR_DEPTH. */
+class JsonCommandServer::PeerIndex::Parser {
+  public:
+    Parser(const PeerIndex& index, const QString& text)
+        : index_(index), text_(text), pos_(0), depth_(0) {}
+
+    bool parse(std::set<Atom>& out, QString& error) {
+        bool ok = expr(out);
+        skipSpaces();
+        if (ok && pos_ < text_.size()) {
+            ok = fail(QObject::tr("'%1' inesperado").arg(text_[pos_]));
+        }
+        error = error_;
+        return ok;
+    }
+
+  private:
+    bool expr(std::set<Atom>& out) {
+        if (!term(out)) return false;
+        while (accept('|')) {
+            std::set<Atom> rhs;
+            if (!term(rhs)) return false;
+            out.insert(rhs.begin(), rhs.end());
+        }
+        return true;
+    }
+
+    bool term(std::set<Atom>& out) {
+        if (!factor(out)) return false;
+        while (accept('&')) {
+            std::set<Atom> rhs;
+            if (!factor(rhs)) return false;
+            // walk the smaller side
+            std::set<Atom>& small = out.size() < rhs.size() ? out : rhs;
+            const std::set<Atom>& large = out.size() < rhs.size() ? rhs : out;
+            std::set<Atom> both;
+            for (std::set<Atom>::const_iterator it = small.begin(); it != small.end(); ++it) {
+                if (large.count(*it)) both.insert(both.end(), *it);
+            }
+            out.swap(both);
+        }
+        return true;
+    }
+
+    bool factor(std::set<Atom>& out) {
+        if (depth_ >= MAX_SELECTOR_DEPTH) {
+            return fail(QObject::tr("aninhamento acima de %1 níveis").arg(MAX_SELECTOR_DEPTH));
+        }
+        ++depth_;
+        bool ok = nested(out);
+        --depth_;
+        return ok;
+    }
+
+    bool nested(std::set<Atom>& out) {
+        if (accept('!')) {
+            // a run of '!' cancels in pairs, so it costs one complement at most
+            bool negate = true;
+            while (accept('!')) negate = !negate;
+            if (!negate) return factor(out);
+            std::set<Atom> negated;
+            if (!factor(negated)) return false;
+            for (std::map<Atom, Entry>::const_iterator it = index_.peers_.begin();
+                    it != index_.peers_.end(); ++it) {
+                if (!negated.count(it->first)) out.insert(out.end(), it->first);
+            }
+            return true;
+        }
+        if (accept('(')) {
+            if (!expr(out)) return false;
+            return accept(')') || fail(QObject::tr("')' esperado"));
+        }
+        return primary(out);
+    }
+
+    bool primary(std::set<Atom>& out) {
+        skipSpaces();
+        int start = pos_;
+        while (pos_ < text_.size() && !text_[pos_].isSpace() &&
+                !QString("&|!()").contains(text_[pos_])) {
+            ++pos_;
+        }
+        QString word = text_.mid(start, pos_ - start);
+        if (word.startsWith(GROUP_PREFIX)) {
+            bool ok = false;
+            int group = word.mid(GROUP_PREFIX_SIZE).toInt(&ok);
+            if (!ok) return fail(QObject::tr("grupo inválido em '%1'").arg(word));
+            std::map<int, std::set<Atom> >::const_iterator it = index_.groups_.find(group);
+            if (it != index_.groups_.end()) out = it->second;
+            return true;
+        }
+        if (word.startsWith(TYPE_PREFIX) && word.size() > TYPE_PREFIX_SIZE) {
+            std::map<QString, std::set<Atom> >::const_iterator it =
+                index_.types_.find(word.mid(TYPE_PREFIX_SIZE));
+            if (it != index_.types_.end()) out = it->second;
+            return true;
+        }
+        return fail(word.isEmpty() ? QObject::tr("termo esperado")
+                                   : QObject::tr("termo inválido '%1'").arg(word));
+    }
+
+    void skipSpaces() {
+        while (pos_ < text_.size() && text_[pos_].isSpace()) ++pos_;
+    }
+
+    bool accept(char c) {
+        skipSpaces();
+        if (pos_ < text_.size() && text_[pos_] == QChar(c)) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    bool fail(const QString& error) {
+        if (error_.isEmpty()) error_ = error;
+        return false;
+    }
+
+    const PeerIndex& index_;
+    const QString& text_;
+    int pos_;
+    int depth_;
+    QString error_;
+};
+
+JsonCommandServer::PeerIndex::PeerIndex() {
+}
+
+/* Also moves a peer that identifies again with another group or type. */
+void JsonCommandServer::PeerIndex::insert(Atom peer, int group, const QString &type) {
+    remove(peer);
+    Entry& entry = peers_[peer];
+    entry.group = group;
+    entry.type = type;
+    groups_[group].insert(peer);
+    types_[type].insert(peer);
+}
+
+void JsonCommandServer::PeerIndex::remove(Atom peer) {
+    std::map<Atom, Entry>::iterator it = peers_.find(peer);
+    if (it == peers_.end()) return;
+    std::set<Atom>& in_group = groups_[it->second.group];
+    in_group.erase(peer);
+    if (in_group.empty()) groups_.erase(it->second.group);
+    std::set<Atom>& of_type = types_[it->second.type];
+    of_type.erase(peer);
+    if (of_type.empty()) types_.erase(it->second.type);
+    peers_.erase(it);
+}
+
+void JsonCommandServer::PeerIndex::clear() {
+    peers_.clear();
+    groups_.clear();
+    types_.clear();
+}
+
+/* Peer names look like name@ip:port, so these starts never clash with one. */
+bool JsonCommandServer::PeerIndex::isSelector(const QString &to) {
+    QString text = to.trimmed();
+    return text.startsWith(GROUP_PREFIX) || text.startsWith(TYPE_PREFIX) ||
+           text.startsWith('!') || text.startsWith('(');
+}
+
+bool JsonCommandServer::PeerIndex::select(const QString &selector, std::set<Atom> &out,
+        QString *error) const {
+    out.clear();
+    if (selector.size() > MAX_SELECTOR_SIZE) {
+        if (error) {
+            *error = QObject::tr("seletor com %1 caracteres (máximo %2)")
+                     .arg(selector.size()).arg(MAX_SELECTOR_SIZE);
+        }
+        return false;
+    }
+    Parser parser(*this, selector);
+    QString parse_error;
+    if (!parser.parse(out, parse_error)) {
+        out.clear();
+        if (error) *error = parse_error;
+        return false;
+    }
+    return true;
+}
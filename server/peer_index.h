@@ -0,0 +1,88 @@
+/*
+Json Command Server
+
+PEER INDEX
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_PEER_INDEX_H
+#define JSONCOMMANDSERVER_PEER_INDEX_H
+
+#include "atom_table.h"
+
+#include <QString>
+
+#include <map>
+#include <set>
+
+namespace JsonCommandServer {
+
+/* Inverted indexes of the identified local peers by group and by type, kept
+ * up to date as peers identify and leave, so a selector address reaches its
+ * matches without scanning every peer.
+ *
+ * A selector combines `group:<n>` and `type:<name>` terms with `&`, `|`, `!`
+ * and parentheses, e.g. "group:2 & !type:sensor" or "(group:1 | group:2)".
+ * `!` is the only operator that costs O(peers). Peers are atoms of the
+ * server's AtomTable.
+ *
+ * Selectors come from clients, so their length and nesting are bounded:
+ * anything past MAX_SELECTOR_SIZE characters or MAX_SELECTOR_DEPTH nested
+ * `!` and parentheses is rejected before it is evaluated. */
+class JSONCOMMANDSERVERSHARED_EXPORT PeerIndex {
+  public:
+    static const int MAX_SELECTOR_SIZE = 1024;
+    static const int MAX_SELECTOR_DEPTH = 32;
+
+    PeerIndex();
+
+    void insert(Atom peer, int group, const QString& type);
+    void remove(Atom peer);
+    void clear();
+
+    static bool isSelector(const QString& to);
+    // peers matching selector; false, with error set, when it does not parse
+    bool select(const QString& selector, std::set<Atom>& out, QString* error = 0) const;
+
+  private:
+    struct Entry {
+        int group;
+        QString type;
+    };
+
+    class Parser;
+
+    std::map<Atom, Entry> peers_;
+    std::map<int, std::set<Atom> > groups_;
+    std::map<QString, std::set<Atom> > types_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_PEER_INDEX_H
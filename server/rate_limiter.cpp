@@ -0,0 +1,112 @@
+/*
+Json Command Server
+
+RATE LIMITER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "rate_limiter.h"
+
+#include <cmath>
+
+JsonCommandServer::TokenBucket::TokenBucket(double _rate, double _burst)
+    : rate_(0),
+      burst_(0),
+      tokens_(0),
+      last_ms_(-1) {
+    setRate(_rate, _burst);
+}
+
+void JsonCommandServer::TokenBucket::setRate(double _rate, double _burst) {
+    rate_ = _rate;
+    burst_ = _burst < 1.0 ? 1.0 : _burst;
+    tokens_ = burst_;
+    last_ms_ = -1;
+}
+
+void JsonCommandServer::TokenBucket::refill(qint64 now_ms) {
+    if (last_ms_ >= 0 && now_ms > last_ms_) {
+        tokens_ += rate_ * (now_ms - last_ms_) / 1000.0;
+        if (tokens_ > burst_) tokens_ = burst_;
+    }
+    last_ms_ = now_ms;
+}
+
+bool JsonCommandServer::TokenBucket::consume(qint64 now_ms, double tokens) {
+    if (unlimited()) return true;
+    refill(now_ms);
+    if (tokens_ < tokens) return false;
+    tokens_ -= tokens;
+    return true;
+}
+
+qint64 JsonCommandServer::TokenBucket::waitTime(qint64 now_ms, double tokens) {
+    if (unlimited()) return 0;
+    refill(now_ms);
+    if (tokens_ >= tokens) return 0;
+    return static_cast<qint64>(std::ceil((tokens - tokens_) * 1000.0 / rate_));
+}
+
+JsonCommandServer::ClientRateLimiter::ClientRateLimiter(const RateLimit& frame_limit,
+        const std::map<int, RateLimit>& command_limits)
+    : frames_(frame_limit.rate, frame_limit.burst),
+      frame_count_(0) {
+    for (std::map<int, RateLimit>::const_iterator it = command_limits.begin();
+            it != command_limits.end(); ++it) {
+        setCommandLimit(it->first, it->second);
+    }
+}
+
+void JsonCommandServer::ClientRateLimiter::setFrameLimit(const RateLimit& limit) {
+    frames_.setRate(limit.rate, limit.burst);
+}
+
+void JsonCommandServer::ClientRateLimiter::setCommandLimit(int type, const RateLimit& limit) {
+    if (limit.rate <= 0) {
+        commands_.erase(type);
+    } else {
+        commands_[type].setRate(limit.rate, limit.burst);
+    }
+}
+
+bool JsonCommandServer::ClientRateLimiter::acceptFrame(qint64 now_ms) {
+    if (!frames_.consume(now_ms)) return false;
+    ++frame_count_;
+    return true;
+}
+
+qint64 JsonCommandServer::ClientRateLimiter::frameWaitTime(qint64 now_ms) {
+    return frames_.waitTime(now_ms);
+}
+
+bool JsonCommandServer::ClientRateLimiter::acceptCommand(int type, qint64 now_ms) {
+    std::map<int, TokenBucket>::iterator it = commands_.find(type);
+    if (it == commands_.end()) return true;
+    return it->second.consume(now_ms);
+}
@@ -0,0 +1,97 @@
+/*
+Json Command Server
+
+RATE LIMITER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_RATE_LIMITER_H
+#define JSONCOMMANDSERVER_RATE_LIMITER_H
+
+#include "jsoncommandserver_global.h"
+
+#include <map>
+
+namespace JsonCommandServer {
+
+/* Token bucket: `rate` tokens per second, at most `burst` stored.
+ * A rate <= 0 means unlimited. */
+class JSONCOMMANDSERVERSHARED_EXPORT TokenBucket {
+  public:
+    TokenBucket(double rate = 0, double burst = 0);
+
+    void setRate(double rate, double burst);
+    bool unlimited() const { return rate_ <= 0; }
+
+    bool consume(qint64 now_ms, double tokens = 1.0);
+    qint64 waitTime(qint64 now_ms, double tokens = 1.0);
+
+  private:
+    void refill(qint64 now_ms);
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    qint64 last_ms_;
+};
+
+struct JSONCOMMANDSERVERSHARED_EXPORT RateLimit {
+    RateLimit(double _rate = 0, double _burst = 0) : rate(_rate), burst(_burst) {}
+
+    double rate;
+    double burst;
+};
+
+/* Frame and per-command-type limits of a single client connection. It also
+ * counts the frames accepted since clearFrameCount(), to find the noisiest
+ * connections when shedding load. */
+class JSONCOMMANDSERVERSHARED_EXPORT ClientRateLimiter {
+  public:
+    ClientRateLimiter(const RateLimit& frame_limit,
+                      const std::map<int, RateLimit>& command_limits);
+
+    void setFrameLimit(const RateLimit& limit);
+    void setCommandLimit(int type, const RateLimit& limit);
+
+    bool acceptFrame(qint64 now_ms);
+    qint64 frameWaitTime(qint64 now_ms);
+    bool acceptCommand(int type, qint64 now_ms);
+
+    quint64 frameCount() const { return frame_count_; }
+    void clearFrameCount() { frame_count_ = 0; }
+
+  private:
+    TokenBucket frames_;
+    quint64 frame_count_;
+    std::map<int, TokenBucket> commands_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_RATE_LIMITER_H
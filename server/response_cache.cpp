@@ -0,0 +1,256 @@
+/*
+Json Command Server
+
+RESPONSE CACHE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "response_cache.h"
+
+#include <QJsonDocument>
+
+#include <utility>
+
+const int JsonCommandServer::ResponseCache::DEFAULT_MAX_ENTRIES;
+const qint64 JsonCommandServer::ResponseCache::DEFAULT_MAX_BYTES;
+const int JsonCommandServer::DuplicateFilter::DEFAULT_WINDOW_MS;
+const int JsonCommandServer::DuplicateFilter::DEFAULT_MAX_KEYS;
+const qint64 JsonCommandServer::DuplicateFilter::DEFAULT_MAX_BYTES;
+
+// set by the server or the sender for every delivery, not part of what is asked
+static const char* const ENVELOPE_FIELDS[] = {
+    "id", "ip", "port", "time", "date", "id_client", "group_client", "name_client",
+    "type_client", "description_client", "trace", "request_id", "idempotency_key", 0
+};
+
+JsonCommandServer::ResponseCache::ResponseCache()
+    : hand_(0),
+      max_entries_(DEFAULT_MAX_ENTRIES),
+      max_bytes_(DEFAULT_MAX_BYTES),
+      bytes_(0),
+      hits_(0),
+      misses_(0),
+      expired_(0),
+      evicted_(0),
+      saved_ns_(0) {
+}
+
+void JsonCommandServer::ResponseCache::setCapacity(int max_entries, qint64 max_bytes) {
+    max_entries_ = qMax(0, max_entries);
+    max_bytes_ = max_bytes;
+    clear();
+}
+
+void JsonCommandServer::ResponseCache::clear() {
+    slots_.clear();
+    free_.clear();
+    index_.clear();
+    hand_ = 0;
+    bytes_ = 0;
+}
+
+/* QJsonObject keeps its keys sorted, so equal commands serialize equally. */
+QByteArray JsonCommandServer::ResponseCache::canonicalBody(const QJsonObject &cmd) {
+    QJsonObject body = cmd;
+    for (int i = 0; ENVELOPE_FIELDS[i]; ++i) {
+        body.remove(ENVELOPE_FIELDS[i]);
+    }
+    return QJsonDocument(body).toJson(QJsonDocument::Compact);
+}
+
+quint64 JsonCommandServer::ResponseCache::hash(const QByteArray &body) {
+    quint64 h = Q_UINT64_C(14695981039346656037);
+    const uchar* p = reinterpret_cast<const uchar*>(body.constData());
+    for (int i = 0; i < body.size(); ++i) {
+        h ^= p[i];
+        h *= Q_UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+bool JsonCommandServer::ResponseCache::find(quint64 key, const QByteArray &body, qint64 now_ms,
+        QList<CachedFrame> *frames) {
+    QHash<quint64, int>::const_iterator it = index_.constFind(key);
+    if (it == index_.constEnd()) {
+        ++misses_;
+        return false;
+    }
+    Slot& slot = slots_[it.value()];
+    if (slot.expires_ms <= now_ms) {
+        ++expired_;
+        ++misses_;
+        release(it.value());
+        return false;
+    }
+    if (slot.body != body) {
+        ++misses_;
+        return false;
+    }
+    slot.referenced = true;
+    ++hits_;
+    saved_ns_ += slot.cost_ns;
+    *frames = slot.frames;
+    return true;
+}
+
+void JsonCommandServer::ResponseCache::insert(quint64 key, const QByteArray &body,
+        const QList<CachedFrame> &frames, qint64 ttl_ms, qint64 cost_ns, qint64 now_ms) {
+    if (max_entries_ == 0 || ttl_ms <= 0) return;
+    qint64 bytes = body.size();
+    for (int i = 0; i < frames.size(); ++i) {
+        bytes += frames[i].data.size();
+    }
+    // one reply must not flush most of the cache
+    if (bytes > max_bytes_ / 8) return;
+    QHash<quint64, int>::const_iterator it = index_.constFind(key);
+    if (it != index_.constEnd()) release(it.value());
+    while (index_.size() >= max_entries_ || bytes_ + bytes > max_bytes_) {
+        release(victim());
+        ++evicted_;
+    }
+    int n;
+    if (!free_.empty()) {
+        n = free_.back();
+        free_.pop_back();
+    } else {
+        n = static_cast<int>(slots_.size());
+        slots_.push_back(Slot());
+    }
+    Slot& slot = slots_[n];
+    slot.key = key;
+    slot.body = body;
+    slot.frames = frames;
+    slot.expires_ms = now_ms + ttl_ms;
+    slot.cost_ns = cost_ns;
+    slot.bytes = bytes;
+    slot.referenced = false;
+    slot.used = true;
+    bytes_ += bytes;
+    index_.insert(key, n);
+}
+
+void JsonCommandServer::ResponseCache::release(int n) {
+    Slot& slot = slots_[n];
+    index_.remove(slot.key);
+    bytes_ -= slot.bytes;
+    slot = Slot();
+    free_.push_back(n);
+}
+
+/* The clock hand gives every referenced entry a second chance. */
+int JsonCommandServer::ResponseCache::victim() {
+    while (true) {
+        if (hand_ >= static_cast<int>(slots_.size())) hand_ = 0;
+        Slot& slot = slots_[hand_++];
+        if (!slot.used) continue;
+        if (slot.referenced) {
+            slot.referenced = false;
+            continue;
+        }
+        return hand_ - 1;
+    }
+}
+
+QJsonObject JsonCommandServer::ResponseCache::toJson() const {
+    QJsonObject out;
+    out.insert("entries", index_.size());
+    out.insert("bytes", double(bytes_));
+    out.insert("hits", double(hits_));
+    out.insert("misses", double(misses_));
+    out.insert("expired", double(expired_));
+    out.insert("evicted", double(evicted_));
+    out.insert("saved_us", double(saved_ns_ / 1000));
+    return out;
+}
+
+JsonCommandServer::DuplicateFilter::DuplicateFilter()
+    : window_ms_(DEFAULT_WINDOW_MS),
+      max_keys_(DEFAULT_MAX_KEYS),
+      max_bytes_(DEFAULT_MAX_BYTES),
+      bytes_(0),
+      duplicates_(0) {
+}
+
+void JsonCommandServer::DuplicateFilter::setWindow(int window_ms, int max_keys,
+        qint64 max_bytes) {
+    window_ms_ = window_ms;
+    max_keys_ = qMax(0, max_keys);
+    max_bytes_ = qMax<qint64>(0, max_bytes);
+    seen_.clear();
+    order_.clear();
+    bytes_ = 0;
+}
+
+bool JsonCommandServer::DuplicateFilter::isDuplicate(const QString &key, qint64 now_ms,
+        QList<CachedFrame>* reply) {
+    if (window_ms_ <= 0 || max_keys_ == 0) return false;
+    expire(now_ms);
+    QHash<QString, Seen>::const_iterator it = seen_.constFind(key);
+    if (it != seen_.constEnd()) {
+        ++duplicates_;
+        *reply = it.value().reply;
+        return true;
+    }
+    if (seen_.size() >= max_keys_) {
+        forget(order_.front().second);
+        order_.pop_front();
+    }
+    seen_[key].time_ms = now_ms;
+    order_.push_back(std::make_pair(now_ms, key));
+    return false;
+}
+
+/* A reply over what is left of the byte budget is not kept. */
+void JsonCommandServer::DuplicateFilter::setReply(const QString &key,
+        const QList<CachedFrame> &reply) {
+    QHash<QString, Seen>::iterator it = seen_.find(key);
+    if (it == seen_.end()) return;
+    qint64 bytes = 0;
+    for (int i = 0; i < reply.size(); ++i) {
+        bytes += reply[i].data.size();
+    }
+    if (bytes_ - it.value().bytes + bytes > max_bytes_) return;
+    bytes_ += bytes - it.value().bytes;
+    it.value().reply = reply;
+    it.value().bytes = bytes;
+}
+
+void JsonCommandServer::DuplicateFilter::expire(qint64 now_ms) {
+    while (!order_.empty() && order_.front().first + window_ms_ <= now_ms) {
+        forget(order_.front().second);
+        order_.pop_front();
+    }
+}
+
+void JsonCommandServer::DuplicateFilter::forget(const QString &key) {
+    QHash<QString, Seen>::iterator it = seen_.find(key);
+    if (it == seen_.end()) return;
+    bytes_ -= it.value().bytes;
+    seen_.erase(it);
+}
@@ -0,0 +1,157 @@
+/*
+Json Command Server
+
+RESPONSE CACHE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_RESPONSE_CACHE_H
+#define JSONCOMMANDSERVER_RESPONSE_CACHE_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QString>
+
+#include <deque>
+#include <vector>
+
+namespace JsonCommandServer {
+
+struct JSONCOMMANDSERVERSHARED_EXPORT CachedFrame {
+    QByteArray data;
+    int priority;
+};
+
+/* Replies of idempotent commands, by the command's canonical body: the frames
+ * its handler wrote back to the caller. Entries expire after their TTL and
+ * are evicted by CLOCK (second chance) when the entry or byte budget is full.
+ * The index is a 64-bit FNV-1a hash of the body; the body is kept and
+ * compared on a hit, so a collision is only a miss. */
+class JSONCOMMANDSERVERSHARED_EXPORT ResponseCache {
+  public:
+    static const int DEFAULT_MAX_ENTRIES = 1024;
+    static const qint64 DEFAULT_MAX_BYTES = 16 * 1024 * 1024;
+
+    ResponseCache();
+
+    void setCapacity(int max_entries, qint64 max_bytes);
+    void clear();
+
+    static QByteArray canonicalBody(const QJsonObject& cmd);
+    static quint64 hash(const QByteArray& body);
+
+    bool find(quint64 key, const QByteArray& body, qint64 now_ms, QList<CachedFrame>* frames);
+    void insert(quint64 key, const QByteArray& body, const QList<CachedFrame>& frames,
+                qint64 ttl_ms, qint64 cost_ns, qint64 now_ms);
+
+    int size() const { return index_.size(); }
+    qint64 bytes() const { return bytes_; }
+    QJsonObject toJson() const;
+
+  private:
+    struct Slot {
+        Slot() : key(0), expires_ms(0), cost_ns(0), bytes(0), referenced(false), used(false) {}
+
+        quint64 key;
+        QByteArray body;
+        QList<CachedFrame> frames;
+        qint64 expires_ms;
+        qint64 cost_ns;  // what running the handler took
+        qint64 bytes;
+        bool referenced;
+        bool used;
+    };
+
+    void release(int slot);
+    int victim();
+
+    std::vector<Slot> slots_;
+    std::vector<int> free_;
+    QHash<quint64, int> index_;
+    int hand_;
+    int max_entries_;
+    qint64 max_bytes_;
+    qint64 bytes_;
+    quint64 hits_;
+    quint64 misses_;
+    quint64 expired_;
+    quint64 evicted_;
+    qint64 saved_ns_;
+};
+
+/* Idempotency keys seen in the last window_ms: a command delivered again with
+ * the same key is a duplicate, answered with the reply kept for the first
+ * delivery. At most max_keys are remembered, the oldest going first, and
+ * replies are kept up to max_bytes in all. */
+class JSONCOMMANDSERVERSHARED_EXPORT DuplicateFilter {
+  public:
+    static const int DEFAULT_WINDOW_MS = 60000;
+    static const int DEFAULT_MAX_KEYS = 16384;
+    static const qint64 DEFAULT_MAX_BYTES = 16 * 1024 * 1024;
+
+    DuplicateFilter();
+
+    void setWindow(int window_ms, int max_keys, qint64 max_bytes = DEFAULT_MAX_BYTES);
+    /* False the first time key is seen. Otherwise *reply gets what was kept
+     * for it, empty when nothing was. */
+    bool isDuplicate(const QString& key, qint64 now_ms, QList<CachedFrame>* reply);
+    void setReply(const QString& key, const QList<CachedFrame>& reply);
+
+    quint64 duplicates() const { return duplicates_; }
+    int size() const { return seen_.size(); }
+    qint64 bytes() const { return bytes_; }
+
+  private:
+    struct Seen {
+        Seen() : time_ms(0), bytes(0) {}
+
+        qint64 time_ms;
+        QList<CachedFrame> reply;
+        qint64 bytes;
+    };
+
+    void expire(qint64 now_ms);
+    void forget(const QString& key);
+
+    QHash<QString, Seen> seen_;
+    std::deque<std::pair<qint64, QString> > order_;
+    int window_ms_;
+    int max_keys_;
+    qint64 max_bytes_;
+    qint64 bytes_;
+    quint64 duplicates_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_RESPONSE_CACHE_H
@@ -0,0 +1,192 @@
+/*
+Json Command Server
+
+SEND QUEUE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "send_queue.h"
+#include "trace_recorder.h"
+
+static const int DEFAULT_LANE_WEIGHTS[JsonCommandServer::N_PRIORITIES] = { 8, 4, 2, 1 };
+
+JsonCommandServer::SendQueue::SendQueue()
+    : mode_(WEIGHTED_PRIORITY),
+      version_(FRAME_V1),
+      chunk_size_(DEFAULT_STREAM_CHUNK_SIZE),
+      next_stream_(1),
+      frames_(0),
+      bytes_(0) {
+    for (int i = 0; i < N_PRIORITIES; ++i) {
+        weights_[i] = DEFAULT_LANE_WEIGHTS[i];
+        credits_[i] = weights_[i];
+    }
+}
+
+void JsonCommandServer::SendQueue::setScheduling(int mode) {
+    mode_ = mode;
+}
+
+void JsonCommandServer::SendQueue::setWeight(int priority, int weight) {
+    if (priority < 0 || priority >= N_PRIORITIES) return;
+    weights_[priority] = qMax(1, weight);
+    credits_[priority] = qMin(credits_[priority], weights_[priority]);
+}
+
+/* Applies from the next pop(): what is still queued leaves with the new framing. */
+void JsonCommandServer::SendQueue::setFraming(int version, int chunk_size) {
+    version_ = version;
+    chunk_size_ = qMax(1, chunk_size);
+}
+
+/* False when data replaced the pending frame of conflation_key. */
+bool JsonCommandServer::SendQueue::push(int priority, const QByteArray& data, quint64 trace,
+        int encoding, const QString& conflation_key) {
+    if (!conflation_key.isEmpty()) {
+        QHash<QString, Entry*>::iterator it = latest_.find(conflation_key);
+        if (it != latest_.end()) {
+            Entry* pending = it.value();
+            bytes_ += data.size() - pending->data.size();
+            pending->data = data;
+            pending->encoding = static_cast<quint8>(encoding);
+            pending->trace = trace;
+            return false;
+        }
+    }
+    priority = qBound<int>(PRIORITY_CONTROL, priority, PRIORITY_BULK);
+    Entry entry;
+    entry.data = data;
+    entry.trace = trace;
+    entry.queued_ns = trace ? TraceRecorder::now() : 0;
+    entry.stream = 0;
+    entry.offset = 0;
+    entry.encoding = static_cast<quint8>(encoding);
+    entry.flags = 0;
+    entry.piece = false;
+    entry.key = conflation_key;
+    lanes_[priority].push_back(entry);
+    if (!conflation_key.isEmpty()) {
+        latest_.insert(conflation_key, &lanes_[priority].back());
+    }
+    ++frames_;
+    bytes_ += data.size();
+    return true;
+}
+
+/* Stream 0 is for whole messages. */
+quint32 JsonCommandServer::SendQueue::openStream() {
+    quint32 stream = next_stream_++;
+    if (next_stream_ == 0) next_stream_ = 1;
+    return stream;
+}
+
+void JsonCommandServer::SendQueue::pushPiece(int priority, quint32 stream, int flags,
+        const QByteArray& data, int encoding) {
+    push(priority, data, 0, encoding);
+    Entry& entry = lanes_[qBound<int>(PRIORITY_CONTROL, priority, PRIORITY_BULK)].back();
+    entry.stream = stream;
+    entry.flags = static_cast<quint8>(flags);
+    entry.piece = true;
+}
+
+QByteArray JsonCommandServer::SendQueue::pop(int* priority, quint64* trace, qint64* queued_ns,
+        bool* complete) {
+    int lane = nextLane();
+    if (lane < 0) return QByteArray();
+    Entry& entry = lanes_[lane].front();
+    if (!entry.key.isEmpty()) {
+        // on its way out: later frames of the key queue up anew
+        latest_.remove(entry.key);
+        entry.key = QString();
+    }
+    --credits_[lane];
+    if (priority) *priority = lane;
+    QByteArray frame;
+    int left = entry.data.size() - entry.offset;
+    if (version_ < FRAME_V2) {
+        frame = IntToArray(left) + entry.data.mid(entry.offset);
+    } else if (entry.piece) {
+        // already a chunk of its stream: split, it could be overtaken by the next one
+        FrameHeader header;
+        header.flags = entry.flags;
+        header.encoding = entry.encoding;
+        header.stream = entry.stream;
+        header.size = left;
+        frame = encodeFrameHeader(header) + entry.data;
+    } else {
+        FrameHeader header;
+        header.encoding = entry.encoding;
+        header.size = qMin(left, chunk_size_);
+        if (entry.offset == 0 && header.size < left) {
+            entry.stream = openStream();
+        }
+        header.stream = entry.stream;
+        if (header.size < left) {
+            header.flags = FRAME_MORE;
+        }
+        frame = encodeFrameHeader(header) + entry.data.mid(entry.offset, header.size);
+        if (header.size < left) {
+            entry.offset += header.size;
+            bytes_ -= header.size;
+            // let the rest of the lane go before the next chunk
+            lanes_[lane].push_back(entry);
+            lanes_[lane].pop_front();
+            if (trace) *trace = 0;
+            if (complete) *complete = false;
+            return frame;
+        }
+    }
+    if (trace) *trace = entry.trace;
+    if (queued_ns) *queued_ns = entry.queued_ns;
+    if (complete) *complete = true;
+    lanes_[lane].pop_front();
+    --frames_;
+    bytes_ -= left;
+    return frame;
+}
+
+int JsonCommandServer::SendQueue::nextLane() {
+    if (frames_ == 0) return -1;
+    if (mode_ == STRICT_PRIORITY) {
+        for (int i = 0; i < N_PRIORITIES; ++i) {
+            if (!lanes_[i].empty()) return i;
+        }
+        return -1;
+    }
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < N_PRIORITIES; ++i) {
+            if (!lanes_[i].empty() && credits_[i] > 0) return i;
+        }
+        // every backlogged lane spent its share: start a new round
+        for (int i = 0; i < N_PRIORITIES; ++i) {
+            credits_[i] = weights_[i];
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,114 @@
+/*
+Json Command Server
+
+SEND QUEUE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_SEND_QUEUE_H
+#define JSONCOMMANDSERVER_SEND_QUEUE_H
+
+#include "commands_controller.h"
+#include "frame_codec.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+#include <deque>
+
+namespace JsonCommandServer {
+
+/* Outbound frames of one connection, one FIFO lane per MessagePriority.
+ * Frames are moved to the socket only while its write buffer is small, so
+ * control traffic can overtake bulk traffic still waiting here. A traced frame
+ * keeps its trace id and the time it was queued (see trace_recorder.h).
+ *
+ * Messages are framed as they leave. With v2 framing (see frame_codec.h) a
+ * message larger than the chunk size leaves one chunk per pop() and goes back
+ * to the end of its lane in between, so it no longer holds up the messages
+ * queued behind it. pop() sets *complete on the last chunk of a message.
+ * Pieces of a relayed stream are pushed one by one with pushPiece() and leave
+ * as they are, in order, on the stream openStream() handed out.
+ *
+ * A frame pushed with a conflation key replaces the pending frame of the same
+ * key in place, keeping that one's place in the queue: for a stream of latest
+ * values the queue holds at most one frame per key, however slow the reader.
+ * A frame whose first chunk has already left is not replaced. */
+class JSONCOMMANDSERVERSHARED_EXPORT SendQueue {
+  public:
+    SendQueue();
+
+    void setScheduling(int mode);
+    void setWeight(int priority, int weight);
+    void setFraming(int version, int chunk_size = DEFAULT_STREAM_CHUNK_SIZE);
+    int framing() const { return version_; }
+
+    bool push(int priority, const QByteArray& data, quint64 trace = 0,
+              int encoding = ENCODING_JSON, const QString& conflation_key = QString());
+    quint32 openStream();
+    void pushPiece(int priority, quint32 stream, int flags, const QByteArray& data,
+                   int encoding = ENCODING_JSON);
+    QByteArray pop(int* priority = 0, quint64* trace = 0, qint64* queued_ns = 0,
+                   bool* complete = 0);
+
+    bool isEmpty() const { return frames_ == 0; }
+    int pendingFrames() const { return frames_; }
+    qint64 pendingBytes() const { return bytes_; }
+
+  private:
+    struct Entry {
+        QByteArray data;
+        quint64 trace;
+        qint64 queued_ns;
+        quint32 stream;
+        int offset;
+        quint8 encoding;
+        quint8 flags;
+        bool piece;
+        QString key;
+    };
+
+    int nextLane();
+
+    std::deque<Entry> lanes_[N_PRIORITIES];
+    QHash<QString, Entry*> latest_;  // deque entries stay put until popped
+    int weights_[N_PRIORITIES];
+    int credits_[N_PRIORITIES];
+    int mode_;
+    int version_;
+    int chunk_size_;
+    quint32 next_stream_;
+    int frames_;
+    qint64 bytes_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_SEND_QUEUE_H
@@ -0,0 +1,96 @@
+/*
+Json Command Server
+
+SERVER METRICS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "server_metrics.h"
+
+JsonCommandServer::ServerMetrics::ServerMetrics() {
+    reset();
+}
+
+void JsonCommandServer::ServerMetrics::reset() {
+    connections_accepted = 0;
+    connections_rejected = 0;
+    frames_received = 0;
+    frames_oversized = 0;
+    frames_throttled = 0;
+    commands_throttled = 0;
+    connections_shed = 0;
+    commands_shed = 0;
+    for (int i = 0; i < N_PRIORITIES; ++i) {
+        frames_sent[i] = 0;
+    }
+    frames_conflated = 0;
+    offline_stored = 0;
+    offline_replayed = 0;
+    streams_opened = 0;
+    streams_aborted = 0;
+    stream_bytes = 0;
+    gathers_started = 0;
+    gathers_timed_out = 0;
+    datagrams_received = 0;
+    datagrams_sent = 0;
+    datagrams_lost = 0;
+    datagrams_late = 0;
+    datagrams_rejected = 0;
+}
+
+QJsonObject JsonCommandServer::ServerMetrics::toJson() const {
+    QJsonObject out;
+    out.insert("connections_accepted", double(connections_accepted));
+    out.insert("connections_rejected", double(connections_rejected));
+    out.insert("frames_received", double(frames_received));
+    out.insert("frames_oversized", double(frames_oversized));
+    out.insert("frames_throttled", double(frames_throttled));
+    out.insert("commands_throttled", double(commands_throttled));
+    out.insert("connections_shed", double(connections_shed));
+    out.insert("commands_shed", double(commands_shed));
+    QJsonArray sent;
+    for (int i = 0; i < N_PRIORITIES; ++i) {
+        sent.append(double(frames_sent[i]));
+    }
+    out.insert("frames_sent", sent);
+    out.insert("frames_conflated", double(frames_conflated));
+    out.insert("offline_stored", double(offline_stored));
+    out.insert("offline_replayed", double(offline_replayed));
+    out.insert("streams_opened", double(streams_opened));
+    out.insert("streams_aborted", double(streams_aborted));
+    out.insert("stream_bytes", double(stream_bytes));
+    out.insert("gathers_started", double(gathers_started));
+    out.insert("gathers_timed_out", double(gathers_timed_out));
+    out.insert("datagrams_received", double(datagrams_received));
+    out.insert("datagrams_sent", double(datagrams_sent));
+    out.insert("datagrams_lost", double(datagrams_lost));
+    out.insert("datagrams_late", double(datagrams_late));
+    out.insert("datagrams_rejected", double(datagrams_rejected));
+    return out;
+}
@@ -0,0 +1,75 @@
+/*
+Json Command Server
+
+SERVER METRICS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_SERVER_METRICS_H
+#define JSONCOMMANDSERVER_SERVER_METRICS_H
+
+#include "commands_controller.h"
+
+#include <QJsonObject>
+
+namespace JsonCommandServer {
+
+struct JSONCOMMANDSERVERSHARED_EXPORT ServerMetrics {
+    ServerMetrics();
+
+    void reset();
+    QJsonObject toJson() const;
+
+    quint64 connections_accepted;
+    quint64 connections_rejected;
+    quint64 frames_received;
+    quint64 frames_oversized;
+    quint64 frames_throttled;
+    quint64 commands_throttled;
+    quint64 connections_shed;
+    quint64 commands_shed;
+    quint64 frames_sent[N_PRIORITIES];
+    quint64 frames_conflated;
+    quint64 offline_stored;
+    quint64 offline_replayed;
+    quint64 streams_opened;
+    quint64 streams_aborted;
+    quint64 stream_bytes;
+    quint64 gathers_started;
+    quint64 gathers_timed_out;
+    quint64 datagrams_received;
+    quint64 datagrams_sent;
+    quint64 datagrams_lost;
+    quint64 datagrams_late;
+    quint64 datagrams_rejected;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_SERVER_METRICS_H
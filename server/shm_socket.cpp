@@ -0,0 +1,603 @@
+/*
+Json Command Server
+
+SHARED MEMORY SOCKET
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "shm_socket.h"
+#include "local_listener.h"
+
+#include <QElapsedTimer>
+#include <QSocketNotifier>
+
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if ATOMIC_INT_LOCK_FREE != 2
+#error "ShmSocket needs lock-free 32 bit atomics, they are shared between processes"
+#endif
+
+static const quint32 SHM_MAGIC = 0x4a43534d;  // "JCSM"
+static const quint32 SHM_VERSION = 1;
+static const qint64 SHM_HEADER_SIZE = 4096;
+static const qint64 MIN_RING_SIZE = 1 << 16;
+static const qint64 MAX_RING_SIZE = 1 << 30;
+static const int CLIENT_SIDE = 0;
+static const int SERVER_SIDE = 1;
+static const int N_SHM_FDS = 3;  // memfd, the server's eventfd, the client's eventfd
+// the client sends its descriptors right after connecting
+static const int SHM_HANDSHAKE_TIMEOUT_MS = 100;
+static const int SHM_CONNECT_TIMEOUT_MS = 5000;
+// a blocking wait polls the ring this many times before going to sleep, if
+// the writer can run meanwhile
+static const int N_SPINS = 4000;
+
+/* One direction. Positions count bytes since the start and wrap at 2^32, so
+ * head - tail is what the ring holds. The reader publishes reader_waiting
+ * before it sleeps and the writer takes it back when it rings, so a burst costs
+ * one eventfd write at most; writer_waiting does the same for a full ring. */
+struct JsonCommandServer::ShmRing {
+    std::atomic<quint32> head;  // written by the producer
+    char pad0[60];
+    std::atomic<quint32> tail;  // written by the consumer
+    char pad1[60];
+    std::atomic<quint32> reader_waiting;
+    std::atomic<quint32> writer_waiting;
+    char pad2[56];
+};
+
+namespace {
+
+struct ShmHeader {
+    quint32 magic;
+    quint32 version;
+    quint32 ring_size;
+    quint32 reserved;
+    char pad[48];
+    JsonCommandServer::ShmRing rings[2];  // indexed by the writing side
+};
+
+void closeFds(int* fds, int n) {
+    for (int i = 0; i < n; ++i) {
+        if (fds[i] >= 0) ::close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+bool sendFds(int control, const int* fds) {
+    char tag = 'S';
+    iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    char control_buffer[CMSG_SPACE(N_SHM_FDS * sizeof(int))];
+    memset(control_buffer, 0, sizeof(control_buffer));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_buffer;
+    msg.msg_controllen = sizeof(control_buffer);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(N_SHM_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, N_SHM_FDS * sizeof(int));
+    return ::sendmsg(control, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/* Fills fds only when all of them came. */
+bool receiveFds(int control, int* fds) {
+    char tag = 0;
+    iovec iov;
+    iov.iov_base = &tag;
+    iov.iov_len = 1;
+    char control_buffer[CMSG_SPACE(N_SHM_FDS * sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_buffer;
+    msg.msg_controllen = sizeof(control_buffer);
+    if (::recvmsg(control, &msg, MSG_CMSG_CLOEXEC) != 1) return false;
+    int received[N_SHM_FDS] = {-1, -1, -1};
+    int n = 0;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (n < N_SHM_FDS) {
+                received[n++] = fd;
+            } else {
+                ::close(fd);
+            }
+        }
+    }
+    if (tag != 'S' || n < N_SHM_FDS) {
+        closeFds(received, N_SHM_FDS);
+        return false;
+    }
+    memcpy(fds, received, sizeof(received));
+    return true;
+}
+
+bool waitReadable(int fd, int msecs) {
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    int r;
+    do {
+        r = ::poll(&p, 1, msecs);
+    } while (r < 0 && errno == EINTR);
+    return r > 0;
+}
+
+int spinsBeforeSleep() {
+    static const int spins = ::sysconf(_SC_NPROCESSORS_ONLN) > 1 ? N_SPINS : 0;
+    return spins;
+}
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+}  // namespace
+
+JsonCommandServer::ShmSocket::ShmSocket(QObject *_parent)
+    : QTcpSocket(_parent),
+      region_(0),
+      region_size_(0),
+      in_(0),
+      out_(0),
+      in_data_(0),
+      out_data_(0),
+      ring_mask_(0),
+      bell_(-1),
+      peer_bell_(-1),
+      control_fd_(-1),
+      bell_notifier_(0),
+      control_notifier_(0),
+      pending_pos_(0),
+      unreported_(0),
+      notify_scheduled_(false),
+      report_scheduled_(false) {
+}
+
+JsonCommandServer::ShmSocket::~ShmSocket() {
+    // QAbstractSocket's destructor would otherwise abort a socket engine there is none of
+    setSocketState(QAbstractSocket::UnconnectedState);
+    delete bell_notifier_;
+    delete control_notifier_;
+    if (region_) ::munmap(region_, region_size_);
+    int fds[3] = {bell_, peer_bell_, control_fd_};
+    closeFds(fds, 3);
+}
+
+JsonCommandServer::ShmSocket* JsonCommandServer::ShmSocket::connectTo(const QString &path,
+        QString *error, qint64 ring_size, QObject *_parent) {
+    qint64 size = MIN_RING_SIZE;
+    while (size < ring_size && size < MAX_RING_SIZE) size <<= 1;
+    // memfd, server bell, client bell, control connection
+    int fds[4] = {-1, -1, -1, -1};
+    fds[0] = ::memfd_create("jsoncommandserver-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    quint32 header[4] = {SHM_MAGIC, SHM_VERSION, quint32(size), 0};
+    // sealed, so the server can not be made to fault on a region shrunk under it
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 ||
+            ::ftruncate(fds[0], SHM_HEADER_SIZE + 2 * size) < 0 ||
+            ::fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+            ::pwrite(fds[0], header, sizeof(header), 0) != sizeof(header)) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        closeFds(fds, 4);
+        return 0;
+    }
+    fds[3] = connectLocalSocket(path, error);
+    if (fds[3] < 0) {
+        closeFds(fds, 4);
+        return 0;
+    }
+    char ack = 0;
+    if (!sendFds(fds[3], fds) || !waitReadable(fds[3], SHM_CONNECT_TIMEOUT_MS) ||
+            ::recv(fds[3], &ack, 1, 0) != 1) {
+        if (error) *error = QObject::tr("o servidor recusou a região de memória compartilhada");
+        closeFds(fds, 4);
+        return 0;
+    }
+    ShmSocket* socket = new ShmSocket(_parent);
+    if (!socket->attach(fds[0], fds[2], fds[1], fds[3], CLIENT_SIDE, error)) {
+        delete socket;
+        return 0;
+    }
+    return socket;
+}
+
+JsonCommandServer::ShmSocket* JsonCommandServer::ShmSocket::accept(qintptr control_fd,
+        QString *error, QObject *_parent) {
+    int control = static_cast<int>(control_fd);
+    int fds[N_SHM_FDS];
+    if (!waitReadable(control, SHM_HANDSHAKE_TIMEOUT_MS) || !receiveFds(control, fds)) {
+        if (error) *error = QObject::tr("descritores da região não recebidos");
+        ::close(control);
+        return 0;
+    }
+    ShmSocket* socket = new ShmSocket(_parent);
+    if (!socket->attach(fds[0], fds[1], fds[2], control, SERVER_SIDE, error)) {
+        delete socket;
+        return 0;
+    }
+    char ack = 'A';
+    if (::send(control, &ack, 1, MSG_NOSIGNAL) != 1) {
+        if (error) *error = QString::fromLocal8Bit(strerror(errno));
+        delete socket;
+        return 0;
+    }
+    return socket;
+}
+
+/* Takes every descriptor, whatever happens: the memfd is closed once mapped,
+ * the others by the destructor. */
+bool JsonCommandServer::ShmSocket::attach(int memfd, int bell, int peer_bell, int control_fd,
+        int side, QString *error) {
+    bell_ = bell;
+    peer_bell_ = peer_bell;
+    control_fd_ = control_fd;
+    struct stat st;
+    bool ok = ::fstat(memfd, &st) == 0 && st.st_size >= SHM_HEADER_SIZE + 2 * MIN_RING_SIZE &&
+              (::fcntl(memfd, F_GET_SEALS) & F_SEAL_SHRINK);
+    void* map = MAP_FAILED;
+    if (ok) {
+        map = ::mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    ::close(memfd);
+    if (map == MAP_FAILED) {
+        if (error) *error = tr("região de memória compartilhada inválida");
+        return false;
+    }
+    region_ = static_cast<uchar*>(map);
+    region_size_ = st.st_size;
+    ShmHeader* header = reinterpret_cast<ShmHeader*>(region_);
+    // read once: the peer can still write to the header after this check
+    qint64 ring_size = header->ring_size;
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION ||
+            ring_size < MIN_RING_SIZE || ring_size > MAX_RING_SIZE ||
+            (ring_size & (ring_size - 1)) != 0 ||
+            SHM_HEADER_SIZE + 2 * ring_size != region_size_) {
+        if (error) *error = tr("região de memória compartilhada inválida");
+        return false;
+    }
+    ring_mask_ = quint32(ring_size - 1);
+    out_ = &header->rings[side];
+    in_ = &header->rings[1 - side];
+    out_data_ = region_ + SHM_HEADER_SIZE + side * ring_size;
+    in_data_ = region_ + SHM_HEADER_SIZE + (1 - side) * ring_size;
+    ::fcntl(control_fd_, F_SETFL, ::fcntl(control_fd_, F_GETFL) | O_NONBLOCK);
+    bell_notifier_ = new QSocketNotifier(bell_, QSocketNotifier::Read, this);
+    connect(bell_notifier_, SIGNAL(activated(int)), this, SLOT(doorbell()));
+    control_notifier_ = new QSocketNotifier(control_fd_, QSocketNotifier::Read, this);
+    connect(control_notifier_, SIGNAL(activated(int)), this, SLOT(controlEvent()));
+    setSocketState(QAbstractSocket::ConnectedState);
+    setOpenMode(QIODevice::ReadWrite | QIODevice::Unbuffered);
+    armReader();
+    return true;
+}
+
+qint64 JsonCommandServer::ShmSocket::bytesAvailable() const {
+    return QIODevice::bytesAvailable() + readable();
+}
+
+qint64 JsonCommandServer::ShmSocket::bytesToWrite() const {
+    return pending_.size() - pending_pos_;
+}
+
+/* Positions are shared with the peer, so they are checked, not trusted: a ring
+ * that claims more than its size reads as empty here and is dropped by pop(). */
+qint64 JsonCommandServer::ShmSocket::readable() const {
+    if (!in_) return 0;
+    quint32 used = in_->head.load(std::memory_order_acquire) -
+                   in_->tail.load(std::memory_order_relaxed);
+    return used > ring_mask_ + 1 ? 0 : used;
+}
+
+qint64 JsonCommandServer::ShmSocket::writable() const {
+    if (!out_) return 0;
+    quint32 used = out_->head.load(std::memory_order_relaxed) -
+                   out_->tail.load(std::memory_order_acquire);
+    return used > ring_mask_ + 1 ? 0 : qint64(ring_mask_) + 1 - used;
+}
+
+qint64 JsonCommandServer::ShmSocket::push(const char *data, qint64 size) {
+    quint32 head = out_->head.load(std::memory_order_relaxed);
+    quint32 used = head - out_->tail.load(std::memory_order_acquire);
+    if (used > ring_mask_ + 1) {
+        corrupt();
+        return 0;
+    }
+    qint64 n = qMin<qint64>(size, qint64(ring_mask_) + 1 - used);
+    if (n <= 0) return 0;
+    quint32 at = head & ring_mask_;
+    qint64 first = qMin<qint64>(n, qint64(ring_mask_) + 1 - at);
+    memcpy(out_data_ + at, data, first);
+    memcpy(out_data_, data + first, n - first);
+    out_->head.store(head + quint32(n), std::memory_order_seq_cst);
+    if (out_->reader_waiting.load(std::memory_order_seq_cst) &&
+            out_->reader_waiting.exchange(0)) {
+        ring();
+    }
+    return n;
+}
+
+qint64 JsonCommandServer::ShmSocket::pop(char *data, qint64 max_size) {
+    quint32 tail = in_->tail.load(std::memory_order_relaxed);
+    quint32 used = in_->head.load(std::memory_order_acquire) - tail;
+    if (used > ring_mask_ + 1) {
+        corrupt();
+        return 0;
+    }
+    qint64 n = qMin<qint64>(max_size, used);
+    if (n <= 0) return 0;
+    quint32 at = tail & ring_mask_;
+    qint64 first = qMin<qint64>(n, qint64(ring_mask_) + 1 - at);
+    memcpy(data, in_data_ + at, first);
+    memcpy(data + first, in_data_, n - first);
+    in_->tail.store(tail + quint32(n), std::memory_order_seq_cst);
+    if (in_->writer_waiting.load(std::memory_order_seq_cst) &&
+            in_->writer_waiting.exchange(0)) {
+        ring();
+    }
+    return n;
+}
+
+void JsonCommandServer::ShmSocket::ring() {
+    quint64 one = 1;
+    ssize_t r = ::write(peer_bell_, &one, sizeof(one));
+    Q_UNUSED(r);  // EAGAIN: the counter is saturated, the peer wakes anyway
+}
+
+/* Publishes that this side is about to sleep, then looks once more: data the
+ * writer pushed before it could see the flag would otherwise wait for the next
+ * burst. */
+void JsonCommandServer::ShmSocket::armReader() {
+    in_->reader_waiting.store(1, std::memory_order_seq_cst);
+    if (readable() > 0 && in_->reader_waiting.exchange(0)) scheduleNotify();
+}
+
+qint64 JsonCommandServer::ShmSocket::readData(char *data, qint64 max_size) {
+    if (!in_) return -1;
+    qint64 n = pop(data, max_size);
+    if (readable() == 0) {
+        if (state() == QAbstractSocket::UnconnectedState) return n > 0 ? n : -1;
+        armReader();
+    }
+    return n;
+}
+
+qint64 JsonCommandServer::ShmSocket::writeData(const char *data, qint64 size) {
+    if (state() != QAbstractSocket::ConnectedState) {
+        setErrorString(tr("conexão fechada"));
+        return -1;
+    }
+    qint64 done = 0;
+    if (bytesToWrite() == 0) {
+        done = push(data, size);
+        unreported_ += done;
+    }
+    if (done < size) {
+        pending_.append(data + done, size - done);
+        flushPending();
+    }
+    if (unreported_ > 0) scheduleReport();
+    return size;
+}
+
+/* Moves held writes into the ring. When it is full the reader is asked to
+ * ring once it made room. */
+void JsonCommandServer::ShmSocket::flushPending() {
+    while (pending_pos_ < pending_.size() && state() != QAbstractSocket::UnconnectedState) {
+        qint64 n = push(pending_.constData() + pending_pos_, pending_.size() - pending_pos_);
+        if (n > 0) {
+            pending_pos_ += n;
+            unreported_ += n;
+            continue;
+        }
+        out_->writer_waiting.store(1, std::memory_order_seq_cst);
+        if (writable() == 0) break;
+        out_->writer_waiting.store(0, std::memory_order_relaxed);
+    }
+    if (pending_pos_ == pending_.size()) {
+        pending_.clear();
+        pending_pos_ = 0;
+    } else if (pending_pos_ > pending_.size() / 2) {
+        pending_.remove(0, pending_pos_);
+        pending_pos_ = 0;
+    }
+}
+
+void JsonCommandServer::ShmSocket::scheduleNotify() {
+    if (notify_scheduled_) return;
+    notify_scheduled_ = true;
+    QMetaObject::invokeMethod(this, "notifyReadable", Qt::QueuedConnection);
+}
+
+void JsonCommandServer::ShmSocket::scheduleReport() {
+    if (report_scheduled_) return;
+    report_scheduled_ = true;
+    QMetaObject::invokeMethod(this, "reportWritten", Qt::QueuedConnection);
+}
+
+/* Like Qt's sockets, readyRead() only comes from the event loop. Data left
+ * unread stays in the ring; the next readData() that empties it arms the
+ * doorbell again. */
+void JsonCommandServer::ShmSocket::notifyReadable() {
+    notify_scheduled_ = false;
+    if (state() == QAbstractSocket::UnconnectedState) return;
+    if (readable() > 0) {
+        emit readyRead();
+    } else {
+        armReader();
+    }
+}
+
+void JsonCommandServer::ShmSocket::reportWritten() {
+    report_scheduled_ = false;
+    if (unreported_ <= 0) return;
+    qint64 written = unreported_;
+    unreported_ = 0;
+    emit bytesWritten(written);
+}
+
+void JsonCommandServer::ShmSocket::doorbell() {
+    quint64 count;
+    ssize_t r = ::read(bell_, &count, sizeof(count));
+    Q_UNUSED(r);
+    if (bytesToWrite() > 0) {
+        flushPending();
+        if (unreported_ > 0) scheduleReport();
+        if (state() == QAbstractSocket::ClosingState && bytesToWrite() == 0) {
+            finishClose();
+            return;
+        }
+    }
+    notifyReadable();
+}
+
+/* Nothing but the handshake travels on the control connection: readable means
+ * the peer closed it or died. What it wrote before is still delivered. */
+void JsonCommandServer::ShmSocket::controlEvent() {
+    char buffer[64];
+    ssize_t r = ::recv(control_fd_, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (r > 0 || (r < 0 && (errno == EAGAIN || errno == EINTR))) return;
+    if (readable() > 0) emit readyRead();
+    finishClose();
+}
+
+/* A peer that breaks the ring invariants is dropped as if it hung up. */
+void JsonCommandServer::ShmSocket::corrupt() {
+    setErrorString(tr("região de memória compartilhada corrompida"));
+    pending_.clear();
+    pending_pos_ = 0;
+    ::shutdown(control_fd_, SHUT_RDWR);
+}
+
+/* Both sides keep their mapping until they are deleted, so data still in the
+ * rings stays readable after the disconnect. */
+void JsonCommandServer::ShmSocket::finishClose() {
+    if (state() == QAbstractSocket::UnconnectedState) return;
+    if (bell_notifier_) bell_notifier_->setEnabled(false);
+    if (control_notifier_) control_notifier_->setEnabled(false);
+    ::shutdown(control_fd_, SHUT_RDWR);
+    setSocketState(QAbstractSocket::UnconnectedState);
+    emit disconnected();
+}
+
+/* Held writes go out first, as with Qt's write buffer. */
+void JsonCommandServer::ShmSocket::disconnectFromHost() {
+    if (state() != QAbstractSocket::ConnectedState) return;
+    setSocketState(QAbstractSocket::ClosingState);
+    flushPending();
+    if (bytesToWrite() == 0) finishClose();
+}
+
+void JsonCommandServer::ShmSocket::close() {
+    pending_.clear();
+    pending_pos_ = 0;
+    finishClose();
+    QIODevice::close();
+}
+
+/* Sleeps on the doorbell until it rings or the peer hangs up. */
+bool JsonCommandServer::ShmSocket::waitForBell(int msecs) {
+    pollfd p[2];
+    p[0].fd = bell_;
+    p[1].fd = control_fd_;
+    p[0].events = p[1].events = POLLIN;
+    p[0].revents = p[1].revents = 0;
+    int r;
+    do {
+        r = ::poll(p, 2, msecs);
+    } while (r < 0 && errno == EINTR);
+    if (r <= 0) return false;
+    if (p[0].revents) {
+        quint64 count;
+        ssize_t n = ::read(bell_, &count, sizeof(count));
+        Q_UNUSED(n);
+        flushPending();
+    }
+    if (p[1].revents) controlEvent();
+    return state() != QAbstractSocket::UnconnectedState;
+}
+
+/* For clients without an event loop. It spins on the ring for a moment before
+ * sleeping: a reply that comes within microseconds costs no system call. */
+bool JsonCommandServer::ShmSocket::waitForReadyRead(int msecs) {
+    if (bytesAvailable() > 0) return true;
+    QElapsedTimer clock;
+    clock.start();
+    int spins = spinsBeforeSleep();
+    while (state() != QAbstractSocket::UnconnectedState) {
+        for (int i = 0; i < spins && readable() == 0; ++i) cpuRelax();
+        if (readable() > 0) break;
+        armReader();
+        if (readable() > 0) break;
+        int left = msecs < 0 ? -1 : int(msecs - clock.elapsed());
+        if (msecs >= 0 && left <= 0) return false;
+        waitForBell(left);
+    }
+    if (readable() == 0) return false;
+    emit readyRead();
+    return true;
+}
+
+bool JsonCommandServer::ShmSocket::waitForBytesWritten(int msecs) {
+    QElapsedTimer clock;
+    clock.start();
+    flushPending();
+    while (bytesToWrite() > 0 && state() != QAbstractSocket::UnconnectedState) {
+        int left = msecs < 0 ? -1 : int(msecs - clock.elapsed());
+        if (msecs >= 0 && left <= 0) return false;
+        if (!waitForBell(left)) return false;
+    }
+    if (unreported_ <= 0) return false;
+    reportWritten();
+    return true;
+}
@@ -0,0 +1,137 @@
+/*
+Json Command Server
+
+SHARED MEMORY SOCKET
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_SHM_SOCKET_H
+#define JSONCOMMANDSERVER_SHM_SOCKET_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QString>
+#include <QTcpSocket>
+
+class QSocketNotifier;
+
+namespace JsonCommandServer {
+
+struct ShmRing;
+
+/* A connection through shared memory, for the highest-rate producers on the
+ * server's host (Linux only). A memfd holds one single-producer single-consumer
+ * byte ring per direction. Each side sleeps on its own eventfd, and the other
+ * side only writes to it after seeing the sleeper's waiting flag, so a busy
+ * stream moves without any system call. The memfd and both eventfds are passed
+ * over a Unix domain control connection (SCM_RIGHTS) that stays open for the
+ * lifetime of the connection: its hangup is the disconnect, also when a side
+ * crashes.
+ *
+ * For BaseServer it is one more QTcpSocket, with the same framing, queues,
+ * identity and routing; only the byte transport differs. Writes that do not fit
+ * in the ring are held, like Qt's write buffer, and bytesWritten() follows as
+ * the reader makes room. */
+class JSONCOMMANDSERVERSHARED_EXPORT ShmSocket : public QTcpSocket {
+    Q_OBJECT
+
+  public:
+    enum {
+        DEFAULT_RING_SIZE = 1 << 20
+    };
+
+    virtual ~ShmSocket();
+
+    /* Client side: creates a region with rings of ring_size bytes (rounded up
+     * to a power of two) and hands it to the listener at `path`. Returns a
+     * connected socket, or 0 and fills `error`. */
+    static ShmSocket* connectTo(const QString& path, QString* error,
+                                qint64 ring_size = DEFAULT_RING_SIZE, QObject* parent = 0);
+
+    /* Server side: adopts the region a client sent on an accepted control
+     * connection. Takes ownership of control_fd, also on failure. */
+    static ShmSocket* accept(qintptr control_fd, QString* error, QObject* parent = 0);
+
+    virtual qint64 bytesAvailable() const;
+    virtual qint64 bytesToWrite() const;
+    virtual void disconnectFromHost();
+    virtual void close();
+    virtual bool waitForReadyRead(int msecs = 30000);
+    virtual bool waitForBytesWritten(int msecs = 30000);
+
+  protected:
+    virtual qint64 readData(char* data, qint64 max_size);
+    virtual qint64 writeData(const char* data, qint64 size);
+
+  private slots:
+    void doorbell();
+    void controlEvent();
+    void notifyReadable();
+    void reportWritten();
+
+  private:
+    ShmSocket(QObject* parent);
+
+    bool attach(int memfd, int bell, int peer_bell, int control_fd, int side, QString* error);
+    qint64 readable() const;
+    qint64 push(const char* data, qint64 size);
+    qint64 pop(char* data, qint64 max_size);
+    void flushPending();
+    void armReader();
+    void ring();
+    bool waitForBell(int msecs);
+    qint64 writable() const;
+    void scheduleNotify();
+    void scheduleReport();
+    void finishClose();
+    void corrupt();
+
+    uchar* region_;
+    qint64 region_size_;
+    ShmRing* in_;
+    ShmRing* out_;
+    uchar* in_data_;
+    uchar* out_data_;
+    quint32 ring_mask_;
+    int bell_;
+    int peer_bell_;
+    int control_fd_;
+    QSocketNotifier* bell_notifier_;
+    QSocketNotifier* control_notifier_;
+    QByteArray pending_;
+    int pending_pos_;
+    qint64 unreported_;
+    bool notify_scheduled_;
+    bool report_scheduled_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_SHM_SOCKET_H
@@ -0,0 +1,462 @@
+/*
+Json Command Server
+
+STATE JOURNAL
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "state_journal.h"
+
+#include "binary_format.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStringList>
+
+#include <vector>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#endif
+
+static const quint32 SNAPSHOT_MAGIC = 0x4a435353; // "JCSS"
+static const quint32 SNAPSHOT_VERSION = 2;
+static const qint64 SNAPSHOT_HEADER_SIZE = 16;
+static const qint64 SNAPSHOT_SLOT_SIZE = 8;
+static const quint32 MIN_SNAPSHOT_BUCKETS = 16;
+static const qint64 MAX_SNAPSHOT_OFFSET = 0xffffffffLL;
+static const qint64 RECORD_HEADER_SIZE = 13;
+static const qint64 DEFAULT_COMPACT_THRESHOLD = 16 * 1024 * 1024;
+static const int SNAPSHOT_CHUNK_SIZE = 1024 * 1024;
+static const char OP_PUT = 1;
+static const char OP_REMOVE = 2;
+
+static QString journalName(quint64 seq) {
+    return QString("journal.%1.log").arg(seq, 16, 16, QChar('0'));
+}
+
+static quint64 journalSeq(const QString& file_name) {
+    return file_name.mid(8, 16).toULongLong(0, 16);
+}
+
+namespace {
+
+/* Writes a snapshot of the state and drops the journals up to `upto`. Runs on
+ * the journal's writer thread, and raises `written` once the snapshot is in
+ * place. The previous snapshot stays mapped until the journal adopts the new
+ * one, which waits for this writer; the changes since are implicitly shared
+ * copies.
+ *
+ * snapshot.bin is a 16 byte header (magic, version, count, buckets), the
+ * records (key size, value size, key, value) and a table of `buckets` slots
+ * (key hash, record offset) filled by linear probing, offset 0 marking an
+ * empty slot. Offsets are 32 bits, so a snapshot holds at most 4 GiB. */
+class SnapshotWriter : public QRunnable {
+  public:
+    SnapshotWriter(const QString& path, const JsonCommandServer::SnapshotView& snapshot,
+                   const QHash<QByteArray, QByteArray>& changes,
+                   const QSet<QByteArray>& removed, int count, quint64 upto, QAtomicInt* written)
+        : path_(path), snapshot_(snapshot), changes_(changes), removed_(removed),
+          count_(static_cast<quint32>(count)), upto_(upto), written_flag_(written),
+          buckets_(MIN_SNAPSHOT_BUCKETS),
+          file_(0), pos_(SNAPSHOT_HEADER_SIZE), written_(0) {
+        // at most half full, so probes stay short
+        while (buckets_ < count_ * 2) buckets_ *= 2;
+        table_.assign(static_cast<size_t>(buckets_) * 2, 0);
+    }
+
+    void run() {
+        QDir dir(path_);
+        QSaveFile file(dir.filePath("snapshot.bin"));
+        if (!file.open(QIODevice::WriteOnly)) return;
+        file_ = &file;
+        chunk_.reserve(SNAPSHOT_CHUNK_SIZE + 1024);
+        JsonCommandServer::appendField<quint32>(chunk_, SNAPSHOT_MAGIC);
+        JsonCommandServer::appendField<quint32>(chunk_, SNAPSHOT_VERSION);
+        JsonCommandServer::appendField<quint32>(chunk_, count_);
+        JsonCommandServer::appendField<quint32>(chunk_, buckets_);
+        QByteArray key, value;
+        qint64 pos = 0;
+        while (snapshot_.next(&pos, &key, &value)) {
+            if (changes_.contains(key) || removed_.contains(key)) continue;
+            if (!add(key, value)) return;
+        }
+        for (QHash<QByteArray, QByteArray>::const_iterator it = changes_.constBegin();
+                it != changes_.constEnd(); ++it) {
+            if (!add(it.key(), it.value())) return;
+        }
+        if (written_ != count_) return;
+        for (size_t i = 0; i < table_.size(); ++i) {
+            JsonCommandServer::appendField<quint32>(chunk_, table_[i]);
+            flush(false);
+        }
+        flush(true);
+        if (!file.commit()) return;
+        QStringList journals = dir.entryList(QStringList() << "journal.*.log", QDir::Files);
+        for (int i = 0; i < journals.size(); ++i) {
+            if (journalSeq(journals[i]) <= upto_) {
+                dir.remove(journals[i]);
+            }
+        }
+        written_flag_->storeRelease(1);
+    }
+
+  private:
+    bool add(const QByteArray& key, const QByteArray& value) {
+        if (written_ == count_ || pos_ > MAX_SNAPSHOT_OFFSET) return false;
+        quint32 hash = JsonCommandServer::checksum(key.constData(), key.size());
+        quint32 mask = buckets_ - 1;
+        quint32 slot = hash & mask;
+        while (table_[2 * slot + 1] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        table_[2 * slot] = hash;
+        table_[2 * slot + 1] = static_cast<quint32>(pos_);
+        JsonCommandServer::appendField<quint32>(chunk_, static_cast<quint32>(key.size()));
+        JsonCommandServer::appendField<quint32>(chunk_, static_cast<quint32>(value.size()));
+        chunk_.append(key);
+        chunk_.append(value);
+        pos_ += 8 + key.size() + value.size();
+        ++written_;
+        flush(false);
+        return true;
+    }
+
+    void flush(bool all) {
+        if (all || chunk_.size() >= SNAPSHOT_CHUNK_SIZE) {
+            file_->write(chunk_);
+            chunk_.clear();
+        }
+    }
+
+    QString path_;
+    JsonCommandServer::SnapshotView snapshot_;
+    QHash<QByteArray, QByteArray> changes_;
+    QSet<QByteArray> removed_;
+    quint32 count_;
+    quint64 upto_;
+    QAtomicInt* written_flag_;
+    quint32 buckets_;
+    std::vector<quint32> table_;
+    QSaveFile* file_;
+    QByteArray chunk_;
+    qint64 pos_;
+    quint32 written_;
+};
+
+}  // namespace
+
+bool JsonCommandServer::SnapshotView::attach(const uchar* data, qint64 size) {
+    detach();
+    if (size < SNAPSHOT_HEADER_SIZE || readField<quint32>(data) != SNAPSHOT_MAGIC ||
+            readField<quint32>(data + 4) != SNAPSHOT_VERSION) {
+        return false;
+    }
+    quint32 count = readField<quint32>(data + 8);
+    quint32 buckets = readField<quint32>(data + 12);
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0 || count > buckets ||
+            size - SNAPSHOT_HEADER_SIZE < qint64(buckets) * SNAPSHOT_SLOT_SIZE) {
+        return false;
+    }
+    data_ = data;
+    records_end_ = size - qint64(buckets) * SNAPSHOT_SLOT_SIZE;
+    buckets_ = buckets;
+    count_ = count;
+    return true;
+}
+
+bool JsonCommandServer::SnapshotView::find(const QByteArray& key, QByteArray* value) const {
+    if (!data_) return false;
+    quint32 hash = checksum(key.constData(), key.size());
+    quint32 mask = buckets_ - 1;
+    quint32 slot = hash & mask;
+    QByteArray found;
+    qint64 end;
+    for (quint32 i = 0; i < buckets_; ++i, slot = (slot + 1) & mask) {
+        const uchar* p = data_ + records_end_ + qint64(slot) * SNAPSHOT_SLOT_SIZE;
+        quint32 offset = readField<quint32>(p + 4);
+        if (offset == 0) return false;
+        if (readField<quint32>(p) == hash && record(offset, &found, value, &end) && found == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Start with *pos = 0. */
+bool JsonCommandServer::SnapshotView::next(qint64* pos, QByteArray* key, QByteArray* value) const {
+    if (!data_) return false;
+    if (*pos == 0) *pos = SNAPSHOT_HEADER_SIZE;
+    return record(*pos, key, value, pos);
+}
+
+bool JsonCommandServer::SnapshotView::record(qint64 pos, QByteArray* key, QByteArray* value,
+        qint64* end) const {
+    if (pos < SNAPSHOT_HEADER_SIZE || pos + 8 > records_end_) return false;
+    qint64 key_size = readField<quint32>(data_ + pos);
+    qint64 value_size = readField<quint32>(data_ + pos + 4);
+    if (pos + 8 + key_size + value_size > records_end_) return false;
+    const char* p = reinterpret_cast<const char*>(data_ + pos + 8);
+    *key = QByteArray::fromRawData(p, static_cast<int>(key_size));
+    if (value) *value = QByteArray::fromRawData(p + key_size, static_cast<int>(value_size));
+    *end = pos + 8 + key_size + value_size;
+    return true;
+}
+
+JsonCommandServer::StateJournal::StateJournal()
+    : journal_seq_(0),
+      journal_bytes_(0),
+      compact_threshold_(DEFAULT_COMPACT_THRESHOLD),
+      snapshot_file_(0),
+      size_(0) {
+    writer_.setMaxThreadCount(1);
+}
+
+JsonCommandServer::StateJournal::~StateJournal() {
+    close();
+}
+
+bool JsonCommandServer::StateJournal::open(const QString& path) {
+    close();
+    QDir dir(path);
+    if (!dir.exists() && !dir.mkpath(".")) return false;
+    path_ = dir.absolutePath();
+    if (loadSnapshot(dir.filePath("snapshot.bin"))) {
+        size_ = static_cast<int>(snapshot_.count());
+    }
+    QStringList journals = dir.entryList(QStringList() << "journal.*.log", QDir::Files, QDir::Name);
+    quint64 seq = 0;
+    qint64 replayed = 0;
+    for (int i = 0; i < journals.size(); ++i) {
+        replayJournal(dir.filePath(journals[i]));
+        replayed += QFileInfo(dir.filePath(journals[i])).size();
+        seq = qMax(seq, journalSeq(journals[i]));
+    }
+    // never append to a journal that may end in a torn record
+    if (!openJournal(seq + 1)) return false;
+    if (replayed > compact_threshold_) {
+        compact();
+    }
+    return true;
+}
+
+void JsonCommandServer::StateJournal::close() {
+    if (journal_.isOpen()) {
+        sync();
+        journal_.close();
+    }
+    // the writer may still be reading the mapping
+    writer_.waitForDone();
+    snapshot_.detach();
+    delete snapshot_file_;
+    snapshot_file_ = 0;
+    changes_.clear();
+    removed_.clear();
+    compacted_changes_.clear();
+    compacted_removed_.clear();
+    snapshot_written_.storeRelease(0);
+    size_ = 0;
+    path_ = QString();
+    journal_bytes_ = 0;
+}
+
+void JsonCommandServer::StateJournal::put(const QByteArray& key, const QByteArray& value) {
+    QByteArray current;
+    if (find(key, &current) && current == value) return;
+    apply(OP_PUT, key, value);
+    append(OP_PUT, key, value);
+}
+
+void JsonCommandServer::StateJournal::remove(const QByteArray& key) {
+    if (!apply(OP_REMOVE, key, QByteArray())) return;
+    append(OP_REMOVE, key, QByteArray());
+}
+
+bool JsonCommandServer::StateJournal::contains(const QByteArray& key) const {
+    return find(key, 0);
+}
+
+/* Values from the snapshot are copied out of the mapping. */
+QByteArray JsonCommandServer::StateJournal::value(const QByteArray& key) const {
+    QByteArray value;
+    if (!find(key, &value)) return QByteArray();
+    return QByteArray(value.constData(), value.size());
+}
+
+/* Also adopts a snapshot the writer has finished since. */
+void JsonCommandServer::StateJournal::sync() {
+    if (!journal_.isOpen()) return;
+    adoptSnapshot();
+    journal_.flush();
+#ifdef Q_OS_UNIX
+    ::fsync(journal_.handle());
+#endif
+}
+
+/* Rotates the journal and snapshots the current state in the background. */
+void JsonCommandServer::StateJournal::compact() {
+    if (!isOpen() || writer_.activeThreadCount() > 0) return;
+    quint64 upto = journal_seq_;
+    sync();
+    journal_.close();
+    openJournal(upto + 1);
+    compacted_changes_ = changes_;
+    compacted_removed_ = removed_;
+    writer_.start(new SnapshotWriter(path_, snapshot_, changes_, removed_, size_, upto,
+                                     &snapshot_written_));
+}
+
+/* Maps the snapshot the writer published in place of the previous one, and
+ * forgets the changes it covers: those not changed again since compact(). */
+void JsonCommandServer::StateJournal::adoptSnapshot() {
+    if (!snapshot_written_.loadAcquire()) return;
+    writer_.waitForDone();
+    snapshot_written_.storeRelease(0);
+    // on failure the previous mapping is kept, along with every change
+    if (!loadSnapshot(QDir(path_).filePath("snapshot.bin"))) return;
+    for (QHash<QByteArray, QByteArray>::const_iterator it = compacted_changes_.constBegin();
+            it != compacted_changes_.constEnd(); ++it) {
+        QHash<QByteArray, QByteArray>::iterator current = changes_.find(it.key());
+        if (current != changes_.end() && current.value() == it.value()) {
+            changes_.erase(current);
+        }
+    }
+    for (QSet<QByteArray>::const_iterator it = compacted_removed_.constBegin();
+            it != compacted_removed_.constEnd(); ++it) {
+        removed_.remove(*it);
+    }
+    compacted_changes_.clear();
+    compacted_removed_.clear();
+}
+
+void JsonCommandServer::StateJournal::setCompactThreshold(qint64 bytes) {
+    compact_threshold_ = bytes;
+}
+
+bool JsonCommandServer::StateJournal::find(const QByteArray& key, QByteArray* value) const {
+    QHash<QByteArray, QByteArray>::const_iterator it = changes_.constFind(key);
+    if (it != changes_.constEnd()) {
+        if (value) *value = it.value();
+        return true;
+    }
+    return !removed_.contains(key) && snapshot_.find(key, value);
+}
+
+/* Applies a change in memory; false when a remove finds nothing. */
+bool JsonCommandServer::StateJournal::apply(char op, const QByteArray& key,
+        const QByteArray& value) {
+    bool existed = contains(key);
+    if (op == OP_PUT) {
+        changes_.insert(key, value);
+        removed_.remove(key);
+        if (!existed) ++size_;
+        return true;
+    }
+    if (!existed) return false;
+    changes_.remove(key);
+    // also hidden from a snapshot being written with it
+    if (snapshot_.find(key, 0) || compacted_changes_.contains(key)) removed_.insert(key);
+    --size_;
+    return true;
+}
+
+bool JsonCommandServer::StateJournal::append(char op, const QByteArray& key,
+        const QByteArray& value) {
+    if (!journal_.isOpen()) return false;
+    QByteArray record;
+    record.reserve(static_cast<int>(RECORD_HEADER_SIZE) + key.size() + value.size());
+    appendField<quint32>(record, 0);
+    record.append(op);
+    appendField<quint32>(record, static_cast<quint32>(key.size()));
+    appendField<quint32>(record, static_cast<quint32>(value.size()));
+    record.append(key);
+    record.append(value);
+    writeField<quint32>(reinterpret_cast<uchar*>(record.data()),
+                        checksum(record.constData() + 4, record.size() - 4));
+    if (journal_.write(record) != record.size()) return false;
+    journal_bytes_ += record.size();
+    if (journal_bytes_ > compact_threshold_) {
+        compact();
+    }
+    return true;
+}
+
+/* Only maps the file; entries are read from it as they are looked up. The
+ * previous snapshot is unmapped once the new one is attached. */
+bool JsonCommandServer::StateJournal::loadSnapshot(const QString& file_name) {
+    QFile* file = new QFile(file_name);
+    qint64 size = file->open(QIODevice::ReadOnly) ? file->size() : 0;
+    const uchar* data = size > 0 ? file->map(0, size) : 0;
+    SnapshotView view;
+    if (!data || !view.attach(data, size)) {
+        delete file;
+        return false;
+    }
+    snapshot_ = view;
+    delete snapshot_file_;
+    snapshot_file_ = file;
+    return true;
+}
+
+bool JsonCommandServer::StateJournal::replayJournal(const QString& file_name) {
+    QFile file(file_name);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+    qint64 size = file.size();
+    if (size == 0) return true;
+    const uchar* data = file.map(0, size);
+    if (!data) return false;
+    qint64 pos = 0;
+    while (pos + RECORD_HEADER_SIZE <= size) {
+        char op = static_cast<char>(data[pos + 4]);
+        qint64 key_size = readField<quint32>(data + pos + 5);
+        qint64 value_size = readField<quint32>(data + pos + 9);
+        qint64 record_size = RECORD_HEADER_SIZE + key_size + value_size;
+        if (pos + record_size > size) break;
+        const char* p = reinterpret_cast<const char*>(data + pos);
+        if (checksum(p + 4, static_cast<int>(record_size - 4)) != readField<quint32>(data + pos)) {
+            break;
+        }
+        if (op == OP_PUT || op == OP_REMOVE) {
+            apply(op, QByteArray(p + RECORD_HEADER_SIZE, static_cast<int>(key_size)),
+                  QByteArray(p + RECORD_HEADER_SIZE + key_size, static_cast<int>(value_size)));
+        }
+        pos += record_size;
+    }
+    file.unmap(const_cast<uchar*>(data));
+    return pos == size;
+}
+
+bool JsonCommandServer::StateJournal::openJournal(quint64 seq) {
+    journal_seq_ = seq;
+    journal_bytes_ = 0;
+    journal_.setFileName(QDir(path_).filePath(journalName(seq)));
+    return journal_.open(QIODevice::WriteOnly | QIODevice::Truncate);
+}
@@ -0,0 +1,150 @@
+/*
+Json Command Server
+
+STATE JOURNAL
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_STATE_JOURNAL_H
+#define JSONCOMMANDSERVER_STATE_JOURNAL_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+namespace JsonCommandServer {
+
+/* A snapshot.bin mapped read-only. Records are walked in file order, and keys
+ * are looked up through the open addressing table at the end of the file, so
+ * nothing is loaded when it is attached. Keys and values handed out point
+ * into the mapping. */
+class SnapshotView {
+  public:
+    SnapshotView() : data_(0), records_end_(0), buckets_(0), count_(0) {}
+
+    bool attach(const uchar* data, qint64 size);
+    void detach() { *this = SnapshotView(); }
+    bool find(const QByteArray& key, QByteArray* value) const;
+    bool next(qint64* pos, QByteArray* key, QByteArray* value) const;
+    quint32 count() const { return count_; }
+
+  private:
+    bool record(qint64 pos, QByteArray* key, QByteArray* value, qint64* end) const;
+
+    const uchar* data_;
+    qint64 records_end_;
+    quint32 buckets_;
+    quint32 count_;
+};
+
+/* Incremental key/value persistence of the server state.
+ *
+ * Changes are appended to journal.<n>.log. When the journal grows past a
+ * threshold it is rotated and a compacted snapshot.bin of the whole state is
+ * written by a background thread, which then deletes the journals it covers.
+ * open() maps the snapshot and replays the remaining journals on top of it:
+ * only the entries changed since the snapshot are kept in memory, the others
+ * are read from the mapping when they are asked for. The next sync() or
+ * compact() after a snapshot is written maps it, unmaps the previous one and
+ * drops the changes it covers from memory. */
+class JSONCOMMANDSERVERSHARED_EXPORT StateJournal {
+  public:
+    StateJournal();
+    ~StateJournal();
+
+    bool open(const QString& path);
+    void close();
+    bool isOpen() const { return journal_.isOpen(); }
+
+    void put(const QByteArray& key, const QByteArray& value);
+    void remove(const QByteArray& key);
+    bool contains(const QByteArray& key) const;
+    QByteArray value(const QByteArray& key) const;
+
+    /* Calls f(key, value) for every entry. The arguments may point into the
+     * mapped snapshot and are only valid during the call. */
+    template<typename F>
+    void forEach(F f) const;
+
+    void sync();
+    void compact();
+    void setCompactThreshold(qint64 bytes);
+
+    qint64 journalBytes() const { return journal_bytes_; }
+    int size() const { return size_; }
+    // entries kept in memory, not read from the snapshot
+    int pendingChanges() const { return changes_.size() + removed_.size(); }
+
+  private:
+    bool find(const QByteArray& key, QByteArray* value) const;
+    bool apply(char op, const QByteArray& key, const QByteArray& value);
+    bool append(char op, const QByteArray& key, const QByteArray& value);
+    bool loadSnapshot(const QString& file_name);
+    bool replayJournal(const QString& file_name);
+    bool openJournal(quint64 seq);
+    void adoptSnapshot();
+
+    QString path_;
+    QFile journal_;
+    quint64 journal_seq_;
+    qint64 journal_bytes_;
+    qint64 compact_threshold_;
+    QFile* snapshot_file_;
+    SnapshotView snapshot_;
+    QHash<QByteArray, QByteArray> changes_;  // written since the snapshot
+    QSet<QByteArray> removed_;               // snapshot keys removed since
+    QHash<QByteArray, QByteArray> compacted_changes_;  // given to the writer
+    QSet<QByteArray> compacted_removed_;
+    QAtomicInt snapshot_written_;
+    int size_;
+    QThreadPool writer_;
+};
+
+template<typename F>
+void StateJournal::forEach(F f) const {
+    QByteArray key, value;
+    qint64 pos = 0;
+    while (snapshot_.next(&pos, &key, &value)) {
+        if (!changes_.contains(key) && !removed_.contains(key)) f(key, value);
+    }
+    for (QHash<QByteArray, QByteArray>::const_iterator it = changes_.constBegin();
+            it != changes_.constEnd(); ++it) {
+        f(it.key(), it.value());
+    }
+}
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_STATE_JOURNAL_H
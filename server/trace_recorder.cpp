@@ -0,0 +1,211 @@
+/*
+Json Command Server
+
+TRACE RECORDER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "trace_recorder.h"
+
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+static const quint64 TRACE_RING_SIZE = 8192;  // spans per thread
+
+std::atomic<int> JsonCommandServer::TraceRecorder::sampling_(0);
+
+namespace {
+
+struct TraceSpan {
+    quint64 trace;
+    const char* stage;
+    qint64 begin_ns;
+    qint64 end_ns;
+};
+
+/* Written by its thread only. A span is stored before head moves past it, so
+ * a reader that loads head with acquire sees it whole, unless the writer has
+ * lapped it meanwhile: readers check head again after copying. */
+struct TraceRing {
+    explicit TraceRing(int _thread) : head(0), floor(0), thread(_thread) {}
+
+    std::atomic<quint64> head;
+    std::atomic<quint64> floor;  // spans before it were cleared
+    int thread;
+    TraceSpan spans[TRACE_RING_SIZE];
+};
+
+QMutex& ringsMutex() {
+    static QMutex mutex;
+    return mutex;
+}
+
+/* Rings outlive their threads, their spans may still be exported. */
+std::vector<TraceRing*>& rings() {
+    static std::vector<TraceRing*> all;
+    return all;
+}
+
+TraceRing* threadRing() {
+    thread_local TraceRing* ring = 0;
+    if (!ring) {
+        QMutexLocker lock(&ringsMutex());
+        ring = new TraceRing(int(rings().size()) + 1);
+        rings().push_back(ring);
+    }
+    return ring;
+}
+
+qint64 wallOffset() {
+    using namespace std::chrono;
+    static const qint64 offset =
+        duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count() -
+        duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    return offset;
+}
+
+void appendMicros(QByteArray& out, qint64 ns) {
+    out += QByteArray::number(ns / 1000);
+    int frac = int(ns % 1000);
+    if (frac == 0) return;
+    char digits[5] = { '.', char('0' + frac / 100), char('0' + frac / 10 % 10),
+                       char('0' + frac % 10), 0 };
+    out += digits;
+}
+
+}  // namespace
+
+void JsonCommandServer::TraceRecorder::setSampling(int one_in_n) {
+    sampling_.store(qMax(0, one_in_n), std::memory_order_relaxed);
+}
+
+quint64 JsonCommandServer::TraceRecorder::sample() {
+    thread_local int countdown = 0;
+    int n = sampling();
+    if (n <= 0) return 0;
+    if (--countdown > 0) return 0;
+    countdown = n;
+    return newId();
+}
+
+quint64 JsonCommandServer::TraceRecorder::newId() {
+    thread_local std::mt19937_64 random((std::random_device()()) ^ quint64(now()));
+    quint64 id = 0;
+    while (id == 0) id = random();
+    return id;
+}
+
+qint64 JsonCommandServer::TraceRecorder::now() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void JsonCommandServer::TraceRecorder::record(quint64 trace, const char* stage,
+        qint64 begin_ns, qint64 end_ns) {
+    TraceRing* ring = threadRing();
+    quint64 head = ring->head.load(std::memory_order_relaxed);
+    TraceSpan& span = ring->spans[head % TRACE_RING_SIZE];
+    span.trace = trace;
+    span.stage = stage;
+    span.begin_ns = begin_ns;
+    span.end_ns = end_ns;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void JsonCommandServer::TraceRecorder::clear() {
+    QMutexLocker lock(&ringsMutex());
+    for (size_t i = 0; i < rings().size(); ++i) {
+        rings()[i]->floor.store(rings()[i]->head.load(std::memory_order_acquire));
+    }
+}
+
+QByteArray JsonCommandServer::TraceRecorder::toChromeTrace(const QString& process_name) {
+    QByteArray pid = QByteArray::number(qHash(process_name) & 0x7fffffff);
+    QJsonObject name;
+    name.insert("name", process_name);
+    QJsonObject meta;
+    meta.insert("name", QString("process_name"));
+    meta.insert("ph", QString("M"));
+    meta.insert("pid", pid.toInt());
+    meta.insert("args", name);
+    QByteArray out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    out += QJsonDocument(meta).toJson(QJsonDocument::Compact);
+    std::vector<TraceSpan> spans;
+    QMutexLocker lock(&ringsMutex());
+    for (size_t r = 0; r < rings().size(); ++r) {
+        TraceRing* ring = rings()[r];
+        quint64 head = ring->head.load(std::memory_order_acquire);
+        quint64 first = qMax(ring->floor.load(), head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0);
+        spans.clear();
+        for (quint64 i = first; i < head; ++i) {
+            spans.push_back(ring->spans[i % TRACE_RING_SIZE]);
+        }
+        // drop what the writer may have overwritten while it was copied
+        quint64 after = ring->head.load(std::memory_order_acquire);
+        size_t skip = after > first + TRACE_RING_SIZE - 1 ?
+                      size_t(qMin<quint64>(after - (first + TRACE_RING_SIZE - 1), spans.size())) : 0;
+        QByteArray tid = QByteArray::number(ring->thread);
+        for (size_t i = skip; i < spans.size(); ++i) {
+            const TraceSpan& span = spans[i];
+            out += ",{\"name\":\"";
+            out += span.stage;
+            out += "\",\"cat\":\"jsoncommandserver\",\"ph\":\"X\",\"pid\":";
+            out += pid;
+            out += ",\"tid\":";
+            out += tid;
+            out += ",\"ts\":";
+            appendMicros(out, span.begin_ns + wallOffset());
+            out += ",\"dur\":";
+            appendMicros(out, qMax<qint64>(0, span.end_ns - span.begin_ns));
+            out += ",\"args\":{\"trace\":\"";
+            out += idToString(span.trace).toLatin1();
+            out += "\"}}";
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+QString JsonCommandServer::TraceRecorder::idToString(quint64 trace) {
+    return QString::number(trace, 16).rightJustified(16, QChar('0'));
+}
+
+/* 0 when the value is not a trace id. */
+quint64 JsonCommandServer::TraceRecorder::idFromJson(const QJsonValue& value) {
+    if (!value.isString()) return 0;
+    bool ok = false;
+    quint64 trace = value.toString().toULongLong(&ok, 16);
+    return ok ? trace : 0;
+}
@@ -0,0 +1,83 @@
+/*
+Json Command Server
+
+TRACE RECORDER
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_TRACE_RECORDER_H
+#define JSONCOMMANDSERVER_TRACE_RECORDER_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QJsonValue>
+#include <QString>
+
+#include <atomic>
+
+namespace JsonCommandServer {
+
+/* Sampled per-command tracing. One command in N gets a trace id, carried in
+ * its envelope as "trace" (16 hex digits) across clients and federated nodes,
+ * and every stage it goes through records a span: a stage name and the
+ * monotonic begin/end times, in ns.
+ *
+ * Spans go to a fixed ring of the recording thread: the writer only stores the
+ * span and publishes the new head, so recording takes no lock and never
+ * allocates. When a ring wraps, its oldest spans are lost. toChromeTrace()
+ * collects the rings as Chrome trace-event JSON (chrome://tracing, Perfetto),
+ * timestamped in wall clock microseconds so traces of different nodes can be
+ * loaded together. Stage names must be string literals. */
+class JSONCOMMANDSERVERSHARED_EXPORT TraceRecorder {
+  public:
+    static void setSampling(int one_in_n);
+    static int sampling() { return sampling_.load(std::memory_order_relaxed); }
+    static bool enabled() { return sampling() > 0; }
+
+    /* A new trace id for one call in sampling(), 0 for the others. */
+    static quint64 sample();
+    static quint64 newId();
+
+    static qint64 now();
+    static void record(quint64 trace, const char* stage, qint64 begin_ns, qint64 end_ns);
+    static void clear();
+
+    static QByteArray toChromeTrace(const QString& process_name);
+
+    static QString idToString(quint64 trace);
+    static quint64 idFromJson(const QJsonValue& value);
+
+  private:
+    static std::atomic<int> sampling_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_TRACE_RECORDER_H
@@ -0,0 +1,185 @@
+/*
+Json Command Server
+
+TRAFFIC CAPTURE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "traffic_capture.h"
+
+#include <QDateTime>
+
+static const quint32 CAPTURE_MAGIC = 0x4a435443; // "JCTC"
+static const quint32 CAPTURE_VERSION = 2;  // 2 adds CAPTURE_STREAM
+static const int CAPTURE_HEADER_SIZE = 16;
+static const int CAPTURE_BLOCK_SIZE = 256 * 1024;
+
+static void appendVarint(QByteArray& out, quint64 value) {
+    char bytes[10];
+    int n = 0;
+    do {
+        bytes[n] = static_cast<char>(value & 0x7f);
+        value >>= 7;
+        if (value) bytes[n] |= static_cast<char>(0x80);
+        ++n;
+    } while (value);
+    out.append(bytes, n);
+}
+
+static void appendLittleEndian(QByteArray& out, quint64 value, int size) {
+    for (int i = 0; i < size; ++i) {
+        out.append(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static quint64 readLittleEndian(const QByteArray& in, int offset, int size) {
+    quint64 value = 0;
+    for (int i = 0; i < size; ++i) {
+        value |= quint64(static_cast<uchar>(in[offset + i])) << (8 * i);
+    }
+    return value;
+}
+
+JsonCommandServer::TrafficCapture::TrafficCapture()
+    : last_ns_(0), next_connection_(0), frames_(0) {
+}
+
+JsonCommandServer::TrafficCapture::~TrafficCapture() {
+    close();
+}
+
+bool JsonCommandServer::TrafficCapture::open(const QString &path) {
+    close();
+    file_.setFileName(path);
+    if (!file_.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+    QByteArray header;
+    appendLittleEndian(header, CAPTURE_MAGIC, 4);
+    appendLittleEndian(header, CAPTURE_VERSION, 4);
+    appendLittleEndian(header, quint64(QDateTime::currentMSecsSinceEpoch()), 8);
+    file_.write(header);
+    clock_.start();
+    last_ns_ = 0;
+    next_connection_ = 0;
+    frames_ = 0;
+    return true;
+}
+
+void JsonCommandServer::TrafficCapture::close() {
+    if (!file_.isOpen()) return;
+    flush();
+    file_.close();
+}
+
+quint32 JsonCommandServer::TrafficCapture::connectionOpened() {
+    quint32 connection = ++next_connection_;
+    append(CAPTURE_OPEN, connection, 0, 0);
+    return connection;
+}
+
+void JsonCommandServer::TrafficCapture::connectionClosed(quint32 connection) {
+    append(CAPTURE_CLOSE, connection, 0, 0);
+}
+
+void JsonCommandServer::TrafficCapture::frame(quint32 connection, const QByteArray &data) {
+    ++frames_;
+    append(CAPTURE_FRAME, connection, data.constData(), data.size());
+}
+
+void JsonCommandServer::TrafficCapture::stream(quint32 connection) {
+    append(CAPTURE_STREAM, connection, 0, 0);
+}
+
+void JsonCommandServer::TrafficCapture::flush() {
+    if (buffer_.isEmpty()) return;
+    file_.write(buffer_);
+    file_.flush();
+    buffer_.resize(0);
+}
+
+void JsonCommandServer::TrafficCapture::append(int kind, quint32 connection, const char *data,
+        int size) {
+    if (!file_.isOpen()) return;
+    qint64 now = clock_.nsecsElapsed();
+    buffer_.append(static_cast<char>(kind));
+    appendVarint(buffer_, connection);
+    appendVarint(buffer_, quint64(qMax<qint64>(0, now - last_ns_)));
+    appendVarint(buffer_, quint64(size));
+    buffer_.append(data, size);
+    last_ns_ = now;
+    if (buffer_.size() >= CAPTURE_BLOCK_SIZE) {
+        flush();
+    }
+}
+
+JsonCommandServer::CaptureReader::CaptureReader()
+    : start_ms_(0), time_ns_(0) {
+}
+
+bool JsonCommandServer::CaptureReader::open(const QString &path) {
+    file_.close();
+    file_.setFileName(path);
+    if (!file_.open(QIODevice::ReadOnly)) return false;
+    QByteArray header = file_.read(CAPTURE_HEADER_SIZE);
+    if (header.size() != CAPTURE_HEADER_SIZE ||
+            readLittleEndian(header, 0, 4) != CAPTURE_MAGIC ||
+            readLittleEndian(header, 4, 4) < 1 || readLittleEndian(header, 4, 4) > CAPTURE_VERSION) {
+        file_.close();
+        return false;
+    }
+    start_ms_ = static_cast<qint64>(readLittleEndian(header, 8, 8));
+    time_ns_ = 0;
+    return true;
+}
+
+bool JsonCommandServer::CaptureReader::next(CaptureRecord &record) {
+    char kind;
+    quint64 connection, delta, size;
+    if (!file_.getChar(&kind) || !readVarint(connection) || !readVarint(delta) ||
+            !readVarint(size)) {
+        return false;
+    }
+    if (kind < CAPTURE_OPEN || kind > CAPTURE_STREAM || size > quint64(0x7fffffff)) return false;
+    record.kind = kind;
+    record.connection = static_cast<quint32>(connection);
+    time_ns_ += static_cast<qint64>(delta);
+    record.time_ns = time_ns_;
+    record.data = file_.read(static_cast<qint64>(size));
+    return record.data.size() == static_cast<int>(size);
+}
+
+bool JsonCommandServer::CaptureReader::readVarint(quint64 &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char byte;
+        if (!file_.getChar(&byte)) return false;
+        value |= quint64(static_cast<uchar>(byte) & 0x7f) << shift;
+        if (!(static_cast<uchar>(byte) & 0x80)) return true;
+    }
+    return false;
+}
@@ -0,0 +1,121 @@
+/*
+Json Command Server
+
+TRAFFIC CAPTURE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_TRAFFIC_CAPTURE_H
+#define JSONCOMMANDSERVER_TRAFFIC_CAPTURE_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+
+namespace JsonCommandServer {
+
+enum CaptureRecordKind {
+    CAPTURE_OPEN = 1, // A CONNECTION STARTS SENDING
+    CAPTURE_FRAME = 2, // ONE INBOUND FRAME, WITHOUT ITS LENGTH PREFIX
+    CAPTURE_CLOSE = 3, // THE CONNECTION IS GONE
+    CAPTURE_STREAM = 4 // THE CONNECTION OPENED A STREAM, ITS CHUNKS ARE NOT RECORDED
+};
+
+struct JSONCOMMANDSERVERSHARED_EXPORT CaptureRecord {
+    CaptureRecord() : kind(0), connection(0), time_ns(0) {}
+
+    int kind;
+    quint32 connection;
+    qint64 time_ns;  // since the capture started
+    QByteArray data;
+};
+
+/* Trace of the inbound traffic of a server, for replaying it elsewhere.
+ *   header: magic, version, capture start (ms since epoch)
+ *   record: kind byte, then varints: connection id, ns since the previous
+ *           record, payload length; then the payload (frames only)
+ * Varints keep a record header at a few bytes and make the file independent
+ * of the byte order of the machine that wrote it. Records are buffered and
+ * written in blocks.
+ *
+ * Only whole messages are recorded. The chunks of a stream (see
+ * frame_codec.h) are not: the stream leaves a CAPTURE_STREAM record, and a
+ * connection that has one cannot be replayed faithfully. */
+class JSONCOMMANDSERVERSHARED_EXPORT TrafficCapture {
+  public:
+    TrafficCapture();
+    ~TrafficCapture();
+
+    bool open(const QString& path);
+    void close();
+    bool isOpen() const { return file_.isOpen(); }
+
+    quint32 connectionOpened();
+    void connectionClosed(quint32 connection);
+    void frame(quint32 connection, const QByteArray& data);
+    void stream(quint32 connection);
+    void flush();
+
+    quint64 frames() const { return frames_; }
+
+  private:
+    void append(int kind, quint32 connection, const char* data, int size);
+
+    QFile file_;
+    QByteArray buffer_;
+    QElapsedTimer clock_;
+    qint64 last_ns_;
+    quint32 next_connection_;
+    quint64 frames_;
+};
+
+/* Reads back what TrafficCapture wrote. A torn record at the end of a trace
+ * whose writer died is treated as the end of the trace. */
+class JSONCOMMANDSERVERSHARED_EXPORT CaptureReader {
+  public:
+    CaptureReader();
+
+    bool open(const QString& path);
+    bool next(CaptureRecord& record);
+    qint64 startTime() const { return start_ms_; }
+
+  private:
+    bool readVarint(quint64& value);
+
+    QFile file_;
+    qint64 start_ms_;
+    qint64 time_ns_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_TRAFFIC_CAPTURE_H
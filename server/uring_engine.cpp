@@ -0,0 +1,440 @@
+/*
+Json Command Server
+
+URING ENGINE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "uring_engine.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef IORING_RECVSEND_FIXED_BUF  // kernel headers of 6.0 or newer
+
+static_assert(JsonCommandServer::UringEngine::F_BUFFER == IORING_CQE_F_BUFFER &&
+              JsonCommandServer::UringEngine::F_MORE == IORING_CQE_F_MORE &&
+              JsonCommandServer::UringEngine::F_NOTIF == IORING_CQE_F_NOTIF &&
+              int(JsonCommandServer::UringEngine::BUFFER_SHIFT) == int(IORING_CQE_BUFFER_SHIFT),
+              "io_uring completion flags");
+
+static const unsigned short BUFFER_GROUP = 0;
+static const unsigned MAX_BUFFER_RING_ENTRIES = 32768;
+
+static int uringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                                      static_cast<void*>(0), 0));
+}
+
+static int uringRegister(int fd, unsigned opcode, const void* arg, unsigned n_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, n_args));
+}
+
+static void* mapAnonymous(size_t size) {
+    void* p = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+JsonCommandServer::UringEngine::UringEngine()
+    : ring_fd_(-1), error_(0),
+      sq_ring_(0), cq_ring_(0), sq_ring_size_(0), cq_ring_size_(0), sqes_(0), sqes_size_(0),
+      sq_head_(0), sq_tail_(0), sq_mask_(0), sq_entries_(0), sq_array_(0),
+      cq_head_(0), cq_tail_(0), cq_mask_(0), cqes_(0), to_submit_(0),
+      buffers_(0), n_buffers_(0), buffer_size_(0), buf_ring_(0), buf_ring_tail_(0),
+      slots_(0), n_slots_(0), slot_size_(0), syscalls_(0) {
+}
+
+JsonCommandServer::UringEngine::~UringEngine() {
+    close();
+}
+
+bool JsonCommandServer::UringEngine::init(unsigned entries, unsigned n_buffers,
+        unsigned buffer_size, unsigned n_slots, unsigned slot_size) {
+    close();
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = entries * 4;
+    ring_fd_ = uringSetup(entries, &params);
+    if (ring_fd_ < 0) {
+        error_ = errno;
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        error_ = ENOSYS;
+        close();
+        return false;
+    }
+    // SEND_ZC came with multishot receive (6.0); older kernels use epoll
+    std::vector<char> probe_data(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(&probe_data[0]);
+    if (uringRegister(ring_fd_, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+            probe->last_op < IORING_OP_SEND_ZC ||
+            !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)) {
+        error_ = ENOSYS;
+        close();
+        return false;
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (cq_ring_size_ > sq_ring_size_) sq_ring_size_ = cq_ring_size_;
+    cq_ring_size_ = 0;  // shares the SQ ring mapping
+    sq_ring_ = ::mmap(0, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+        error_ = errno;
+        if (sq_ring_ == MAP_FAILED) sq_ring_ = 0;
+        if (sqes != MAP_FAILED) ::munmap(sqes, sqes_size_);
+        close();
+        return false;
+    }
+    cq_ring_ = sq_ring_;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(sq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(sq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(sq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(sq + params.cq_off.cqes);
+
+    // provided buffers for multishot receive: a buffer ring where the kernel
+    // takes one (5.19), else handed over with the first submit
+    n_buffers_ = n_buffers;
+    buffer_size_ = buffer_size;
+    buffers_ = static_cast<char*>(mapAnonymous(size_t(n_buffers) * buffer_size));
+    if (!buffers_) {
+        error_ = ENOMEM;
+        close();
+        return false;
+    }
+    if (!registerBufferRing()) {
+        provideBuffers(0, n_buffers);
+    }
+
+    // registered slots for shared frames
+    n_slots_ = n_slots;
+    slot_size_ = slot_size;
+    if (n_slots > 0) {
+        slots_ = static_cast<char*>(mapAnonymous(size_t(n_slots) * slot_size));
+        if (!slots_) {
+            error_ = ENOMEM;
+            close();
+            return false;
+        }
+        std::vector<iovec> iov(n_slots);
+        for (unsigned i = 0; i < n_slots; ++i) {
+            iov[i].iov_base = slots_ + size_t(i) * slot_size;
+            iov[i].iov_len = slot_size;
+        }
+        if (uringRegister(ring_fd_, IORING_REGISTER_BUFFERS, &iov[0], n_slots) < 0) {
+            error_ = errno;
+            close();
+            return false;
+        }
+        slot_refs_.assign(n_slots, 0);
+        free_slots_.clear();
+        for (unsigned i = n_slots; i > 0; --i) {
+            free_slots_.push_back(i - 1);
+        }
+    }
+    return true;
+}
+
+void JsonCommandServer::UringEngine::close() {
+    if (sqes_) ::munmap(sqes_, sqes_size_);
+    if (sq_ring_) ::munmap(sq_ring_, sq_ring_size_);
+    if (buffers_) ::munmap(buffers_, size_t(n_buffers_) * buffer_size_);
+    if (slots_) ::munmap(slots_, size_t(n_slots_) * slot_size_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+    // the kernel drops its reference to the buffer ring with the ring fd
+    if (buf_ring_) ::munmap(buf_ring_, size_t(n_buffers_) * sizeof(io_uring_buf));
+    ring_fd_ = -1;
+    sqes_ = 0;
+    sq_ring_ = cq_ring_ = 0;
+    buffers_ = 0;
+    buf_ring_ = 0;
+    buf_ring_tail_ = 0;
+    slots_ = 0;
+    to_submit_ = 0;
+    unprovided_.clear();
+    slot_refs_.clear();
+    free_slots_.clear();
+}
+
+io_uring_sqe* JsonCommandServer::UringEngine::nextSqe() {
+    unsigned tail = *sq_tail_;
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        submit();  // full: hand the batch over early
+        if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            return 0;  // the kernel took nothing, error() says why
+        }
+    }
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqe;
+}
+
+bool JsonCommandServer::UringEngine::acceptMultishot(int listen_fd, quint64 user_data) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool JsonCommandServer::UringEngine::recvMultishot(int fd, quint64 user_data) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool JsonCommandServer::UringEngine::send(int fd, const char *data, unsigned size,
+        quint64 user_data) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<quint64>(data);
+    sqe->len = size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+}
+
+/* Completes twice: the result (with IORING_CQE_F_MORE) and, once the kernel no
+ * longer reads the slot, a notification with IORING_CQE_F_NOTIF. */
+bool JsonCommandServer::UringEngine::sendSlot(int fd, int slot, unsigned offset, unsigned size,
+        quint64 user_data) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_SEND_ZC;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<quint64>(slots_ + size_t(slot) * slot_size_ + offset);
+    sqe->len = size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+    sqe->buf_index = static_cast<unsigned short>(slot);
+    sqe->user_data = user_data;
+    return true;
+}
+
+int JsonCommandServer::UringEngine::submit() {
+    if (ring_fd_ < 0) return 0;
+    // buffers recycled while the queue was full, as far as it has room now
+    while (!unprovided_.empty() &&
+            *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < sq_entries_) {
+        provideBuffers(unprovided_.back(), 1);
+        unprovided_.pop_back();
+    }
+    if (to_submit_ == 0) return 0;
+    int submitted;
+    do {
+        submitted = uringEnter(ring_fd_, to_submit_, 0, 0);
+        ++syscalls_;
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted < 0) {
+        error_ = errno;
+        return -1;
+    }
+    to_submit_ -= qMin<unsigned>(to_submit_, submitted);
+    return submitted;
+}
+
+int JsonCommandServer::UringEngine::reap(Completion *out, int max) {
+    if (ring_fd_ < 0) return 0;
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (head != tail && n < max) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        ++head;
+        if (cqe.user_data == 0) continue;  // buffers handed back to the kernel
+        out[n].user_data = cqe.user_data;
+        out[n].res = cqe.res;
+        out[n].flags = cqe.flags;
+        ++n;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+const char* JsonCommandServer::UringEngine::buffer(unsigned id) const {
+    return buffers_ + size_t(id) * buffer_size_;
+}
+
+/* On the buffer ring this is a store the kernel sees at once; otherwise a
+ * PROVIDE_BUFFERS request, kept for a later submit if the queue is full. */
+void JsonCommandServer::UringEngine::recycleBuffer(unsigned id) {
+    if (buf_ring_) {
+        addRingBuffer(id);
+        io_uring_buf_ring* ring = static_cast<io_uring_buf_ring*>(buf_ring_);
+        __atomic_store_n(&ring->tail, buf_ring_tail_, __ATOMIC_RELEASE);
+    } else if (!provideBuffers(id, 1)) {
+        unprovided_.push_back(id);
+    }
+}
+
+/* The ring needs a power of two entries; kernels before 5.19 refuse the
+ * registration and the buffers are provided by requests instead. */
+bool JsonCommandServer::UringEngine::registerBufferRing() {
+    if (n_buffers_ == 0 || n_buffers_ > MAX_BUFFER_RING_ENTRIES ||
+            (n_buffers_ & (n_buffers_ - 1)) != 0) {
+        return false;
+    }
+    size_t size = size_t(n_buffers_) * sizeof(io_uring_buf);
+    void* ring = mapAnonymous(size);
+    if (!ring) return false;
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<quint64>(ring);
+    reg.ring_entries = n_buffers_;
+    reg.bgid = BUFFER_GROUP;
+    if (uringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        ::munmap(ring, size);
+        return false;
+    }
+    buf_ring_ = ring;
+    buf_ring_tail_ = 0;
+    for (unsigned i = 0; i < n_buffers_; ++i) {
+        addRingBuffer(i);
+    }
+    __atomic_store_n(&static_cast<io_uring_buf_ring*>(ring)->tail, buf_ring_tail_,
+                     __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Fills the next entry; the caller publishes the tail. */
+void JsonCommandServer::UringEngine::addRingBuffer(unsigned id) {
+    io_uring_buf_ring* ring = static_cast<io_uring_buf_ring*>(buf_ring_);
+    io_uring_buf* buf = &ring->bufs[buf_ring_tail_ & (n_buffers_ - 1)];
+    buf->addr = reinterpret_cast<quint64>(buffers_ + size_t(id) * buffer_size_);
+    buf->len = buffer_size_;
+    buf->bid = static_cast<unsigned short>(id);
+    ++buf_ring_tail_;
+}
+
+bool JsonCommandServer::UringEngine::provideBuffers(unsigned first, unsigned count) {
+    io_uring_sqe* sqe = nextSqe();
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<quint64>(buffers_ + size_t(first) * buffer_size_);
+    sqe->len = buffer_size_;
+    sqe->off = first;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = 0;
+    return true;
+}
+
+int JsonCommandServer::UringEngine::acquireSlot(unsigned size) {
+    if (free_slots_.empty() || size > slot_size_) return -1;
+    int slot = free_slots_.back();
+    free_slots_.pop_back();
+    slot_refs_[slot] = 1;
+    return slot;
+}
+
+char* JsonCommandServer::UringEngine::slotData(int slot) {
+    return slots_ + size_t(slot) * slot_size_;
+}
+
+void JsonCommandServer::UringEngine::retainSlot(int slot) {
+    ++slot_refs_[slot];
+}
+
+void JsonCommandServer::UringEngine::releaseSlot(int slot) {
+    if (--slot_refs_[slot] == 0) {
+        free_slots_.push_back(slot);
+    }
+}
+
+#else
+
+/* Built against older kernel headers: init() always fails, the server uses
+ * epoll. */
+JsonCommandServer::UringEngine::UringEngine()
+    : ring_fd_(-1), error_(ENOSYS), to_submit_(0), buf_ring_(0), syscalls_(0) {
+}
+
+JsonCommandServer::UringEngine::~UringEngine() {
+}
+
+bool JsonCommandServer::UringEngine::init(unsigned, unsigned, unsigned, unsigned, unsigned) {
+    error_ = ENOSYS;
+    return false;
+}
+
+void JsonCommandServer::UringEngine::close() {}
+bool JsonCommandServer::UringEngine::acceptMultishot(int, quint64) { return false; }
+bool JsonCommandServer::UringEngine::recvMultishot(int, quint64) { return false; }
+bool JsonCommandServer::UringEngine::send(int, const char*, unsigned, quint64) { return false; }
+bool JsonCommandServer::UringEngine::sendSlot(int, int, unsigned, unsigned, quint64) {
+    return false;
+}
+int JsonCommandServer::UringEngine::submit() { return 0; }
+int JsonCommandServer::UringEngine::reap(Completion*, int) { return 0; }
+const char* JsonCommandServer::UringEngine::buffer(unsigned) const { return 0; }
+void JsonCommandServer::UringEngine::recycleBuffer(unsigned) {}
+int JsonCommandServer::UringEngine::acquireSlot(unsigned) { return -1; }
+char* JsonCommandServer::UringEngine::slotData(int) { return 0; }
+void JsonCommandServer::UringEngine::retainSlot(int) {}
+void JsonCommandServer::UringEngine::releaseSlot(int) {}
+
+#endif
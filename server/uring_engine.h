@@ -0,0 +1,157 @@
+/*
+Json Command Server
+
+URING ENGINE
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef JSONCOMMANDSERVER_URING_ENGINE_H
+#define JSONCOMMANDSERVER_URING_ENGINE_H
+
+#include "jsoncommandserver_global.h"
+
+#include <QtGlobal>
+
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace JsonCommandServer {
+
+/* Minimal io_uring ring on the raw syscalls (Linux 6.0 or newer):
+ *  - multishot accept and multishot receive into provided buffers, so a
+ *    connection is armed once and its data arrives without any syscall; used
+ *    buffers go back through a registered buffer ring, without any request, or
+ *    with PROVIDE_BUFFERS in the next submit where the kernel refuses the ring;
+ *  - registered buffer slots for frames shared by many sends (broadcasts),
+ *    sent zero-copy with SEND_ZC;
+ *  - everything queued in a loop iteration goes out with one io_uring_enter.
+ * init() fails when the kernel lacks any of these, and the caller falls back
+ * to epoll. The ring fd is pollable: readable while completions are pending. */
+class JSONCOMMANDSERVERSHARED_EXPORT UringEngine {
+  public:
+    struct Completion {
+        quint64 user_data;
+        qint32 res;
+        quint32 flags;
+
+        bool more() const { return (flags & F_MORE) != 0; }
+        bool notification() const { return (flags & F_NOTIF) != 0; }
+        // provided buffer holding the data of a receive, or -1
+        int bufferId() const { return (flags & F_BUFFER) ? int(flags >> BUFFER_SHIFT) : -1; }
+    };
+
+    // IORING_CQE_* values, so users need not include the kernel header
+    enum {
+        F_BUFFER = 1 << 0,
+        F_MORE = 1 << 1,
+        F_NOTIF = 1 << 3,
+        BUFFER_SHIFT = 16
+    };
+
+    UringEngine();
+    ~UringEngine();
+
+    // returns false with error() set to an errno value
+    bool init(unsigned entries, unsigned n_buffers, unsigned buffer_size,
+              unsigned n_slots, unsigned slot_size);
+    void close();
+    bool isOpen() const { return ring_fd_ >= 0; }
+    int fd() const { return ring_fd_; }
+    int error() const { return error_; }
+
+    /* These return false, queuing nothing, when the submission queue stays
+     * full even after a submit; the caller retries after a later submit.
+     * user_data 0 is reserved for the engine's own requests. */
+    bool acceptMultishot(int listen_fd, quint64 user_data);
+    bool recvMultishot(int fd, quint64 user_data);
+    bool send(int fd, const char* data, unsigned size, quint64 user_data);
+    bool sendSlot(int fd, int slot, unsigned offset, unsigned size, quint64 user_data);
+    int submit();
+    int reap(Completion* out, int max);
+
+    const char* buffer(unsigned id) const;
+    void recycleBuffer(unsigned id);
+    bool usesBufferRing() const { return buf_ring_ != 0; }
+
+    /* Slots are reference counted; acquireSlot() returns one holding a single
+     * reference, or -1 when none is free or size does not fit. */
+    int acquireSlot(unsigned size);
+    char* slotData(int slot);
+    void retainSlot(int slot);
+    void releaseSlot(int slot);
+
+    quint64 syscalls() const { return syscalls_; }
+
+  private:
+    io_uring_sqe* nextSqe();
+    bool registerBufferRing();
+    void addRingBuffer(unsigned id);
+    bool provideBuffers(unsigned first, unsigned count);
+
+    int ring_fd_;
+    int error_;
+
+    void* sq_ring_;
+    void* cq_ring_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+    unsigned to_submit_;
+
+    char* buffers_;
+    unsigned n_buffers_;
+    unsigned buffer_size_;
+    void* buf_ring_;  // io_uring_buf_ring, 0 when buffers are provided by requests
+    unsigned short buf_ring_tail_;
+    std::vector<unsigned> unprovided_;  // recycled while the queue was full
+
+    char* slots_;
+    unsigned n_slots_;
+    unsigned slot_size_;
+    std::vector<int> slot_refs_;
+    std::vector<int> free_slots_;
+
+    quint64 syscalls_;
+};
+
+}  // namespace JsonCommandServer
+
+#endif // JSONCOMMANDSERVER_URING_ENGINE_H
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of Acceptor and the SO_REUSEPORT listeners, see server/acceptor.h
+#
+#-------------------------------------------------
+
+TARGET = tst_acceptor
+
+include(../tests.pri)
+
+SOURCES += tst_acceptor.cpp
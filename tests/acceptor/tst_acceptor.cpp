@@ -0,0 +1,164 @@
+/*
+Json Command Server
+
+ACCEPTOR TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Acceptor batches and the SO_REUSEPORT listeners behind them, alone and as
+ * the acceptor threads of a live server taking a burst of connections. */
+
+#include "acceptor.h"
+#include "base_server.h"
+#include "listen_socket.h"
+#include "test_client.h"
+
+#include <QtTest>
+
+#include <fcntl.h>
+
+using JsonCommandServer::Acceptor;
+using JsonCommandServer::BaseServer;
+using namespace TestClient;
+
+namespace {
+
+const int N_CLIENTS = 64;
+
+class TestServer : public BaseServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+}  // namespace
+
+class TestAcceptor : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void reusePortGroup();
+    void batches();
+    void connectionStorm();
+};
+
+void TestAcceptor::reusePortGroup() {
+    quint16 port = freePort();
+    QHostAddress localhost(QHostAddress::LocalHost);
+    QString error;
+    qintptr first = JsonCommandServer::openListenSocket(localhost, port, true, 16, &error);
+    QVERIFY2(first >= 0, qPrintable(error));
+    qintptr second = JsonCommandServer::openListenSocket(localhost, port, true, 16, &error);
+    QVERIFY2(second >= 0, qPrintable(error));
+    QVERIFY(fcntl(first, F_GETFD) & FD_CLOEXEC);
+    QVERIFY(fcntl(first, F_GETFL) & O_NONBLOCK);
+
+    // without SO_REUSEPORT the port is taken
+    error.clear();
+    QCOMPARE(JsonCommandServer::openListenSocket(localhost, port, false, 16, &error),
+             qintptr(-1));
+    QVERIFY(!error.isEmpty());
+
+    JsonCommandServer::closeDescriptor(first);
+    JsonCommandServer::closeDescriptor(second);
+}
+
+void TestAcceptor::batches() {
+    quint16 port = freePort();
+    QString error;
+    qintptr fd = JsonCommandServer::openListenSocket(QHostAddress(QHostAddress::LocalHost), port,
+                 true, 64, &error);
+    QVERIFY2(fd >= 0, qPrintable(error));
+    Acceptor acceptor;
+    QVERIFY(acceptor.adopt(fd));
+
+    QList<QVector<qintptr> > batches;
+    connect(&acceptor, &Acceptor::connectionsAccepted,
+            [&batches](const QVector<qintptr>& descriptors) { batches.append(descriptors); });
+
+    const int n = 8;
+    QList<QTcpSocket*> clients;
+    for (int i = 0; i < n; ++i) {
+        QTcpSocket* client = new QTcpSocket(this);
+        client->connectToHost(QHostAddress(QHostAddress::LocalHost), port);
+        clients.append(client);
+    }
+    int accepted = 0;
+    QElapsedTimer timer;
+    timer.start();
+    while (accepted < n && timer.elapsed() < TIMEOUT_MS) {
+        QTest::qWait(10);
+        accepted = 0;
+        for (int i = 0; i < batches.size(); ++i) accepted += batches[i].size();
+    }
+    QCOMPARE(accepted, n);
+    // handed on, not accepted one signal at a time
+    QVERIFY(batches.size() < n);
+    for (int i = 0; i < batches.size(); ++i) {
+        for (int j = 0; j < batches[i].size(); ++j) {
+            QVERIFY(fcntl(batches[i][j], F_GETFD) >= 0);
+            JsonCommandServer::closeDescriptor(batches[i][j]);
+        }
+    }
+    qDeleteAll(clients);
+}
+
+void TestAcceptor::connectionStorm() {
+    quint16 port = freePort();
+    TestServer server;
+    server.setServerMode(true);
+    server.setVerbose(false);
+    server.setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server.setPortServer(port);
+    server.setAcceptors(4);
+    server.initServer();
+    QVERIFY2(server.errors.isEmpty(), qPrintable(server.errors.join("\n")));
+
+    QList<QTcpSocket*> clients;
+    for (int i = 0; i < N_CLIENTS; ++i) {
+        QTcpSocket* client = new QTcpSocket(this);
+        client->connectToHost(QHostAddress(QHostAddress::LocalHost), port);
+        clients.append(client);
+    }
+    for (int i = 0; i < N_CLIENTS; ++i) {
+        QJsonObject status;
+        QVERIFY2(waitFor(clients[i], JsonCommandServer::MESSAGE_STATUS, &status),
+                 qPrintable(QString("client %1 not greeted").arg(i)));
+        QCOMPARE(status["message"].toString(), QString("conectado"));
+    }
+    QCOMPARE(server.numSockets(), N_CLIENTS);
+    QVERIFY2(server.errors.isEmpty(), qPrintable(server.errors.join("\n")));
+
+    server.closeServer();
+    qDeleteAll(clients);
+}
+
+QTEST_GUILESS_MAIN(TestAcceptor)
+
+#include "tst_acceptor.moc"
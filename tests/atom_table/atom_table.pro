@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of AtomTable, see server/atom_table.h
+#
+#-------------------------------------------------
+
+TARGET = tst_atom_table
+
+include(../tests.pri)
+
+SOURCES += tst_atom_table.cpp
@@ -0,0 +1,142 @@
+/*
+Json Command Server
+
+ATOM TABLE TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* AtomTable reference counting and id reuse: an atom lives while it has
+ * references, and its id goes to the next new string once it is released. */
+
+#include "atom_table.h"
+
+#include <QtTest>
+
+using JsonCommandServer::Atom;
+using JsonCommandServer::AtomTable;
+using JsonCommandServer::NO_ATOM;
+
+class TestAtomTable : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void intern();
+    void releaseLastReference();
+    void retain();
+    void reuse();
+    void extraRelease();
+    void clear();
+};
+
+void TestAtomTable::intern() {
+    AtomTable table;
+    QCOMPARE(table.size(), 0);
+    QCOMPARE(table.find("peer"), NO_ATOM);
+    Atom peer = table.intern("peer");
+    QVERIFY(peer != NO_ATOM);
+    QCOMPARE(table.intern("peer"), peer);
+    Atom other = table.intern("other");
+    QVERIFY(other != peer);
+    QCOMPARE(table.size(), 2);
+    QCOMPARE(table.find("peer"), peer);
+    QCOMPARE(table.string(peer), QString("peer"));
+    QCOMPARE(table.string(other), QString("other"));
+    QVERIFY(table.string(NO_ATOM).isEmpty());
+}
+
+void TestAtomTable::releaseLastReference() {
+    AtomTable table;
+    Atom peer = table.intern("peer");
+    table.intern("peer");
+    table.release(peer);
+    QCOMPARE(table.find("peer"), peer);
+    table.release(peer);
+    QCOMPARE(table.find("peer"), NO_ATOM);
+    QCOMPARE(table.size(), 0);
+}
+
+void TestAtomTable::retain() {
+    AtomTable table;
+    Atom peer = table.intern("peer");
+    table.retain(peer);
+    table.release(peer);
+    QCOMPARE(table.find("peer"), peer);
+    table.release(peer);
+    QCOMPARE(table.find("peer"), NO_ATOM);
+    // NO_ATOM is never counted
+    table.retain(NO_ATOM);
+    table.release(NO_ATOM);
+    QCOMPARE(table.size(), 0);
+}
+
+void TestAtomTable::reuse() {
+    AtomTable table;
+    Atom first = table.intern("first");
+    Atom second = table.intern("second");
+    table.release(first);
+    Atom third = table.intern("third");
+    QCOMPARE(third, first);
+    QCOMPARE(table.string(third), QString("third"));
+    QCOMPARE(table.find("first"), NO_ATOM);
+    QCOMPARE(table.find("third"), third);
+    QCOMPARE(table.string(second), QString("second"));
+    // no free id left: the next one is new
+    Atom fourth = table.intern("fourth");
+    QVERIFY(fourth != first && fourth != second);
+    QCOMPARE(table.size(), 3);
+}
+
+void TestAtomTable::extraRelease() {
+    AtomTable table;
+    Atom peer = table.intern("peer");
+    table.release(peer);
+    // a second release must not free the id twice
+    table.release(peer);
+    table.release(Atom(1000));
+    Atom a = table.intern("a");
+    Atom b = table.intern("b");
+    QVERIFY(a != b);
+    QCOMPARE(table.string(a), QString("a"));
+    QCOMPARE(table.string(b), QString("b"));
+}
+
+void TestAtomTable::clear() {
+    AtomTable table;
+    table.intern("a");
+    table.intern("b");
+    table.clear();
+    QCOMPARE(table.size(), 0);
+    QCOMPARE(table.find("a"), NO_ATOM);
+    Atom c = table.intern("c");
+    QCOMPARE(c, Atom(1));
+}
+
+QTEST_APPLESS_MAIN(TestAtomTable)
+
+#include "tst_atom_table.moc"
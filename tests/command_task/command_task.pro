@@ -0,0 +1,14 @@
+#-------------------------------------------------
+#
+# Unit tests of the coroutine command handlers, see server/command_task.h
+#
+#-------------------------------------------------
+
+TARGET = tst_command_task
+
+include(../tests.pri)
+
+# command_task.h is empty below C++20
+CONFIG += c++2a
+
+SOURCES += tst_command_task.cpp
@@ -0,0 +1,258 @@
+/*
+Json Command Server
+
+COMMAND TASK TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Coroutine handlers on a live server: sleeping, running in the pool and
+ * asking another client, while the connection's later commands wait. */
+
+#include "command_task.h"
+#include "test_client.h"
+
+#include <QPointer>
+#include <QtTest>
+
+using JsonCommandServer::BaseController;
+using JsonCommandServer::BaseServer;
+using namespace TestClient;
+
+namespace {
+
+enum TestCommands {
+    ECHO = 100,
+    SLEEP = 101,
+    POOL = 102,
+    ASK = 103,
+    QUERY = 104
+};
+
+class TestServer : public BaseServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+void reply(BaseServer* server, QTcpSocket* socket, const QString& message) {
+    if (!socket) return;
+    server->writeMessage(socket, command(JsonCommandServer::MESSAGE_NORMAL, "message", message));
+}
+
+void echo(BaseController* w, const QJsonObject&) {
+    BaseServer* server = static_cast<BaseServer*>(w);
+    reply(server, server->currentConnection(), "echo");
+}
+
+#ifdef JSONCOMMANDSERVER_HAS_COROUTINES
+
+using JsonCommandServer::CommandTask;
+using JsonCommandServer::ReplyResult;
+
+// the connection is only current until the first co_await
+CommandTask sleepThenReply(BaseServer* server, QJsonObject cmd) {
+    QPointer<QTcpSocket> socket = server->currentConnection();
+    co_await JsonCommandServer::sleepFor(server, cmd["ms"].toInt());
+    reply(server, socket, "slept");
+}
+
+CommandTask replyFromPool(BaseServer* server, QJsonObject) {
+    QPointer<QTcpSocket> socket = server->currentConnection();
+    QThread* loop = QThread::currentThread();
+    QThread* worker = 0;
+    co_await JsonCommandServer::runInPool(server, [&] { worker = QThread::currentThread(); });
+    bool back = QThread::currentThread() == loop;
+    reply(server, socket, worker != loop && back ? "pool" : "loop");
+}
+
+CommandTask askPeer(BaseServer* server, QJsonObject cmd) {
+    QPointer<QTcpSocket> socket = server->currentConnection();
+    ReplyResult result = co_await JsonCommandServer::request(
+                             server, cmd["peer"].toString(), command(QUERY, "message", "?"),
+                             cmd["timeout"].toInt());
+    reply(server, socket, result.ok ? result.reply["answer"].toString() : QString("timeout"));
+}
+
+#endif
+
+void start(TestServer* server, quint16 port) {
+    server->setServerMode(true);
+    server->setVerbose(false);
+    server->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server->setPortServer(port);
+    server->initServer();
+}
+
+bool greeted(QTcpSocket* socket, quint16 port) {
+    QJsonObject status;
+    return connectTo(socket, port) &&
+           waitFor(socket, JsonCommandServer::MESSAGE_STATUS, &status);
+}
+
+QString nextMessage(QTcpSocket* socket) {
+    QJsonObject message;
+    if (!waitFor(socket, JsonCommandServer::MESSAGE_NORMAL, &message)) return QString();
+    return message["message"].toString();
+}
+
+/* The unidentified name the server gives a client. */
+QString peerName(QTcpSocket* socket) {
+    return "@" + socket->localAddress().toString() + ":" +
+           QString::number(socket->localPort());
+}
+
+QJsonArray ask(const QString& peer, int timeout_ms) {
+    QJsonObject cmd;
+    cmd.insert("type", ASK);
+    cmd.insert("peer", peer);
+    cmd.insert("timeout", timeout_ms);
+    return QJsonArray() << cmd;
+}
+
+}  // namespace
+
+class TestCommandTask : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void init();
+    void cleanup();
+    void laterCommandsWait();
+    void runInPool();
+    void requestReply();
+    void requestTimeout();
+    void requestUnknownPeer();
+
+  private:
+    TestServer* server_;
+    quint16 port_;
+};
+
+void TestCommandTask::initTestCase() {
+#ifndef JSONCOMMANDSERVER_HAS_COROUTINES
+    QSKIP("command_task.h needs a compiler with C++20 coroutines");
+#else
+    JsonCommandServer::JsonCommandServer::addCommand(echo, ECHO);
+    JsonCommandServer::addCoroutineCommand(sleepThenReply, SLEEP);
+    JsonCommandServer::addCoroutineCommand(replyFromPool, POOL);
+    JsonCommandServer::addCoroutineCommand(askPeer, ASK);
+#endif
+}
+
+void TestCommandTask::init() {
+    port_ = freePort();
+    server_ = new TestServer;
+    start(server_, port_);
+}
+
+void TestCommandTask::cleanup() {
+    // a handler that threw; clients leaving are reported as errors too
+    QString errors = server_->errors.join("\n");
+    delete server_;
+    QVERIFY2(!errors.contains(QString::fromUtf8("assíncrono")), qPrintable(errors));
+}
+
+void TestCommandTask::laterCommandsWait() {
+    QTcpSocket client;
+    QVERIFY(greeted(&client, port_));
+    QJsonArray sleep = command(SLEEP, "ms", 50);
+    sendFrame(&client, sleep);
+    sendFrame(&client, command(ECHO, "message", "!"));
+    QCOMPARE(nextMessage(&client), QString("slept"));
+    QCOMPARE(nextMessage(&client), QString("echo"));
+
+    // other connections are not held up meanwhile
+    QTcpSocket other;
+    QVERIFY(greeted(&other, port_));
+    sendFrame(&client, command(SLEEP, "ms", 500));
+    sendFrame(&other, command(ECHO, "message", "!"));
+    QCOMPARE(nextMessage(&other), QString("echo"));
+    QCOMPARE(client.bytesAvailable(), qint64(0));
+    QCOMPARE(nextMessage(&client), QString("slept"));
+}
+
+void TestCommandTask::runInPool() {
+    QTcpSocket client;
+    QVERIFY(greeted(&client, port_));
+    sendFrame(&client, command(POOL, "message", "!"));
+    QCOMPARE(nextMessage(&client), QString("pool"));
+}
+
+void TestCommandTask::requestReply() {
+    QTcpSocket asker;
+    QTcpSocket asked;
+    QVERIFY(greeted(&asker, port_));
+    QVERIFY(greeted(&asked, port_));
+    sendFrame(&asker, ask(peerName(&asked), 2000));
+
+    QJsonObject query;
+    QVERIFY(waitFor(&asked, QUERY, &query));
+    QVERIFY(query["request_id"].toDouble() > 0);
+    QJsonObject answer;
+    answer.insert("type", JsonCommandServer::COMMAND_REPLY);
+    answer.insert("request_id", query["request_id"]);
+    answer.insert("answer", "42");
+    sendFrame(&asked, QJsonArray() << answer);
+    QCOMPARE(nextMessage(&asker), QString("42"));
+}
+
+void TestCommandTask::requestTimeout() {
+    QTcpSocket asker;
+    QTcpSocket asked;
+    QVERIFY(greeted(&asker, port_));
+    QVERIFY(greeted(&asked, port_));
+    sendFrame(&asker, ask(peerName(&asked), 100));
+    QJsonObject query;
+    QVERIFY(waitFor(&asked, QUERY, &query));
+    QCOMPARE(nextMessage(&asker), QString("timeout"));
+
+    // an answer after the timeout reaches nobody
+    QJsonObject answer;
+    answer.insert("type", JsonCommandServer::COMMAND_REPLY);
+    answer.insert("request_id", query["request_id"]);
+    answer.insert("answer", "late");
+    sendFrame(&asked, QJsonArray() << answer);
+    QJsonArray frame;
+    QVERIFY(!readFrame(&asker, &frame, 200));
+}
+
+void TestCommandTask::requestUnknownPeer() {
+    QTcpSocket asker;
+    QVERIFY(greeted(&asker, port_));
+    sendFrame(&asker, ask("@nobody", 2000));
+    QElapsedTimer timer;
+    timer.start();
+    QCOMPARE(nextMessage(&asker), QString("timeout"));
+    QVERIFY(timer.elapsed() < 1000);
+}
+
+QTEST_GUILESS_MAIN(TestCommandTask)
+
+#include "tst_command_task.moc"
@@ -0,0 +1,12 @@
+#-------------------------------------------------
+#
+# Unit tests of DatagramChannel and the datagram transport, see
+# server/datagram_channel.h
+#
+#-------------------------------------------------
+
+TARGET = tst_datagram_channel
+
+include(../tests.pri)
+
+SOURCES += tst_datagram_channel.cpp
@@ -0,0 +1,425 @@
+/*
+Json Command Server
+
+DATAGRAM CHANNEL TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* The datagram header and its MAC, DatagramChannel batches between two bound
+ * channels, and a live server taking authenticated datagrams: forged ones,
+ * lost and late sequences, the resync after a jump, and replies going back
+ * as datagrams once the client's endpoint is known. */
+
+#include "base_server.h"
+#include "datagram_channel.h"
+#include "jsoncommandserver.h"
+#include "test_client.h"
+
+#include <QUdpSocket>
+#include <QtTest>
+
+using JsonCommandServer::BaseController;
+using JsonCommandServer::BaseServer;
+using JsonCommandServer::Datagram;
+using JsonCommandServer::DatagramChannel;
+using JsonCommandServer::DatagramHeader;
+using namespace TestClient;
+
+namespace {
+
+enum TestCommands {
+    TELEMETRY = 100
+};
+
+class TestServer : public BaseServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+/* The values TELEMETRY was called with; each is echoed to its sender. */
+QList<int> values;
+
+void telemetry(BaseController* w, const QJsonObject& cmd) {
+    values.append(cmd["value"].toInt());
+    BaseServer* server = static_cast<BaseServer*>(w);
+    QTcpSocket* socket = server->currentConnection();
+    if (socket) server->writeMessage(socket, command(TELEMETRY, "value", cmd["value"]));
+}
+
+bool waitValues(int n) {
+    QElapsedTimer timer;
+    timer.start();
+    while (values.size() < n && timer.elapsed() < TIMEOUT_MS) QTest::qWait(10);
+    return values.size() >= n;
+}
+
+bool waitReceived(DatagramChannel* channel, QList<Datagram>* out, int n) {
+    QElapsedTimer timer;
+    timer.start();
+    while (out->size() < n && timer.elapsed() < TIMEOUT_MS) {
+        if (channel->receive(*out) == 0) QTest::qWait(10);
+    }
+    return out->size() >= n;
+}
+
+/* A UDP port nothing is bound to right now. */
+quint16 freeUdpPort() {
+    DatagramChannel channel;
+    QString error;
+    if (!channel.bind(QHostAddress(QHostAddress::LocalHost), 0, &error)) return 0;
+    return channel.localPort();
+}
+
+QByteArray payload(int type, int value) {
+    return QJsonDocument(command(type, "value", value)).toJson(QJsonDocument::Compact);
+}
+
+/* A TCP connection that asked for datagrams, and its own UDP channel. */
+struct Client {
+    QTcpSocket socket;
+    DatagramChannel channel;
+    quint16 server_port;
+    quint32 token;
+    QByteArray key;
+
+    bool identify(quint16 port) {
+        QJsonObject status;
+        return connectTo(&socket, port) &&
+               waitFor(&socket, JsonCommandServer::MESSAGE_STATUS, &status) &&
+               askForDatagrams();
+    }
+
+    bool askForDatagrams() {
+        QJsonObject cmd;
+        cmd.insert("type", JsonCommandServer::MESSAGE_IDENTIFY);
+        cmd.insert("datagrams", true);
+        sendFrame(&socket, QJsonArray() << cmd);
+        QJsonObject answer;
+        do {
+            if (!waitFor(&socket, JsonCommandServer::MESSAGE_IDENTIFY, &answer)) return false;
+        } while (!answer.contains("datagram_port"));
+        server_port = quint16(answer["datagram_port"].toInt());
+        token = quint32(answer["datagram_token"].toDouble());
+        key = QByteArray::fromHex(answer["datagram_key"].toString().toLatin1());
+        QString error;
+        return channel.isOpen() ||
+               channel.bind(QHostAddress(QHostAddress::LocalHost), 0, &error);
+    }
+
+    void send(quint32 sequence, const QByteArray& data, const QByteArray& with_key) {
+        channel.send(QHostAddress(QHostAddress::LocalHost), server_port,
+                     JsonCommandServer::encodeDatagram(token, sequence, with_key, data));
+    }
+
+    void send(quint32 sequence, int value) {
+        send(sequence, payload(TELEMETRY, value), key);
+    }
+};
+
+}  // namespace
+
+class TestDatagramChannel : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void init();
+    void cleanup();
+    void encodeAndDecode();
+    void foreignHeaders();
+    void macCheck();
+    void newKeys();
+    void channelBatches();
+    void oversizedDropped();
+    void negotiate();
+    void authenticDatagrams();
+    void forgedDatagrams();
+    void lostAndLate();
+    void resyncAfterJump();
+
+  private:
+    TestServer* server_;
+    quint16 port_;
+};
+
+void TestDatagramChannel::initTestCase() {
+    JsonCommandServer::JsonCommandServer::addCommand(telemetry, TELEMETRY);
+}
+
+void TestDatagramChannel::init() {
+    values.clear();
+    port_ = freePort();
+    quint16 udp_port = freeUdpPort();
+    QVERIFY(port_ != 0 && udp_port != 0);
+    server_ = new TestServer;
+    server_->setServerMode(true);
+    server_->setVerbose(false);
+    server_->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server_->setPortServer(port_);
+    server_->setDatagramPort(udp_port);
+    server_->setUnreliable(TELEMETRY, true);
+    server_->initServer();
+}
+
+void TestDatagramChannel::cleanup() {
+    delete server_;
+}
+
+void TestDatagramChannel::encodeAndDecode() {
+    QByteArray key = JsonCommandServer::newDatagramKey();
+    QByteArray data = payload(TELEMETRY, 1);
+    QByteArray datagram = JsonCommandServer::encodeDatagram(0xdeadbeef, 7, key, data);
+    QCOMPARE(datagram.size(), JsonCommandServer::DATAGRAM_HEADER_SIZE + data.size());
+    QCOMPARE(uchar(datagram.at(0)), JsonCommandServer::DATAGRAM_MAGIC);
+    QCOMPARE(uchar(datagram.at(1)), JsonCommandServer::DATAGRAM_VERSION);
+    QCOMPARE(datagram.mid(JsonCommandServer::DATAGRAM_HEADER_SIZE), data);
+
+    DatagramHeader header;
+    QVERIFY(JsonCommandServer::decodeDatagramHeader(datagram, header));
+    QCOMPARE(header.token, quint32(0xdeadbeef));
+    QCOMPARE(header.sequence, quint32(7));
+    QVERIFY(JsonCommandServer::checkDatagramMac(datagram, key));
+
+    // an empty payload is still a datagram
+    QByteArray empty = JsonCommandServer::encodeDatagram(1, 1, key, QByteArray());
+    QCOMPARE(empty.size(), JsonCommandServer::DATAGRAM_HEADER_SIZE);
+    QVERIFY(JsonCommandServer::decodeDatagramHeader(empty, header));
+    QVERIFY(JsonCommandServer::checkDatagramMac(empty, key));
+}
+
+void TestDatagramChannel::foreignHeaders() {
+    QByteArray key = JsonCommandServer::newDatagramKey();
+    QByteArray datagram = JsonCommandServer::encodeDatagram(1, 1, key, "[]");
+    DatagramHeader header;
+    QVERIFY(!JsonCommandServer::decodeDatagramHeader(
+                datagram.left(JsonCommandServer::DATAGRAM_HEADER_SIZE - 1), header));
+    QByteArray magic = datagram;
+    magic[0] = char(0);
+    QVERIFY(!JsonCommandServer::decodeDatagramHeader(magic, header));
+    // the v1 header had no MAC
+    QByteArray version = datagram;
+    version[1] = char(1);
+    QVERIFY(!JsonCommandServer::decodeDatagramHeader(version, header));
+}
+
+void TestDatagramChannel::macCheck() {
+    QByteArray key = JsonCommandServer::newDatagramKey();
+    QByteArray datagram = JsonCommandServer::encodeDatagram(42, 3, key, payload(TELEMETRY, 5));
+    QVERIFY(JsonCommandServer::checkDatagramMac(datagram, key));
+    QVERIFY(!JsonCommandServer::checkDatagramMac(datagram, JsonCommandServer::newDatagramKey()));
+    QVERIFY(!JsonCommandServer::checkDatagramMac(datagram, QByteArray()));
+    QVERIFY(!JsonCommandServer::checkDatagramMac(
+                datagram.left(JsonCommandServer::DATAGRAM_HEADER_SIZE - 1), key));
+
+    // every byte but the reserved ones is covered: token, sequence, mac, payload
+    const int covered[] = { 4, 8, JsonCommandServer::DATAGRAM_HEADER_SIZE - 1,
+                            JsonCommandServer::DATAGRAM_HEADER_SIZE, datagram.size() - 1
+                          };
+    for (size_t i = 0; i < sizeof(covered) / sizeof(covered[0]); ++i) {
+        QByteArray tampered = datagram;
+        tampered[covered[i]] = char(tampered.at(covered[i]) ^ 0x01);
+        QVERIFY2(!JsonCommandServer::checkDatagramMac(tampered, key),
+                 qPrintable(QString::number(covered[i])));
+    }
+}
+
+void TestDatagramChannel::newKeys() {
+    QByteArray a = JsonCommandServer::newDatagramKey();
+    QByteArray b = JsonCommandServer::newDatagramKey();
+    QCOMPARE(a.size(), JsonCommandServer::DATAGRAM_KEY_SIZE);
+    QCOMPARE(b.size(), JsonCommandServer::DATAGRAM_KEY_SIZE);
+    QVERIFY(a != b);
+}
+
+void TestDatagramChannel::channelBatches() {
+    DatagramChannel a;
+    DatagramChannel b;
+    QString error;
+    QVERIFY2(a.bind(QHostAddress(QHostAddress::LocalHost), 0, &error), qPrintable(error));
+    QVERIFY2(b.bind(QHostAddress(QHostAddress::LocalHost), 0, &error), qPrintable(error));
+    QVERIFY(a.isOpen());
+    QVERIFY(a.localPort() != 0);
+
+    // queued in one event loop turn, sent together
+    for (int i = 0; i < 10; ++i) {
+        a.send(QHostAddress(QHostAddress::LocalHost), b.localPort(), QByteArray::number(i));
+    }
+    QCOMPARE(a.syscalls(), quint64(0));
+    QList<Datagram> received;
+    QVERIFY(waitReceived(&b, &received, 10));
+    for (int i = 0; i < 10; ++i) {
+        QCOMPARE(received[i].data, QByteArray::number(i));
+        QCOMPARE(received[i].port, a.localPort());
+        QVERIFY(received[i].address.isLoopback());
+    }
+#ifdef Q_OS_LINUX
+    QCOMPARE(a.syscalls(), quint64(1));
+#endif
+    QCOMPARE(a.dropped(), quint64(0));
+
+    a.close();
+    QVERIFY(!a.isOpen());
+    QCOMPARE(a.localPort(), quint16(0));
+}
+
+void TestDatagramChannel::oversizedDropped() {
+    DatagramChannel channel;
+    QString error;
+    QVERIFY2(channel.bind(QHostAddress(QHostAddress::LocalHost), 0, &error), qPrintable(error));
+    channel.send(QHostAddress(QHostAddress::LocalHost), channel.localPort(),
+                 QByteArray(JsonCommandServer::MAX_DATAGRAM_SIZE + 1, 'x'));
+    QCOMPARE(channel.dropped(), quint64(1));
+
+    // one from outside is read and dropped, the next one still comes through
+    QUdpSocket sender;
+    sender.writeDatagram(QByteArray(JsonCommandServer::MAX_DATAGRAM_SIZE + 100, 'x'),
+                         QHostAddress(QHostAddress::LocalHost), channel.localPort());
+    sender.writeDatagram(QByteArray("fits"), QHostAddress(QHostAddress::LocalHost),
+                         channel.localPort());
+    QList<Datagram> received;
+    QVERIFY(waitReceived(&channel, &received, 1));
+    QCOMPARE(received.size(), 1);
+    QCOMPARE(received[0].data, QByteArray("fits"));
+    QCOMPARE(channel.dropped(), quint64(2));
+}
+
+void TestDatagramChannel::negotiate() {
+    Client client;
+    QVERIFY(client.identify(port_));
+    QVERIFY(client.token != 0);
+    QCOMPARE(client.key.size(), JsonCommandServer::DATAGRAM_KEY_SIZE);
+
+    // identifying again keeps the token and the key
+    quint32 token = client.token;
+    QByteArray key = client.key;
+    QVERIFY(client.askForDatagrams());
+    QCOMPARE(client.token, token);
+    QCOMPARE(client.key, key);
+}
+
+void TestDatagramChannel::authenticDatagrams() {
+    Client client;
+    QVERIFY(client.identify(port_));
+
+    // no datagram yet: the echo comes over TCP
+    sendFrame(&client.socket, command(TELEMETRY, "value", 0));
+    QJsonObject echo;
+    QVERIFY(waitFor(&client.socket, TELEMETRY, &echo));
+    QCOMPARE(echo["value"].toInt(), 0);
+
+    client.send(1, 1);
+    QVERIFY(waitValues(2));
+    QCOMPARE(values.last(), 1);
+    QList<Datagram> received;
+    QVERIFY(waitReceived(&client.channel, &received, 1));
+    DatagramHeader header;
+    QVERIFY(JsonCommandServer::decodeDatagramHeader(received[0].data, header));
+    QCOMPARE(header.token, client.token);
+    QCOMPARE(header.sequence, quint32(1));
+    QVERIFY(JsonCommandServer::checkDatagramMac(received[0].data, client.key));
+    QJsonArray cmd = QJsonDocument::fromJson(
+                         received[0].data.mid(JsonCommandServer::DATAGRAM_HEADER_SIZE)).array();
+    QCOMPARE(cmd[0].toObject()["value"].toInt(), 1);
+
+    QJsonObject metrics = server_->metrics();
+    QCOMPARE(metrics["datagrams_received"].toInt(), 1);
+    QCOMPARE(metrics["datagrams_sent"].toInt(), 1);
+    QCOMPARE(metrics["datagrams_rejected"].toInt(), 0);
+}
+
+void TestDatagramChannel::forgedDatagrams() {
+    Client client;
+    QVERIFY(client.identify(port_));
+    client.send(1, payload(TELEMETRY, 1), JsonCommandServer::newDatagramKey());
+    quint32 token = client.token;
+    client.token = token + 1;
+    client.send(2, 2);
+    client.token = token;
+    // authentic, but not a type that may come as a datagram
+    QJsonObject message;
+    message.insert("type", JsonCommandServer::MESSAGE_NORMAL);
+    message.insert("message", "reliable");
+    client.send(3, QJsonDocument(QJsonArray() << message).toJson(), client.key);
+    client.send(4, "not json", client.key);
+
+    QElapsedTimer timer;
+    timer.start();
+    while (server_->metrics()["datagrams_rejected"].toInt() < 4 && timer.elapsed() < TIMEOUT_MS) {
+        QTest::qWait(10);
+    }
+    QCOMPARE(server_->metrics()["datagrams_rejected"].toInt(), 4);
+    QVERIFY(values.isEmpty());
+
+    // the channel still takes the client's datagrams
+    client.send(5, 5);
+    QVERIFY(waitValues(1));
+    QCOMPARE(values.first(), 5);
+}
+
+void TestDatagramChannel::lostAndLate() {
+    Client client;
+    QVERIFY(client.identify(port_));
+    client.send(1, 1);
+    QVERIFY(waitValues(1));
+    client.send(4, 4);
+    QVERIFY(waitValues(2));
+    // a stale reading
+    client.send(3, 3);
+    client.send(5, 5);
+    QVERIFY(waitValues(3));
+    QCOMPARE(values, QList<int>() << 1 << 4 << 5);
+    QJsonObject metrics = server_->metrics();
+    QCOMPARE(metrics["datagrams_lost"].toInt(), 2);
+    QCOMPARE(metrics["datagrams_late"].toInt(), 1);
+    QCOMPARE(metrics["datagrams_received"].toInt(), 3);
+}
+
+void TestDatagramChannel::resyncAfterJump() {
+    Client client;
+    QVERIFY(client.identify(port_));
+    client.send(1, 1);
+    QVERIFY(waitValues(1));
+    // too far ahead to be loss: dropped, until 16 in a row
+    for (int i = 0; i < 16; ++i) {
+        client.send(5000 + i, 5000 + i);
+    }
+    QVERIFY(waitValues(2));
+    QCOMPARE(values.last(), 5015);
+    client.send(5016, 5016);
+    QVERIFY(waitValues(3));
+    QCOMPARE(values, QList<int>() << 1 << 5015 << 5016);
+    QJsonObject metrics = server_->metrics();
+    QCOMPARE(metrics["datagrams_late"].toInt(), 15);
+    QCOMPARE(metrics["datagrams_lost"].toInt(), 0);
+}
+
+QTEST_GUILESS_MAIN(TestDatagramChannel)
+
+#include "tst_datagram_channel.moc"
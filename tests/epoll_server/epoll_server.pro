@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of EpollServer, see server/epoll_server.h
+#
+#-------------------------------------------------
+
+TARGET = tst_epoll_server
+
+include(../tests.pri)
+
+SOURCES += tst_epoll_server.cpp
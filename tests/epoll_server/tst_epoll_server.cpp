@@ -0,0 +1,290 @@
+/*
+Json Command Server
+
+EPOLL SERVER TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* EpollServer on its epoll path against real clients: routing, frames split
+ * and batched in one read, the frame and client limits, a reader that never
+ * reads, and a listener that runs out of descriptors. */
+
+#include "epoll_server.h"
+#include "test_client.h"
+
+#include <QtTest>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using JsonCommandServer::EpollServer;
+using namespace TestClient;
+
+namespace {
+
+class TestServer : public EpollServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+QString peerName(quint16 local_port) {
+    return "@127.0.0.1:" + QString::number(local_port);
+}
+
+QJsonArray messageTo(const QString& to, const QString& message) {
+    QJsonObject cmd;
+    cmd.insert("type", JsonCommandServer::MESSAGE_TO);
+    cmd.insert("from", "test");
+    cmd.insert("to", to);
+    cmd.insert("message", message);
+    return QJsonArray() << cmd;
+}
+
+bool greeted(QTcpSocket* socket, quint16 port) {
+    QJsonObject status;
+    return connectTo(socket, port) &&
+           waitFor(socket, JsonCommandServer::MESSAGE_STATUS, &status) &&
+           status["message"].toString() == "conectado";
+}
+
+QString nextMessage(QTcpSocket* socket) {
+    QJsonObject message;
+    if (!waitFor(socket, JsonCommandServer::MESSAGE_NORMAL, &message)) return QString();
+    return message["message"].toString();
+}
+
+bool waitSockets(EpollServer* server, int n) {
+    QElapsedTimer timer;
+    timer.start();
+    while (server->numSockets() != n) {
+        if (timer.elapsed() > 2 * TIMEOUT_MS) return false;
+        QTest::qWait(10);
+    }
+    return true;
+}
+
+}  // namespace
+
+class TestEpollServer : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void init();
+    void cleanup();
+    void routesMessages();
+    void batchedFrames();
+    void splitFrame();
+    void oversizedFrame();
+    void maxClients();
+    void readerThatNeverReads();
+    void outOfDescriptors();
+
+  private:
+    TestServer* server_;
+    quint16 port_;
+};
+
+void TestEpollServer::init() {
+    port_ = freePort();
+    server_ = new TestServer;
+    server_->setPortServer(port_);
+    server_->setIoEngine(EpollServer::IO_EPOLL);
+}
+
+void TestEpollServer::cleanup() {
+    server_->closeServer();
+    delete server_;
+}
+
+void TestEpollServer::routesMessages() {
+    server_->initServer();
+    QVERIFY2(server_->errors.isEmpty(), qPrintable(server_->errors.join("\n")));
+    QCOMPARE(server_->ioEngine(), int(EpollServer::IO_EPOLL));
+
+    QTcpSocket a;
+    QTcpSocket b;
+    QVERIFY(greeted(&a, port_));
+    QVERIFY(greeted(&b, port_));
+    QVERIFY(waitSockets(server_, 2));
+    QVERIFY(server_->getPeers().contains(peerName(b.localPort())));
+
+    sendFrame(&a, messageTo(peerName(b.localPort()), "hello"));
+    QCOMPARE(nextMessage(&b), QString("hello"));
+
+    QJsonObject stats = server_->ioStats();
+    QCOMPARE(stats["engine"].toString(), QString("epoll"));
+    QVERIFY(stats["frames_received"].toDouble() >= 1);
+}
+
+void TestEpollServer::batchedFrames() {
+    server_->initServer();
+    QTcpSocket a;
+    QTcpSocket b;
+    QVERIFY(greeted(&a, port_));
+    QVERIFY(greeted(&b, port_));
+
+    const int n = 200;
+    QByteArray burst;
+    for (int i = 0; i < n; ++i) {
+        QByteArray data = QJsonDocument(messageTo(peerName(b.localPort()), QString::number(i)))
+                          .toJson(QJsonDocument::Compact);
+        burst.append(JsonCommandServer::IntToArray(data.size()));
+        burst.append(data);
+    }
+    a.write(burst);
+    for (int i = 0; i < n; ++i) {
+        QCOMPARE(nextMessage(&b), QString::number(i));
+    }
+}
+
+void TestEpollServer::splitFrame() {
+    server_->initServer();
+    QTcpSocket a;
+    QTcpSocket b;
+    QVERIFY(greeted(&a, port_));
+    QVERIFY(greeted(&b, port_));
+
+    QByteArray data = QJsonDocument(messageTo(peerName(b.localPort()), "pieces"))
+                      .toJson(QJsonDocument::Compact);
+    QByteArray frame = JsonCommandServer::IntToArray(data.size()) + data;
+    for (int i = 0; i < frame.size(); i += 7) {
+        a.write(frame.mid(i, 7));
+        a.flush();
+        QTest::qWait(2);
+    }
+    QCOMPARE(nextMessage(&b), QString("pieces"));
+}
+
+void TestEpollServer::oversizedFrame() {
+    server_->setMaxFrameSize(64);
+    server_->initServer();
+    QTcpSocket a;
+    QVERIFY(greeted(&a, port_));
+    a.write(JsonCommandServer::IntToArray(1000));
+    QJsonObject error;
+    QVERIFY(waitFor(&a, JsonCommandServer::MESSAGE_ERROR, &error));
+    QVERIFY(waitClosed(&a));
+    QVERIFY(waitSockets(server_, 0));
+}
+
+void TestEpollServer::maxClients() {
+    server_->setNMaxClients(1);
+    server_->initServer();
+    QTcpSocket a;
+    QVERIFY(greeted(&a, port_));
+    QTcpSocket b;
+    QVERIFY(connectTo(&b, port_));
+    QJsonObject error;
+    QVERIFY(waitFor(&b, JsonCommandServer::MESSAGE_ERROR, &error));
+    QVERIFY(waitClosed(&b));
+    QCOMPARE(server_->numSockets(), 1);
+}
+
+/* The slow reader is a plain socket with a small receive buffer, so Qt does
+ * not read on its behalf. */
+void TestEpollServer::readerThatNeverReads() {
+    server_->setMaxPendingOutput(64 * 1024);
+    server_->initServer();
+    QTcpSocket a;
+    QVERIFY(greeted(&a, port_));
+
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    QVERIFY(fd >= 0);
+    int size = 4096;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port_);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    QCOMPARE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    socklen_t len = sizeof(addr);
+    ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    QString slow = peerName(ntohs(addr.sin_port));
+    QVERIFY(waitSockets(server_, 2));
+
+    QString payload(16 * 1024, QChar('x'));
+    for (int i = 0; i < 1024 && server_->numSockets() == 2; ++i) {
+        sendFrame(&a, messageTo(slow, payload));
+        QTest::qWait(1);
+    }
+    QVERIFY(waitSockets(server_, 1));
+    QVERIFY(server_->errors.join("\n").contains("pendentes"));
+    ::close(fd);
+
+    // the others are still served
+    QTcpSocket b;
+    QVERIFY(greeted(&b, port_));
+    sendFrame(&a, messageTo(peerName(b.localPort()), "still here"));
+    QCOMPARE(nextMessage(&b), QString("still here"));
+}
+
+/* With the descriptor table full the pending connection is accepted on the
+ * spare descriptor and closed, instead of staying in the backlog for good. */
+void TestEpollServer::outOfDescriptors() {
+    server_->initServer();
+    rlimit old_limit;
+    QCOMPARE(::getrlimit(RLIMIT_NOFILE, &old_limit), 0);
+    rlimit limit = old_limit;
+    limit.rlim_cur = qMin<rlim_t>(old_limit.rlim_max, 1024);
+    QCOMPARE(::setrlimit(RLIMIT_NOFILE, &limit), 0);
+    QList<int> fillers;
+    for (;;) {
+        int fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) break;
+        fillers.append(fd);
+    }
+    QVERIFY(errno == EMFILE && !fillers.isEmpty());
+    // room for the client's own socket only
+    ::close(fillers.takeLast());
+
+    QTcpSocket turned_away;
+    turned_away.connectToHost(QHostAddress(QHostAddress::LocalHost), port_);
+    bool closed = waitClosed(&turned_away) ||
+                  turned_away.state() == QAbstractSocket::UnconnectedState;
+    bool refused = server_->errors.join("\n").contains("descritores");
+
+    for (int i = 0; i < fillers.size(); ++i) ::close(fillers[i]);
+    ::setrlimit(RLIMIT_NOFILE, &old_limit);
+    QVERIFY(closed);
+    QVERIFY2(refused, qPrintable(server_->errors.join("\n")));
+
+    QTcpSocket later;
+    QVERIFY(greeted(&later, port_));
+}
+
+QTEST_GUILESS_MAIN(TestEpollServer)
+
+#include "tst_epoll_server.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of GatherReducer, see server/gather_reducer.h
+#
+#-------------------------------------------------
+
+TARGET = tst_gather_reducer
+
+include(../tests.pri)
+
+SOURCES += tst_gather_reducer.cpp
@@ -0,0 +1,199 @@
+/*
+Json Command Server
+
+GATHER REDUCER TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* GatherReducer: each aggregate folded over replies as they arrive, nested
+ * fields, skipped replies and the setup errors sent back to the caller. */
+
+#include "gather_reducer.h"
+
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QtTest>
+
+using namespace JsonCommandServer;
+
+class TestGatherReducer : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void names();
+    void setupErrors();
+    void collect();
+    void count();
+    void minMaxSum();
+    void nothingToFold();
+    void firstK();
+
+  private:
+    static QJsonObject request(const QString& aggregate, const QString& field = QString(),
+                               int k = 0);
+    static QJsonObject reply(double load);
+};
+
+QJsonObject TestGatherReducer::request(const QString& aggregate, const QString& field, int k) {
+    QJsonObject out;
+    if (!aggregate.isEmpty()) out.insert("aggregate", aggregate);
+    if (!field.isEmpty()) out.insert("field", field);
+    if (k) out.insert("k", k);
+    return out;
+}
+
+/* {"stats": {"load": load}} with the envelope a reply comes in. */
+QJsonObject TestGatherReducer::reply(double load) {
+    QJsonObject stats;
+    stats.insert("load", load);
+    QJsonObject out;
+    out.insert("type", 12);
+    out.insert("request_id", 1);
+    out.insert("ip", "127.0.0.1");
+    out.insert("port", 5000);
+    out.insert("stats", stats);
+    return out;
+}
+
+void TestGatherReducer::names() {
+    for (int i = 0; i < N_GATHER_AGGREGATES; ++i) {
+        QCOMPARE(GatherReducer::aggregateByName(GatherReducer::aggregateName(i)), i);
+    }
+    QCOMPARE(GatherReducer::aggregateByName("median"), -1);
+    QVERIFY(GatherReducer::aggregateName(N_GATHER_AGGREGATES).isEmpty());
+}
+
+void TestGatherReducer::setupErrors() {
+    GatherReducer reducer;
+    QString error;
+    QVERIFY(!reducer.setup(request("median"), error));
+    QVERIFY(!error.isEmpty());
+    error.clear();
+    QVERIFY(!reducer.setup(request("sum"), error));
+    QVERIFY(!error.isEmpty());
+    error.clear();
+    QVERIFY(!reducer.setup(request("first"), error));
+    QVERIFY(!error.isEmpty());
+    QVERIFY(!reducer.setup(request("first", QString(), -1), error));
+    QVERIFY(reducer.setup(request("first", QString(), 1), error));
+    QVERIFY(reducer.setup(request(QString()), error));
+    QCOMPARE(reducer.result()["aggregate"].toString(), QString("collect"));
+}
+
+void TestGatherReducer::collect() {
+    GatherReducer reducer;
+    QString error;
+    QVERIFY(reducer.setup(request("collect"), error));
+    QVERIFY(!reducer.add("a", reply(1)));
+    QVERIFY(!reducer.add("b", reply(2)));
+    QVERIFY(!reducer.done());
+    QCOMPARE(reducer.replies(), 2);
+    QJsonArray result = reducer.result()["result"].toArray();
+    QCOMPARE(result.size(), 2);
+    // in arrival order, with the sender instead of the envelope
+    QJsonObject first = result[0].toObject();
+    QCOMPARE(first["from"].toString(), QString("a"));
+    QVERIFY(!first.contains("type"));
+    QVERIFY(!first.contains("request_id"));
+    QVERIFY(!first.contains("ip"));
+    QVERIFY(!first.contains("port"));
+    QCOMPARE(first["stats"].toObject()["load"].toDouble(), 1.0);
+    QCOMPARE(result[1].toObject()["from"].toString(), QString("b"));
+}
+
+void TestGatherReducer::count() {
+    GatherReducer reducer;
+    QString error;
+    QVERIFY(reducer.setup(request("count"), error));
+    for (int i = 0; i < 5; ++i) {
+        reducer.add(QString::number(i), QJsonObject());
+    }
+    QCOMPARE(reducer.result()["result"].toInt(), 5);
+}
+
+void TestGatherReducer::minMaxSum() {
+    const double loads[] = { 3, -1.5, 7, 0.5 };
+    const char* const aggregates[] = { "min", "max", "sum" };
+    const double expected[] = { -1.5, 7, 9 };
+    for (int a = 0; a < 3; ++a) {
+        GatherReducer reducer;
+        QString error;
+        QVERIFY(reducer.setup(request(aggregates[a], "stats.load"), error));
+        for (int i = 0; i < 4; ++i) {
+            QVERIFY(!reducer.add(QString::number(i), reply(loads[i])));
+        }
+        // missing, not a number, or not an object on the way: skipped
+        QJsonObject missing;
+        missing.insert("stats", QJsonObject());
+        reducer.add("missing", missing);
+        QJsonObject flat;
+        flat.insert("stats", 4);
+        reducer.add("flat", flat);
+        QJsonObject result = reducer.result();
+        QCOMPARE(result["aggregate"].toString(), QString(aggregates[a]));
+        QCOMPARE(result["result"].toDouble(), expected[a]);
+        QCOMPARE(result["field"].toString(), QString("stats.load"));
+        QCOMPARE(result["skipped"].toInt(), 2);
+        QCOMPARE(reducer.replies(), 6);
+    }
+}
+
+void TestGatherReducer::nothingToFold() {
+    GatherReducer reducer;
+    QString error;
+    QVERIFY(reducer.setup(request("max", "load"), error));
+    QJsonObject result = reducer.result();
+    QVERIFY(result["result"].isNull());
+    QCOMPARE(result["skipped"].toInt(), 0);
+    QJsonObject wrong;
+    wrong.insert("load", "high");
+    reducer.add("a", wrong);
+    result = reducer.result();
+    QVERIFY(result["result"].isNull());
+    QCOMPARE(result["skipped"].toInt(), 1);
+}
+
+void TestGatherReducer::firstK() {
+    GatherReducer reducer;
+    QString error;
+    QVERIFY(reducer.setup(request("first", QString(), 2), error));
+    QVERIFY(!reducer.add("a", reply(1)));
+    QVERIFY(reducer.add("b", reply(2)));
+    QVERIFY(reducer.done());
+    // later replies change nothing
+    QVERIFY(reducer.add("c", reply(3)));
+    QCOMPARE(reducer.replies(), 2);
+    QJsonArray result = reducer.result()["result"].toArray();
+    QCOMPARE(result.size(), 2);
+    QCOMPARE(result[1].toObject()["from"].toString(), QString("b"));
+}
+
+QTEST_APPLESS_MAIN(TestGatherReducer)
+
+#include "tst_gather_reducer.moc"
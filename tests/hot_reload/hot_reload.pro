@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of BaseServer's hot reload, see server/base_server.h
+#
+#-------------------------------------------------
+
+TARGET = tst_hot_reload
+
+include(../tests.pri)
+
+SOURCES += tst_hot_reload.cpp
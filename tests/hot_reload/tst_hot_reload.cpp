@@ -0,0 +1,218 @@
+/*
+Json Command Server
+
+HOT RELOAD TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Hot reload against a live server: clients kept across a port change and a
+ * handler swap, and a listener handed over to another server. */
+
+#include "base_server.h"
+#include "jsoncommandserver.h"
+#include "listen_socket.h"
+#include "test_client.h"
+
+#include <QtTest>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using JsonCommandServer::BaseController;
+using JsonCommandServer::BaseServer;
+using JsonCommandServer::CommandTable;
+using namespace TestClient;
+
+namespace {
+
+const int ECHO = 100;
+
+class TestServer : public BaseServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+void reply(BaseController* w, const QString& message) {
+    BaseServer* server = static_cast<BaseServer*>(w);
+    server->writeMessage(server->currentConnection(),
+                         command(JsonCommandServer::MESSAGE_NORMAL, "message", message));
+}
+
+void echoV1(BaseController* w, const QJsonObject&) {
+    reply(w, "v1");
+}
+
+void echoV2(BaseController* w, const QJsonObject&) {
+    reply(w, "v2");
+}
+
+void start(TestServer* server, quint16 port) {
+    server->setServerMode(true);
+    server->setVerbose(false);
+    server->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server->setPortServer(port);
+    server->initServer();
+}
+
+/* Connects and waits for the server's "conectado". */
+bool greeted(QTcpSocket* socket, quint16 port) {
+    QJsonObject status;
+    return connectTo(socket, port) &&
+           waitFor(socket, JsonCommandServer::MESSAGE_STATUS, &status) &&
+           status["message"].toString() == "conectado";
+}
+
+QString echo(QTcpSocket* socket) {
+    sendFrame(socket, command(ECHO, "message", "ping"));
+    QJsonObject answer;
+    if (!waitFor(socket, JsonCommandServer::MESSAGE_NORMAL, &answer)) return QString();
+    return answer["message"].toString();
+}
+
+}  // namespace
+
+class TestHotReload : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void init();
+    void keepsClientsAcrossPortChange();
+    void keepsClientsAcrossHandlerSwap();
+    void reloadWithoutHotReloadDropsClients();
+    void handOverListener();
+    void reusePort();
+};
+
+void TestHotReload::init() {
+    JsonCommandServer::JsonCommandServer::addCommand(echoV1, ECHO);
+}
+
+void TestHotReload::keepsClientsAcrossPortChange() {
+    quint16 old_port = freePort();
+    TestServer server;
+    server.setHotReload(true);
+    start(&server, old_port);
+    QVERIFY2(server.errors.isEmpty(), qPrintable(server.errors.join("\n")));
+
+    QTcpSocket client;
+    QVERIFY(greeted(&client, old_port));
+    QCOMPARE(server.numSockets(), 1);
+
+    quint16 new_port = freePort();
+    server.setPortServer(new_port);
+    server.updateServer();
+    QVERIFY2(server.errors.isEmpty(), qPrintable(server.errors.join("\n")));
+    QCOMPARE(server.numSockets(), 1);
+    QCOMPARE(client.state(), QAbstractSocket::ConnectedState);
+    QCOMPARE(echo(&client), QString("v1"));
+
+    QTcpSocket late;
+    QVERIFY(greeted(&late, new_port));
+    QCOMPARE(server.numSockets(), 2);
+
+    QTcpSocket stale;
+    QVERIFY(!connectTo(&stale, old_port));
+}
+
+void TestHotReload::keepsClientsAcrossHandlerSwap() {
+    quint16 port = freePort();
+    TestServer server;
+    server.setHotReload(true);
+    start(&server, port);
+
+    QTcpSocket client;
+    QVERIFY(greeted(&client, port));
+    QCOMPARE(echo(&client), QString("v1"));
+
+    CommandTable table = JsonCommandServer::JsonCommandServer::commands();
+    table.add(echoV2, ECHO);
+    JsonCommandServer::JsonCommandServer::swapCommands(table);
+    server.updateServer();
+
+    QCOMPARE(client.state(), QAbstractSocket::ConnectedState);
+    QCOMPARE(echo(&client), QString("v2"));
+}
+
+void TestHotReload::reloadWithoutHotReloadDropsClients() {
+    quint16 port = freePort();
+    TestServer server;
+    start(&server, port);
+
+    QTcpSocket client;
+    QVERIFY(greeted(&client, port));
+    server.updateServer();
+    QVERIFY(waitClosed(&client));
+
+    QTcpSocket again;
+    QVERIFY(greeted(&again, port));
+}
+
+void TestHotReload::handOverListener() {
+    quint16 port = freePort();
+    TestServer old_server;
+    start(&old_server, port);
+
+    qintptr fd = old_server.handOverListener();
+    QVERIFY(fd >= 0);
+    QCOMPARE(fcntl(fd, F_GETFD) & FD_CLOEXEC, 0);
+
+    // what exec() would leave the new process: its own copy of the descriptor
+    TestServer new_server;
+    new_server.setListenerDescriptor(dup(fd));
+    start(&new_server, port);
+    QVERIFY2(new_server.errors.isEmpty(), qPrintable(new_server.errors.join("\n")));
+
+    QTcpSocket client;
+    QVERIFY(greeted(&client, port));
+    QCOMPARE(new_server.numSockets(), 1);
+    QCOMPARE(old_server.numSockets(), 0);
+}
+
+void TestHotReload::reusePort() {
+    quint16 port = freePort();
+    TestServer first;
+    first.setReusePort(true);
+    start(&first, port);
+    TestServer second;
+    second.setReusePort(true);
+    start(&second, port);
+    QVERIFY2(first.errors.isEmpty(), qPrintable(first.errors.join("\n")));
+    QVERIFY2(second.errors.isEmpty(), qPrintable(second.errors.join("\n")));
+
+    // the old server can leave while the new one keeps the port
+    first.closeServer();
+    QTcpSocket client;
+    QVERIFY(greeted(&client, port));
+    QCOMPARE(second.numSockets(), 1);
+}
+
+QTEST_GUILESS_MAIN(TestHotReload)
+
+#include "tst_hot_reload.moc"
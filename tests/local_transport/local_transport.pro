@@ -0,0 +1,12 @@
+#-------------------------------------------------
+#
+# Unit tests of LocalListener and ShmSocket, see server/local_listener.h and
+# server/shm_socket.h
+#
+#-------------------------------------------------
+
+TARGET = tst_local_transport
+
+include(../tests.pri)
+
+SOURCES += tst_local_transport.cpp
@@ -0,0 +1,403 @@
+/*
+Json Command Server
+
+LOCAL TRANSPORT TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* The same-host transports: LocalListener paths and accepts, a listener out
+ * of descriptors, ShmSocket pairs moving more than a ring holds, and a live
+ * server routing between TCP, Unix domain and shared memory clients. */
+
+#include "base_server.h"
+#include "local_listener.h"
+#include "shm_socket.h"
+#include "test_client.h"
+
+#include <QFile>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QtTest>
+
+#include <atomic>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using JsonCommandServer::BaseServer;
+using JsonCommandServer::LocalListener;
+using JsonCommandServer::ShmSocket;
+using namespace TestClient;
+
+namespace {
+
+/* Waits for the listener's next batch. */
+class Batches : public QObject {
+  public:
+    explicit Batches(LocalListener* listener) {
+        connect(listener, &LocalListener::connectionsAccepted,
+                [this](const QVector<qintptr>& descriptors) { accepted += descriptors; });
+    }
+
+    bool wait(int n) {
+        QElapsedTimer timer;
+        timer.start();
+        while (accepted.size() < n && timer.elapsed() < TIMEOUT_MS) QTest::qWait(10);
+        return accepted.size() >= n;
+    }
+
+    QVector<qintptr> accepted;
+};
+
+/* Whether the other end closed fd within the timeout. */
+bool peerClosed(int fd) {
+    pollfd p = { fd, POLLIN, 0 };
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < TIMEOUT_MS) {
+        QTest::qWait(10);
+        if (::poll(&p, 1, 0) == 1) {
+            char c;
+            return ::read(fd, &c, 1) <= 0;
+        }
+    }
+    return false;
+}
+
+bool readAll(QIODevice* device, QByteArray* out, int size) {
+    QElapsedTimer timer;
+    timer.start();
+    while (out->size() < size && timer.elapsed() < TIMEOUT_MS) {
+        out->append(device->readAll());
+        if (out->size() < size) QTest::qWait(1);
+    }
+    return out->size() == size;
+}
+
+#ifdef Q_OS_LINUX
+/* ShmSocket::connectTo() waits for the server's answer, so the client side
+ * runs on its own thread, with the blocking waits ShmSocket implements. */
+class ShmClient : public QThread {
+  public:
+    ShmClient(const QString& _path, qint64 _ring_size)
+        : path(_path), ring_size(_ring_size), expected(0), connected(false), done(false) {}
+
+    QString path;
+    qint64 ring_size;
+    QByteArray to_send;
+    int expected;
+    QByteArray received;
+    QString error;
+    bool connected;
+    std::atomic<bool> done;
+
+  protected:
+    void run() {
+        ShmSocket* socket = ShmSocket::connectTo(path, &error, ring_size);
+        if (!socket) return;
+        connected = true;
+        socket->write(to_send);
+        while (socket->bytesToWrite() > 0 && socket->waitForBytesWritten(TIMEOUT_MS)) {}
+        while (received.size() < expected && socket->waitForReadyRead(TIMEOUT_MS)) {
+            received.append(socket->readAll());
+        }
+        while (!done) msleep(5);
+        delete socket;
+    }
+};
+#endif
+
+}  // namespace
+
+class TestLocalTransport : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void listenAndAccept();
+    void replacesStaleSocket();
+    void keepsRegularFile();
+    void connectWithoutListener();
+    void outOfDescriptors();
+    void sharedMemoryPair();
+    void sharedMemoryHangup();
+    void serverRoutesAcrossTransports();
+};
+
+void TestLocalTransport::listenAndAccept() {
+    QTemporaryDir dir;
+    QString path = dir.filePath("local.sock");
+    LocalListener listener;
+    QString error;
+    QVERIFY2(listener.listen(path, &error), qPrintable(error));
+    QVERIFY(listener.isListening());
+    QCOMPARE(listener.path(), path);
+    Batches batches(&listener);
+
+    qintptr client = JsonCommandServer::connectLocalSocket(path, &error);
+    QVERIFY2(client >= 0, qPrintable(error));
+    QVERIFY(fcntl(client, F_GETFD) & FD_CLOEXEC);
+    QVERIFY(batches.wait(1));
+    qintptr server = batches.accepted[0];
+    QVERIFY(fcntl(server, F_GETFL) & O_NONBLOCK);
+
+    QCOMPARE(::write(client, "ping", 4), ssize_t(4));
+    char data[4];
+    pollfd p = { int(server), POLLIN, 0 };
+    QCOMPARE(::poll(&p, 1, TIMEOUT_MS), 1);
+    QCOMPARE(::read(server, data, 4), ssize_t(4));
+    QCOMPARE(QByteArray(data, 4), QByteArray("ping"));
+
+    ::close(client);
+    ::close(server);
+    listener.close();
+    QVERIFY(!listener.isListening());
+    QVERIFY(!QFile::exists(path));
+}
+
+void TestLocalTransport::replacesStaleSocket() {
+    QTemporaryDir dir;
+    QString path = dir.filePath("stale.sock");
+    // what a crashed server leaves behind
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.toLocal8Bit().constData());
+    QCOMPARE(::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    ::close(fd);
+    QVERIFY(QFile::exists(path));
+
+    LocalListener listener;
+    QString error;
+    QVERIFY2(listener.listen(path, &error), qPrintable(error));
+    qintptr client = JsonCommandServer::connectLocalSocket(path, &error);
+    QVERIFY2(client >= 0, qPrintable(error));
+    ::close(client);
+}
+
+void TestLocalTransport::keepsRegularFile() {
+    QTemporaryDir dir;
+    QString path = dir.filePath("not_a_socket");
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("keep me");
+    file.close();
+
+    LocalListener listener;
+    QString error;
+    QVERIFY(!listener.listen(path, &error));
+    QVERIFY(!error.isEmpty());
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QCOMPARE(file.readAll(), QByteArray("keep me"));
+
+    QVERIFY(!listener.listen(QString(200, QChar('x')), &error));
+    QVERIFY(!listener.listen(QString(), &error));
+}
+
+void TestLocalTransport::connectWithoutListener() {
+    QTemporaryDir dir;
+    QString error;
+    QCOMPARE(JsonCommandServer::connectLocalSocket(dir.filePath("nobody.sock"), &error),
+             qintptr(-1));
+    QVERIFY(!error.isEmpty());
+}
+
+/* With the descriptor table full a pending connection is turned away on the
+ * spare descriptor, instead of waking the listener over and over. */
+void TestLocalTransport::outOfDescriptors() {
+    QTemporaryDir dir;
+    QString path = dir.filePath("full.sock");
+    LocalListener listener;
+    QString error;
+    QVERIFY2(listener.listen(path, &error), qPrintable(error));
+    Batches batches(&listener);
+
+    rlimit old_limit;
+    QCOMPARE(::getrlimit(RLIMIT_NOFILE, &old_limit), 0);
+    rlimit limit = old_limit;
+    limit.rlim_cur = qMin<rlim_t>(old_limit.rlim_max, 1024);
+    QCOMPARE(::setrlimit(RLIMIT_NOFILE, &limit), 0);
+    QList<int> fillers;
+    for (;;) {
+        int fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) break;
+        fillers.append(fd);
+    }
+    bool full = errno == EMFILE;
+    ::close(fillers.takeLast());
+
+    qintptr client = JsonCommandServer::connectLocalSocket(path, &error);
+    bool closed = client >= 0 && peerClosed(client);
+
+    if (client >= 0) ::close(client);
+    for (int i = 0; i < fillers.size(); ++i) ::close(fillers[i]);
+    ::setrlimit(RLIMIT_NOFILE, &old_limit);
+    QVERIFY(full);
+    QVERIFY2(client >= 0, qPrintable(error));
+    QVERIFY(closed);
+    QVERIFY(batches.accepted.isEmpty());
+
+    // and it accepts again once there is room
+    client = JsonCommandServer::connectLocalSocket(path, &error);
+    QVERIFY2(client >= 0, qPrintable(error));
+    QVERIFY(batches.wait(1));
+    ::close(client);
+    ::close(batches.accepted[0]);
+}
+
+/* More than the rings hold, both ways. */
+void TestLocalTransport::sharedMemoryPair() {
+#ifndef Q_OS_LINUX
+    QSKIP("shared memory connections are Linux only");
+#else
+    QTemporaryDir dir;
+    QString path = dir.filePath("shm.sock");
+    LocalListener listener;
+    QString error;
+    QVERIFY2(listener.listen(path, &error), qPrintable(error));
+    Batches batches(&listener);
+
+    ShmClient client(path, 4096);
+    for (int i = 0; i < 100 * 1024; ++i) client.to_send.append(char(i * 7));
+    QByteArray down(50 * 1024, 'd');
+    client.expected = down.size();
+    client.start();
+    QVERIFY(batches.wait(1));
+    ShmSocket* server = ShmSocket::accept(batches.accepted[0], &error, this);
+    QVERIFY2(server, qPrintable(error));
+    QCOMPARE(server->state(), QAbstractSocket::ConnectedState);
+
+    QByteArray received;
+    QVERIFY(readAll(server, &received, client.to_send.size()));
+    QVERIFY(received == client.to_send);
+    server->write(down);
+    QTRY_COMPARE(server->bytesToWrite(), qint64(0));
+    client.done = true;
+    QVERIFY(client.wait(TIMEOUT_MS));
+    QVERIFY2(client.connected, qPrintable(client.error));
+    QVERIFY(client.received == down);
+    delete server;
+#endif
+}
+
+/* The control connection's hangup is the disconnect. */
+void TestLocalTransport::sharedMemoryHangup() {
+#ifndef Q_OS_LINUX
+    QSKIP("shared memory connections are Linux only");
+#else
+    QTemporaryDir dir;
+    QString path = dir.filePath("shm.sock");
+    LocalListener listener;
+    QString error;
+    QVERIFY2(listener.listen(path, &error), qPrintable(error));
+    Batches batches(&listener);
+
+    ShmClient client(path, 4096);
+    client.done = true;  // leaves as soon as it is connected
+    client.start();
+    QVERIFY(batches.wait(1));
+    ShmSocket* server = ShmSocket::accept(batches.accepted[0], &error, this);
+    QVERIFY2(server, qPrintable(error));
+    QVERIFY(client.wait(TIMEOUT_MS));
+    QVERIFY2(client.connected, qPrintable(client.error));
+    QTRY_COMPARE(server->state(), QAbstractSocket::UnconnectedState);
+    delete server;
+
+    // a plain local connection is no shared memory client
+    qintptr plain = JsonCommandServer::connectLocalSocket(path, &error);
+    QVERIFY(batches.wait(2));
+    ::close(plain);
+    error.clear();
+    QVERIFY(!ShmSocket::accept(batches.accepted[1], &error, this));
+    QVERIFY(!error.isEmpty());
+#endif
+}
+
+void TestLocalTransport::serverRoutesAcrossTransports() {
+    QTemporaryDir dir;
+    quint16 port = freePort();
+    BaseServer server;
+    server.setServerMode(true);
+    server.setVerbose(false);
+    server.setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server.setPortServer(port);
+    server.setLocalPath(dir.filePath("server.sock"));
+#ifdef Q_OS_LINUX
+    server.setSharedMemoryPath(dir.filePath("server-shm.sock"));
+#endif
+    server.initServer();
+
+    QJsonObject status;
+    QTcpSocket tcp;
+    QVERIFY(connectTo(&tcp, port) && waitFor(&tcp, JsonCommandServer::MESSAGE_STATUS, &status));
+    QString error;
+    qintptr fd = JsonCommandServer::connectLocalSocket(dir.filePath("server.sock"), &error);
+    QVERIFY2(fd >= 0, qPrintable(error));
+    QTcpSocket local;
+    QVERIFY(local.setSocketDescriptor(fd));
+    QVERIFY(waitFor(&local, JsonCommandServer::MESSAGE_STATUS, &status));
+    QCOMPARE(status["message"].toString(), QString("conectado"));
+    QTRY_VERIFY(server.getPeers().contains("@unix:1"));
+
+    QJsonObject cmd;
+    cmd.insert("type", JsonCommandServer::MESSAGE_TO);
+    cmd.insert("from", "tcp");
+    cmd.insert("to", "@unix:1");
+    cmd.insert("message", "to a Unix domain client");
+    sendFrame(&tcp, QJsonArray() << cmd);
+    QJsonObject message;
+    QVERIFY(waitFor(&local, JsonCommandServer::MESSAGE_NORMAL, &message));
+    QCOMPARE(message["message"].toString(), QString("to a Unix domain client"));
+
+#ifdef Q_OS_LINUX
+    cmd.insert("from", "shm");
+    cmd.insert("to", "@127.0.0.1:" + QString::number(tcp.localPort()));
+    cmd.insert("message", "from shared memory");
+    QByteArray data = QJsonDocument(QJsonArray() << cmd).toJson(QJsonDocument::Compact);
+    ShmClient shm(dir.filePath("server-shm.sock"), ShmSocket::DEFAULT_RING_SIZE);
+    shm.to_send = JsonCommandServer::IntToArray(data.size()) + data;
+    shm.start();
+    QVERIFY(waitFor(&tcp, JsonCommandServer::MESSAGE_NORMAL, &message));
+    QCOMPARE(message["message"].toString(), QString("from shared memory"));
+    QVERIFY(server.getPeers().contains("@shm:2"));
+    shm.done = true;
+    QVERIFY(shm.wait(TIMEOUT_MS));
+    QVERIFY2(shm.connected, qPrintable(shm.error));
+#endif
+}
+
+QTEST_GUILESS_MAIN(TestLocalTransport)
+
+#include "tst_local_transport.moc"
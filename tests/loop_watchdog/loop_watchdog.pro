@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of LoopWatchdog and load shedding, see server/loop_watchdog.h
+#
+#-------------------------------------------------
+
+TARGET = tst_loop_watchdog
+
+include(../tests.pri)
+
+SOURCES += tst_loop_watchdog.cpp
@@ -0,0 +1,308 @@
+/*
+Json Command Server
+
+LOOP WATCHDOG TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Event loop lag as the watchdog sees it when the test blocks the loop: the
+ * histogram and percentiles, the shed level rising and recovering stage by
+ * stage, and a live server refusing connections and bulk commands meanwhile. */
+
+#include "base_server.h"
+#include "jsoncommandserver.h"
+#include "loop_watchdog.h"
+#include "test_client.h"
+
+#include <QPair>
+#include <QtTest>
+
+using JsonCommandServer::BaseController;
+using JsonCommandServer::BaseServer;
+using JsonCommandServer::LoopWatchdog;
+using namespace TestClient;
+
+namespace {
+
+enum TestCommands {
+    ECHO = 100,
+    BULK_ECHO = 101
+};
+
+/* Keeps the loop from running, which is what a slow handler does. */
+void blockLoop(int ms) {
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < ms) {}
+}
+
+/* The (level, previous) pairs of levelChanged(). */
+class Levels : public QObject {
+  public:
+    explicit Levels(LoopWatchdog* watchdog) {
+        connect(watchdog, &LoopWatchdog::levelChanged, [this](int level, int previous, qint64) {
+            changes.append(qMakePair(level, previous));
+        });
+    }
+
+    bool waitLevel(int level) {
+        QElapsedTimer timer;
+        timer.start();
+        while (timer.elapsed() < TIMEOUT_MS) {
+            if (!changes.isEmpty() && changes.last().first == level) return true;
+            QTest::qWait(5);
+        }
+        return false;
+    }
+
+    QList<QPair<int, int> > changes;
+};
+
+class TestServer : public BaseServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+void echo(BaseController* w, const QJsonObject&) {
+    BaseServer* server = static_cast<BaseServer*>(w);
+    QTcpSocket* socket = server->currentConnection();
+    if (socket) {
+        server->writeMessage(socket, command(JsonCommandServer::MESSAGE_NORMAL, "message", "echo"));
+    }
+}
+
+}  // namespace
+
+class TestLoopWatchdog : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void idleLoop();
+    void measuresLag();
+    void clearHistogram();
+    void thresholds();
+    void risesAndRecovers();
+    void skipsStagesLeftOut();
+    void stopLiftsShedding();
+    void serverShedsLoad();
+};
+
+void TestLoopWatchdog::initTestCase() {
+    JsonCommandServer::JsonCommandServer::addCommand(echo, ECHO);
+    JsonCommandServer::JsonCommandServer::addCommand(echo, BULK_ECHO,
+            JsonCommandServer::PRIORITY_BULK);
+}
+
+void TestLoopWatchdog::idleLoop() {
+    LoopWatchdog watchdog;
+    QVERIFY(!watchdog.isActive());
+    watchdog.start(5);
+    QVERIFY(watchdog.isActive());
+    QTest::qWait(200);
+    QJsonObject json = watchdog.toJson();
+    QVERIFY(json["samples"].toInt() > 0);
+    QCOMPARE(json["interval_ms"].toInt(), 5);
+    // no thresholds: nothing is ever shed
+    QCOMPARE(watchdog.level(), int(JsonCommandServer::SHED_NONE));
+}
+
+void TestLoopWatchdog::measuresLag() {
+    LoopWatchdog watchdog;
+    watchdog.start(5);
+    for (int i = 0; i < 3; ++i) {
+        QTest::qWait(50);
+        blockLoop(100);
+    }
+    QTest::qWait(50);
+    QJsonObject json = watchdog.toJson();
+    qint64 max_lag = qint64(json["max_lag_us"].toDouble());
+    QVERIFY(max_lag >= 90000);
+    QCOMPARE(watchdog.lagPercentile(1.0), max_lag);
+    QVERIFY(watchdog.lagPercentile(0.5) < max_lag);
+    QVERIFY(watchdog.lag() > 0);
+
+    // bucket i counts lags below 2^(i+1) us: the blocks land at 16 and up
+    QJsonArray histogram = json["lag_histogram"].toArray();
+    QCOMPARE(histogram.size(), int(LoopWatchdog::N_LAG_BUCKETS));
+    double total = 0;
+    double blocked = 0;
+    for (int i = 0; i < histogram.size(); ++i) {
+        total += histogram[i].toDouble();
+        if (i >= 16) blocked += histogram[i].toDouble();
+    }
+    QCOMPARE(total, json["samples"].toDouble());
+    QVERIFY(blocked >= 3);
+}
+
+void TestLoopWatchdog::clearHistogram() {
+    LoopWatchdog watchdog;
+    watchdog.start(5);
+    QTest::qWait(20);
+    blockLoop(50);
+    QTest::qWait(20);
+    QVERIFY(watchdog.toJson()["samples"].toInt() > 0);
+    watchdog.stop();
+    watchdog.clearHistogram();
+    QJsonObject json = watchdog.toJson();
+    QCOMPARE(json["samples"].toInt(), 0);
+    QCOMPARE(json["max_lag_us"].toInt(), 0);
+    QCOMPARE(watchdog.lagPercentile(0.99), qint64(0));
+    QJsonArray histogram = json["lag_histogram"].toArray();
+    for (int i = 0; i < histogram.size(); ++i) {
+        QCOMPARE(histogram[i].toInt(), 0);
+    }
+}
+
+void TestLoopWatchdog::thresholds() {
+    LoopWatchdog watchdog;
+    watchdog.setThreshold(JsonCommandServer::SHED_ACCEPT, 10);
+    watchdog.setThreshold(JsonCommandServer::SHED_LOW_PRIORITY, 20);
+    watchdog.setThreshold(JsonCommandServer::SHED_READS, 30);
+    // not stages
+    watchdog.setThreshold(JsonCommandServer::SHED_NONE, 5);
+    watchdog.setThreshold(JsonCommandServer::N_SHED_LEVELS, 5);
+    QJsonArray thresholds = watchdog.toJson()["thresholds_ms"].toArray();
+    QCOMPARE(thresholds.size(), 3);
+    QCOMPARE(thresholds[0].toInt(), 10);
+    QCOMPARE(thresholds[1].toInt(), 20);
+    QCOMPARE(thresholds[2].toInt(), 30);
+}
+
+void TestLoopWatchdog::risesAndRecovers() {
+    LoopWatchdog watchdog;
+    Levels levels(&watchdog);
+    watchdog.setThreshold(JsonCommandServer::SHED_ACCEPT, 10);
+    watchdog.setThreshold(JsonCommandServer::SHED_LOW_PRIORITY, 1000);
+    watchdog.setRecoveryTime(50);
+    watchdog.start(5);
+    QTest::qWait(20);
+    // a new sample counts 1/8: 200 ms late moves the average past 10 ms
+    blockLoop(200);
+    QVERIFY(levels.waitLevel(JsonCommandServer::SHED_ACCEPT));
+    QCOMPARE(levels.changes.first(), qMakePair(int(JsonCommandServer::SHED_ACCEPT),
+             int(JsonCommandServer::SHED_NONE)));
+
+    QVERIFY(levels.waitLevel(JsonCommandServer::SHED_NONE));
+    QCOMPARE(levels.changes.size(), 2);
+    QVERIFY(watchdog.lag() * 2 < 10000);
+
+    QJsonArray transitions = watchdog.toJson()["transitions"].toArray();
+    QCOMPARE(transitions.size(), 2);
+    QCOMPARE(transitions[0].toObject()["from"].toInt(), int(JsonCommandServer::SHED_NONE));
+    QCOMPARE(transitions[0].toObject()["to"].toInt(), int(JsonCommandServer::SHED_ACCEPT));
+    QVERIFY(transitions[0].toObject()["lag_us"].toDouble() >= 10000);
+    QCOMPARE(transitions[1].toObject()["to"].toInt(), int(JsonCommandServer::SHED_NONE));
+}
+
+void TestLoopWatchdog::skipsStagesLeftOut() {
+    LoopWatchdog watchdog;
+    Levels levels(&watchdog);
+    watchdog.setThreshold(JsonCommandServer::SHED_READS, 10);
+    watchdog.setRecoveryTime(50);
+    watchdog.start(5);
+    QTest::qWait(20);
+    blockLoop(200);
+    QVERIFY(levels.waitLevel(JsonCommandServer::SHED_READS));
+    QCOMPARE(levels.changes.first().second, int(JsonCommandServer::SHED_NONE));
+    // and back in one step, past the two stages left out
+    QVERIFY(levels.waitLevel(JsonCommandServer::SHED_NONE));
+    QCOMPARE(levels.changes.size(), 2);
+    QCOMPARE(levels.changes.last().second, int(JsonCommandServer::SHED_READS));
+}
+
+void TestLoopWatchdog::stopLiftsShedding() {
+    LoopWatchdog watchdog;
+    Levels levels(&watchdog);
+    watchdog.setThreshold(JsonCommandServer::SHED_ACCEPT, 10);
+    watchdog.setRecoveryTime(60000);
+    watchdog.start(5);
+    QTest::qWait(20);
+    blockLoop(200);
+    QVERIFY(levels.waitLevel(JsonCommandServer::SHED_ACCEPT));
+
+    watchdog.stop();
+    QVERIFY(!watchdog.isActive());
+    QCOMPARE(watchdog.level(), int(JsonCommandServer::SHED_NONE));
+    QCOMPARE(watchdog.lag(), qint64(0));
+    QCOMPARE(levels.changes.last(), qMakePair(int(JsonCommandServer::SHED_NONE),
+             int(JsonCommandServer::SHED_ACCEPT)));
+}
+
+void TestLoopWatchdog::serverShedsLoad() {
+    quint16 port = freePort();
+    QVERIFY(port != 0);
+    TestServer server;
+    server.setServerMode(true);
+    server.setVerbose(false);
+    server.setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server.setPortServer(port);
+    server.setLagWatchdog(5);
+    server.setLoadShedding(20, 40, 0);
+    server.initServer();
+
+    QTcpSocket client;
+    QJsonObject status;
+    QVERIFY(connectTo(&client, port));
+    QVERIFY(waitFor(&client, JsonCommandServer::MESSAGE_STATUS, &status));
+
+    // 500 ms late: the average jumps past both thresholds, and takes the
+    // default 2 s of calm per stage to come down
+    QTest::qWait(20);
+    blockLoop(500);
+    QTest::qWait(20);
+    QJsonObject loop = server.metrics()["loop"].toObject();
+    QCOMPARE(loop["level"].toInt(), int(JsonCommandServer::SHED_LOW_PRIORITY));
+    QVERIFY2(server.errors.join("\n").contains(QString::fromUtf8("Atraso do laço")),
+             qPrintable(server.errors.join("\n")));
+
+    sendFrame(&client, command(BULK_ECHO, "message", "?"));
+    QJsonObject error;
+    QVERIFY(waitFor(&client, JsonCommandServer::MESSAGE_ERROR, &error));
+    QVERIFY2(error["message"].toString().contains("sobrecarregado"),
+             qPrintable(error["message"].toString()));
+    sendFrame(&client, command(ECHO, "message", "?"));
+    QJsonObject reply;
+    QVERIFY(waitFor(&client, JsonCommandServer::MESSAGE_NORMAL, &reply));
+    QCOMPARE(reply["message"].toString(), QString("echo"));
+    QCOMPARE(server.metrics()["commands_shed"].toInt(), 1);
+
+    // the listener is paused: a new client waits in the backlog
+    QTcpSocket late;
+    QVERIFY(connectTo(&late, port));
+    QVERIFY(!waitFor(&late, JsonCommandServer::MESSAGE_STATUS, &status, 300));
+    QVERIFY(waitFor(&late, JsonCommandServer::MESSAGE_STATUS, &status, 3 * TIMEOUT_MS));
+    QCOMPARE(server.metrics()["loop"].toObject()["level"].toInt(),
+             int(JsonCommandServer::SHED_NONE));
+}
+
+QTEST_GUILESS_MAIN(TestLoopWatchdog)
+
+#include "tst_loop_watchdog.moc"
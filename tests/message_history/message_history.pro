@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of MessageHistory, see server/message_history.h
+#
+#-------------------------------------------------
+
+TARGET = tst_message_history
+
+include(../tests.pri)
+
+SOURCES += tst_message_history.cpp
@@ -0,0 +1,276 @@
+/*
+Json Command Server
+
+MESSAGE HISTORY TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* MessageHistory paging: cursors forward and backward, pages that stay put
+ * while records come in or fall off the ring, filters, and the peer atoms
+ * the records hold. */
+
+#include "commands_controller.h"
+#include "message_history.h"
+
+#include <QJsonObject>
+#include <QtTest>
+
+#include <vector>
+
+using namespace JsonCommandServer;
+
+class TestMessageHistory : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void noCapacity();
+    void ring();
+    void forward();
+    void backward();
+    void appendWhilePaging();
+    void overwrittenCursor();
+    void filter();
+    void matchNothing();
+    void peerAtoms();
+
+  private:
+    static void append(MessageHistory& history, int n, int level = HISTORY_CLIENT,
+                       Atom peer = NO_ATOM, int type = MESSAGE_TO);
+    static QList<int> page(const MessageHistory& history, const HistoryFilter& filter,
+                           quint64 cursor, bool forward, int limit, quint64* next);
+};
+
+/* Appends n records, each with its number as time and as "n". */
+void TestMessageHistory::append(MessageHistory& history, int n, int level, Atom peer,
+        int type) {
+    for (int i = 0; i < n; ++i) {
+        QJsonObject payload;
+        payload.insert("n", int(history.newest() + 1));
+        history.append(qint64(history.newest() + 1), level, peer, type, payload);
+    }
+}
+
+QList<int> TestMessageHistory::page(const MessageHistory& history, const HistoryFilter& filter,
+        quint64 cursor, bool forward, int limit, quint64* next) {
+    std::vector<const HistoryRecord*> records;
+    *next = history.query(filter, cursor, forward, limit, records);
+    QList<int> out;
+    for (size_t i = 0; i < records.size(); ++i) {
+        out.append(int(records[i]->seq));
+    }
+    return out;
+}
+
+static QList<int> range(int first, int last) {
+    QList<int> out;
+    for (int i = first; first <= last ? i <= last : i >= last; i += first <= last ? 1 : -1) {
+        out.append(i);
+    }
+    return out;
+}
+
+void TestMessageHistory::noCapacity() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    append(history, 3);
+    QCOMPARE(history.oldest(), quint64(0));
+    QCOMPARE(history.newest(), quint64(0));
+    quint64 next = 1;
+    QVERIFY(page(history, HistoryFilter(), 0, true, 10, &next).isEmpty());
+    QCOMPARE(next, quint64(0));
+}
+
+void TestMessageHistory::ring() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(5);
+    append(history, 3);
+    QCOMPARE(history.oldest(), quint64(1));
+    QCOMPARE(history.newest(), quint64(3));
+    append(history, 5);
+    QCOMPARE(history.oldest(), quint64(4));
+    QCOMPARE(history.newest(), quint64(8));
+    quint64 next = 0;
+    QCOMPARE(page(history, HistoryFilter(), 0, true, 10, &next), range(4, 8));
+    // resizing starts over
+    history.setCapacity(3);
+    QCOMPARE(history.oldest(), quint64(0));
+    append(history, 1);
+    QCOMPARE(history.newest(), quint64(1));
+}
+
+void TestMessageHistory::forward() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(100);
+    append(history, 25);
+    HistoryFilter all;
+    quint64 next = 0;
+    QCOMPARE(page(history, all, 0, true, 10, &next), range(1, 10));
+    QCOMPARE(next, quint64(10));
+    QCOMPARE(page(history, all, next, true, 10, &next), range(11, 20));
+    QCOMPARE(next, quint64(20));
+    QCOMPARE(page(history, all, next, true, 10, &next), range(21, 25));
+    QCOMPARE(next, quint64(0));
+    // a page that ends with the last record says there is no more
+    QCOMPARE(page(history, all, 15, true, 10, &next), range(16, 25));
+    QCOMPARE(next, quint64(0));
+    QVERIFY(page(history, all, 25, true, 10, &next).isEmpty());
+    QVERIFY(page(history, all, 0, true, 0, &next).isEmpty());
+}
+
+void TestMessageHistory::backward() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(100);
+    append(history, 25);
+    HistoryFilter all;
+    quint64 next = 0;
+    QCOMPARE(page(history, all, 0, false, 10, &next), range(25, 16));
+    QCOMPARE(next, quint64(16));
+    QCOMPARE(page(history, all, next, false, 10, &next), range(15, 6));
+    QCOMPARE(next, quint64(6));
+    QCOMPARE(page(history, all, next, false, 10, &next), range(5, 1));
+    QCOMPARE(next, quint64(0));
+    QCOMPARE(page(history, all, 11, false, 10, &next), range(10, 1));
+    QCOMPARE(next, quint64(0));
+}
+
+void TestMessageHistory::appendWhilePaging() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(100);
+    append(history, 10);
+    HistoryFilter all;
+    quint64 older = 0;
+    QCOMPARE(page(history, all, 0, false, 5, &older), range(10, 6));
+    quint64 newer = 0;
+    QCOMPARE(page(history, all, 0, true, 10, &newer), range(1, 10));
+    append(history, 10);
+    // backward pages go on from where they were, new records come after
+    QCOMPARE(page(history, all, older, false, 5, &older), range(5, 1));
+    QCOMPARE(page(history, all, 10, true, 10, &newer), range(11, 20));
+}
+
+void TestMessageHistory::overwrittenCursor() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(10);
+    append(history, 5);
+    quint64 next = 0;
+    QCOMPARE(page(history, HistoryFilter(), 0, true, 2, &next), range(1, 2));
+    append(history, 20);
+    // the records after the cursor fell off: the page starts at the oldest kept
+    QCOMPARE(page(history, HistoryFilter(), next, true, 3, &next), range(16, 18));
+    QCOMPARE(page(history, HistoryFilter(), 3, false, 3, &next), QList<int>());
+    QCOMPARE(next, quint64(0));
+}
+
+void TestMessageHistory::filter() {
+    AtomTable atoms;
+    Atom alice = atoms.intern("alice");
+    Atom bob = atoms.intern("bob");
+    MessageHistory history(atoms);
+    history.setCapacity(100);
+    append(history, 4, HISTORY_CLIENT, alice, MESSAGE_TO);       // 1-4
+    append(history, 4, HISTORY_CLIENT, bob, MESSAGE_TO);         // 5-8
+    append(history, 2, HISTORY_STATUS, NO_ATOM, MESSAGE_STATUS); // 9-10
+    append(history, 2, HISTORY_ERROR, bob, MESSAGE_ERROR);       // 11-12
+    quint64 next = 0;
+
+    HistoryFilter peer;
+    peer.any_peer = false;
+    peer.peer = bob;
+    QCOMPARE(page(history, peer, 0, true, 100, &next), range(5, 8) << 11 << 12);
+    // the cursor of a filtered page is the last record it looked at
+    QCOMPARE(page(history, peer, 0, true, 3, &next), range(5, 7));
+    QCOMPARE(next, quint64(7));
+    QCOMPARE(page(history, peer, next, true, 3, &next), QList<int>() << 8 << 11 << 12);
+
+    HistoryFilter levels;
+    levels.levels = (1u << HISTORY_STATUS) | (1u << HISTORY_ERROR);
+    QCOMPARE(page(history, levels, 0, true, 100, &next), range(9, 12));
+
+    HistoryFilter type;
+    type.any_type = false;
+    type.type = MESSAGE_STATUS;
+    QCOMPARE(page(history, type, 0, false, 100, &next), range(10, 9));
+
+    HistoryFilter time;
+    time.since_ms = 3;
+    time.until_ms = 6;
+    QCOMPARE(page(history, time, 0, true, 100, &next), range(3, 6));
+
+    HistoryFilter none;
+    none.levels = 0;
+    QVERIFY(page(history, none, 0, true, 100, &next).isEmpty());
+    QCOMPARE(next, quint64(0));
+}
+
+void TestMessageHistory::matchNothing() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(10);
+    append(history, 5);
+    HistoryFilter nothing;
+    nothing.match_nothing = true;
+    quint64 next = 1;
+    QVERIFY(page(history, nothing, 0, true, 10, &next).isEmpty());
+    QCOMPARE(next, quint64(0));
+    QVERIFY(page(history, nothing, 0, false, 10, &next).isEmpty());
+    QCOMPARE(next, quint64(0));
+}
+
+/* A record keeps its peer's name after the connection let go of it. */
+void TestMessageHistory::peerAtoms() {
+    AtomTable atoms;
+    MessageHistory history(atoms);
+    history.setCapacity(2);
+    Atom peer = atoms.intern("peer");
+    append(history, 1, HISTORY_CLIENT, peer);
+    atoms.release(peer);
+    QCOMPARE(atoms.find("peer"), peer);
+    append(history, 1);
+    QCOMPARE(atoms.find("peer"), peer);
+    // overwritten by the ring
+    append(history, 1);
+    QCOMPARE(atoms.find("peer"), NO_ATOM);
+
+    peer = atoms.intern("peer");
+    append(history, 2, HISTORY_CLIENT, peer);
+    atoms.release(peer);
+    QCOMPARE(atoms.find("peer"), peer);
+    history.clear();
+    QCOMPARE(atoms.find("peer"), NO_ATOM);
+    QCOMPARE(atoms.size(), 0);
+}
+
+QTEST_APPLESS_MAIN(TestMessageHistory)
+
+#include "tst_message_history.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of NodeLinkHandshake, see server/node_link.h
+#
+#-------------------------------------------------
+
+TARGET = tst_node_link
+
+include(../tests.pri)
+
+SOURCES += tst_node_link.cpp
@@ -0,0 +1,191 @@
+/*
+Json Command Server
+
+NODE LINK TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* The NODE_LINK handshake: two servers with the same secret link, anything
+ * else is refused, and no server can be used to sign a challenge it was
+ * handed by someone who has not proven the secret. */
+
+#include "node_link.h"
+
+#include <QtTest>
+
+using namespace JsonCommandServer;
+
+static const char* const SECRET = "federation secret";
+
+class TestNodeLink : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void link();
+    void wrongSecret();
+    void noSecret();
+    void ownName();
+    void responderProvesLast();
+    void relayChallenge();
+    void reflectProof();
+    void replayProof();
+};
+
+void TestNodeLink::link() {
+    NodeLinkHandshake a(LINK_INITIATOR, SECRET, "A");
+    NodeLinkHandshake b(LINK_RESPONDER, SECRET, "B");
+    QJsonObject to_b = a.start();
+    QJsonObject to_a;
+    QCOMPARE(b.receive(to_b, &to_a), int(LINK_PENDING));
+    QCOMPARE(a.receive(to_a, &to_b), int(LINK_PENDING));
+    QCOMPARE(b.receive(to_b, &to_a), int(LINK_ACCEPTED));
+    QCOMPARE(a.receive(to_a, &to_b), int(LINK_ACCEPTED));
+    QVERIFY(to_b.isEmpty());
+    QCOMPARE(a.peer(), QString("B"));
+    QCOMPARE(b.peer(), QString("A"));
+}
+
+void TestNodeLink::wrongSecret() {
+    NodeLinkHandshake a(LINK_INITIATOR, "one secret", "A");
+    NodeLinkHandshake b(LINK_RESPONDER, "another secret", "B");
+    QJsonObject to_b = a.start();
+    QJsonObject to_a;
+    b.receive(to_b, &to_a);
+    a.receive(to_a, &to_b);
+    QCOMPARE(b.receive(to_b, &to_a), int(LINK_REJECTED));
+    QVERIFY(to_a.isEmpty());
+}
+
+void TestNodeLink::noSecret() {
+    NodeLinkHandshake a(LINK_INITIATOR, QByteArray(), "A");
+    QVERIFY(a.start().isEmpty());
+    QCOMPARE(a.state(), int(LINK_REJECTED));
+    NodeLinkHandshake b(LINK_RESPONDER, QByteArray(), "B");
+    NodeLinkHandshake c(LINK_INITIATOR, SECRET, "C");
+    QJsonObject reply;
+    QCOMPARE(b.receive(c.start(), &reply), int(LINK_REJECTED));
+    QVERIFY(reply.isEmpty());
+}
+
+void TestNodeLink::ownName() {
+    NodeLinkHandshake a(LINK_INITIATOR, SECRET, "A");
+    NodeLinkHandshake b(LINK_RESPONDER, SECRET, "A");
+    QJsonObject reply;
+    QCOMPARE(b.receive(a.start(), &reply), int(LINK_REJECTED));
+}
+
+/* The responder's only answer to a stranger is a challenge. */
+void TestNodeLink::responderProvesLast() {
+    NodeLinkHandshake b(LINK_RESPONDER, SECRET, "B");
+    QJsonObject hello;
+    hello.insert("node", "A");
+    hello.insert("challenge", QString::fromLatin1(NodeLinkHandshake::newChallenge().toHex()));
+    QJsonObject reply;
+    QCOMPARE(b.receive(hello, &reply), int(LINK_PENDING));
+    QVERIFY(!reply.contains("proof"));
+    QVERIFY(reply.contains("challenge"));
+    // a hello that already carries a proof is refused
+    NodeLinkHandshake c(LINK_RESPONDER, SECRET, "C");
+    hello.insert("proof", QString("00"));
+    QCOMPARE(c.receive(hello, &reply), int(LINK_REJECTED));
+    // and so is an initiator proving before it was challenged
+    NodeLinkHandshake d(LINK_INITIATOR, SECRET, "D");
+    QJsonObject early;
+    early.insert("node", "E");
+    early.insert("challenge", QString::fromLatin1(NodeLinkHandshake::newChallenge().toHex()));
+    early.insert("proof", QString("00"));
+    d.start();
+    QCOMPARE(d.receive(early, &reply), int(LINK_REJECTED));
+}
+
+/* Mallory connects to A claiming to be B, and hands A's challenge to B to
+ * have it signed. B only ever answers with a challenge of its own, so
+ * Mallory has nothing to give back to A. */
+void TestNodeLink::relayChallenge() {
+    NodeLinkHandshake a(LINK_RESPONDER, SECRET, "A");
+    QJsonObject hello;
+    hello.insert("node", "B");
+    hello.insert("challenge", QString::fromLatin1(NodeLinkHandshake::newChallenge().toHex()));
+    QJsonObject from_a;
+    QCOMPARE(a.receive(hello, &from_a), int(LINK_PENDING));
+
+    NodeLinkHandshake b(LINK_RESPONDER, SECRET, "B");
+    QJsonObject relayed;
+    relayed.insert("node", "M");
+    relayed.insert("challenge", from_a["challenge"]);
+    QJsonObject from_b;
+    QCOMPARE(b.receive(relayed, &from_b), int(LINK_PENDING));
+    QVERIFY(!from_b.contains("proof"));
+
+    // the best Mallory can send is a proof for some other handshake
+    QJsonObject forged;
+    forged.insert("node", "B");
+    forged.insert("proof", QString::fromLatin1(NodeLinkHandshake::proof(
+        "guess", LINK_INITIATOR, QByteArray(16, 'x'),
+        QByteArray::fromHex(from_a["challenge"].toString().toLatin1()), "B", "A").toHex()));
+    QJsonObject reply;
+    QCOMPARE(a.receive(forged, &reply), int(LINK_REJECTED));
+    QVERIFY(reply.isEmpty());
+}
+
+/* Sending the initiator its own proof back does not pass for the responder's. */
+void TestNodeLink::reflectProof() {
+    NodeLinkHandshake a(LINK_INITIATOR, SECRET, "A");
+    NodeLinkHandshake b(LINK_RESPONDER, SECRET, "B");
+    QJsonObject to_b = a.start();
+    QJsonObject to_a;
+    b.receive(to_b, &to_a);
+    a.receive(to_a, &to_b);
+    QJsonObject reflected = to_b;
+    reflected.insert("node", "B");
+    QJsonObject reply;
+    QCOMPARE(a.receive(reflected, &reply), int(LINK_REJECTED));
+}
+
+/* A proof is bound to both challenges: the one from an earlier handshake is
+ * useless in the next. */
+void TestNodeLink::replayProof() {
+    NodeLinkHandshake a(LINK_INITIATOR, SECRET, "A");
+    NodeLinkHandshake b(LINK_RESPONDER, SECRET, "B");
+    QJsonObject hello = a.start();
+    QJsonObject to_a;
+    QJsonObject to_b;
+    b.receive(hello, &to_a);
+    a.receive(to_a, &to_b);
+    QJsonObject recorded = to_b;
+
+    NodeLinkHandshake again(LINK_RESPONDER, SECRET, "B");
+    QJsonObject reply;
+    QCOMPARE(again.receive(hello, &reply), int(LINK_PENDING));
+    QCOMPARE(again.receive(recorded, &reply), int(LINK_REJECTED));
+}
+
+QTEST_APPLESS_MAIN(TestNodeLink)
+
+#include "tst_node_link.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of OfflineStore, see server/offline_store.h
+#
+#-------------------------------------------------
+
+TARGET = tst_offline_store
+
+include(../tests.pri)
+
+SOURCES += tst_offline_store.cpp
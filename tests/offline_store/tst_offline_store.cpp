@@ -0,0 +1,204 @@
+/*
+Json Command Server
+
+OFFLINE STORE TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* OfflineStore: frames come back in order, also after reopening, and the
+ * store as a whole stays within its number of destinations, total size and
+ * open queues whatever destinations the clients name. */
+
+#include "offline_store.h"
+
+#include <QDir>
+#include <QTemporaryDir>
+#include <QtTest>
+
+using JsonCommandServer::OfflineStore;
+using JsonCommandServer::SYNC_NEVER;
+
+// 16 bytes of record header + "frame N" padded to 8
+static const qint64 RECORD_SIZE = 24;
+
+class TestOfflineStore : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void appendTake();
+    void reopen();
+    void maxDestinations();
+    void maxTotalBytes();
+    void maxOpenQueues();
+    void longName();
+};
+
+static QByteArray frame(int i) {
+    return "frame " + QByteArray::number(i);
+}
+
+void TestOfflineStore::appendTake() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    OfflineStore store;
+    QVERIFY(store.open(dir.path()));
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(store.append("ana", frame(i), SYNC_NEVER));
+    }
+    QVERIFY(store.hasPending("ana"));
+    QVERIFY(!store.hasPending("bia"));
+    QCOMPARE(store.pendingBytes(), 5 * RECORD_SIZE);
+    QList<QByteArray> frames = store.take("ana", 3);
+    QCOMPARE(frames.size(), 3);
+    QCOMPARE(frames[0], frame(0));
+    QCOMPARE(frames[2], frame(2));
+    frames = store.take("ana", 10);
+    QCOMPARE(frames.size(), 2);
+    QCOMPARE(frames[1], frame(4));
+    QVERIFY(!store.hasPending("ana"));
+    QCOMPARE(store.pendingBytes(), qint64(0));
+}
+
+void TestOfflineStore::reopen() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    {
+        OfflineStore store;
+        QVERIFY(store.open(dir.path()));
+        for (int i = 0; i < 4; ++i) {
+            QVERIFY(store.append("ana", frame(i), SYNC_NEVER));
+        }
+        QCOMPARE(store.take("ana", 1).size(), 1);
+    }
+    OfflineStore store;
+    QVERIFY(store.open(dir.path()));
+    QCOMPARE(store.numDestinations(), 1);
+    QCOMPARE(store.pendingBytes(), 3 * RECORD_SIZE);
+    QList<QByteArray> frames = store.take("ana", 10);
+    QCOMPARE(frames.size(), 3);
+    QCOMPARE(frames[0], frame(1));
+}
+
+void TestOfflineStore::maxDestinations() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    OfflineStore store;
+    QVERIFY(store.open(dir.path()));
+    store.setMaxDestinations(2);
+    QVERIFY(store.append("ana", frame(0), SYNC_NEVER));
+    QVERIFY(store.append("bia", frame(0), SYNC_NEVER));
+    QVERIFY(!store.append("caio", frame(0), SYNC_NEVER));
+    QCOMPARE(store.numDestinations(), 2);
+    QCOMPARE(store.dropped(), quint64(1));
+    QCOMPARE(QDir(dir.path()).entryList(QDir::Dirs | QDir::NoDotAndDotDot).size(), 2);
+    // the known ones still queue
+    QVERIFY(store.append("ana", frame(1), SYNC_NEVER));
+    // an emptied destination is forgotten and frees its place
+    QCOMPARE(store.take("bia", 10).size(), 1);
+    store.expire();
+    QCOMPARE(store.numDestinations(), 1);
+    QVERIFY(store.append("caio", frame(0), SYNC_NEVER));
+}
+
+void TestOfflineStore::maxTotalBytes() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    OfflineStore store;
+    QVERIFY(store.open(dir.path()));
+    store.setMaxTotalBytes(3 * RECORD_SIZE);
+    QVERIFY(store.append("ana", frame(0), SYNC_NEVER));
+    QVERIFY(store.append("bia", frame(0), SYNC_NEVER));
+    QVERIFY(store.append("caio", frame(0), SYNC_NEVER));
+    QVERIFY(!store.append("davi", frame(0), SYNC_NEVER));
+    QVERIFY(!store.append("ana", frame(1), SYNC_NEVER));
+    QCOMPARE(store.pendingBytes(), 3 * RECORD_SIZE);
+    QCOMPARE(store.dropped(), quint64(2));
+    QCOMPARE(store.take("ana", 10).size(), 1);
+    QVERIFY(store.append("davi", frame(0), SYNC_NEVER));
+}
+
+void TestOfflineStore::maxOpenQueues() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    OfflineStore store;
+    QVERIFY(store.open(dir.path()));
+    store.setMaxOpenQueues(2);
+    QStringList dests = QStringList() << "ana" << "bia" << "caio" << "davi";
+    for (int i = 0; i < dests.size(); ++i) {
+        QVERIFY(store.append(dests[i], frame(i), SYNC_NEVER));
+        QVERIFY(store.numOpenQueues() <= 2);
+    }
+    QCOMPARE(store.numDestinations(), 4);
+    QCOMPARE(store.pendingBytes(), 4 * RECORD_SIZE);
+    // closed queues still count, and reopen when used
+    for (int i = 0; i < dests.size(); ++i) {
+        QVERIFY(store.hasPending(dests[i]));
+        QVERIFY(store.append(dests[i], frame(10 + i), SYNC_NEVER));
+        QCOMPARE(store.numOpenQueues(), 2);
+    }
+    for (int i = 0; i < dests.size(); ++i) {
+        QList<QByteArray> frames = store.take(dests[i], 10);
+        QCOMPARE(frames.size(), 2);
+        QCOMPARE(frames[0], frame(i));
+        QCOMPARE(frames[1], frame(10 + i));
+    }
+    QCOMPARE(store.pendingBytes(), qint64(0));
+    store.expire();
+    QCOMPARE(store.numDestinations(), 0);
+    QCOMPARE(store.numOpenQueues(), 0);
+}
+
+void TestOfflineStore::longName() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString name(300, QChar('x'));
+    {
+        OfflineStore store;
+        QVERIFY(store.open(dir.path()));
+        QVERIFY(store.append(name, frame(0), SYNC_NEVER));
+        QVERIFY(store.append(name + "y", frame(1), SYNC_NEVER));
+    }
+    QStringList entries = QDir(dir.path()).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    QCOMPARE(entries.size(), 2);
+    for (int i = 0; i < entries.size(); ++i) {
+        QVERIFY(entries[i].size() <= 255);
+    }
+    OfflineStore store;
+    QVERIFY(store.open(dir.path()));
+    QList<QByteArray> frames = store.take(name, 10);
+    QCOMPARE(frames.size(), 1);
+    QCOMPARE(frames[0], frame(0));
+    frames = store.take(name + "y", 10);
+    QCOMPARE(frames.size(), 1);
+    QCOMPARE(frames[0], frame(1));
+}
+
+QTEST_APPLESS_MAIN(TestOfflineStore)
+
+#include "tst_offline_store.moc"
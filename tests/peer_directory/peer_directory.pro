@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of PeerDirectory, see server/peer_directory.h
+#
+#-------------------------------------------------
+
+TARGET = tst_peer_directory
+
+include(../tests.pri)
+
+SOURCES += tst_peer_directory.cpp
@@ -0,0 +1,168 @@
+/*
+Json Command Server
+
+PEER DIRECTORY TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* PeerDirectory publishing and reclamation: a guard keeps the snapshot it
+ * pinned, a replaced snapshot is freed once no guard can still see it, and
+ * readers on other threads always see whole snapshots. */
+
+#include "peer_directory.h"
+
+#include <QtTest>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using JsonCommandServer::PeerDirectory;
+using JsonCommandServer::PeerSnapshot;
+
+class TestPeerDirectory : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void initialSnapshot();
+    void publishWithoutReaders();
+    void guardPinsSnapshot();
+    void nestedGuards();
+    void concurrentReaders();
+
+  private:
+    static PeerSnapshot* snapshot(quint64 version, int peers);
+};
+
+/* version peers named peer0..peerN-1. */
+PeerSnapshot* TestPeerDirectory::snapshot(quint64 version, int peers) {
+    PeerSnapshot* out = new PeerSnapshot;
+    out->version = version;
+    for (int i = 0; i < peers; ++i) {
+        QString name = QString("peer%1").arg(i);
+        out->peers.insert(name, static_cast<QTcpSocket*>(0));
+        out->names.append(name);
+    }
+    return out;
+}
+
+void TestPeerDirectory::initialSnapshot() {
+    PeerDirectory directory;
+    PeerDirectory::ReadGuard peers(directory);
+    QCOMPARE(peers->version, quint64(0));
+    QVERIFY(peers->peers.isEmpty());
+    QCOMPARE(directory.retired(), 0);
+}
+
+void TestPeerDirectory::publishWithoutReaders() {
+    PeerDirectory directory;
+    directory.publish(snapshot(1, 1));
+    QCOMPARE(directory.retired(), 0);
+    directory.publish(snapshot(2, 2));
+    QCOMPARE(directory.retired(), 0);
+    PeerDirectory::ReadGuard peers(directory);
+    QCOMPARE(peers->version, quint64(2));
+    QCOMPARE(peers->names.size(), 2);
+}
+
+void TestPeerDirectory::guardPinsSnapshot() {
+    PeerDirectory directory;
+    directory.publish(snapshot(1, 1));
+    {
+        PeerDirectory::ReadGuard peers(directory);
+        directory.publish(snapshot(2, 2));
+        directory.publish(snapshot(3, 3));
+        QCOMPARE(peers->version, quint64(1));
+        QCOMPARE(peers->names.size(), 1);
+        QCOMPARE(directory.retired(), 2);
+    }
+    directory.reclaim();
+    QCOMPARE(directory.retired(), 0);
+    PeerDirectory::ReadGuard peers(directory);
+    QCOMPARE(peers->version, quint64(3));
+}
+
+void TestPeerDirectory::nestedGuards() {
+    PeerDirectory directory;
+    directory.publish(snapshot(1, 1));
+    {
+        PeerDirectory::ReadGuard outer(directory);
+        directory.publish(snapshot(2, 2));
+        {
+            PeerDirectory::ReadGuard inner(directory);
+            QCOMPARE(inner->version, quint64(2));
+        }
+        // the outer guard still holds version 1
+        directory.reclaim();
+        QCOMPARE(directory.retired(), 1);
+        QCOMPARE(outer->version, quint64(1));
+    }
+    directory.reclaim();
+    QCOMPARE(directory.retired(), 0);
+}
+
+void TestPeerDirectory::concurrentReaders() {
+    const int N_READERS = 4;
+    const int N_PUBLISHES = 20000;
+    PeerDirectory directory;
+    std::atomic<bool> stop(false);
+    std::atomic<int> torn(0);
+    std::atomic<int> backwards(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < N_READERS; ++i) {
+        readers.push_back(std::thread([&]() {
+            quint64 last = 0;
+            while (!stop.load()) {
+                PeerDirectory::ReadGuard peers(directory);
+                // every snapshot has version % 8 peers
+                if (peers->peers.size() != int(peers->version % 8) ||
+                        peers->names.size() != peers->peers.size()) {
+                    ++torn;
+                }
+                if (peers->version < last) ++backwards;
+                last = peers->version;
+            }
+        }));
+    }
+    for (int i = 1; i <= N_PUBLISHES; ++i) {
+        directory.publish(snapshot(quint64(i), i % 8));
+    }
+    stop.store(true);
+    for (size_t i = 0; i < readers.size(); ++i) {
+        readers[i].join();
+    }
+    QCOMPARE(torn.load(), 0);
+    QCOMPARE(backwards.load(), 0);
+    directory.reclaim();
+    QCOMPARE(directory.retired(), 0);
+}
+
+QTEST_APPLESS_MAIN(TestPeerDirectory)
+
+#include "tst_peer_directory.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of PeerIndex, see server/peer_index.h
+#
+#-------------------------------------------------
+
+TARGET = tst_peer_index
+
+include(../tests.pri)
+
+SOURCES += tst_peer_index.cpp
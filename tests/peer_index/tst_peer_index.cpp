@@ -0,0 +1,219 @@
+/*
+Json Command Server
+
+PEER INDEX TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* PeerIndex selectors: the operators, and the length and nesting limits that
+ * keep a client's selector from exhausting the stack. */
+
+#include "peer_index.h"
+
+#include <QtTest>
+
+using JsonCommandServer::Atom;
+using JsonCommandServer::PeerIndex;
+
+class TestPeerIndex : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void isSelector();
+    void operators();
+    void unknownTerms();
+    void removeAndMove();
+    void invalid();
+    void negationDepth();
+    void parenthesesDepth();
+    void negationRun();
+    void size();
+};
+
+static PeerIndex sample() {
+    PeerIndex index;
+    index.insert(1, 1, "sensor");
+    index.insert(2, 1, "display");
+    index.insert(3, 2, "sensor");
+    index.insert(4, 2, "display");
+    return index;
+}
+
+static std::set<Atom> atoms(Atom a, Atom b = 0, Atom c = 0) {
+    std::set<Atom> result;
+    result.insert(a);
+    if (b) result.insert(b);
+    if (c) result.insert(c);
+    return result;
+}
+
+static QString repeat(const QString& text, int times) {
+    QString result;
+    for (int i = 0; i < times; ++i) result += text;
+    return result;
+}
+
+void TestPeerIndex::isSelector() {
+    QVERIFY(PeerIndex::isSelector("group:1"));
+    QVERIFY(PeerIndex::isSelector(" type:sensor"));
+    QVERIFY(PeerIndex::isSelector("!group:1"));
+    QVERIFY(PeerIndex::isSelector("(group:1)"));
+    QVERIFY(!PeerIndex::isSelector("cliente@127.0.0.1:5000"));
+    QVERIFY(!PeerIndex::isSelector("Todos"));
+}
+
+void TestPeerIndex::operators() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QVERIFY(index.select("group:1", out));
+    QVERIFY(out == atoms(1, 2));
+    QVERIFY(index.select("type:sensor", out));
+    QVERIFY(out == atoms(1, 3));
+    QVERIFY(index.select("group:2 & type:sensor", out));
+    QVERIFY(out == atoms(3));
+    QVERIFY(index.select("group:1 | type:sensor", out));
+    QVERIFY(out == atoms(1, 2, 3));
+    QVERIFY(index.select("!type:sensor", out));
+    QVERIFY(out == atoms(2, 4));
+    // '&' binds tighter than '|'
+    QVERIFY(index.select("type:display | group:2 & type:sensor", out));
+    QVERIFY(out == atoms(2, 3, 4));
+    QVERIFY(index.select("(type:display | group:2) & type:sensor", out));
+    QVERIFY(out == atoms(3));
+    QVERIFY(index.select("group:1 & !(type:display)", out));
+    QVERIFY(out == atoms(1));
+}
+
+void TestPeerIndex::unknownTerms() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QVERIFY(index.select("group:7", out));
+    QVERIFY(out.empty());
+    QVERIFY(index.select("type:camera", out));
+    QVERIFY(out.empty());
+    QVERIFY(index.select("!group:7", out));
+    QCOMPARE(int(out.size()), 4);
+}
+
+void TestPeerIndex::removeAndMove() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    index.remove(1);
+    QVERIFY(index.select("type:sensor", out));
+    QVERIFY(out == atoms(3));
+    // identifying again moves the peer
+    index.insert(2, 2, "sensor");
+    QVERIFY(index.select("group:1", out));
+    QVERIFY(out.empty());
+    QVERIFY(index.select("group:2 & type:sensor", out));
+    QVERIFY(out == atoms(2, 3));
+    index.clear();
+    QVERIFY(index.select("!group:1", out));
+    QVERIFY(out.empty());
+}
+
+void TestPeerIndex::invalid() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QString error;
+    QVERIFY(!index.select("group:x", out, &error));
+    QVERIFY(!error.isEmpty());
+    QVERIFY(out.empty());
+    error.clear();
+    QVERIFY(!index.select("(group:1", out, &error));
+    QVERIFY(!error.isEmpty());
+    error.clear();
+    QVERIFY(!index.select("group:1 &", out, &error));
+    QVERIFY(!error.isEmpty());
+    error.clear();
+    QVERIFY(!index.select("group:1)", out, &error));
+    QVERIFY(!error.isEmpty());
+}
+
+void TestPeerIndex::negationDepth() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QString error;
+    // '!' alternating with parentheses cannot be folded, every level counts
+    QString at_limit = repeat("!(", PeerIndex::MAX_SELECTOR_DEPTH / 2 - 1) + "group:1" +
+                       repeat(")", PeerIndex::MAX_SELECTOR_DEPTH / 2 - 1);
+    QVERIFY2(index.select(at_limit, out, &error), qPrintable(error));
+    QString past_limit = repeat("!(", PeerIndex::MAX_SELECTOR_DEPTH) + "group:1" +
+                         repeat(")", PeerIndex::MAX_SELECTOR_DEPTH);
+    QVERIFY(!index.select(past_limit, out, &error));
+    QVERIFY(!error.isEmpty());
+    QVERIFY(out.empty());
+}
+
+void TestPeerIndex::parenthesesDepth() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QString error;
+    int depth = PeerIndex::MAX_SELECTOR_DEPTH - 1;
+    QString at_limit = repeat("(", depth) + "group:1" + repeat(")", depth);
+    QVERIFY2(index.select(at_limit, out, &error), qPrintable(error));
+    QVERIFY(out == atoms(1, 2));
+    QString past_limit = "(" + at_limit + ")";
+    QVERIFY(!index.select(past_limit, out, &error));
+    QVERIFY(!error.isEmpty());
+    // what used to overflow the stack is now a plain error
+    QString huge = repeat("(", PeerIndex::MAX_SELECTOR_SIZE / 2);
+    QVERIFY(!index.select(huge, out, &error));
+}
+
+void TestPeerIndex::negationRun() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QString error;
+    // a run of '!' folds to its parity and takes one level
+    QString run = repeat("!", PeerIndex::MAX_SELECTOR_SIZE - 7) + "group:1";
+    QCOMPARE(run.size(), PeerIndex::MAX_SELECTOR_SIZE);
+    QVERIFY2(index.select(run, out, &error), qPrintable(error));
+    QVERIFY(out == atoms(3, 4));
+    QVERIFY(index.select("!!group:1", out, &error));
+    QVERIFY(out == atoms(1, 2));
+}
+
+void TestPeerIndex::size() {
+    PeerIndex index = sample();
+    std::set<Atom> out;
+    QString error;
+    QString term = "group:1 | ";
+    QString at_limit = repeat(" ", PeerIndex::MAX_SELECTOR_SIZE - 7) + "group:1";
+    QVERIFY2(index.select(at_limit, out, &error), qPrintable(error));
+    QString past_limit = " " + at_limit;
+    QVERIFY(!index.select(past_limit, out, &error));
+    QVERIFY(!error.isEmpty());
+    QVERIFY(out.empty());
+    QVERIFY(!index.select(repeat(term, 200) + "group:2", out, &error));
+}
+
+QTEST_APPLESS_MAIN(TestPeerIndex)
+
+#include "tst_peer_index.moc"
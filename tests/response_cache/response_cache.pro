@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of ResponseCache and DuplicateFilter, see server/response_cache.h
+#
+#-------------------------------------------------
+
+TARGET = tst_response_cache
+
+include(../tests.pri)
+
+SOURCES += tst_response_cache.cpp
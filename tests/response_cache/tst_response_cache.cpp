@@ -0,0 +1,260 @@
+/*
+Json Command Server
+
+RESPONSE CACHE TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* ResponseCache lookups, TTL and CLOCK eviction, and DuplicateFilter windows
+ * and reply budget. Both take the time as an argument, so every case runs on
+ * a made up clock. */
+
+#include "commands_controller.h"
+#include "response_cache.h"
+
+#include <QJsonObject>
+#include <QtTest>
+
+using namespace JsonCommandServer;
+
+class TestResponseCache : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void canonicalBody();
+    void hitAndMiss();
+    void ttl();
+    void clock();
+    void byteBudget();
+    void duplicate();
+    void duplicateReply();
+    void duplicateWindow();
+    void duplicateMaxKeys();
+    void duplicateByteBudget();
+
+  private:
+    static QList<CachedFrame> reply(const QByteArray& data);
+    static void insert(ResponseCache& cache, const QByteArray& body, qint64 ttl_ms,
+                       qint64 now_ms, int reply_size = 8);
+    static bool cached(ResponseCache& cache, const QByteArray& body, qint64 now_ms);
+};
+
+QList<CachedFrame> TestResponseCache::reply(const QByteArray& data) {
+    CachedFrame frame;
+    frame.data = data;
+    frame.priority = PRIORITY_NORMAL;
+    return QList<CachedFrame>() << frame;
+}
+
+void TestResponseCache::insert(ResponseCache& cache, const QByteArray& body, qint64 ttl_ms,
+        qint64 now_ms, int reply_size) {
+    cache.insert(ResponseCache::hash(body), body, reply(QByteArray(reply_size, 'r')), ttl_ms,
+                 1000, now_ms);
+}
+
+bool TestResponseCache::cached(ResponseCache& cache, const QByteArray& body, qint64 now_ms) {
+    QList<CachedFrame> frames;
+    return cache.find(ResponseCache::hash(body), body, now_ms, &frames);
+}
+
+void TestResponseCache::canonicalBody() {
+    QJsonObject first;
+    first.insert("type", 7);
+    first.insert("value", 1);
+    first.insert("id", 10);
+    first.insert("time", "10:00");
+    first.insert("request_id", 1);
+    first.insert("idempotency_key", "a");
+    QJsonObject second;
+    second.insert("value", 1);
+    second.insert("type", 7);
+    second.insert("id", 11);
+    second.insert("request_id", 2);
+    // what the sender adds for each delivery is not part of the body
+    QCOMPARE(ResponseCache::canonicalBody(first), ResponseCache::canonicalBody(second));
+    second.insert("value", 2);
+    QVERIFY(ResponseCache::canonicalBody(first) != ResponseCache::canonicalBody(second));
+}
+
+void TestResponseCache::hitAndMiss() {
+    ResponseCache cache;
+    QByteArray body("{\"type\":7}");
+    quint64 key = ResponseCache::hash(body);
+    QList<CachedFrame> frames;
+    QVERIFY(!cache.find(key, body, 0, &frames));
+    cache.insert(key, body, reply("answer"), 1000, 500, 0);
+    QCOMPARE(cache.size(), 1);
+    QVERIFY(cache.find(key, body, 10, &frames));
+    QCOMPARE(frames.size(), 1);
+    QCOMPARE(frames[0].data, QByteArray("answer"));
+    QCOMPARE(frames[0].priority, int(PRIORITY_NORMAL));
+    // a colliding hash with another body is a miss, not a wrong reply
+    QVERIFY(!cache.find(key, "{\"type\":8}", 10, &frames));
+    QJsonObject stats = cache.toJson();
+    QCOMPARE(stats["hits"].toInt(), 1);
+    QCOMPARE(stats["misses"].toInt(), 2);
+    QCOMPARE(stats["saved_us"].toInt(), 0);
+    // inserting the key again replaces the entry
+    cache.insert(key, body, reply("other"), 1000, 500, 20);
+    QCOMPARE(cache.size(), 1);
+    QVERIFY(cache.find(key, body, 30, &frames));
+    QCOMPARE(frames[0].data, QByteArray("other"));
+}
+
+void TestResponseCache::ttl() {
+    ResponseCache cache;
+    insert(cache, "a", 100, 0);
+    QVERIFY(cached(cache, "a", 99));
+    QVERIFY(!cached(cache, "a", 100));
+    QCOMPARE(cache.size(), 0);
+    QCOMPARE(cache.bytes(), qint64(0));
+    QCOMPARE(cache.toJson()["expired"].toInt(), 1);
+    // a TTL of 0 is never cached
+    insert(cache, "b", 0, 0);
+    QCOMPARE(cache.size(), 0);
+}
+
+/* Referenced entries get a second chance, the hand evicts the first one
+ * that was not looked up since it last passed. */
+void TestResponseCache::clock() {
+    ResponseCache cache;
+    cache.setCapacity(3, ResponseCache::DEFAULT_MAX_BYTES);
+    insert(cache, "1", 1000, 0);
+    insert(cache, "2", 1000, 0);
+    insert(cache, "3", 1000, 0);
+    QVERIFY(cached(cache, "1", 1));
+    insert(cache, "4", 1000, 2);
+    QCOMPARE(cache.size(), 3);
+    QVERIFY(!cached(cache, "2", 3));
+    insert(cache, "5", 1000, 4);
+    QVERIFY(!cached(cache, "3", 5));
+    QVERIFY(cached(cache, "1", 5));
+    QVERIFY(cached(cache, "4", 5));
+    QVERIFY(cached(cache, "5", 5));
+    QCOMPARE(cache.toJson()["evicted"].toInt(), 2);
+}
+
+void TestResponseCache::byteBudget() {
+    ResponseCache cache;
+    cache.setCapacity(100, 800);
+    // one reply may use an eighth of the budget at most
+    insert(cache, "large", 1000, 0, 100);
+    QCOMPARE(cache.size(), 0);
+    for (int i = 0; i < 20; ++i) {
+        insert(cache, QByteArray::number(i), 1000, 0, 90);
+        QVERIFY(cache.bytes() <= 800);
+    }
+    QCOMPARE(cache.size(), 8);
+    QVERIFY(cached(cache, "19", 1));
+    cache.setCapacity(0, 800);
+    insert(cache, "a", 1000, 0);
+    QCOMPARE(cache.size(), 0);
+}
+
+void TestResponseCache::duplicate() {
+    DuplicateFilter filter;
+    QList<CachedFrame> frames;
+    QVERIFY(!filter.isDuplicate("key", 0, &frames));
+    QVERIFY(filter.isDuplicate("key", 1, &frames));
+    QVERIFY(frames.isEmpty());
+    QVERIFY(!filter.isDuplicate("other", 1, &frames));
+    QCOMPARE(filter.duplicates(), quint64(1));
+    QCOMPARE(filter.size(), 2);
+    filter.setWindow(0, DuplicateFilter::DEFAULT_MAX_KEYS);
+    QVERIFY(!filter.isDuplicate("key", 2, &frames));
+    QVERIFY(!filter.isDuplicate("key", 2, &frames));
+}
+
+void TestResponseCache::duplicateReply() {
+    DuplicateFilter filter;
+    QList<CachedFrame> frames;
+    filter.setReply("unknown", reply("ignored"));
+    QCOMPARE(filter.bytes(), qint64(0));
+    QVERIFY(!filter.isDuplicate("key", 0, &frames));
+    filter.setReply("key", reply("answer"));
+    QCOMPARE(filter.bytes(), qint64(6));
+    QVERIFY(filter.isDuplicate("key", 1, &frames));
+    QCOMPARE(frames.size(), 1);
+    QCOMPARE(frames[0].data, QByteArray("answer"));
+    filter.setReply("key", reply("longer answer"));
+    QCOMPARE(filter.bytes(), qint64(13));
+}
+
+void TestResponseCache::duplicateWindow() {
+    DuplicateFilter filter;
+    filter.setWindow(100, 10);
+    QList<CachedFrame> frames;
+    QVERIFY(!filter.isDuplicate("key", 0, &frames));
+    filter.setReply("key", reply("answer"));
+    QVERIFY(filter.isDuplicate("key", 99, &frames));
+    // the window counts from the first delivery
+    QVERIFY(!filter.isDuplicate("key", 100, &frames));
+    QCOMPARE(filter.bytes(), qint64(0));
+    QVERIFY(filter.isDuplicate("key", 199, &frames));
+    QVERIFY(frames.isEmpty());
+}
+
+void TestResponseCache::duplicateMaxKeys() {
+    DuplicateFilter filter;
+    filter.setWindow(1000, 2);
+    QList<CachedFrame> frames;
+    QVERIFY(!filter.isDuplicate("a", 0, &frames));
+    QVERIFY(!filter.isDuplicate("b", 1, &frames));
+    QVERIFY(!filter.isDuplicate("c", 2, &frames));
+    QCOMPARE(filter.size(), 2);
+    // the oldest went first
+    QVERIFY(filter.isDuplicate("c", 3, &frames));
+    QVERIFY(filter.isDuplicate("b", 3, &frames));
+    QVERIFY(!filter.isDuplicate("a", 3, &frames));
+}
+
+void TestResponseCache::duplicateByteBudget() {
+    DuplicateFilter filter;
+    filter.setWindow(100, 10, 100);
+    QList<CachedFrame> frames;
+    QVERIFY(!filter.isDuplicate("a", 0, &frames));
+    QVERIFY(!filter.isDuplicate("b", 10, &frames));
+    filter.setReply("a", reply(QByteArray(60, 'a')));
+    filter.setReply("b", reply(QByteArray(60, 'b')));
+    QCOMPARE(filter.bytes(), qint64(60));
+    // b is still a duplicate, answered without its reply
+    QVERIFY(filter.isDuplicate("b", 20, &frames));
+    QVERIFY(frames.isEmpty());
+    QVERIFY(filter.isDuplicate("a", 20, &frames));
+    QCOMPARE(frames.size(), 1);
+    // a expires, and its bytes with it
+    QVERIFY(!filter.isDuplicate("c", 100, &frames));
+    QCOMPARE(filter.bytes(), qint64(0));
+    filter.setReply("b", reply(QByteArray(60, 'b')));
+    QCOMPARE(filter.bytes(), qint64(60));
+}
+
+QTEST_APPLESS_MAIN(TestResponseCache)
+
+#include "tst_response_cache.moc"
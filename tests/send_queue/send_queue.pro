@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of SendQueue, see server/send_queue.h
+#
+#-------------------------------------------------
+
+TARGET = tst_send_queue
+
+include(../tests.pri)
+
+SOURCES += tst_send_queue.cpp
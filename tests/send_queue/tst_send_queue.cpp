@@ -0,0 +1,149 @@
+/*
+Json Command Server
+
+SEND QUEUE TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* SendQueue conflation: a frame pushed with a key replaces the pending frame
+ * of that key in place, so a slow reader gets the latest value once, where
+ * the first one was queued. */
+
+#include "send_queue.h"
+
+#include <QtTest>
+
+using namespace JsonCommandServer;
+
+class TestSendQueue : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void replacesPending();
+    void keepsPlace();
+    void keysAreIndependent();
+    void withoutKey();
+    void afterPop();
+    void partlySent();
+
+  private:
+    static QByteArray payload(const QByteArray& frame);
+};
+
+/* The message of a whole v1 or v2 frame. */
+QByteArray TestSendQueue::payload(const QByteArray& frame) {
+    return frame.mid(frameHeaderSize(frame));
+}
+
+void TestSendQueue::replacesPending() {
+    SendQueue queue;
+    QVERIFY(queue.push(PRIORITY_NORMAL, "status 1", 0, ENCODING_JSON, "status"));
+    QVERIFY(!queue.push(PRIORITY_NORMAL, "status 22", 0, ENCODING_JSON, "status"));
+    QVERIFY(!queue.push(PRIORITY_NORMAL, "status 333", 0, ENCODING_JSON, "status"));
+    QCOMPARE(queue.pendingFrames(), 1);
+    QCOMPARE(queue.pendingBytes(), qint64(10));
+    QCOMPARE(payload(queue.pop()), QByteArray("status 333"));
+    QVERIFY(queue.isEmpty());
+    QCOMPARE(queue.pendingBytes(), qint64(0));
+}
+
+void TestSendQueue::keepsPlace() {
+    SendQueue queue;
+    queue.push(PRIORITY_NORMAL, "first", 0, ENCODING_JSON, "status");
+    queue.push(PRIORITY_NORMAL, "other");
+    queue.push(PRIORITY_NORMAL, "latest", 0, ENCODING_JSON, "status");
+    QCOMPARE(payload(queue.pop()), QByteArray("latest"));
+    QCOMPARE(payload(queue.pop()), QByteArray("other"));
+    QVERIFY(queue.isEmpty());
+    // and its lane, whatever the new frame asks for
+    queue.push(PRIORITY_BULK, "bulk", 0, ENCODING_JSON, "status");
+    queue.push(PRIORITY_CONTROL, "control", 0, ENCODING_JSON, "status");
+    int priority = -1;
+    QCOMPARE(payload(queue.pop(&priority)), QByteArray("control"));
+    QCOMPARE(priority, int(PRIORITY_BULK));
+}
+
+void TestSendQueue::keysAreIndependent() {
+    SendQueue queue;
+    queue.push(PRIORITY_NORMAL, "a1", 0, ENCODING_JSON, "a");
+    queue.push(PRIORITY_NORMAL, "b1", 0, ENCODING_JSON, "b");
+    queue.push(PRIORITY_NORMAL, "b2", 0, ENCODING_JSON, "b");
+    queue.push(PRIORITY_NORMAL, "a2", 0, ENCODING_JSON, "a");
+    QCOMPARE(queue.pendingFrames(), 2);
+    QCOMPARE(payload(queue.pop()), QByteArray("a2"));
+    QCOMPARE(payload(queue.pop()), QByteArray("b2"));
+}
+
+void TestSendQueue::withoutKey() {
+    SendQueue queue;
+    QVERIFY(queue.push(PRIORITY_NORMAL, "same"));
+    QVERIFY(queue.push(PRIORITY_NORMAL, "same"));
+    QCOMPARE(queue.pendingFrames(), 2);
+}
+
+void TestSendQueue::afterPop() {
+    SendQueue queue;
+    queue.push(PRIORITY_NORMAL, "1", 0, ENCODING_JSON, "status");
+    QCOMPARE(payload(queue.pop()), QByteArray("1"));
+    QVERIFY(queue.push(PRIORITY_NORMAL, "2", 0, ENCODING_JSON, "status"));
+    QVERIFY(!queue.push(PRIORITY_NORMAL, "3", 0, ENCODING_JSON, "status"));
+    QCOMPARE(queue.pendingFrames(), 1);
+    QCOMPARE(payload(queue.pop()), QByteArray("3"));
+}
+
+/* A frame whose first chunk has left is finished as it was. */
+void TestSendQueue::partlySent() {
+    SendQueue queue;
+    queue.setFraming(FRAME_V2, 4);
+    queue.push(PRIORITY_NORMAL, "12345678", 0, ENCODING_JSON, "status");
+    bool complete = true;
+    QByteArray frame = queue.pop(0, 0, 0, &complete);
+    QVERIFY(!complete);
+    FrameHeader first = decodeFrameHeader(frame);
+    QVERIFY(first.stream != 0);
+    QVERIFY(first.flags & FRAME_MORE);
+    QCOMPARE(payload(frame), QByteArray("1234"));
+    QVERIFY(queue.push(PRIORITY_NORMAL, "abcd", 0, ENCODING_JSON, "status"));
+    QCOMPARE(queue.pendingFrames(), 2);
+    frame = queue.pop(0, 0, 0, &complete);
+    QVERIFY(complete);
+    QCOMPARE(decodeFrameHeader(frame).stream, first.stream);
+    QCOMPARE(payload(frame), QByteArray("5678"));
+    // the new frame is conflated again until it leaves
+    QVERIFY(!queue.push(PRIORITY_NORMAL, "efgh", 0, ENCODING_JSON, "status"));
+    frame = queue.pop(0, 0, 0, &complete);
+    QVERIFY(complete);
+    QCOMPARE(decodeFrameHeader(frame).stream, quint32(0));
+    QCOMPARE(payload(frame), QByteArray("efgh"));
+    QVERIFY(queue.isEmpty());
+}
+
+QTEST_APPLESS_MAIN(TestSendQueue)
+
+#include "tst_send_queue.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of BaseServer's server mode, see server/base_server.h
+#
+#-------------------------------------------------
+
+TARGET = tst_server_mode
+
+include(../tests.pri)
+
+SOURCES += tst_server_mode.cpp
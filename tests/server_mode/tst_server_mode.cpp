@@ -0,0 +1,160 @@
+/*
+Json Command Server
+
+SERVER MODE TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Server mode startup: listening right away on the configured addresses,
+ * the address myIP() reports, startup time, and the errors of addresses
+ * that can not be bound. */
+
+#include "base_server.h"
+#include "test_client.h"
+
+#include <QtTest>
+
+using JsonCommandServer::BaseServer;
+using namespace TestClient;
+
+namespace {
+
+class TestServer : public BaseServer {
+  public:
+    QStringList status;
+    QStringList errors;
+    void addStatusMessage(const QString& message) { status.append(message); }
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+// TEST-NET-1, never an address of this host
+const char* const FOREIGN_ADDRESS = "192.0.2.1";
+
+bool greeted(const QHostAddress& address, quint16 port) {
+    QTcpSocket socket;
+    QJsonObject status;
+    return connectTo(&socket, port, address) &&
+           waitFor(&socket, JsonCommandServer::MESSAGE_STATUS, &status) &&
+           status["message"].toString() == "conectado";
+}
+
+}  // namespace
+
+class TestServerMode : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void init();
+    void cleanup();
+    void listensAtOnce();
+    void ipFromListenAddress();
+    void configuredIpWins();
+    void severalAddresses();
+    void unboundAddress();
+    void unboundExtraAddress();
+
+  private:
+    TestServer* server_;
+    quint16 port_;
+};
+
+void TestServerMode::init() {
+    port_ = freePort();
+    server_ = new TestServer;
+    server_->setServerMode(true);
+    server_->setVerbose(false);
+    server_->setPortServer(port_);
+}
+
+void TestServerMode::cleanup() {
+    delete server_;
+}
+
+/* No network session to wait for: the port is open when initServer()
+ * returns. */
+void TestServerMode::listensAtOnce() {
+    server_->initServer();
+    QVERIFY2(server_->errors.isEmpty(), qPrintable(server_->errors.join("\n")));
+    QVERIFY(server_->status.join("\n").contains("Servidor pronto em"));
+    QVERIFY(server_->metrics().contains("startup_us"));
+    QVERIFY(server_->metrics()["startup_us"].toDouble() >= 0);
+    // only the wildcard was configured
+    QCOMPARE(server_->myIP(), QString("127.0.0.1"));
+    QVERIFY(greeted(QHostAddress(QHostAddress::LocalHost), port_));
+}
+
+void TestServerMode::ipFromListenAddress() {
+    server_->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server_->initServer();
+    QVERIFY2(server_->errors.isEmpty(), qPrintable(server_->errors.join("\n")));
+    QCOMPARE(server_->myIP(), QString("127.0.0.1"));
+    QVERIFY(greeted(QHostAddress(QHostAddress::LocalHost), port_));
+}
+
+void TestServerMode::configuredIpWins() {
+    server_->setIPServer("10.1.2.3");
+    server_->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server_->initServer();
+    QVERIFY2(server_->errors.isEmpty(), qPrintable(server_->errors.join("\n")));
+    QCOMPARE(server_->myIP(), QString("10.1.2.3"));
+}
+
+void TestServerMode::severalAddresses() {
+    QTcpServer probe;
+    if (!probe.listen(QHostAddress(QHostAddress::LocalHostIPv6), 0)) {
+        QSKIP("no IPv6 loopback on this host");
+    }
+    probe.close();
+    server_->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost)
+                                << QHostAddress(QHostAddress::LocalHostIPv6));
+    server_->initServer();
+    QVERIFY2(server_->errors.isEmpty(), qPrintable(server_->errors.join("\n")));
+    QVERIFY(server_->status.join("\n").contains("::1"));
+    QVERIFY(greeted(QHostAddress(QHostAddress::LocalHost), port_));
+    QVERIFY(greeted(QHostAddress(QHostAddress::LocalHostIPv6), port_));
+    QCOMPARE(server_->myIP(), QString("127.0.0.1"));
+}
+
+void TestServerMode::unboundAddress() {
+    server_->setListenAddresses(QList<QHostAddress>() << QHostAddress(QString(FOREIGN_ADDRESS)));
+    server_->initServer();
+    QVERIFY(server_->errors.join("\n").contains("Não foi possível iniciar o servidor"));
+    QVERIFY(!server_->metrics().contains("startup_us"));
+}
+
+void TestServerMode::unboundExtraAddress() {
+    server_->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost)
+                                << QHostAddress(QString(FOREIGN_ADDRESS)));
+    server_->initServer();
+    QVERIFY(server_->errors.join("\n").contains(FOREIGN_ADDRESS));
+}
+
+QTEST_GUILESS_MAIN(TestServerMode)
+
+#include "tst_server_mode.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of StateJournal, see server/state_journal.h
+#
+#-------------------------------------------------
+
+TARGET = tst_state_journal
+
+include(../tests.pri)
+
+SOURCES += tst_state_journal.cpp
@@ -0,0 +1,239 @@
+/*
+Json Command Server
+
+STATE JOURNAL TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* StateJournal replay: what was written comes back after reopening, from the
+ * journals alone, from a compacted snapshot, and from a snapshot with journals
+ * on top of it. A torn last record is dropped, not the journal. */
+
+#include "state_journal.h"
+
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QTemporaryDir>
+#include <QtTest>
+
+using JsonCommandServer::StateJournal;
+
+class TestStateJournal : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void replayJournal();
+    void replaySnapshot();
+    void replaySnapshotAndJournal();
+    void tornRecord();
+    void compactThreshold();
+    void compactReleasesChanges();
+
+  private:
+    static QHash<QByteArray, QByteArray> entries(const StateJournal& journal);
+};
+
+/* Copies: forEach() may hand out bytes of the mapping. */
+QHash<QByteArray, QByteArray> TestStateJournal::entries(const StateJournal& journal) {
+    QHash<QByteArray, QByteArray> out;
+    int calls = 0;
+    journal.forEach([&](const QByteArray& key, const QByteArray& value) {
+        ++calls;
+        out.insert(QByteArray(key.constData(), key.size()),
+                   QByteArray(value.constData(), value.size()));
+    });
+    // every key once
+    return calls == out.size() ? out : QHash<QByteArray, QByteArray>();
+}
+
+void TestStateJournal::replayJournal() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    {
+        StateJournal journal;
+        QVERIFY(journal.open(dir.path()));
+        journal.put("a", "1");
+        journal.put("b", "2");
+        journal.put("c", "3");
+        journal.remove("b");
+        journal.put("a", "4");
+        journal.remove("missing");
+        QCOMPARE(journal.size(), 2);
+    }
+    StateJournal journal;
+    QVERIFY(journal.open(dir.path()));
+    QCOMPARE(journal.size(), 2);
+    QCOMPARE(journal.value("a"), QByteArray("4"));
+    QVERIFY(!journal.contains("b"));
+    QCOMPARE(journal.value("c"), QByteArray("3"));
+    QCOMPARE(entries(journal).size(), 2);
+}
+
+void TestStateJournal::replaySnapshot() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    {
+        StateJournal journal;
+        QVERIFY(journal.open(dir.path()));
+        for (int i = 0; i < 1000; ++i) {
+            journal.put("key" + QByteArray::number(i), QByteArray::number(i * i));
+        }
+        journal.compact();
+        // waits for the snapshot writer
+        journal.close();
+    }
+    QVERIFY(QFile::exists(QDir(dir.path()).filePath("snapshot.bin")));
+    StateJournal journal;
+    QVERIFY(journal.open(dir.path()));
+    QCOMPARE(journal.size(), 1000);
+    for (int i = 0; i < 1000; ++i) {
+        QCOMPARE(journal.value("key" + QByteArray::number(i)), QByteArray::number(i * i));
+    }
+    QVERIFY(!journal.contains("key1000"));
+    QCOMPARE(entries(journal).size(), 1000);
+}
+
+void TestStateJournal::replaySnapshotAndJournal() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    {
+        StateJournal journal;
+        QVERIFY(journal.open(dir.path()));
+        journal.put("kept", "1");
+        journal.put("changed", "1");
+        journal.put("removed", "1");
+        journal.put("readded", "1");
+        journal.compact();
+        journal.close();
+    }
+    {
+        // changes to snapshot entries go to the journal
+        StateJournal journal;
+        QVERIFY(journal.open(dir.path()));
+        journal.put("changed", "2");
+        journal.remove("removed");
+        journal.remove("readded");
+        journal.put("readded", "3");
+        journal.put("new", "4");
+        QCOMPARE(journal.size(), 5);
+    }
+    StateJournal journal;
+    QVERIFY(journal.open(dir.path()));
+    QCOMPARE(journal.size(), 4);
+    QHash<QByteArray, QByteArray> all = entries(journal);
+    QCOMPARE(all.size(), 4);
+    QCOMPARE(all.value("kept"), QByteArray("1"));
+    QCOMPARE(all.value("changed"), QByteArray("2"));
+    QCOMPARE(all.value("readded"), QByteArray("3"));
+    QCOMPARE(all.value("new"), QByteArray("4"));
+    QVERIFY(!journal.contains("removed"));
+}
+
+void TestStateJournal::tornRecord() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    {
+        StateJournal journal;
+        QVERIFY(journal.open(dir.path()));
+        journal.put("first", "1");
+        journal.put("second", "2");
+    }
+    QDir journals(dir.path());
+    QStringList names = journals.entryList(QStringList() << "journal.*.log", QDir::Files,
+                                           QDir::Name);
+    QCOMPARE(names.size(), 1);
+    QFile file(journals.filePath(names.last()));
+    QVERIFY(file.resize(file.size() - 1));
+    {
+        StateJournal journal;
+        QVERIFY(journal.open(dir.path()));
+        QCOMPARE(journal.value("first"), QByteArray("1"));
+        QVERIFY(!journal.contains("second"));
+        journal.put("third", "3");
+    }
+    // the torn journal is left as it is, later writes go to a new one
+    StateJournal journal;
+    QVERIFY(journal.open(dir.path()));
+    QCOMPARE(journal.size(), 2);
+    QCOMPARE(journal.value("third"), QByteArray("3"));
+}
+
+void TestStateJournal::compactThreshold() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    {
+        StateJournal journal;
+        journal.setCompactThreshold(1024);
+        QVERIFY(journal.open(dir.path()));
+        for (int i = 0; i < 200; ++i) {
+            journal.put("key" + QByteArray::number(i % 10), QByteArray(100, char('a' + i % 26)));
+        }
+    }
+    QVERIFY(QFile::exists(QDir(dir.path()).filePath("snapshot.bin")));
+    StateJournal journal;
+    QVERIFY(journal.open(dir.path()));
+    QCOMPARE(journal.size(), 10);
+    for (int i = 190; i < 200; ++i) {
+        QCOMPARE(journal.value("key" + QByteArray::number(i % 10)),
+                 QByteArray(100, char('a' + i % 26)));
+    }
+}
+
+/* Once the snapshot is adopted only what changed after compact() is kept in
+ * memory, and everything else is read from the new mapping. */
+void TestStateJournal::compactReleasesChanges() {
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    StateJournal journal;
+    QVERIFY(journal.open(dir.path()));
+    for (int i = 0; i < 50; ++i) {
+        journal.put("key" + QByteArray::number(i), QByteArray::number(i));
+    }
+    journal.compact();
+    journal.put("key0", "changed");
+    journal.put("late", "1");
+    journal.remove("key1");
+    // the snapshot is written in the background, sync() adopts it
+    for (int i = 0; i < 500 && journal.pendingChanges() > 3; ++i) {
+        QTest::qSleep(10);
+        journal.sync();
+    }
+    QCOMPARE(journal.pendingChanges(), 3);
+    QCOMPARE(journal.size(), 50);
+    QCOMPARE(journal.value("key0"), QByteArray("changed"));
+    QVERIFY(!journal.contains("key1"));
+    QCOMPARE(journal.value("key49"), QByteArray("49"));
+    QCOMPARE(journal.value("late"), QByteArray("1"));
+    QCOMPARE(entries(journal).size(), 50);
+}
+
+QTEST_APPLESS_MAIN(TestStateJournal)
+
+#include "tst_state_journal.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of StreamAssembler, see server/frame_codec.h
+#
+#-------------------------------------------------
+
+TARGET = tst_stream_assembler
+
+include(../tests.pri)
+
+SOURCES += tst_stream_assembler.cpp
@@ -0,0 +1,284 @@
+/*
+Json Command Server
+
+STREAM ASSEMBLER TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* StreamAssembler, the inbound side of v2 framing: whole messages, messages
+ * in chunks interleaved across streams, stream bodies, aborts, and the bounds
+ * on message size, buffered bytes and open streams. */
+
+#include "frame_codec.h"
+
+#include <QtTest>
+
+using namespace JsonCommandServer;
+
+// begin() refused the chunk
+static const int REJECTED = -1;
+
+class TestStreamAssembler : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void headerRoundTrip();
+    void wholeMessage();
+    void chunkedMessage();
+    void interleavedMessages();
+    void streamBody();
+    void abort();
+    void streamInUse();
+    void messageSizeLimit();
+    void bufferedLimit();
+    void openStreamsLimit();
+    void deflate();
+    void encodingSwitch();
+
+  private:
+    static int feed(StreamAssembler& assembler, quint32 stream, int flags,
+                    const QByteArray& chunk, QByteArray* out = 0,
+                    int encoding = ENCODING_JSON);
+};
+
+int TestStreamAssembler::feed(StreamAssembler& assembler, quint32 stream, int flags,
+        const QByteArray& chunk, QByteArray* out, int encoding) {
+    FrameHeader header;
+    header.flags = static_cast<quint8>(flags);
+    header.encoding = static_cast<quint8>(encoding);
+    header.stream = stream;
+    header.size = chunk.size();
+    QString error;
+    if (!assembler.begin(header, &error)) return REJECTED;
+    QByteArray ignored;
+    return assembler.addChunk(chunk, out ? out : &ignored, &error);
+}
+
+void TestStreamAssembler::headerRoundTrip() {
+    FrameHeader header;
+    header.flags = FRAME_MORE | FRAME_STREAM;
+    header.encoding = ENCODING_DEFLATE_JSON;
+    header.stream = 0x01020304;
+    header.size = 70000;
+    QByteArray data = encodeFrameHeader(header);
+    QCOMPARE(data.size(), FRAME_V2_HEADER_SIZE);
+    QCOMPARE(frameHeaderSize(data), FRAME_V2_HEADER_SIZE);
+    FrameHeader decoded = decodeFrameHeader(data);
+    QCOMPARE(decoded.flags, header.flags);
+    QCOMPARE(decoded.encoding, header.encoding);
+    QCOMPARE(decoded.stream, header.stream);
+    QCOMPARE(decoded.size, header.size);
+    QCOMPARE(frameHeaderSize(IntToArray(10)), FRAME_V1_HEADER_SIZE);
+}
+
+void TestStreamAssembler::wholeMessage() {
+    StreamAssembler assembler(1024);
+    QByteArray out;
+    QCOMPARE(feed(assembler, 0, 0, "[{\"type\":1}]", &out), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(out, QByteArray("[{\"type\":1}]"));
+    QVERIFY(!assembler.inChunk());
+    // stream 0 only carries whole messages
+    QCOMPARE(feed(assembler, 0, FRAME_MORE, "[{"), REJECTED);
+    QCOMPARE(feed(assembler, 0, FRAME_STREAM, "[{}]"), REJECTED);
+}
+
+void TestStreamAssembler::chunkedMessage() {
+    StreamAssembler assembler(1024);
+    FrameHeader header;
+    header.flags = FRAME_MORE;
+    header.stream = 5;
+    header.size = 2;
+    QString error;
+    QVERIFY(assembler.begin(header, &error));
+    QVERIFY(assembler.inChunk());
+    QVERIFY(assembler.buffersChunk());
+    QByteArray out;
+    QCOMPARE(assembler.addChunk("ab", &out, &error), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(assembler.partialMessages(), 1);
+    QCOMPARE(assembler.bufferedBytes(), qint64(2));
+    QCOMPARE(feed(assembler, 5, FRAME_MORE, "cd"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 5, 0, "ef", &out), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(out, QByteArray("abcdef"));
+    QCOMPARE(assembler.partialMessages(), 0);
+    QCOMPARE(assembler.bufferedBytes(), qint64(0));
+}
+
+void TestStreamAssembler::interleavedMessages() {
+    StreamAssembler assembler(1024);
+    QByteArray out;
+    QCOMPARE(feed(assembler, 1, FRAME_MORE, "1a"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 2, FRAME_MORE, "2a"), int(StreamAssembler::CHUNK_PARTIAL));
+    // a whole message overtakes both
+    QCOMPARE(feed(assembler, 0, 0, "0", &out), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(out, QByteArray("0"));
+    QCOMPARE(feed(assembler, 2, 0, "2b", &out), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(out, QByteArray("2a2b"));
+    QCOMPARE(feed(assembler, 1, 0, "1b", &out), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(out, QByteArray("1a1b"));
+    QCOMPARE(assembler.partialMessages(), 0);
+}
+
+void TestStreamAssembler::streamBody() {
+    StreamAssembler assembler(16);
+    QByteArray out;
+    QCOMPARE(feed(assembler, 7, FRAME_STREAM | FRAME_MORE, "[{\"type\":2}]", &out),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(out, QByteArray("[{\"type\":2}]"));
+    QCOMPARE(assembler.openStreams(), 1);
+    // body pieces come out as they are, each bounded but not their sum
+    for (int i = 0; i < 10; ++i) {
+        FrameHeader header;
+        header.flags = FRAME_MORE;
+        header.stream = 7;
+        header.size = 16;
+        QString error;
+        QVERIFY(assembler.begin(header, &error));
+        QVERIFY(!assembler.buffersChunk());
+        QCOMPARE(assembler.addChunk(QByteArray(16, 'x'), &out, &error),
+                 int(StreamAssembler::CHUNK_STREAM_DATA));
+        QCOMPARE(out, QByteArray(16, 'x'));
+    }
+    QCOMPARE(assembler.bufferedBytes(), qint64(0));
+    QCOMPARE(feed(assembler, 7, 0, "end", &out), int(StreamAssembler::CHUNK_STREAM_DATA));
+    QCOMPARE(out, QByteArray("end"));
+    QCOMPARE(assembler.openStreams(), 0);
+    // a stream that is only its command
+    QCOMPARE(feed(assembler, 8, FRAME_STREAM, "[{}]"), int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(assembler.openStreams(), 0);
+}
+
+void TestStreamAssembler::abort() {
+    StreamAssembler assembler(1024);
+    QCOMPARE(feed(assembler, 3, FRAME_STREAM | FRAME_MORE, "[{}]"),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(feed(assembler, 3, FRAME_ABORT, ""), int(StreamAssembler::CHUNK_STREAM_ABORT));
+    QCOMPARE(assembler.openStreams(), 0);
+    QCOMPARE(feed(assembler, 4, FRAME_MORE, "abc"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 4, FRAME_ABORT, ""), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(assembler.partialMessages(), 0);
+    QCOMPARE(assembler.bufferedBytes(), qint64(0));
+    // both ids are free again
+    QCOMPARE(feed(assembler, 3, FRAME_STREAM | FRAME_MORE, "[{}]"),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(feed(assembler, 4, FRAME_STREAM, "[{}]"), int(StreamAssembler::CHUNK_STREAM_BEGIN));
+}
+
+void TestStreamAssembler::streamInUse() {
+    StreamAssembler assembler(1024);
+    QCOMPARE(feed(assembler, 1, FRAME_STREAM | FRAME_MORE, "[{}]"),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(feed(assembler, 1, FRAME_STREAM | FRAME_MORE, "[{}]"), REJECTED);
+    QCOMPARE(feed(assembler, 2, FRAME_MORE, "ab"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 2, FRAME_STREAM | FRAME_MORE, "[{}]"), REJECTED);
+}
+
+void TestStreamAssembler::messageSizeLimit() {
+    StreamAssembler assembler(10);
+    QCOMPARE(feed(assembler, 0, 0, QByteArray(10, 'x')), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(feed(assembler, 0, 0, QByteArray(11, 'x')), REJECTED);
+    // the chunks of a message add up
+    QCOMPARE(feed(assembler, 1, FRAME_MORE, QByteArray(6, 'x')),
+             int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 1, 0, QByteArray(5, 'x')), REJECTED);
+    QCOMPARE(feed(assembler, 1, 0, QByteArray(4, 'x')), int(StreamAssembler::CHUNK_MESSAGE));
+    FrameHeader header;
+    header.stream = 2;
+    header.size = -1;
+    QString error;
+    QVERIFY(!assembler.begin(header, &error));
+    QVERIFY(!error.isEmpty());
+}
+
+void TestStreamAssembler::bufferedLimit() {
+    StreamAssembler assembler(10);
+    for (int i = 1; i <= StreamAssembler::MAX_PARTIAL_MESSAGES; ++i) {
+        QCOMPARE(feed(assembler, quint32(i), FRAME_MORE, QByteArray(10, 'x')),
+                 int(StreamAssembler::CHUNK_PARTIAL));
+    }
+    QCOMPARE(assembler.bufferedBytes(), qint64(StreamAssembler::MAX_PARTIAL_MESSAGES * 10));
+    QCOMPARE(feed(assembler, 100, FRAME_MORE, "x"), REJECTED);
+    // stream bodies are not buffered, so they do not count
+    QCOMPARE(feed(assembler, 101, FRAME_STREAM | FRAME_MORE, "[{}]"),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(feed(assembler, 101, 0, QByteArray(10, 'x')),
+             int(StreamAssembler::CHUNK_STREAM_DATA));
+}
+
+void TestStreamAssembler::openStreamsLimit() {
+    StreamAssembler assembler(1024);
+    for (int i = 1; i < StreamAssembler::MAX_OPEN_STREAMS; ++i) {
+        QCOMPARE(feed(assembler, quint32(i), FRAME_STREAM | FRAME_MORE, "[{}]"),
+                 int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    }
+    // partial messages share the bound
+    QCOMPARE(feed(assembler, 1000, FRAME_MORE, "a"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(assembler.openStreams() + assembler.partialMessages(),
+             StreamAssembler::MAX_OPEN_STREAMS);
+    QCOMPARE(feed(assembler, 2000, FRAME_STREAM | FRAME_MORE, "[{}]"), REJECTED);
+    QCOMPARE(feed(assembler, 2001, FRAME_MORE, "a"), REJECTED);
+    // what is open can go on, and whole messages still pass
+    QCOMPARE(feed(assembler, 1, FRAME_MORE, "body"), int(StreamAssembler::CHUNK_STREAM_DATA));
+    QCOMPARE(feed(assembler, 1000, FRAME_MORE, "b"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 0, 0, "[{}]"), int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(feed(assembler, 2002, FRAME_STREAM, "[{}]"),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+    QCOMPARE(feed(assembler, 1, 0, "end"), int(StreamAssembler::CHUNK_STREAM_DATA));
+    QCOMPARE(feed(assembler, 2000, FRAME_STREAM | FRAME_MORE, "[{}]"),
+             int(StreamAssembler::CHUNK_STREAM_BEGIN));
+}
+
+void TestStreamAssembler::deflate() {
+    StreamAssembler assembler(1024);
+    QByteArray text(1000, 'a');
+    QByteArray packed = encodePayload(ENCODING_DEFLATE_JSON, text);
+    QByteArray out;
+    QCOMPARE(feed(assembler, 1, FRAME_MORE, packed.left(5), 0, ENCODING_DEFLATE_JSON),
+             int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 1, 0, packed.mid(5), &out, ENCODING_DEFLATE_JSON),
+             int(StreamAssembler::CHUNK_MESSAGE));
+    QCOMPARE(out, text);
+    // the inflated size is checked before inflating
+    QByteArray large = encodePayload(ENCODING_DEFLATE_JSON, QByteArray(2000, 'a'));
+    QVERIFY(large.size() <= 1024);
+    QCOMPARE(feed(assembler, 0, 0, large, &out, ENCODING_DEFLATE_JSON),
+             int(StreamAssembler::CHUNK_ERROR));
+    QCOMPARE(feed(assembler, 0, 0, "junk", &out, ENCODING_DEFLATE_JSON),
+             int(StreamAssembler::CHUNK_ERROR));
+    QCOMPARE(feed(assembler, 0, 0, "[{}]", &out, N_ENCODINGS), REJECTED);
+}
+
+void TestStreamAssembler::encodingSwitch() {
+    StreamAssembler assembler(1024);
+    QCOMPARE(feed(assembler, 1, FRAME_MORE, "ab"), int(StreamAssembler::CHUNK_PARTIAL));
+    QCOMPARE(feed(assembler, 1, 0, "cd", 0, ENCODING_DEFLATE_JSON), REJECTED);
+}
+
+QTEST_APPLESS_MAIN(TestStreamAssembler)
+
+#include "tst_stream_assembler.moc"
@@ -0,0 +1,12 @@
+#-------------------------------------------------
+#
+# Unit tests of v2 framing and streamed commands on a live server, see
+# server/frame_codec.h and BaseServer::setFrameVersion()
+#
+#-------------------------------------------------
+
+TARGET = tst_stream_commands
+
+include(../tests.pri)
+
+SOURCES += tst_stream_commands.cpp
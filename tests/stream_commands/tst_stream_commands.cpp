@@ -0,0 +1,530 @@
+/*
+Json Command Server
+
+STREAM COMMAND TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* v2 connections on a live server: the identify handshake, stream bodies
+ * reaching their handler piece by piece, aborts and rejections, a CMD_TO
+ * stream piped to another client, and outbound messages chunked and
+ * compressed. */
+
+#include "base_server.h"
+#include "frame_codec.h"
+#include "jsoncommandserver.h"
+#include "test_client.h"
+
+#include <QtTest>
+
+using JsonCommandServer::BaseController;
+using JsonCommandServer::BaseServer;
+using JsonCommandServer::FrameHeader;
+using JsonCommandServer::StreamAssembler;
+using namespace TestClient;
+
+namespace {
+
+enum TestCommands {
+    UPLOAD = 100,
+    PLAIN = 101
+};
+
+const int CHUNK_SIZE = 256;
+const qint32 MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+class TestServer : public BaseServer {
+  public:
+    QStringList errors;
+    void addErrorMessage(const QString& message) { errors.append(message); }
+};
+
+/* What the UPLOAD handler was called with. */
+struct Uploads {
+    QList<int> events;
+    QByteArray body;
+    QJsonObject cmd;
+};
+
+Uploads uploads;
+
+void upload(BaseController*, const QJsonObject& cmd, int event, const QByteArray& chunk) {
+    uploads.events.append(event);
+    uploads.body.append(chunk);
+    uploads.cmd = cmd;
+}
+
+bool waitEvents(int n) {
+    QElapsedTimer timer;
+    timer.start();
+    while (uploads.events.size() < n && timer.elapsed() < TIMEOUT_MS) QTest::qWait(10);
+    return uploads.events.size() >= n;
+}
+
+void start(TestServer* server, quint16 port) {
+    server->setServerMode(true);
+    server->setVerbose(false);
+    server->setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server->setPortServer(port);
+    server->setStreamChunkSize(CHUNK_SIZE);
+    server->initServer();
+}
+
+QJsonObject object(int type) {
+    QJsonObject out;
+    out.insert("type", type);
+    return out;
+}
+
+/* A client that asks for v2 and decodes what the server sends after. */
+class V2Client {
+  public:
+    V2Client() : assembler(MAX_MESSAGE_SIZE) {}
+
+    struct Chunk {
+        FrameHeader header;
+        int kind;
+        QByteArray data;
+    };
+
+    bool handshake(quint16 port) {
+        QJsonObject status;
+        if (!connectTo(&socket, port) ||
+                !waitFor(&socket, JsonCommandServer::MESSAGE_STATUS, &status)) {
+            return false;
+        }
+        QJsonObject identify = object(JsonCommandServer::MESSAGE_IDENTIFY);
+        identify.insert("frame_version", 2);
+        sendFrame(&socket, QJsonArray() << identify);
+        // the answer is the last v1 frame
+        QJsonObject answer;
+        if (!waitFor(&socket, JsonCommandServer::MESSAGE_IDENTIFY, &answer)) return false;
+        chunk_size = answer["stream_chunk_size"].toInt();
+        return answer["frame_version"].toInt() == 2;
+    }
+
+    void sendChunk(int flags, quint32 stream, const QByteArray& data) {
+        FrameHeader header;
+        header.flags = flags;
+        header.stream = stream;
+        header.size = data.size();
+        socket.write(JsonCommandServer::encodeFrameHeader(header) + data);
+    }
+
+    void sendMessage(const QJsonObject& cmd) {
+        sendChunk(0, 0, QJsonDocument(QJsonArray() << cmd).toJson(QJsonDocument::Compact));
+    }
+
+    void openStream(quint32 stream, const QJsonObject& cmd, bool body = true) {
+        sendChunk(JsonCommandServer::FRAME_STREAM | (body ? JsonCommandServer::FRAME_MORE : 0),
+                  stream, QJsonDocument(QJsonArray() << cmd).toJson(QJsonDocument::Compact));
+    }
+
+    bool readChunk(Chunk* chunk, int timeout_ms = TIMEOUT_MS) {
+        QElapsedTimer timer;
+        timer.start();
+        while (true) {
+            if (socket.bytesAvailable() >= JsonCommandServer::FRAME_V2_HEADER_SIZE) {
+                QByteArray bytes = socket.peek(JsonCommandServer::FRAME_V2_HEADER_SIZE);
+                if (uchar(bytes.at(0)) != JsonCommandServer::FRAME_V2_MAGIC) return false;
+                FrameHeader header = JsonCommandServer::decodeFrameHeader(bytes);
+                if (socket.bytesAvailable() >= JsonCommandServer::FRAME_V2_HEADER_SIZE + header.size) {
+                    socket.read(JsonCommandServer::FRAME_V2_HEADER_SIZE);
+                    QByteArray data = socket.read(header.size);
+                    QString error;
+                    if (!assembler.begin(header, &error)) return false;
+                    headers.append(header);
+                    chunk->header = header;
+                    chunk->data.clear();
+                    chunk->kind = assembler.addChunk(data, &chunk->data, &error);
+                    return chunk->kind != StreamAssembler::CHUNK_ERROR;
+                }
+            }
+            if (socket.state() != QAbstractSocket::ConnectedState ||
+                    timer.elapsed() > timeout_ms) {
+                return false;
+            }
+            QTest::qWait(10);
+        }
+    }
+
+    /* The first whole message holding a command of the given type; *last is
+     * the header of its last chunk. */
+    bool waitMessage(int type, QJsonObject* out, FrameHeader* last = 0) {
+        Chunk chunk;
+        while (readChunk(&chunk)) {
+            if (chunk.kind != StreamAssembler::CHUNK_MESSAGE) continue;
+            QJsonArray cmds = QJsonDocument::fromJson(chunk.data).array();
+            for (int i = 0; i < cmds.size(); ++i) {
+                if (cmds[i].toObject()["type"].toInt() == type) {
+                    *out = cmds[i].toObject();
+                    if (last) *last = chunk.header;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /* The name the server knows this client by. */
+    QString name() const {
+        return "@" + socket.localAddress().toString() + ":" + QString::number(socket.localPort());
+    }
+
+    QTcpSocket socket;
+    StreamAssembler assembler;
+    QList<FrameHeader> headers;
+    int chunk_size;
+};
+
+QJsonObject messageTo(const QString& to, const QString& message) {
+    QJsonObject cmd = object(JsonCommandServer::MESSAGE_TO);
+    cmd.insert("from", "test");
+    cmd.insert("to", to);
+    cmd.insert("message", message);
+    return cmd;
+}
+
+/* Text deflate cannot shrink much, so it goes chunked but uncompressed. */
+QString noise(int size) {
+    QString out;
+    quint32 x = 12345;
+    while (out.size() < size) {
+        x = x * 1103515245u + 12345u;
+        out.append(QChar(char('a' + (x >> 16) % 26)));
+    }
+    return out;
+}
+
+}  // namespace
+
+class TestStreamCommands : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void init();
+    void cleanup();
+    void negotiate();
+    void frameVersionOff();
+    void streamBody();
+    void streamWithoutBody();
+    void abortStream();
+    void senderLeaves();
+    void notAStreamCommand();
+    void pipeToPeer();
+    void pipeToV1Peer();
+    void receiverLeaves();
+    void chunkedMessages();
+    void compressedMessages();
+
+  private:
+    TestServer* server_;
+    quint16 port_;
+};
+
+void TestStreamCommands::initTestCase() {
+    JsonCommandServer::JsonCommandServer::addStreamCommand(upload, UPLOAD);
+}
+
+void TestStreamCommands::init() {
+    uploads = Uploads();
+    port_ = freePort();
+    QVERIFY(port_ != 0);
+    server_ = new TestServer;
+    start(server_, port_);
+}
+
+void TestStreamCommands::cleanup() {
+    delete server_;
+}
+
+void TestStreamCommands::negotiate() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    QCOMPARE(client.chunk_size, CHUNK_SIZE);
+    QCOMPARE(server_->metrics()["v2_connections"].toInt(), 1);
+
+    // v2 both ways from here on
+    client.sendMessage(messageTo(client.name(), "v2"));
+    QJsonObject message;
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_NORMAL, &message));
+    QCOMPARE(message["message"].toString(), QString("v2"));
+}
+
+void TestStreamCommands::frameVersionOff() {
+    server_->setFrameVersion(JsonCommandServer::FRAME_V1);
+    QTcpSocket client;
+    QJsonObject status;
+    QVERIFY(connectTo(&client, port_));
+    QVERIFY(waitFor(&client, JsonCommandServer::MESSAGE_STATUS, &status));
+    QJsonObject identify = object(JsonCommandServer::MESSAGE_IDENTIFY);
+    identify.insert("frame_version", 2);
+    sendFrame(&client, QJsonArray() << identify);
+
+    QString name = "@" + client.localAddress().toString() + ":" +
+                   QString::number(client.localPort());
+    sendFrame(&client, QJsonArray() << messageTo(name, "v1"));
+    QJsonObject message;
+    QVERIFY(waitFor(&client, JsonCommandServer::MESSAGE_NORMAL, &message));
+    QCOMPARE(message["message"].toString(), QString("v1"));
+    QCOMPARE(server_->metrics()["v2_connections"].toInt(), 0);
+}
+
+void TestStreamCommands::streamBody() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    QJsonObject cmd = object(UPLOAD);
+    cmd.insert("name", "file");
+    client.openStream(7, cmd);
+    QVERIFY(waitEvents(1));
+    QCOMPARE(uploads.events.first(), int(JsonCommandServer::STREAM_BEGIN));
+
+    client.sendChunk(JsonCommandServer::FRAME_MORE, 7, "one ");
+    client.sendChunk(JsonCommandServer::FRAME_MORE, 7, "two ");
+    client.sendChunk(0, 7, "three");
+    QVERIFY(waitEvents(5));
+    QCOMPARE(uploads.events, QList<int>() << JsonCommandServer::STREAM_BEGIN
+             << JsonCommandServer::STREAM_DATA << JsonCommandServer::STREAM_DATA
+             << JsonCommandServer::STREAM_DATA << JsonCommandServer::STREAM_END);
+    QCOMPARE(uploads.body, QByteArray("one two three"));
+    QCOMPARE(uploads.cmd["name"].toString(), QString("file"));
+    QCOMPARE(uploads.cmd["stream"].toInt(), 7);
+    QCOMPARE(uploads.cmd["ip"].toString(), client.socket.localAddress().toString());
+    QCOMPARE(uploads.cmd["port"].toInt(), int(client.socket.localPort()));
+
+    QJsonObject metrics = server_->metrics();
+    QCOMPARE(metrics["streams_opened"].toInt(), 1);
+    QCOMPARE(metrics["streams_aborted"].toInt(), 0);
+    QCOMPARE(metrics["stream_bytes"].toInt(), 13);
+}
+
+void TestStreamCommands::streamWithoutBody() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    client.openStream(3, object(UPLOAD), false);
+    QVERIFY(waitEvents(2));
+    QCOMPARE(uploads.events, QList<int>() << JsonCommandServer::STREAM_BEGIN
+             << JsonCommandServer::STREAM_END);
+    QVERIFY(uploads.body.isEmpty());
+}
+
+void TestStreamCommands::abortStream() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    client.openStream(5, object(UPLOAD));
+    client.sendChunk(JsonCommandServer::FRAME_MORE, 5, "partial");
+    client.sendChunk(JsonCommandServer::FRAME_ABORT, 5, QByteArray());
+    QVERIFY(waitEvents(3));
+    QCOMPARE(uploads.events, QList<int>() << JsonCommandServer::STREAM_BEGIN
+             << JsonCommandServer::STREAM_DATA << JsonCommandServer::STREAM_ABORT);
+    QCOMPARE(server_->metrics()["streams_aborted"].toInt(), 1);
+
+    // the stream id is free again
+    client.openStream(5, object(UPLOAD), false);
+    QVERIFY(waitEvents(5));
+    QCOMPARE(uploads.events.last(), int(JsonCommandServer::STREAM_END));
+}
+
+void TestStreamCommands::senderLeaves() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    client.openStream(9, object(UPLOAD));
+    client.sendChunk(JsonCommandServer::FRAME_MORE, 9, "half");
+    QVERIFY(waitEvents(2));
+    client.socket.disconnectFromHost();
+    QVERIFY(waitEvents(3));
+    QCOMPARE(uploads.events.last(), int(JsonCommandServer::STREAM_ABORT));
+    QCOMPARE(server_->metrics()["streams_aborted"].toInt(), 1);
+}
+
+void TestStreamCommands::notAStreamCommand() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    client.openStream(4, object(PLAIN));
+    client.sendChunk(0, 4, "dropped");
+    QJsonObject error;
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_ERROR, &error));
+    QVERIFY2(error["message"].toString().contains(QString::fromUtf8("não aceita fluxos")),
+             qPrintable(error["message"].toString()));
+
+    // the body was dropped and the connection still works
+    client.sendMessage(messageTo(client.name(), "still here"));
+    QJsonObject message;
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_NORMAL, &message));
+    QCOMPARE(message["message"].toString(), QString("still here"));
+    QVERIFY(uploads.events.isEmpty());
+}
+
+void TestStreamCommands::pipeToPeer() {
+    V2Client sender;
+    V2Client receiver;
+    QVERIFY(sender.handshake(port_));
+    QVERIFY(receiver.handshake(port_));
+    QJsonObject cmd = object(JsonCommandServer::CMD_TO);
+    cmd.insert("from", "sender");
+    cmd.insert("to", receiver.name());
+    QJsonObject inner = object(UPLOAD);
+    inner.insert("name", "piped");
+    cmd.insert("cmd", QJsonArray() << inner);
+    sender.openStream(2, cmd);
+
+    V2Client::Chunk chunk;
+    do {
+        QVERIFY(receiver.readChunk(&chunk));
+    } while (chunk.kind != StreamAssembler::CHUNK_STREAM_BEGIN);
+    QJsonObject envelope = QJsonDocument::fromJson(chunk.data).array()[0].toObject();
+    QCOMPARE(envelope["type"].toInt(), int(JsonCommandServer::CMD_TO));
+    QCOMPARE(envelope["from"].toString(), QString("sender"));
+    QCOMPARE(envelope["to"].toString(), receiver.name());
+    QCOMPARE(envelope["cmd"].toArray()[0].toObject()["name"].toString(), QString("piped"));
+    quint32 stream = chunk.header.stream;
+
+    QByteArray body = noise(3 * CHUNK_SIZE).toLatin1();
+    sender.sendChunk(JsonCommandServer::FRAME_MORE, 2, body.left(100));
+    sender.sendChunk(JsonCommandServer::FRAME_MORE, 2, body.mid(100, 400));
+    sender.sendChunk(0, 2, body.mid(500));
+    QByteArray piped;
+    do {
+        QVERIFY(receiver.readChunk(&chunk));
+        if (chunk.kind != StreamAssembler::CHUNK_STREAM_DATA) continue;
+        QCOMPARE(chunk.header.stream, stream);
+        piped.append(chunk.data);
+    } while (chunk.kind != StreamAssembler::CHUNK_STREAM_DATA ||
+             (chunk.header.flags & JsonCommandServer::FRAME_MORE));
+    QCOMPARE(piped, body);
+    QCOMPARE(server_->metrics()["stream_bytes"].toInt(), body.size());
+    QVERIFY(uploads.events.isEmpty());
+}
+
+void TestStreamCommands::pipeToV1Peer() {
+    V2Client sender;
+    QVERIFY(sender.handshake(port_));
+    QTcpSocket receiver;
+    QJsonObject status;
+    QVERIFY(connectTo(&receiver, port_));
+    QVERIFY(waitFor(&receiver, JsonCommandServer::MESSAGE_STATUS, &status));
+    QString to = "@" + receiver.localAddress().toString() + ":" +
+                 QString::number(receiver.localPort());
+
+    QJsonObject cmd = object(JsonCommandServer::CMD_TO);
+    cmd.insert("from", "sender");
+    cmd.insert("to", to);
+    cmd.insert("cmd", QJsonArray() << object(UPLOAD));
+    sender.openStream(2, cmd);
+    sender.sendChunk(0, 2, "body");
+    QJsonObject error;
+    QVERIFY(sender.waitMessage(JsonCommandServer::MESSAGE_ERROR, &error));
+    QVERIFY2(error["message"].toString().contains(QString::fromUtf8("não recebe fluxos")),
+             qPrintable(error["message"].toString()));
+    QVERIFY(error["message"].toString().contains(to));
+}
+
+void TestStreamCommands::receiverLeaves() {
+    V2Client sender;
+    V2Client receiver;
+    QVERIFY(sender.handshake(port_));
+    QVERIFY(receiver.handshake(port_));
+    QJsonObject cmd = object(JsonCommandServer::CMD_TO);
+    cmd.insert("from", "sender");
+    cmd.insert("to", receiver.name());
+    cmd.insert("cmd", QJsonArray() << object(UPLOAD));
+    sender.openStream(6, cmd);
+    sender.sendChunk(JsonCommandServer::FRAME_MORE, 6, "first");
+
+    V2Client::Chunk chunk;
+    do {
+        QVERIFY(receiver.readChunk(&chunk));
+    } while (chunk.kind != StreamAssembler::CHUNK_STREAM_DATA);
+    receiver.socket.disconnectFromHost();
+
+    QJsonObject error;
+    QVERIFY(sender.waitMessage(JsonCommandServer::MESSAGE_ERROR, &error));
+    QVERIFY2(error["message"].toString().contains("interrompido"),
+             qPrintable(error["message"].toString()));
+    QCOMPARE(server_->metrics()["streams_aborted"].toInt(), 1);
+}
+
+void TestStreamCommands::chunkedMessages() {
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    QString text = noise(4 * CHUNK_SIZE);
+    client.sendMessage(messageTo(client.name(), text));
+    QJsonObject message;
+    FrameHeader last;
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_NORMAL, &message, &last));
+    QCOMPARE(message["message"].toString(), text);
+    QVERIFY(last.stream != 0);
+    QCOMPARE(int(last.encoding), int(JsonCommandServer::ENCODING_JSON));
+
+    int chunks = 0;
+    for (int i = 0; i < client.headers.size(); ++i) {
+        const FrameHeader& header = client.headers[i];
+        if (header.stream != last.stream) continue;
+        ++chunks;
+        QVERIFY(header.size <= CHUNK_SIZE);
+        if (i != client.headers.size() - 1) {
+            QVERIFY(header.flags & JsonCommandServer::FRAME_MORE);
+        }
+    }
+    QVERIFY(chunks > 4);
+
+    // small ones still go whole on stream 0
+    client.sendMessage(messageTo(client.name(), "small"));
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_NORMAL, &message, &last));
+    QCOMPARE(message["message"].toString(), QString("small"));
+    QCOMPARE(int(last.stream), 0);
+    QCOMPARE(int(last.flags), 0);
+}
+
+void TestStreamCommands::compressedMessages() {
+    server_->setFrameCompression(128);
+    V2Client client;
+    QVERIFY(client.handshake(port_));
+    QString text(2000, QChar('z'));
+    client.sendMessage(messageTo(client.name(), text));
+    QJsonObject message;
+    FrameHeader last;
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_NORMAL, &message, &last));
+    QCOMPARE(message["message"].toString(), text);
+    QCOMPARE(int(last.encoding), int(JsonCommandServer::ENCODING_DEFLATE_JSON));
+    // deflated, it fits in one chunk
+    QCOMPARE(int(last.stream), 0);
+    QVERIFY(last.size < CHUNK_SIZE);
+
+    // below the threshold stays plain
+    client.sendMessage(messageTo(client.name(), "plain"));
+    QVERIFY(client.waitMessage(JsonCommandServer::MESSAGE_NORMAL, &message, &last));
+    QCOMPARE(message["message"].toString(), QString("plain"));
+    QCOMPARE(int(last.encoding), int(JsonCommandServer::ENCODING_JSON));
+}
+
+QTEST_GUILESS_MAIN(TestStreamCommands)
+
+#include "tst_stream_commands.moc"
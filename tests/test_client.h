@@ -0,0 +1,147 @@
+/*
+Json Command Server
+
+TEST CLIENT
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Framed client side of the protocol for the tests that run a server. Server
+ * and client share the test's thread, so every wait spins the event loop. */
+
+#ifndef JSONCOMMANDSERVER_TEST_CLIENT_H
+#define JSONCOMMANDSERVER_TEST_CLIENT_H
+
+#include "commands_controller.h"
+
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtTest>
+
+namespace TestClient {
+
+const int TIMEOUT_MS = 5000;
+
+/* A port nothing listens on right now. */
+inline quint16 freePort() {
+    QTcpServer server;
+    if (!server.listen(QHostAddress::LocalHost, 0)) return 0;
+    quint16 port = server.serverPort();
+    server.close();
+    return port;
+}
+
+inline bool connectTo(QTcpSocket* socket, quint16 port,
+                      const QHostAddress& address = QHostAddress(QHostAddress::LocalHost)) {
+    socket->connectToHost(address, port);
+    QElapsedTimer timer;
+    timer.start();
+    while (socket->state() != QAbstractSocket::ConnectedState) {
+        if (socket->state() == QAbstractSocket::UnconnectedState ||
+                timer.elapsed() > TIMEOUT_MS) {
+            return false;
+        }
+        QTest::qWait(10);
+    }
+    return true;
+}
+
+/* v1 framing: the size as a big-endian qint32, then the JSON array. */
+inline void sendFrame(QTcpSocket* socket, const QJsonArray& cmd) {
+    QByteArray data = QJsonDocument(cmd).toJson(QJsonDocument::Compact);
+    socket->write(JsonCommandServer::IntToArray(data.size()));
+    socket->write(data);
+}
+
+inline bool readFrame(QTcpSocket* socket, QJsonArray* cmd, int timeout_ms = TIMEOUT_MS) {
+    QElapsedTimer timer;
+    timer.start();
+    while (true) {
+        if (socket->bytesAvailable() >= 4) {
+            qint32 size = JsonCommandServer::ArrayToInt(socket->peek(4));
+            if (socket->bytesAvailable() >= 4 + size) {
+                socket->read(4);
+                *cmd = QJsonDocument::fromJson(socket->read(size)).array();
+                return true;
+            }
+        }
+        if (socket->state() != QAbstractSocket::ConnectedState ||
+                timer.elapsed() > timeout_ms) {
+            return false;
+        }
+        QTest::qWait(10);
+    }
+}
+
+/* The first command of the given type, skipping the frames before it. */
+inline bool waitFor(QTcpSocket* socket, int type, QJsonObject* out,
+                    int timeout_ms = TIMEOUT_MS) {
+    QElapsedTimer timer;
+    timer.start();
+    QJsonArray cmd;
+    while (readFrame(socket, &cmd, qMax<qint64>(0, timeout_ms - timer.elapsed()))) {
+        for (int i = 0; i < cmd.size(); ++i) {
+            QJsonObject object = cmd[i].toObject();
+            if (object["type"].toInt() == type) {
+                *out = object;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline QJsonArray command(int type, const QString& key, const QJsonValue& value) {
+    QJsonObject object;
+    object.insert("type", type);
+    object.insert(key, value);
+    QJsonArray cmd;
+    cmd.append(object);
+    return cmd;
+}
+
+/* Whether the server closed the connection within timeout_ms. */
+inline bool waitClosed(QTcpSocket* socket, int timeout_ms = TIMEOUT_MS) {
+    QElapsedTimer timer;
+    timer.start();
+    while (socket->state() == QAbstractSocket::ConnectedState) {
+        if (timer.elapsed() > timeout_ms) return false;
+        socket->readAll();
+        QTest::qWait(10);
+    }
+    return true;
+}
+
+}  // namespace TestClient
+
+#endif // JSONCOMMANDSERVER_TEST_CLIENT_H
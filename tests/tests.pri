@@ -0,0 +1,17 @@
+#-------------------------------------------------
+#
+# Shared by the unit tests: each one is a QtTest app linked against the
+# library, run by "make check"
+#
+#-------------------------------------------------
+
+QT       += network testlib
+QT       -= gui
+
+CONFIG += testcase console c++11
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += $$PWD $$PWD/.. $$PWD/../server
+LIBS += -L$$OUT_PWD/../.. -lJsonCommandServer
@@ -0,0 +1,31 @@
+#-------------------------------------------------
+#
+# Unit tests, built after the library: qmake && make && make check
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += acceptor \
+    atom_table \
+    command_task \
+    datagram_channel \
+    epoll_server \
+    gather_reducer \
+    hot_reload \
+    local_transport \
+    loop_watchdog \
+    message_history \
+    node_link \
+    offline_store \
+    peer_directory \
+    peer_index \
+    response_cache \
+    send_queue \
+    server_mode \
+    state_journal \
+    stream_assembler \
+    stream_commands \
+    token_bucket \
+    trace_recorder \
+    uring_engine
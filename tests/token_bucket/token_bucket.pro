@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of TokenBucket, see server/rate_limiter.h
+#
+#-------------------------------------------------
+
+TARGET = tst_token_bucket
+
+include(../tests.pri)
+
+SOURCES += tst_token_bucket.cpp
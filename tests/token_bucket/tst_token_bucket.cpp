@@ -0,0 +1,129 @@
+/*
+Json Command Server
+
+TOKEN BUCKET TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* TokenBucket, the building block of ClientRateLimiter: a burst is taken at
+ * once, then tokens come back at the rate, never past the burst. Time is
+ * passed in, so every case runs on a made up clock. */
+
+#include "rate_limiter.h"
+
+#include <QtTest>
+
+using JsonCommandServer::TokenBucket;
+
+class TestTokenBucket : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void unlimited();
+    void burstThenRefill();
+    void refillStopsAtBurst();
+    void burstIsAtLeastOne();
+    void waitTime();
+    void setRateRefills();
+};
+
+void TestTokenBucket::unlimited() {
+    TokenBucket bucket;
+    QVERIFY(bucket.unlimited());
+    for (int i = 0; i < 1000; ++i) {
+        QVERIFY(bucket.consume(0));
+    }
+    QVERIFY(bucket.consume(0, 1e9));
+    QCOMPARE(bucket.waitTime(0, 1e9), qint64(0));
+}
+
+void TestTokenBucket::burstThenRefill() {
+    TokenBucket bucket(10, 5);
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(bucket.consume(1000));
+    }
+    QVERIFY(!bucket.consume(1000));
+    // 10 per second: one token every 100 ms
+    QVERIFY(!bucket.consume(1050));
+    QVERIFY(bucket.consume(1100));
+    QVERIFY(!bucket.consume(1100));
+    QVERIFY(bucket.consume(1300));
+    QVERIFY(bucket.consume(1300));
+    QVERIFY(!bucket.consume(1300));
+}
+
+void TestTokenBucket::refillStopsAtBurst() {
+    TokenBucket bucket(10, 5);
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(bucket.consume(0));
+    }
+    // an hour idle still only gives the burst back
+    for (int i = 0; i < 5; ++i) {
+        QVERIFY(bucket.consume(3600 * 1000));
+    }
+    QVERIFY(!bucket.consume(3600 * 1000));
+}
+
+void TestTokenBucket::burstIsAtLeastOne() {
+    TokenBucket bucket(10, 0);
+    QVERIFY(!bucket.unlimited());
+    QVERIFY(bucket.consume(0));
+    QVERIFY(!bucket.consume(0));
+}
+
+void TestTokenBucket::waitTime() {
+    TokenBucket bucket(4, 8);
+    QCOMPARE(bucket.waitTime(0), qint64(0));
+    QVERIFY(bucket.consume(0, 8));
+    QCOMPARE(bucket.waitTime(0), qint64(250));
+    QCOMPARE(bucket.waitTime(0, 3), qint64(750));
+    QCOMPARE(bucket.waitTime(500, 3), qint64(250));
+    // asking does not take anything
+    QCOMPARE(bucket.waitTime(750, 3), qint64(0));
+    QVERIFY(bucket.consume(750, 3));
+    QVERIFY(!bucket.consume(750));
+}
+
+void TestTokenBucket::setRateRefills() {
+    TokenBucket bucket(1, 1);
+    QVERIFY(bucket.consume(0));
+    QVERIFY(!bucket.consume(0));
+    bucket.setRate(1, 3);
+    for (int i = 0; i < 3; ++i) {
+        QVERIFY(bucket.consume(0));
+    }
+    QVERIFY(!bucket.consume(0));
+    bucket.setRate(0, 0);
+    QVERIFY(bucket.unlimited());
+    QVERIFY(bucket.consume(0));
+}
+
+QTEST_APPLESS_MAIN(TestTokenBucket)
+
+#include "tst_token_bucket.moc"
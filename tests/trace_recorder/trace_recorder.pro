@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of TraceRecorder, see server/trace_recorder.h
+#
+#-------------------------------------------------
+
+TARGET = tst_trace_recorder
+
+include(../tests.pri)
+
+SOURCES += tst_trace_recorder.cpp
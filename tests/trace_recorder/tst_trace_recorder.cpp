@@ -0,0 +1,255 @@
+/*
+Json Command Server
+
+TRACE RECORDER TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* TraceRecorder: sampling, trace ids, the Chrome trace export, clearing and
+ * wrapping rings, per-thread rings, and the spans a live server records for
+ * a relayed message. */
+
+#include "base_server.h"
+#include "test_client.h"
+#include "trace_recorder.h"
+
+#include <QFile>
+#include <QSet>
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include <thread>
+
+using JsonCommandServer::BaseServer;
+using JsonCommandServer::TraceRecorder;
+using namespace TestClient;
+
+namespace {
+
+const int TRACE_RING_SIZE = 8192;
+
+QJsonArray events(const QByteArray& trace) {
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(trace, &error);
+    QJsonArray spans;
+    QJsonArray all = doc.object()["traceEvents"].toArray();
+    for (int i = 0; i < all.size(); ++i) {
+        if (all[i].toObject()["ph"].toString() == "X") spans.append(all[i]);
+    }
+    return spans;
+}
+
+QJsonArray spansOf(const QJsonArray& spans, quint64 trace) {
+    QJsonArray out;
+    for (int i = 0; i < spans.size(); ++i) {
+        QJsonObject span = spans[i].toObject();
+        if (span["args"].toObject()["trace"].toString() == TraceRecorder::idToString(trace)) {
+            out.append(span);
+        }
+    }
+    return out;
+}
+
+}  // namespace
+
+class TestTraceRecorder : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void init();
+    void cleanup();
+    void sampling();
+    void ids();
+    void chromeTrace();
+    void clearDropsSpans();
+    void ringWraps();
+    void threadRings();
+    void relayedMessage();
+};
+
+void TestTraceRecorder::init() {
+    TraceRecorder::clear();
+}
+
+void TestTraceRecorder::cleanup() {
+    TraceRecorder::setSampling(0);
+}
+
+void TestTraceRecorder::sampling() {
+    TraceRecorder::setSampling(0);
+    QVERIFY(!TraceRecorder::enabled());
+    for (int i = 0; i < 10; ++i) QCOMPARE(TraceRecorder::sample(), quint64(0));
+
+    TraceRecorder::setSampling(4);
+    int sampled = 0;
+    for (int i = 0; i < 40; ++i) {
+        if (TraceRecorder::sample()) ++sampled;
+    }
+    QCOMPARE(sampled, 10);
+
+    TraceRecorder::setSampling(1);
+    for (int i = 0; i < 10; ++i) QVERIFY(TraceRecorder::sample() != 0);
+
+    TraceRecorder::setSampling(-3);
+    QCOMPARE(TraceRecorder::sampling(), 0);
+}
+
+void TestTraceRecorder::ids() {
+    QCOMPARE(TraceRecorder::idToString(0xab), QString("00000000000000ab"));
+    quint64 id = TraceRecorder::newId();
+    QVERIFY(id != 0);
+    QCOMPARE(TraceRecorder::idToString(id).size(), 16);
+    QCOMPARE(TraceRecorder::idFromJson(TraceRecorder::idToString(id)), id);
+    QCOMPARE(TraceRecorder::idFromJson(QJsonValue(171)), quint64(0));
+    QCOMPARE(TraceRecorder::idFromJson(QJsonValue(QString("not hex"))), quint64(0));
+}
+
+void TestTraceRecorder::chromeTrace() {
+    qint64 begin = TraceRecorder::now();
+    TraceRecorder::record(0x1234, "parse", begin, begin + 1500);
+    QByteArray trace = TraceRecorder::toChromeTrace("node-a");
+
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(trace, &error);
+    QCOMPARE(error.error, QJsonParseError::NoError);
+    QCOMPARE(doc.object()["displayTimeUnit"].toString(), QString("ns"));
+    QJsonArray all = doc.object()["traceEvents"].toArray();
+    QVERIFY(!all.isEmpty());
+    QJsonObject meta = all[0].toObject();
+    QCOMPARE(meta["ph"].toString(), QString("M"));
+    QCOMPARE(meta["args"].toObject()["name"].toString(), QString("node-a"));
+
+    QJsonArray spans = events(trace);
+    QCOMPARE(spans.size(), 1);
+    QJsonObject span = spans[0].toObject();
+    QCOMPARE(span["name"].toString(), QString("parse"));
+    QCOMPARE(span["dur"].toDouble(), 1.5);
+    QCOMPARE(span["pid"].toInt(), meta["pid"].toInt());
+    QCOMPARE(span["args"].toObject()["trace"].toString(), QString("0000000000001234"));
+    // wall clock, so traces of different nodes line up
+    qint64 now_us = QDateTime::currentMSecsSinceEpoch() * 1000;
+    QVERIFY(qAbs(qint64(span["ts"].toDouble()) - now_us) < 60 * 1000 * 1000);
+}
+
+void TestTraceRecorder::clearDropsSpans() {
+    qint64 t = TraceRecorder::now();
+    TraceRecorder::record(1, "parse", t, t);
+    TraceRecorder::clear();
+    TraceRecorder::record(2, "dispatch", t, t);
+    QJsonArray spans = events(TraceRecorder::toChromeTrace("node"));
+    QCOMPARE(spans.size(), 1);
+    QCOMPARE(spans[0].toObject()["name"].toString(), QString("dispatch"));
+}
+
+/* A full ring keeps its newest spans. */
+void TestTraceRecorder::ringWraps() {
+    qint64 t = TraceRecorder::now();
+    for (int i = 1; i <= TRACE_RING_SIZE + 100; ++i) {
+        TraceRecorder::record(quint64(i), "parse", t, t);
+    }
+    QJsonArray spans = events(TraceRecorder::toChromeTrace("node"));
+    QCOMPARE(spans.size(), TRACE_RING_SIZE);
+    QCOMPARE(spans[0].toObject()["args"].toObject()["trace"].toString(),
+             TraceRecorder::idToString(101));
+    QCOMPARE(spans[TRACE_RING_SIZE - 1].toObject()["args"].toObject()["trace"].toString(),
+             TraceRecorder::idToString(TRACE_RING_SIZE + 100));
+}
+
+void TestTraceRecorder::threadRings() {
+    qint64 t = TraceRecorder::now();
+    TraceRecorder::record(7, "parse", t, t);
+    std::thread other([t] { TraceRecorder::record(8, "dispatch", t, t); });
+    other.join();
+    QJsonArray spans = events(TraceRecorder::toChromeTrace("node"));
+    QJsonArray here = spansOf(spans, 7);
+    QJsonArray there = spansOf(spans, 8);
+    QCOMPARE(here.size(), 1);
+    QCOMPARE(there.size(), 1);
+    QVERIFY(here[0].toObject()["tid"].toInt() != there[0].toObject()["tid"].toInt());
+}
+
+/* Every stage of the hop through the server, under the id the sender set or
+ * one the server sampled, which the receiver gets along. */
+void TestTraceRecorder::relayedMessage() {
+    quint16 port = freePort();
+    BaseServer server;
+    server.setServerMode(true);
+    server.setVerbose(false);
+    server.setListenAddresses(QList<QHostAddress>() << QHostAddress(QHostAddress::LocalHost));
+    server.setPortServer(port);
+    server.setTraceSampling(1);
+    server.initServer();
+
+    QTcpSocket a;
+    QTcpSocket b;
+    QJsonObject status;
+    QVERIFY(connectTo(&a, port) && waitFor(&a, JsonCommandServer::MESSAGE_STATUS, &status));
+    QVERIFY(connectTo(&b, port) && waitFor(&b, JsonCommandServer::MESSAGE_STATUS, &status));
+
+    QJsonObject cmd;
+    cmd.insert("type", JsonCommandServer::MESSAGE_TO);
+    cmd.insert("from", "a");
+    cmd.insert("to", "@127.0.0.1:" + QString::number(b.localPort()));
+    cmd.insert("message", "sampled");
+    sendFrame(&a, QJsonArray() << cmd);
+    QJsonObject message;
+    QVERIFY(waitFor(&b, JsonCommandServer::MESSAGE_NORMAL, &message));
+    quint64 sampled = TraceRecorder::idFromJson(message["trace"]);
+    QVERIFY(sampled != 0);
+
+    cmd.insert("message", "given");
+    cmd.insert("trace", TraceRecorder::idToString(0xab));
+    sendFrame(&a, QJsonArray() << cmd);
+    QVERIFY(waitFor(&b, JsonCommandServer::MESSAGE_NORMAL, &message));
+    QCOMPARE(message["trace"].toString(), TraceRecorder::idToString(0xab));
+    QTest::qWait(50);  // socket_write ends once Qt hands the frame to the kernel
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    QString path = dir.filePath("trace.json");
+    QVERIFY(server.writeTrace(path));
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QJsonArray spans = events(file.readAll());
+    QVERIFY(!spansOf(spans, sampled).isEmpty());
+    QSet<QString> stages;
+    QJsonArray given = spansOf(spans, 0xab);
+    for (int i = 0; i < given.size(); ++i) {
+        stages.insert(given[i].toObject()["name"].toString());
+    }
+    QStringList expected;
+    expected << "parse" << "inbound" << "dispatch" << "send_queue" << "socket_write";
+    for (int i = 0; i < expected.size(); ++i) {
+        QVERIFY2(stages.contains(expected[i]), qPrintable(expected[i]));
+    }
+}
+
+QTEST_GUILESS_MAIN(TestTraceRecorder)
+
+#include "tst_trace_recorder.moc"
@@ -0,0 +1,267 @@
+/*
+Json Command Server
+
+URING ENGINE TESTS
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* UringEngine on a socket pair: multishot receive through recycled provided
+ * buffers, sends from memory and from reference counted slots, multishot
+ * accept, and EpollServer running on the ring. Skipped where the kernel
+ * has no usable io_uring. */
+
+#include "epoll_server.h"
+#include "test_client.h"
+#include "uring_engine.h"
+
+#include <QtTest>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using JsonCommandServer::EpollServer;
+using JsonCommandServer::UringEngine;
+using namespace TestClient;
+
+namespace {
+
+const unsigned N_BUFFERS = 16;
+const unsigned BUFFER_SIZE = 256;
+const unsigned N_SLOTS = 4;
+const unsigned SLOT_SIZE = 1024;
+
+/* The next completion, waiting on the ring fd for it. */
+bool nextCompletion(UringEngine* engine, UringEngine::Completion* done) {
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.elapsed() < TIMEOUT_MS) {
+        if (engine->reap(done, 1) == 1) return true;
+        pollfd p = { engine->fd(), POLLIN, 0 };
+        ::poll(&p, 1, 10);
+    }
+    return false;
+}
+
+QByteArray readAvailable(int fd, int size) {
+    QByteArray data(size, 0);
+    int got = 0;
+    while (got < size) {
+        pollfd p = { fd, POLLIN, 0 };
+        if (::poll(&p, 1, TIMEOUT_MS) <= 0) break;
+        ssize_t r = ::read(fd, data.data() + got, size - got);
+        if (r <= 0) break;
+        got += r;
+    }
+    data.resize(got);
+    return data;
+}
+
+}  // namespace
+
+class TestUringEngine : public QObject {
+    Q_OBJECT
+
+  private slots:
+    void init();
+    void cleanup();
+    void slotReferences();
+    void multishotReceive();
+    void sendFromMemory();
+    void sendFromSlot();
+    void multishotAccept();
+    void epollServerOnRing();
+
+  private:
+    UringEngine* engine_;
+    int pair_[2];
+};
+
+void TestUringEngine::init() {
+    engine_ = new UringEngine;
+    pair_[0] = pair_[1] = -1;
+    if (!engine_->init(64, N_BUFFERS, BUFFER_SIZE, N_SLOTS, SLOT_SIZE)) {
+        QSKIP(qPrintable(QString("no usable io_uring: %1").arg(strerror(engine_->error()))));
+    }
+    QCOMPARE(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair_), 0);
+}
+
+void TestUringEngine::cleanup() {
+    delete engine_;
+    if (pair_[0] >= 0) ::close(pair_[0]);
+    if (pair_[1] >= 0) ::close(pair_[1]);
+}
+
+void TestUringEngine::slotReferences() {
+    QCOMPARE(engine_->acquireSlot(SLOT_SIZE + 1), -1);
+    QList<int> held;
+    for (unsigned i = 0; i < N_SLOTS; ++i) {
+        int slot = engine_->acquireSlot(SLOT_SIZE);
+        QVERIFY(slot >= 0 && !held.contains(slot));
+        held.append(slot);
+    }
+    QCOMPARE(engine_->acquireSlot(1), -1);
+
+    // a retained slot is free again only after its last release
+    engine_->retainSlot(held[0]);
+    engine_->releaseSlot(held[0]);
+    QCOMPARE(engine_->acquireSlot(1), -1);
+    engine_->releaseSlot(held[0]);
+    QCOMPARE(engine_->acquireSlot(1), held[0]);
+}
+
+/* More messages than buffers: each one comes back recycled. */
+void TestUringEngine::multishotReceive() {
+    QVERIFY(engine_->recvMultishot(pair_[0], 7));
+    QVERIFY(engine_->submit() >= 0);
+    for (unsigned i = 0; i < 4 * N_BUFFERS; ++i) {
+        QByteArray message = QByteArray::number(i) + ":payload";
+        QCOMPARE(::write(pair_[1], message.constData(), message.size()), ssize_t(message.size()));
+        UringEngine::Completion done;
+        QVERIFY(nextCompletion(engine_, &done));
+        QCOMPARE(done.user_data, quint64(7));
+        QCOMPARE(done.res, qint32(message.size()));
+        QVERIFY(done.more());
+        int id = done.bufferId();
+        QVERIFY(id >= 0 && id < int(N_BUFFERS));
+        QCOMPARE(QByteArray(engine_->buffer(id), done.res), message);
+        engine_->recycleBuffer(id);
+        engine_->submit();
+    }
+}
+
+void TestUringEngine::sendFromMemory() {
+    QByteArray message("from memory");
+    QVERIFY(engine_->send(pair_[0], message.constData(), message.size(), 9));
+    QVERIFY(engine_->submit() >= 1);
+    UringEngine::Completion done;
+    QVERIFY(nextCompletion(engine_, &done));
+    QCOMPARE(done.user_data, quint64(9));
+    QCOMPARE(done.res, qint32(message.size()));
+    QCOMPARE(readAvailable(pair_[1], message.size()), message);
+}
+
+/* SEND_ZC: the send completes, then a notification says the slot may be
+ * reused. */
+void TestUringEngine::sendFromSlot() {
+    QByteArray message("from a registered slot");
+    int slot = engine_->acquireSlot(message.size());
+    QVERIFY(slot >= 0);
+    memcpy(engine_->slotData(slot), message.constData(), message.size());
+    QVERIFY(engine_->sendSlot(pair_[0], slot, 0, message.size(), 11));
+    QVERIFY(engine_->submit() >= 1);
+
+    bool sent = false;
+    bool notified = false;
+    UringEngine::Completion done;
+    while (!(sent && notified) && nextCompletion(engine_, &done)) {
+        QCOMPARE(done.user_data, quint64(11));
+        if (done.notification()) {
+            notified = true;
+        } else {
+            QCOMPARE(done.res, qint32(message.size()));
+            sent = true;
+            if (!done.more()) notified = true;
+        }
+    }
+    QVERIFY(sent && notified);
+    engine_->releaseSlot(slot);
+    QCOMPARE(readAvailable(pair_[1], message.size()), message);
+}
+
+void TestUringEngine::multishotAccept() {
+    int listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    QCOMPARE(::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    QCOMPARE(::listen(listen_fd, 8), 0);
+    socklen_t len = sizeof(addr);
+    ::getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+
+    QVERIFY(engine_->acceptMultishot(listen_fd, 13));
+    engine_->submit();
+    int clients[2];
+    for (int i = 0; i < 2; ++i) {
+        clients[i] = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        QCOMPARE(::connect(clients[i], reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    }
+    for (int i = 0; i < 2; ++i) {
+        UringEngine::Completion done;
+        QVERIFY(nextCompletion(engine_, &done));
+        QCOMPARE(done.user_data, quint64(13));
+        QVERIFY2(done.res >= 0, strerror(-done.res));
+        QVERIFY(done.more());
+        ::close(done.res);
+    }
+    ::close(clients[0]);
+    ::close(clients[1]);
+    ::close(listen_fd);
+}
+
+void TestUringEngine::epollServerOnRing() {
+    EpollServer server;
+    quint16 port = freePort();
+    server.setPortServer(port);
+    server.setIoEngine(EpollServer::IO_URING);
+    server.initServer();
+    if (server.ioEngine() != EpollServer::IO_URING) {
+        QSKIP("EpollServer fell back to epoll");
+    }
+
+    QTcpSocket a;
+    QTcpSocket b;
+    QJsonObject status;
+    QVERIFY(connectTo(&a, port) && waitFor(&a, JsonCommandServer::MESSAGE_STATUS, &status));
+    QVERIFY(connectTo(&b, port) && waitFor(&b, JsonCommandServer::MESSAGE_STATUS, &status));
+
+    // more frames than provided buffers and larger than one of them
+    QJsonObject cmd;
+    cmd.insert("type", JsonCommandServer::MESSAGE_TO);
+    cmd.insert("from", "test");
+    cmd.insert("to", "@127.0.0.1:" + QString::number(b.localPort()));
+    const int n = 100;
+    for (int i = 0; i < n; ++i) {
+        cmd.insert("message", QString::number(i) + QString(i % 3 == 0 ? 4000 : 10, QChar('x')));
+        sendFrame(&a, QJsonArray() << cmd);
+    }
+    for (int i = 0; i < n; ++i) {
+        QJsonObject message;
+        QVERIFY(waitFor(&b, JsonCommandServer::MESSAGE_NORMAL, &message));
+        QVERIFY(message["message"].toString().startsWith(QString::number(i) + "x"));
+    }
+    QCOMPARE(server.ioStats()["engine"].toString(), QString("io_uring"));
+}
+
+QTEST_GUILESS_MAIN(TestUringEngine)
+
+#include "tst_uring_engine.moc"
@@ -0,0 +1,11 @@
+#-------------------------------------------------
+#
+# Unit tests of UringEngine, see server/uring_engine.h
+#
+#-------------------------------------------------
+
+TARGET = tst_uring_engine
+
+include(../tests.pri)
+
+SOURCES += tst_uring_engine.cpp
@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# Connection-establishment benchmark for BaseServer
+#
+#-------------------------------------------------
+
+QT       += network
+QT       -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = connect_bench
+TEMPLATE = app
+
+SOURCES += main.cpp
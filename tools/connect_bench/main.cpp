@@ -0,0 +1,158 @@
+/*
+Json Command Server
+
+CONNECTION BENCHMARK
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Opens `total` connections to a running server, at most `concurrency` of
+ * them in the handshake at once, and reports how fast they are established.
+ * A connection counts as established when the server's first frame (the
+ * "conectado" status) has arrived, so deferred handshakes are included.
+ * Connections are kept open until the end, like devices coming back after a
+ * network blip.
+ *
+ *     connect_bench <host> <port> [total=1000] [concurrency=200]
+ */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QHostAddress>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QVector>
+
+#include <algorithm>
+
+class ConnectBench : public QObject {
+    Q_OBJECT
+
+  public:
+    ConnectBench(const QString& host, quint16 port, int total, int concurrency)
+        : host_(host), port_(port), total_(total), concurrency_(concurrency),
+          started_(0), in_flight_(0), established_(0), failed_(0) {}
+
+    void start() {
+        clock_.start();
+        while (in_flight_ < concurrency_ && started_ < total_) {
+            openNext();
+        }
+    }
+
+  private slots:
+    void receiveFrame() {
+        QTcpSocket* socket = static_cast<QTcpSocket*>(sender());
+        if (socket->bytesAvailable() < 4) return;
+        QByteArray header = socket->peek(4);
+        qint32 size = (qint32(quint8(header[0])) << 24) | (qint32(quint8(header[1])) << 16) |
+                      (qint32(quint8(header[2])) << 8) | qint32(quint8(header[3]));
+        if (socket->bytesAvailable() < 4 + size) return;
+        disconnect(socket, 0, this, 0);
+        latencies_.append(clock_.nsecsElapsed() / 1000 - start_us_.take(socket));
+        ++established_;
+        finishOne();
+    }
+
+    void connectionFailed(QAbstractSocket::SocketError) {
+        QTcpSocket* socket = static_cast<QTcpSocket*>(sender());
+        disconnect(socket, 0, this, 0);
+        start_us_.remove(socket);
+        ++failed_;
+        finishOne();
+    }
+
+  private:
+    void openNext() {
+        QTcpSocket* socket = new QTcpSocket(this);
+        start_us_.insert(socket, clock_.nsecsElapsed() / 1000);
+        connect(socket, SIGNAL(readyRead()), this, SLOT(receiveFrame()));
+        connect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+                this, SLOT(connectionFailed(QAbstractSocket::SocketError)));
+        ++started_;
+        ++in_flight_;
+        socket->connectToHost(host_, port_);
+    }
+
+    void finishOne() {
+        --in_flight_;
+        if (started_ < total_) {
+            openNext();
+        } else if (in_flight_ == 0) {
+            report();
+            QCoreApplication::quit();
+        }
+    }
+
+    void report() {
+        double seconds = clock_.nsecsElapsed() / 1e9;
+        std::sort(latencies_.begin(), latencies_.end());
+        QTextStream out(stdout);
+        out << "established: " << established_ << "  failed: " << failed_
+            << "  elapsed: " << seconds << " s\n";
+        out << "rate: " << (seconds > 0 ? established_ / seconds : 0.0) << " connections/s\n";
+        if (!latencies_.isEmpty()) {
+            out << "handshake p50: " << percentile(0.50) << " us  p99: " << percentile(0.99)
+                << " us  max: " << latencies_.last() << " us\n";
+        }
+    }
+
+    qint64 percentile(double p) const {
+        int i = qMin(latencies_.size() - 1, int(p * latencies_.size()));
+        return latencies_[i];
+    }
+
+    QString host_;
+    quint16 port_;
+    int total_;
+    int concurrency_;
+    int started_;
+    int in_flight_;
+    int established_;
+    int failed_;
+    QElapsedTimer clock_;
+    QHash<QTcpSocket*, qint64> start_us_;
+    QVector<qint64> latencies_;
+};
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    if (args.size() < 3) {
+        QTextStream(stderr) << "usage: connect_bench <host> <port> [total] [concurrency]\n";
+        return 1;
+    }
+    int total = args.size() > 3 ? args[3].toInt() : 1000;
+    int concurrency = args.size() > 4 ? args[4].toInt() : 200;
+    ConnectBench bench(args[1], quint16(args[2].toInt()), qMax(1, total), qMax(1, concurrency));
+    bench.start();
+    return app.exec();
+}
+
+#include "main.moc"
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Round trip latency over TCP loopback, Unix domain sockets and shared memory
+#
+#-------------------------------------------------
+
+QT       += network
+QT       -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = local_latency
+TEMPLATE = app
+
+INCLUDEPATH += ../.. ../../server
+LIBS += -L../.. -lJsonCommandServer
+
+SOURCES += main.cpp
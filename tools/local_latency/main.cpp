@@ -0,0 +1,336 @@
+/*
+Json Command Server
+
+LOCAL LATENCY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Round trip latency of a client on the server's host over TCP loopback, a
+ * Unix domain socket and shared memory, against one BaseServer listening on
+ * all three. Each client identifies, then sends MESSAGE_TO frames addressed to
+ * itself one at a time, the next one after the echo came back, so every sample
+ * is a full trip through the server's framing, routing and send queue. Before
+ * measuring, each client also sends one message to the next one, to check that
+ * routing works across transports.
+ *
+ * The clients run on their own thread and block: plain sockets for TCP and
+ * Unix, ShmSocket's waitForReadyRead() for shared memory, which spins briefly
+ * before sleeping on its eventfd.
+ *
+ *     local_latency [port=47100] [round_trips=20000] [payload=64]
+ */
+
+#include "base_server.h"
+#include "local_listener.h"
+#include "shm_socket.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QThread>
+
+#include <algorithm>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace JsonCommandServer;
+
+static const int N_WARMUP = 1000;
+static const int READ_TIMEOUT_MS = 5000;
+
+class LatencyServer : public BaseServer {
+  public:
+    virtual void addIdentify(const QJsonObject& cmd) {
+        RemoteNodeInfo info;
+        info.IP = cmd["ip"].toString();
+        info.port = cmd["port"].toInt();
+        info.id = cmd["id_client"].toInt();
+        info.group = cmd["group_client"].toInt();
+        info.name = cmd["name_client"].toString();
+        info.type = cmd["type_client"].toString();
+        this->addNewInfo(info);
+    }
+};
+
+static QByteArray frameOf(const QJsonArray& cmd) {
+    QByteArray data = QJsonDocument(cmd).toJson(QJsonDocument::Compact);
+    QByteArray frame(4, 0);
+    frame[0] = char(data.size() >> 24);
+    frame[1] = char(data.size() >> 16);
+    frame[2] = char(data.size() >> 8);
+    frame[3] = char(data.size());
+    return frame + data;
+}
+
+/* A blocking client connection, whatever carries it. */
+class Link {
+  public:
+    virtual ~Link() {}
+    virtual bool send(const QByteArray& data) = 0;
+    virtual bool receive(char* p, qint64 size) = 0;
+
+    bool readFrame(QByteArray& frame) {
+        uchar header[4];
+        if (!receive(reinterpret_cast<char*>(header), 4)) return false;
+        qint32 size = (qint32(header[0]) << 24) | (qint32(header[1]) << 16) |
+                      (qint32(header[2]) << 8) | qint32(header[3]);
+        frame.resize(size);
+        return receive(frame.data(), size);
+    }
+
+    QString peer;
+};
+
+class FdLink : public Link {
+  public:
+    explicit FdLink(int fd) : fd_(fd) {}
+    virtual ~FdLink() { ::close(fd_); }
+
+    virtual bool send(const QByteArray& data) {
+        const char* p = data.constData();
+        qint64 left = data.size();
+        while (left > 0) {
+            ssize_t w = ::send(fd_, p, left, MSG_NOSIGNAL);
+            if (w <= 0) return false;
+            p += w;
+            left -= w;
+        }
+        return true;
+    }
+
+    virtual bool receive(char* p, qint64 size) {
+        while (size > 0) {
+            ssize_t r = ::recv(fd_, p, size, 0);
+            if (r <= 0) return false;
+            p += r;
+            size -= r;
+        }
+        return true;
+    }
+
+  private:
+    int fd_;
+};
+
+class ShmLink : public Link {
+  public:
+    explicit ShmLink(ShmSocket* socket) : socket_(socket) {}
+    virtual ~ShmLink() { delete socket_; }
+
+    virtual bool send(const QByteArray& data) {
+        if (socket_->write(data) != data.size()) return false;
+        return socket_->bytesToWrite() == 0 || socket_->waitForBytesWritten(READ_TIMEOUT_MS);
+    }
+
+    virtual bool receive(char* p, qint64 size) {
+        while (size > 0) {
+            if (socket_->bytesAvailable() == 0 && !socket_->waitForReadyRead(READ_TIMEOUT_MS)) {
+                return false;
+            }
+            qint64 r = socket_->read(p, size);
+            if (r < 0) return false;
+            p += r;
+            size -= r;
+        }
+        return true;
+    }
+
+  private:
+    ShmSocket* socket_;
+};
+
+static Link* connectTcp(quint16 port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return 0;
+    }
+    return new FdLink(fd);
+}
+
+static Link* connectUnix(const QString& path) {
+    int fd = connectLocalSocket(path, 0);
+    return fd < 0 ? 0 : new FdLink(fd);
+}
+
+static Link* connectShm(const QString& path) {
+    ShmSocket* socket = ShmSocket::connectTo(path, 0);
+    return socket ? new ShmLink(socket) : 0;
+}
+
+/* Identifies as `name` and learns the full peer name from the peer lists. */
+static bool identify(Link& link, const QString& name) {
+    QJsonObject identify;
+    identify.insert("type", MESSAGE_IDENTIFY);
+    identify.insert("name_client", name);
+    QJsonArray cmd;
+    cmd.append(identify);
+    if (!link.send(frameOf(cmd))) return false;
+    QByteArray frame;
+    while (link.peer.isEmpty() && link.readFrame(frame)) {
+        QJsonArray in = QJsonDocument::fromJson(frame).array();
+        QJsonArray peers = in.isEmpty() ? QJsonArray() : in[0].toObject()["peers"].toArray();
+        for (int k = 0; k < peers.size(); ++k) {
+            if (peers[k].toString().startsWith(name + "@")) link.peer = peers[k].toString();
+        }
+    }
+    return !link.peer.isEmpty();
+}
+
+static QByteArray messageTo(const QString& from, const QString& to, const QString& message) {
+    QJsonObject echo;
+    echo.insert("type", MESSAGE_TO);
+    echo.insert("from", from);
+    echo.insert("to", to);
+    echo.insert("message", message);
+    QJsonArray cmd;
+    cmd.append(echo);
+    return frameOf(cmd);
+}
+
+/* Reads until the frame carrying `marker`; peer lists may come in between. */
+static bool awaitMessage(Link& link, const QByteArray& marker) {
+    QByteArray frame;
+    while (link.readFrame(frame)) {
+        if (frame.contains(marker)) return true;
+    }
+    return false;
+}
+
+static bool measure(Link& link, int round_trips, int payload, std::vector<qint64>& rtts) {
+    QString message = "lat" + QString(payload, QChar('x'));
+    QByteArray frame = messageTo(link.peer, link.peer, message);
+    QByteArray marker = "\"lat";
+    QElapsedTimer clock;
+    clock.start();
+    for (int i = 0; i < N_WARMUP + round_trips; ++i) {
+        qint64 begin = clock.nsecsElapsed();
+        if (!link.send(frame) || !awaitMessage(link, marker)) return false;
+        if (i >= N_WARMUP) rtts.push_back(clock.nsecsElapsed() - begin);
+    }
+    return true;
+}
+
+static double percentile(std::vector<qint64> values, double p) {
+    if (values.empty()) return 0;
+    size_t k = std::min(values.size() - 1, size_t(p * (values.size() - 1) + 0.5));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k] / 1e3;
+}
+
+static void report(const char* transport, const std::vector<qint64>& rtts, bool ok) {
+    QTextStream out(stdout);
+    out << transport << ": ";
+    if (!ok) {
+        out << "failed\n";
+        return;
+    }
+    qint64 total = 0;
+    for (size_t i = 0; i < rtts.size(); ++i) total += rtts[i];
+    out << "rtt_us p50 " << percentile(rtts, 0.5)
+        << " p90 " << percentile(rtts, 0.9)
+        << " p99 " << percentile(rtts, 0.99)
+        << " max " << percentile(rtts, 1.0)
+        << " mean " << (rtts.empty() ? 0.0 : total / 1e3 / rtts.size())
+        << " (" << qint64(rtts.size()) << " round trips)\n";
+}
+
+/* A QThread rather than a std::thread: ShmSocket creates socket notifiers,
+ * which need a thread with an event dispatcher even if it never runs it. */
+class ClientThread : public QThread {
+  public:
+    ClientThread(quint16 port, const QString& local_path, const QString& shm_path,
+                 int round_trips, int payload)
+        : port_(port), local_path_(local_path), shm_path_(shm_path),
+          round_trips_(round_trips), payload_(payload) {}
+
+  protected:
+    virtual void run() {
+        const char* names[3] = {"tcp", "unix", "shm"};
+        Link* links[3] = {connectTcp(port_), connectUnix(local_path_), connectShm(shm_path_)};
+        bool ok[3];
+        for (int i = 0; i < 3; ++i) ok[i] = links[i] && identify(*links[i], names[i]);
+        QTextStream out(stdout);
+        // each transport to the next one: tcp -> unix -> shm -> tcp
+        for (int i = 0; i < 3; ++i) {
+            int j = (i + 1) % 3;
+            if (!ok[i] || !ok[j]) continue;
+            bool routed = links[i]->send(messageTo(links[i]->peer, links[j]->peer, "cross")) &&
+                          awaitMessage(*links[j], "\"cross\"");
+            out << names[i] << " -> " << names[j] << ": " << (routed ? "ok" : "failed") << "\n";
+            out.flush();
+        }
+        for (int i = 0; i < 3; ++i) {
+            std::vector<qint64> rtts;
+            bool measured = ok[i] && measure(*links[i], round_trips_, payload_, rtts);
+            report(names[i], rtts, measured);
+            delete links[i];
+        }
+        QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+    }
+
+  private:
+    quint16 port_;
+    QString local_path_;
+    QString shm_path_;
+    int round_trips_;
+    int payload_;
+};
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    quint16 port = args.size() > 1 ? quint16(args[1].toInt()) : 47100;
+    int round_trips = args.size() > 2 ? args[2].toInt() : 20000;
+    int payload = args.size() > 3 ? args[3].toInt() : 64;
+    QString base = QString("/tmp/local_latency_%1").arg(::getpid());
+    LatencyServer server;
+    server.setPortServer(port);
+    server.setLocalPath(base + ".sock");
+    server.setSharedMemoryPath(base + ".shm");
+    server.initServer();
+    ClientThread clients(port, base + ".sock", base + ".shm", round_trips, payload);
+    clients.start();
+    QCoreApplication::exec();
+    clients.wait();
+    server.closeServer();
+    return 0;
+}
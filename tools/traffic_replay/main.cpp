@@ -0,0 +1,493 @@
+/*
+Json Command Server
+
+TRAFFIC REPLAY
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Plays a trace written by BaseServer::startCapture() back against a server,
+ * so builds can be compared under the traffic they really get.
+ *
+ *     traffic_replay <trace> [host=127.0.0.1] [port=47000] [speed=1] [--flat]
+ *
+ * speed multiplies the captured pace (10 = ten times faster), "max" sends
+ * everything as fast as the server takes it. --flat keeps the average rate of
+ * the capture but spaces its records evenly, without the bursts.
+ *
+ * Every captured connection gets its own socket, opened, fed and closed at its
+ * recorded time; what the server answers is read and counted. Server to
+ * server frames (negative types) are left out, and identifications do not ask
+ * for v2 framing or datagrams: the replay speaks v1 over TCP only. Stream
+ * bodies are not in traces, so connections that sent a stream are left out
+ * too, and counted in the report. Latency is taken by a separate
+ * probe connection sending a MESSAGE_TO to itself every PROBE_INTERVAL_MS
+ * during the replay: the report gives the round trips of those echoes, the
+ * achieved send rate and how far the sends fell behind the schedule. */
+
+#include "commands_controller.h"
+#include "frame_codec.h"
+#include "traffic_capture.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStringList>
+#include <QTextStream>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace JsonCommandServer;
+
+static const qint64 PROBE_INTERVAL_MS = 10;
+static const qint64 DRAIN_TIMEOUT_MS = 2000;
+static const int READ_CHUNK_SIZE = 64 * 1024;
+
+struct Event {
+    qint64 at_ns;
+    int kind;
+    quint32 connection;
+    QByteArray frame;  // with its length prefix
+};
+
+struct Connection {
+    Connection() : fd(-1), out_pos(0), closing(false) {}
+
+    int fd;
+    QByteArray out;
+    int out_pos;
+    QByteArray in;
+    bool closing;
+};
+
+struct Stats {
+    Stats()
+        : frames_sent(0), bytes_sent(0), frames_received(0), connections(0), failed(0),
+          streaming(0) {}
+
+    qint64 frames_sent;
+    qint64 bytes_sent;
+    qint64 frames_received;
+    int connections;
+    int failed;
+    int streaming;  // left out, they sent streams
+    std::vector<qint64> lag_ns;
+    std::vector<qint64> rtt_ns;
+};
+
+static QByteArray frameOf(const QByteArray& data) {
+    QByteArray frame(4, 0);
+    frame[0] = char(data.size() >> 24);
+    frame[1] = char(data.size() >> 16);
+    frame[2] = char(data.size() >> 8);
+    frame[3] = char(data.size());
+    return frame + data;
+}
+
+static QByteArray frameOf(const QJsonArray& cmd) {
+    return frameOf(QJsonDocument(cmd).toJson(QJsonDocument::Compact));
+}
+
+static bool serverInternal(const QByteArray& data) {
+    QJsonArray cmds = QJsonDocument::fromJson(data).array();
+    for (int i = 0; i < cmds.size(); ++i) {
+        if (cmds[i].toObject()["type"].toInt() < 0 &&
+                cmds[i].toObject()["type"].toInt() != CLOSE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The frame without what a MESSAGE_IDENTIFY asks beyond v1 over TCP; as
+ * captured when there is nothing to drop. */
+static QByteArray replayable(const QByteArray& data) {
+    QJsonArray cmds = QJsonDocument::fromJson(data).array();
+    bool changed = false;
+    for (int i = 0; i < cmds.size(); ++i) {
+        QJsonObject cmd = cmds[i].toObject();
+        if (cmd["type"].toInt() != MESSAGE_IDENTIFY ||
+                (!cmd.contains("frame_version") && !cmd.contains("datagrams"))) {
+            continue;
+        }
+        cmd.remove("frame_version");
+        cmd.remove("datagrams");
+        cmds[i] = cmd;
+        changed = true;
+    }
+    return changed ? QJsonDocument(cmds).toJson(QJsonDocument::Compact) : data;
+}
+
+/* Reads the trace and lays its records out on the replay clock, without the
+ * connections that sent streams. */
+static bool loadTrace(const QString& path, double speed, bool flat, std::vector<Event>& events,
+                      int& skipped) {
+    CaptureReader reader;
+    if (!reader.open(path)) return false;
+    CaptureRecord record;
+    std::set<quint32> streaming;
+    while (reader.next(record)) {
+        if (record.kind == CAPTURE_STREAM) streaming.insert(record.connection);
+        if (record.kind == CAPTURE_STREAM ||
+                (record.kind == CAPTURE_FRAME && serverInternal(record.data))) {
+            continue;
+        }
+        Event event;
+        event.at_ns = record.time_ns;
+        event.kind = record.kind;
+        event.connection = record.connection;
+        if (record.kind == CAPTURE_FRAME) event.frame = frameOf(replayable(record.data));
+        events.push_back(event);
+    }
+    skipped = static_cast<int>(streaming.size());
+    if (skipped > 0) {
+        size_t kept = 0;
+        for (size_t i = 0; i < events.size(); ++i) {
+            if (!streaming.count(events[i].connection)) events[kept++] = events[i];
+        }
+        events.resize(kept);
+    }
+    if (events.empty()) return true;
+    qint64 first = events.front().at_ns;
+    qint64 span = events.back().at_ns - first;
+    for (size_t i = 0; i < events.size(); ++i) {
+        qint64 at = events[i].at_ns - first;
+        if (flat) {
+            at = events.size() > 1 ? qint64(double(span) * i / (events.size() - 1)) : 0;
+        }
+        events[i].at_ns = speed > 0 ? qint64(at / speed) : 0;
+    }
+    return true;
+}
+
+static int connectTo(const sockaddr_storage& addr, socklen_t len) {
+    int fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), len) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* Sends what the socket takes; false when the connection failed. */
+static bool flushOut(Connection& c, Stats& stats) {
+    while (c.out_pos < c.out.size()) {
+        ssize_t w = ::send(c.fd, c.out.constData() + c.out_pos, c.out.size() - c.out_pos,
+                           MSG_NOSIGNAL);
+        if (w > 0) {
+            c.out_pos += w;
+            stats.bytes_sent += w;
+        } else if (w < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+    c.out.resize(0);
+    c.out_pos = 0;
+    return true;
+}
+
+/* Reads what arrived and splits it into v1 frames; false on EOF or error, or
+ * when the server sends something else. */
+static bool readIn(Connection& c, QList<QByteArray>* frames, qint64& n_frames) {
+    for (;;) {
+        int old_size = c.in.size();
+        c.in.resize(old_size + READ_CHUNK_SIZE);
+        ssize_t r = ::recv(c.fd, c.in.data() + old_size, READ_CHUNK_SIZE, 0);
+        c.in.resize(old_size + qMax<ssize_t>(r, 0));
+        if (r == 0) return false;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            break;
+        }
+    }
+    int pos = 0;
+    while (c.in.size() - pos >= 4) {
+        const uchar* p = reinterpret_cast<const uchar*>(c.in.constData() + pos);
+        qint32 size = (qint32(p[0]) << 24) | (qint32(p[1]) << 16) | (qint32(p[2]) << 8) |
+                      qint32(p[3]);
+        if (p[0] == FRAME_V2_MAGIC || size < 0) return false;
+        if (c.in.size() - pos - 4 < size) break;
+        if (frames) frames->append(c.in.mid(pos + 4, size));
+        pos += 4 + size;
+        ++n_frames;
+    }
+    c.in.remove(0, pos);
+    return true;
+}
+
+static double percentile(std::vector<qint64> values, double p) {
+    if (values.empty()) return 0;
+    size_t k = std::min(values.size() - 1, size_t(p * (values.size() - 1) + 0.5));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k] / 1e6;
+}
+
+static void report(const Stats& stats, qint64 nsecs, qint64 schedule_ns) {
+    QTextStream out(stdout);
+    double seconds = nsecs / 1e9;
+    out << "duration_s: " << seconds << " (schedule " << schedule_ns / 1e9 << ")\n";
+    out << "connections: " << stats.connections << " (" << stats.failed << " failed, "
+        << stats.streaming << " left out for sending streams)\n";
+    out << "frames_sent: " << stats.frames_sent << "\n";
+    out << "frames_received: " << stats.frames_received << "\n";
+    out << "send_rate: " << (seconds > 0 ? stats.frames_sent / seconds : 0.0) << " frames/s, "
+        << (seconds > 0 ? stats.bytes_sent / seconds / 1e6 : 0.0) << " MB/s\n";
+    out << "schedule_lag_ms: p50 " << percentile(stats.lag_ns, 0.5)
+        << " p99 " << percentile(stats.lag_ns, 0.99)
+        << " max " << percentile(stats.lag_ns, 1.0) << "\n";
+    out << "probe_rtt_ms: n " << qint64(stats.rtt_ns.size())
+        << " p50 " << percentile(stats.rtt_ns, 0.5)
+        << " p90 " << percentile(stats.rtt_ns, 0.9)
+        << " p99 " << percentile(stats.rtt_ns, 0.99)
+        << " max " << percentile(stats.rtt_ns, 1.0) << "\n";
+}
+
+/* Identifies the probe and learns its full peer name from the peer lists. */
+static QString identifyProbe(int fd) {
+    QJsonObject identify;
+    identify.insert("type", MESSAGE_IDENTIFY);
+    identify.insert("name_client", QString("replay-probe"));
+    QJsonArray cmd;
+    cmd.append(identify);
+    Connection probe;
+    probe.fd = fd;
+    probe.out = frameOf(cmd);
+    Stats ignored;
+    QElapsedTimer clock;
+    clock.start();
+    while (clock.elapsed() < DRAIN_TIMEOUT_MS) {
+        if (!flushOut(probe, ignored)) return QString();
+        pollfd p = { fd, POLLIN, 0 };
+        ::poll(&p, 1, 100);
+        QList<QByteArray> frames;
+        qint64 n = 0;
+        if (!readIn(probe, &frames, n)) return QString();
+        for (int i = 0; i < frames.size(); ++i) {
+            QJsonArray in = QJsonDocument::fromJson(frames[i]).array();
+            QJsonArray peers = in.isEmpty() ? QJsonArray() : in[0].toObject()["peers"].toArray();
+            for (int k = 0; k < peers.size(); ++k) {
+                if (peers[k].toString().startsWith("replay-probe@")) return peers[k].toString();
+            }
+        }
+    }
+    return QString();
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    bool flat = args.removeAll("--flat") > 0;
+    if (args.size() < 2) {
+        QTextStream(stderr) << "usage: traffic_replay <trace> [host=127.0.0.1] [port=47000] "
+                               "[speed=1|N|max] [--flat]\n";
+        return 2;
+    }
+    QString host = args.size() > 2 ? args[2] : QString("127.0.0.1");
+    QString port = args.size() > 3 ? args[3] : QString("47000");
+    QString speed_arg = args.size() > 4 ? args[4] : QString("1");
+    double speed = speed_arg == "max" ? 0 : speed_arg.toDouble();
+    if (speed_arg != "max" && speed <= 0) speed = 1;
+
+    std::vector<Event> events;
+    int streaming = 0;
+    if (!loadTrace(args[1], speed, flat, events, streaming)) {
+        QTextStream(stderr) << "cannot read trace " << args[1] << "\n";
+        return 1;
+    }
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* resolved = 0;
+    if (::getaddrinfo(host.toUtf8().constData(), port.toUtf8().constData(), &hints, &resolved) != 0) {
+        QTextStream(stderr) << "cannot resolve " << host << "\n";
+        return 1;
+    }
+    sockaddr_storage addr;
+    socklen_t addr_len = resolved->ai_addrlen;
+    memcpy(&addr, resolved->ai_addr, addr_len);
+    ::freeaddrinfo(resolved);
+
+    Connection probe;
+    probe.fd = connectTo(addr, addr_len);
+    QString probe_name = probe.fd >= 0 ? identifyProbe(probe.fd) : QString();
+    if (probe_name.isEmpty()) {
+        QTextStream(stderr) << "cannot reach the server at " << host << ":" << port << "\n";
+        return 1;
+    }
+
+    Stats stats;
+    stats.streaming = streaming;
+    std::map<quint32, Connection> connections;
+    std::map<int, qint64> probes_sent;
+    int probe_seq = 0;
+    size_t cursor = 0;
+    qint64 schedule_ns = events.empty() ? 0 : events.back().at_ns;
+    QElapsedTimer clock;
+    clock.start();
+    qint64 next_probe_ns = 0;
+    qint64 drained_at_ns = -1;
+    std::vector<pollfd> polled;
+    std::vector<Connection*> polled_connections;
+    for (;;) {
+        qint64 now = clock.nsecsElapsed();
+        for (; cursor < events.size() && events[cursor].at_ns <= now; ++cursor) {
+            const Event& event = events[cursor];
+            Connection& c = connections[event.connection];
+            if (event.kind == CAPTURE_CLOSE) {
+                c.closing = true;
+                continue;
+            }
+            if (c.fd < 0 && !c.closing) {
+                c.fd = connectTo(addr, addr_len);
+                ++stats.connections;
+                if (c.fd < 0) {
+                    ++stats.failed;
+                    c.closing = true;
+                }
+            }
+            if (event.kind == CAPTURE_FRAME && c.fd >= 0) {
+                c.out.append(event.frame);
+                ++stats.frames_sent;
+                stats.lag_ns.push_back(now - event.at_ns);
+            }
+        }
+        if (now >= next_probe_ns) {
+            QJsonObject echo;
+            echo.insert("type", MESSAGE_TO);
+            echo.insert("from", probe_name);
+            echo.insert("to", probe_name);
+            echo.insert("message", QString("probe:%1").arg(++probe_seq));
+            QJsonArray cmd;
+            cmd.append(echo);
+            probe.out.append(frameOf(cmd));
+            probes_sent[probe_seq] = now;
+            next_probe_ns = now + PROBE_INTERVAL_MS * 1000000;
+        }
+        polled.clear();
+        polled_connections.clear();
+        bool pending_out = false;
+        for (std::map<quint32, Connection>::iterator it = connections.begin();
+                it != connections.end(); ++it) {
+            Connection& c = it->second;
+            if (c.fd < 0) continue;
+            if (!flushOut(c, stats)) {
+                ::close(c.fd);
+                c.fd = -1;
+                ++stats.failed;
+                continue;
+            }
+            if (c.closing && c.out.isEmpty()) {
+                ::close(c.fd);
+                c.fd = -1;
+                continue;
+            }
+            pollfd p = { c.fd, short(POLLIN | (c.out.isEmpty() ? 0 : POLLOUT)), 0 };
+            pending_out = pending_out || !c.out.isEmpty();
+            polled.push_back(p);
+            polled_connections.push_back(&c);
+        }
+        Stats probe_stats;
+        flushOut(probe, probe_stats);
+        pollfd p = { probe.fd, short(POLLIN | (probe.out.isEmpty() ? 0 : POLLOUT)), 0 };
+        polled.push_back(p);
+        polled_connections.push_back(&probe);
+
+        bool done = cursor == events.size() && !pending_out;
+        if (done && drained_at_ns < 0) drained_at_ns = now;
+        if (done && (probes_sent.empty() || now - drained_at_ns > DRAIN_TIMEOUT_MS * 1000000)) {
+            break;
+        }
+        qint64 wake_ns = next_probe_ns;
+        if (cursor < events.size()) wake_ns = qMin(wake_ns, events[cursor].at_ns);
+        int timeout_ms = int(qMax<qint64>(0, (wake_ns - now) / 1000000));
+        ::poll(&polled[0], polled.size(), timeout_ms);
+
+        for (size_t i = 0; i < polled.size(); ++i) {
+            if (!(polled[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            Connection& c = *polled_connections[i];
+            QList<QByteArray> frames;
+            bool is_probe = &c == &probe;
+            qint64 received = 0;
+            bool open = readIn(c, is_probe ? &frames : 0, received);
+            if (!is_probe) stats.frames_received += received;
+            for (int k = 0; k < frames.size(); ++k) {
+                int at = frames[k].indexOf("probe:");
+                if (at < 0) continue;
+                int end = frames[k].indexOf('"', at);
+                int seq = frames[k].mid(at + 6, end - at - 6).toInt();
+                std::map<int, qint64>::iterator sent = probes_sent.find(seq);
+                if (sent == probes_sent.end()) continue;
+                stats.rtt_ns.push_back(clock.nsecsElapsed() - sent->second);
+                probes_sent.erase(sent);
+            }
+            if (!open) {
+                if (is_probe) {
+                    QTextStream(stderr) << "the server closed the probe connection\n";
+                    report(stats, clock.nsecsElapsed(), schedule_ns);
+                    return 1;
+                }
+                ::close(c.fd);
+                c.fd = -1;
+            }
+        }
+        // probes are only taken while the replay runs
+        if (done) next_probe_ns = std::numeric_limits<qint64>::max();
+    }
+    qint64 elapsed = drained_at_ns > 0 ? drained_at_ns : clock.nsecsElapsed();
+    for (std::map<quint32, Connection>::iterator it = connections.begin();
+            it != connections.end(); ++it) {
+        if (it->second.fd >= 0) ::close(it->second.fd);
+    }
+    ::close(probe.fd);
+    report(stats, elapsed, schedule_ns);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Replays a BaseServer traffic capture and reports throughput and latency
+#
+#-------------------------------------------------
+
+QT       += network
+QT       -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = traffic_replay
+TEMPLATE = app
+
+INCLUDEPATH += ../.. ../../server
+LIBS += -L../.. -lJsonCommandServer
+
+SOURCES += main.cpp
@@ -0,0 +1,368 @@
+/*
+Json Command Server
+
+TRANSPORT BENCHMARK
+
+Copyright (c) 2015, gogo40, Péricles Lopes Machado <pericles.raskolnikoff@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this
+list of conditions and the following disclaimer in the documentation and/or other
+materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its contributors may
+be used to endorse or promote products derived from this software without specific
+prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Runs a BaseServer and an EpollServer, on epoll and on io_uring, one after
+ * the other in this process and drives each with the same load: `clients`
+ * connections that each send `window` MESSAGE_TO frames addressed to
+ * themselves per round and wait for the echoes. The load generator uses plain
+ * blocking sockets on its own thread, so it costs the same against every
+ * transport.
+ *
+ * Every run reports what the server thread cost per 1000 frames (each echo
+ * is one frame in and one out), measured the same way for all transports:
+ * syscalls, from the raw_syscalls:sys_enter tracepoint where perf counters
+ * may read it, and system CPU time and context switches from getrusage().
+ * The EpollServer runs also print the syscalls their engine counted itself,
+ * to check one figure against the other.
+ *
+ *     transport_bench [qt|epoll|uring|all] [port=47000] [clients=100] [rounds=200] [window=16]
+ */
+
+#include "base_server.h"
+#include "epoll_server.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QTextStream>
+
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace JsonCommandServer;
+
+/* Same frontend over either transport: identify renames the peer. */
+template <class Transport>
+class BenchServer : public Transport {
+  public:
+    virtual void addIdentify(const QJsonObject& cmd) {
+        RemoteNodeInfo info;
+        info.IP = cmd["ip"].toString();
+        info.port = cmd["port"].toInt();
+        info.id = cmd["id_client"].toInt();
+        info.group = cmd["group_client"].toInt();
+        info.name = cmd["name_client"].toString();
+        info.type = cmd["type_client"].toString();
+        this->addNewInfo(info);
+    }
+};
+
+static bool writeAll(int fd, const QByteArray& data) {
+    const char* p = data.constData();
+    qint64 left = data.size();
+    while (left > 0) {
+        ssize_t w = ::send(fd, p, left, MSG_NOSIGNAL);
+        if (w <= 0) return false;
+        p += w;
+        left -= w;
+    }
+    return true;
+}
+
+static bool readAll(int fd, char* p, qint64 size) {
+    while (size > 0) {
+        ssize_t r = ::recv(fd, p, size, 0);
+        if (r <= 0) return false;
+        p += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool readFrame(int fd, QByteArray& frame) {
+    uchar header[4];
+    if (!readAll(fd, reinterpret_cast<char*>(header), 4)) return false;
+    qint32 size = (qint32(header[0]) << 24) | (qint32(header[1]) << 16) |
+                  (qint32(header[2]) << 8) | qint32(header[3]);
+    frame.resize(size);
+    return readAll(fd, frame.data(), size);
+}
+
+static QByteArray frameOf(const QJsonArray& cmd) {
+    QByteArray data = QJsonDocument(cmd).toJson(QJsonDocument::Compact);
+    QByteArray frame(4, 0);
+    frame[0] = char(data.size() >> 24);
+    frame[1] = char(data.size() >> 16);
+    frame[2] = char(data.size() >> 8);
+    frame[3] = char(data.size());
+    return frame + data;
+}
+
+/* Cost of the calling thread, which runs the server's event loop: the load
+ * generator's own thread is not counted. syscalls is -1 where the tracepoint
+ * cannot be read, e.g. with a strict perf_event_paranoid. */
+struct ThreadUsage {
+    ThreadUsage() : syscalls(-1), sys_us(0), context_switches(0) {}
+
+    qint64 syscalls;
+    qint64 sys_us;
+    qint64 context_switches;
+};
+
+static int tracepointId(const char* event) {
+    const char* roots[] = { "/sys/kernel/tracing/events/", "/sys/kernel/debug/tracing/events/" };
+    for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); ++i) {
+        QFile file(QString(roots[i]) + event + "/id");
+        if (file.open(QIODevice::ReadOnly)) return file.readAll().trimmed().toInt();
+    }
+    return -1;
+}
+
+class UsageMeter {
+  public:
+    UsageMeter() : fd_(-1) {
+        int id = tracepointId("raw_syscalls/sys_enter");
+        if (id < 0) return;
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_TRACEPOINT;
+        attr.size = sizeof(attr);
+        attr.config = quint64(id);
+        attr.disabled = 1;
+        fd_ = int(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    ~UsageMeter() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    void start() {
+        if (fd_ >= 0) {
+            ::ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ::ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        ::getrusage(RUSAGE_THREAD, &start_);
+    }
+
+    ThreadUsage stop() {
+        ThreadUsage usage;
+        rusage end;
+        ::getrusage(RUSAGE_THREAD, &end);
+        if (fd_ >= 0) {
+            ::ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            quint64 count = 0;
+            if (::read(fd_, &count, sizeof(count)) == ssize_t(sizeof(count))) {
+                usage.syscalls = qint64(count);
+            }
+        }
+        usage.sys_us = (end.ru_stime.tv_sec - start_.ru_stime.tv_sec) * Q_INT64_C(1000000) +
+                       (end.ru_stime.tv_usec - start_.ru_stime.tv_usec);
+        usage.context_switches = (end.ru_nvcsw - start_.ru_nvcsw) +
+                                 (end.ru_nivcsw - start_.ru_nivcsw);
+        return usage;
+    }
+
+  private:
+    int fd_;
+    rusage start_;
+};
+
+struct LoadResult {
+    LoadResult() : frames(0), nsecs(0), failed(false) {}
+
+    qint64 frames;
+    qint64 nsecs;
+    bool failed;
+    ThreadUsage usage;
+    QJsonObject io_stats;
+};
+
+/* Connects, identifies as bench<i> and learns the full peer name from the peer
+ * lists, then runs the echo rounds. */
+static void runLoad(quint16 port, int n_clients, int rounds, int window, LoadResult* result) {
+    std::vector<int> fds;
+    std::vector<QByteArray> echoes;
+    for (int i = 0; i < n_clients && !result->failed; ++i) {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            result->failed = true;
+            ::close(fd);
+            break;
+        }
+        fds.push_back(fd);
+        QString name = QString("bench%1").arg(i);
+        QJsonObject identify;
+        identify.insert("type", MESSAGE_IDENTIFY);
+        identify.insert("name_client", name);
+        QJsonArray cmd;
+        cmd.append(identify);
+        writeAll(fd, frameOf(cmd));
+        QString peer;
+        QByteArray frame;
+        while (peer.isEmpty() && readFrame(fd, frame)) {
+            QJsonArray in = QJsonDocument::fromJson(frame).array();
+            QJsonArray peers = in.isEmpty() ? QJsonArray() : in[0].toObject()["peers"].toArray();
+            for (int k = 0; k < peers.size(); ++k) {
+                if (peers[k].toString().startsWith(name + "@")) peer = peers[k].toString();
+            }
+        }
+        if (peer.isEmpty()) {
+            result->failed = true;
+            break;
+        }
+        QJsonObject echo;
+        echo.insert("type", MESSAGE_TO);
+        echo.insert("from", peer);
+        echo.insert("to", peer);
+        echo.insert("message", QString("bench"));
+        QJsonArray echo_cmd;
+        echo_cmd.append(echo);
+        QByteArray batch;
+        for (int w = 0; w < window; ++w) batch += frameOf(echo_cmd);
+        echoes.push_back(batch);
+    }
+    QElapsedTimer clock;
+    clock.start();
+    QByteArray frame;
+    for (int r = 0; r < rounds && !result->failed; ++r) {
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (!writeAll(fds[i], echoes[i])) result->failed = true;
+        }
+        for (size_t i = 0; i < fds.size() && !result->failed; ++i) {
+            int received = 0;
+            while (received < window) {
+                if (!readFrame(fds[i], frame)) {
+                    result->failed = true;
+                    break;
+                }
+                // peer lists of late joiners may be interleaved
+                if (frame.contains("\"bench\"")) ++received;
+            }
+            result->frames += received;
+        }
+    }
+    result->nsecs = clock.nsecsElapsed();
+    for (size_t i = 0; i < fds.size(); ++i) ::close(fds[i]);
+}
+
+static void setIoEngine(BaseServer&, int) {}
+
+static void setIoEngine(EpollServer& server, int io_engine) {
+    server.setIoEngine(io_engine);
+}
+
+static QJsonObject ioStats(BaseServer&) {
+    return QJsonObject();
+}
+
+static QJsonObject ioStats(EpollServer& server) {
+    return server.ioStats();
+}
+
+template <class Server>
+static LoadResult runBench(quint16 port, int n_clients, int rounds, int window,
+                           int io_engine = EpollServer::IO_EPOLL) {
+    BenchServer<Server> server;
+    server.setPortServer(port);
+    server.setNMaxClients(n_clients + 1);
+    setIoEngine(server, io_engine);
+    server.initServer();
+    LoadResult result;
+    UsageMeter meter;
+    meter.start();
+    std::thread load([&]() {
+        runLoad(port, n_clients, rounds, window, &result);
+        QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+    });
+    QCoreApplication::exec();
+    result.usage = meter.stop();
+    load.join();
+    result.io_stats = ioStats(server);
+    server.closeServer();
+    return result;
+}
+
+static void report(const char* transport, const LoadResult& result) {
+    QTextStream out(stdout);
+    double seconds = result.nsecs / 1e9;
+    out << transport << ": ";
+    if (result.failed) {
+        out << "failed\n";
+        return;
+    }
+    out << result.frames << " echoes in " << seconds << " s, "
+        << (seconds > 0 ? result.frames / seconds : 0.0) << " echoes/s\n";
+    double per_1k = result.frames > 0 ? 1000.0 / (2 * result.frames) : 0.0;
+    out << "  measured: ";
+    if (result.usage.syscalls >= 0) {
+        out << result.usage.syscalls * per_1k << " syscalls/1k frames, ";
+    } else {
+        out << "syscalls n/a (no access to the raw_syscalls tracepoint), ";
+    }
+    out << result.usage.sys_us * per_1k << " us system CPU/1k frames, "
+        << result.usage.context_switches * per_1k << " context switches/1k frames\n";
+    if (!result.io_stats.isEmpty()) {
+        out << "  counted by " << result.io_stats["engine"].toString() << ": "
+            << result.io_stats["syscalls_per_1k_frames"].toDouble() << " syscalls/1k frames\n";
+    }
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QStringList args = app.arguments();
+    QString mode = args.size() > 1 ? args[1] : QString("all");
+    quint16 port = args.size() > 2 ? quint16(args[2].toInt()) : 47000;
+    int n_clients = args.size() > 3 ? args[3].toInt() : 100;
+    int rounds = args.size() > 4 ? args[4].toInt() : 200;
+    int window = args.size() > 5 ? args[5].toInt() : 16;
+    if (mode == "qt" || mode == "all") {
+        report("qt", runBench<BaseServer>(port, n_clients, rounds, window));
+    }
+    if (mode == "epoll" || mode == "all") {
+        report("epoll", runBench<EpollServer>(port + 1, n_clients, rounds, window));
+    }
+    if (mode == "uring" || mode == "all") {
+        // falls back to epoll, and says so, where io_uring is missing
+        report("uring", runBench<EpollServer>(port + 2, n_clients, rounds, window,
+                                              EpollServer::IO_URING));
+    }
+    return 0;
+}
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# BaseServer (QTcpSocket) vs EpollServer throughput benchmark
+#
+#-------------------------------------------------
+
+QT       += network
+QT       -= gui
+
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = transport_bench
+TEMPLATE = app
+
+INCLUDEPATH += ../.. ../../server
+LIBS += -L../.. -lJsonCommandServer
+
+SOURCES += main.cpp